@@ -2,7 +2,7 @@
 # Component Makefile
 #
 
-COMPONENT_OBJS := heap_caps_init.o heap_caps.o mem_block.o mem_block_group.o mem_block_list.o mem_block_map.o multi_heap.o
+COMPONENT_OBJS := heap_caps_init.o heap_caps.o mem_block.o mem_block_group.o mem_block_list.o mem_block_map.o mem_block_tlsf.o mem_block_tree.o multi_heap.o
 
 ifdef CONFIG_HEAP_TRACING
 
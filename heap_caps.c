@@ -58,10 +58,156 @@ bool heap_caps_match(const heap_t *heap, uint32_t caps)
     return heap->heap != NULL && ((get_all_caps(heap) & caps) == caps);
 }
 
+/*
+Call the watermark callback of a heap if its free memory crossed the watermark.
+Called after the heap lock is released, events of interrupts are reported by the next call to the heap.
+The callback isn't entered twice, events caused while it runs are reported by the next call to the heap.
+*/
+IRAM_ATTR static inline void heap_caps_watermark_dispatch(heap_t *heap)
+{
+    heap_caps_watermark_cb_t cb = heap->watermark_cb;
+    if (cb == NULL || MULTI_HEAP_IN_ISR()) {
+        return;
+    }
+    if (__atomic_exchange_n(&heap->watermark_active, 1, __ATOMIC_ACQUIRE)) {
+        return;
+    }
+    multi_heap_watermark_t event = multi_heap_get_watermark_event(heap->heap);
+    if (event != MULTI_HEAP_WATERMARK_NONE) {
+        cb(heap->watermark_caps, multi_heap_free_size(heap->heap), event == MULTI_HEAP_WATERMARK_LOW);
+    }
+    __atomic_store_n(&heap->watermark_active, 0, __ATOMIC_RELEASE);
+}
+
+/*
+Reclaim callbacks, sorted by priority. The registry is copied under its lock and the callbacks
+are called without any lock, so they can free memory and allocate themselves.
+*/
+typedef struct {
+    heap_caps_reclaim_cb_t cb;
+    int priority;
+} heap_caps_reclaim_t;
+
+static heap_caps_reclaim_t reclaim_callbacks[HEAP_CAPS_RECLAIM_MAX];
+static volatile size_t reclaim_count = 0;
+static multi_heap_lock_t reclaim_lock = MULTI_HEAP_LOCK_STATIC_INITIALIZER;
+static volatile uint32_t reclaim_active = 0;
+
+bool heap_caps_register_reclaim( heap_caps_reclaim_cb_t cb, int priority )
+{
+    if (cb == NULL) {
+        return false;
+    }
+    bool success = false;
+    MULTI_HEAP_LOCK(&reclaim_lock);
+    if (reclaim_count < HEAP_CAPS_RECLAIM_MAX) {
+        //Insert after all callbacks with the same or a lower priority
+        size_t pos = reclaim_count;
+        while (pos > 0 && reclaim_callbacks[pos - 1].priority > priority) {
+            reclaim_callbacks[pos] = reclaim_callbacks[pos - 1];
+            pos--;
+        }
+        reclaim_callbacks[pos].cb = cb;
+        reclaim_callbacks[pos].priority = priority;
+        reclaim_count++;
+        success = true;
+    }
+    MULTI_HEAP_UNLOCK(&reclaim_lock);
+    return success;
+}
+
+void heap_caps_unregister_reclaim( heap_caps_reclaim_cb_t cb )
+{
+    MULTI_HEAP_LOCK(&reclaim_lock);
+    size_t count = 0;
+    for (size_t pos = 0; pos < reclaim_count; pos++) {
+        if (reclaim_callbacks[pos].cb != cb) {
+            reclaim_callbacks[count++] = reclaim_callbacks[pos];
+        }
+    }
+    reclaim_count = count;
+    MULTI_HEAP_UNLOCK(&reclaim_lock);
+}
+
+/*
+Call the reclaim callbacks from position 'first' until one of them releases memory.
+Returns the position after that callback, or 0 if none released anything. Allocations failing
+inside a callback, in an interrupt or while another task reclaims memory don't call them again.
+*/
+static size_t heap_caps_reclaim( size_t size, uint32_t caps, size_t first )
+{
+    if (reclaim_count == 0 || MULTI_HEAP_IN_ISR()) {
+        return 0;
+    }
+    if (__atomic_exchange_n(&reclaim_active, 1, __ATOMIC_ACQUIRE)) {
+        return 0;
+    }
+    heap_caps_reclaim_t callbacks[HEAP_CAPS_RECLAIM_MAX];
+    MULTI_HEAP_LOCK(&reclaim_lock);
+    size_t count = reclaim_count;
+    memcpy(callbacks, reclaim_callbacks, count * sizeof(heap_caps_reclaim_t));
+    MULTI_HEAP_UNLOCK(&reclaim_lock);
+    size_t next = 0;
+    for (size_t pos = first; pos < count; pos++) {
+        if (callbacks[pos].cb(size, caps) > 0) {
+            next = pos + 1;
+            break;
+        }
+    }
+    __atomic_store_n(&reclaim_active, 0, __ATOMIC_RELEASE);
+    return next;
+}
+
+/*
+Usage of the allocation tags, updated without a lock. Memory is reserved for the requested size before
+any heap is searched and corrected to the size of the block afterwards.
+*/
+typedef struct {
+    volatile size_t current;
+    volatile size_t peak;
+    volatile size_t limit;
+    volatile size_t allocations;
+    volatile size_t failures;
+} heap_caps_tag_t;
+
+static heap_caps_tag_t tag_counters[HEAP_CAPS_TAG_COUNT];
+
+IRAM_ATTR static heap_t *find_containing_heap(void *ptr );
+
+static bool heap_caps_tag_reserve( uint32_t tag, size_t size )
+{
+    heap_caps_tag_t *counter = &tag_counters[tag];
+    size_t limit = counter->limit;
+    size_t current = __atomic_add_fetch(&counter->current, size, __ATOMIC_RELAXED);
+    if (limit != 0 && current > limit) {
+        __atomic_sub_fetch(&counter->current, size, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&counter->failures, 1, __ATOMIC_RELAXED);
+        return false;
+    }
+    return true;
+}
+
+static void heap_caps_tag_update( uint32_t tag, size_t add, size_t sub )
+{
+    heap_caps_tag_t *counter = &tag_counters[tag];
+    size_t current = __atomic_add_fetch(&counter->current, add - sub, __ATOMIC_RELAXED);
+    size_t peak = __atomic_load_n(&counter->peak, __ATOMIC_RELAXED);
+    while (current > peak && !__atomic_compare_exchange_n(&counter->peak, &peak, current, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+/*
+Return the tag of an allocation and the size of its block, pointers of another heap are untagged.
+*/
+IRAM_ATTR static uint32_t heap_caps_tag_get( heap_t *heap, void *ptr, size_t *size )
+{
+    uint32_t tag = multi_heap_get_tag(heap->heap, ptr, size);
+    return tag < HEAP_CAPS_TAG_COUNT ? tag : 0;
+}
+
 /*
 Routine to allocate a bit of memory with certain capabilities. caps is a bitfield of MALLOC_CAP_* bits.
 */
-IRAM_ATTR void *heap_caps_malloc( size_t size, uint32_t caps )
+IRAM_ATTR static void *heap_caps_malloc_base( size_t size, uint32_t caps, uint32_t tag )
 {
     void *ret = NULL;
 
@@ -71,6 +217,10 @@ IRAM_ATTR void *heap_caps_malloc( size_t size, uint32_t caps )
         return NULL;
     }
 
+    //MALLOC_CAP_CRITICAL isn't a capability of the memory, it allows the critical reserve of each heap
+    bool critical = (caps & MALLOC_CAP_CRITICAL) != 0;
+    caps &= ~MALLOC_CAP_CRITICAL;
+
     if (caps & MALLOC_CAP_EXEC) {
         //MALLOC_CAP_EXEC forces an alloc from IRAM. There is a region which has both this as well as the following
         //caps, but the following caps are not possible for IRAM.  Thus, the combination is impossible and we return
@@ -105,15 +255,25 @@ IRAM_ATTR void *heap_caps_malloc( size_t size, uint32_t caps )
                         //This is special, insofar that what we're going to get back is a DRAM address. If so,
                         //we need to 'invert' it (lowest address in DRAM == highest address in IRAM and vice-versa) and
                         //add a pointer to the DRAM equivalent before the address we're going to return.
-                        ret = multi_heap_malloc(heap->heap, size + 4);  // int overflow checked above
+                        if (critical) {
+                            ret = multi_heap_malloc_critical(heap->heap, size + 4);  // int overflow checked above
+                        } else {
+                            ret = multi_heap_malloc_tagged(heap->heap, size + 4, tag);  // int overflow checked above
+                        }
 
                         if (ret != NULL) {
+                            heap_caps_watermark_dispatch(heap);
                             return dram_alloc_to_iram_addr(ret, size + 4);  // int overflow checked above
                         }
                     } else {
                         //Just try to alloc, nothing special.
-                        ret = multi_heap_malloc(heap->heap, size);
+                        if (critical) {
+                            ret = multi_heap_malloc_critical(heap->heap, size);
+                        } else {
+                            ret = multi_heap_malloc_tagged(heap->heap, size, tag);
+                        }
                         if (ret != NULL) {
+                            heap_caps_watermark_dispatch(heap);
                             return ret;
                         }
                     }
@@ -125,6 +285,101 @@ IRAM_ATTR void *heap_caps_malloc( size_t size, uint32_t caps )
     return NULL;
 }
 
+/*
+Allocate memory, if all matching heaps are exhausted ask the reclaim callbacks for memory and try again.
+Each callback is asked once per allocation.
+*/
+IRAM_ATTR static void *heap_caps_malloc_retry( size_t size, uint32_t caps, uint32_t tag )
+{
+    void *ret = heap_caps_malloc_base(size, caps, tag);
+    size_t next = 0;
+    while (ret == NULL && (next = heap_caps_reclaim(size, caps, next)) != 0) {
+        ret = heap_caps_malloc_base(size, caps, tag);
+    }
+    return ret;
+}
+
+IRAM_ATTR void *heap_caps_malloc( size_t size, uint32_t caps )
+{
+    return heap_caps_malloc_retry(size, caps, 0);
+}
+
+IRAM_ATTR void *heap_caps_malloc_tagged( size_t size, uint32_t caps, uint32_t tag )
+{
+    if (tag == 0) {
+        return heap_caps_malloc(size, caps);
+    }
+    if (tag >= HEAP_CAPS_TAG_COUNT) {
+        return NULL;
+    }
+    //Over budget, fail before a heap is locked and searched
+    if (!heap_caps_tag_reserve(tag, size)) {
+        return NULL;
+    }
+    //The critical path doesn't tag the block
+    caps &= ~MALLOC_CAP_CRITICAL;
+    void *ret = heap_caps_malloc_retry(size, caps, tag);
+    if (ret == NULL) {
+        heap_caps_tag_update(tag, 0, size);
+        __atomic_add_fetch(&tag_counters[tag].failures, 1, __ATOMIC_RELAXED);
+        return NULL;
+    }
+    void *dram_ptr = ret;
+    if (esp_ptr_in_diram_iram(ret)) {
+        dram_ptr = (void *)((uint32_t *)ret)[-1];
+    }
+    size_t block_size = 0;
+    heap_caps_tag_get(find_containing_heap(dram_ptr), dram_ptr, &block_size);
+    heap_caps_tag_update(tag, block_size, size);
+    __atomic_add_fetch(&tag_counters[tag].allocations, 1, __ATOMIC_RELAXED);
+    return ret;
+}
+
+/*
+Allocate several chunks of the same size, locking each heap only once.
+*/
+IRAM_ATTR size_t heap_caps_malloc_batch( size_t size, size_t count, void **ptrs, uint32_t caps )
+{
+    if (ptrs == NULL) {
+        return 0;
+    }
+
+    size_t done = 0;
+    caps &= ~MALLOC_CAP_CRITICAL;
+    if (size > HEAP_SIZE_MAX || (caps & MALLOC_CAP_EXEC)) {
+        //Oversized requests fail, executable memory needs the IRAM translation of heap_caps_malloc()
+        for (; done < count; done++) {
+            ptrs[done] = heap_caps_malloc(size, caps);
+            if (ptrs[done] == NULL) {
+                break;
+            }
+        }
+    } else {
+        if (caps & MALLOC_CAP_32BIT) {
+            size = (size + 3) & (~3); // int overflow checked above
+        }
+        for (int prio = 0; prio < SOC_MEMORY_TYPE_NO_PRIOS && done < count; prio++) {
+            heap_t *heap;
+            SLIST_FOREACH(heap, &registered_heaps, next) {
+                if (heap->heap == NULL) {
+                    continue;
+                }
+                if ((heap->caps[prio] & caps) != 0 && (get_all_caps(heap) & caps) == caps) {
+                    done += multi_heap_malloc_batch(heap->heap, size, count - done, &ptrs[done]);
+                    heap_caps_watermark_dispatch(heap);
+                    if (done == count) {
+                        break;
+                    }
+                }
+            }
+        }
+    }
+    for (size_t pos = done; pos < count; pos++) {
+        ptrs[pos] = NULL;
+    }
+    return done;
+}
+
 
 #define MALLOC_DISABLE_EXTERNAL_ALLOCS -1
 //Dual-use: -1 (=MALLOC_DISABLE_EXTERNAL_ALLOCS) disables allocations in external memory, >=0 sets the limit for allocations preferring internal memory.
@@ -269,7 +524,112 @@ IRAM_ATTR void heap_caps_free( void *ptr)
 
     heap_t *heap = find_containing_heap(ptr);
     assert(heap != NULL && "free() target pointer is outside heap areas");
+    size_t block_size = 0;
+    uint32_t tag = heap_caps_tag_get(heap, ptr, &block_size);
+    if (tag != 0) {
+        heap_caps_tag_update(tag, 0, block_size);
+    }
+#ifdef CONFIG_HEAP_ISR_FREE_QUEUE
+    if (MULTI_HEAP_IN_ISR()) {
+        //Don't wait for a task holding the heap lock, the next call to this heap frees the memory
+        multi_heap_free_from_isr(heap->heap, ptr);
+        return;
+    }
+#endif
     multi_heap_free(heap->heap, ptr);
+    heap_caps_watermark_dispatch(heap);
+}
+
+IRAM_ATTR void heap_caps_free_batch(size_t count, void **ptrs)
+{
+    if (ptrs == NULL) {
+        return;
+    }
+
+    size_t pos = 0;
+    while (pos < count) {
+        if (ptrs[pos] == NULL) {
+            pos++;
+            continue;
+        }
+        if (esp_ptr_in_diram_iram(ptrs[pos])) {
+            //IRAM aliases need to be translated, just free them one by one.
+            heap_caps_free(ptrs[pos]);
+            pos++;
+            continue;
+        }
+        heap_t *heap = find_containing_heap(ptrs[pos]);
+        assert(heap != NULL && "free() target pointer is outside heap areas");
+        //Collect the following pointers of the same heap
+        size_t end = pos + 1;
+        while (end < count && (ptrs[end] == NULL || ((intptr_t)ptrs[end] >= heap->start && (intptr_t)ptrs[end] < heap->end))) {
+            end++;
+        }
+        for (size_t tagged = pos; tagged < end; tagged++) {
+            size_t block_size = 0;
+            uint32_t tag = ptrs[tagged] ? heap_caps_tag_get(heap, ptrs[tagged], &block_size) : 0;
+            if (tag != 0) {
+                heap_caps_tag_update(tag, 0, block_size);
+            }
+        }
+        multi_heap_free_batch(heap->heap, end - pos, &ptrs[pos]);
+        heap_caps_watermark_dispatch(heap);
+        pos = end;
+    }
+}
+
+/*
+Create a bump-arena in the first heap with the requested capabilities that can hold it.
+*/
+multi_heap_arena_handle_t heap_caps_arena_create( size_t size, uint32_t caps )
+{
+    if (size > HEAP_SIZE_MAX || (caps & MALLOC_CAP_EXEC)) {
+        //Arena buffers can't be translated to IRAM addresses
+        return NULL;
+    }
+
+    for (int prio = 0; prio < SOC_MEMORY_TYPE_NO_PRIOS; prio++) {
+        heap_t *heap;
+        SLIST_FOREACH(heap, &registered_heaps, next) {
+            if (heap->heap == NULL) {
+                continue;
+            }
+            if ((heap->caps[prio] & caps) != 0 && (get_all_caps(heap) & caps) == caps) {
+                multi_heap_arena_handle_t arena = multi_heap_arena_create(heap->heap, size);
+                if (arena != NULL) {
+                    return arena;
+                }
+            }
+        }
+    }
+    return NULL;
+}
+
+/*
+Create an object pool in the first heap with the requested capabilities that can hold its first page.
+*/
+multi_heap_pool_handle_t heap_caps_pool_create( size_t object_size, uint32_t caps, size_t initial_count )
+{
+    if (object_size > HEAP_SIZE_MAX || (caps & MALLOC_CAP_EXEC)) {
+        //Pool objects can't be translated to IRAM addresses
+        return NULL;
+    }
+
+    for (int prio = 0; prio < SOC_MEMORY_TYPE_NO_PRIOS; prio++) {
+        heap_t *heap;
+        SLIST_FOREACH(heap, &registered_heaps, next) {
+            if (heap->heap == NULL) {
+                continue;
+            }
+            if ((heap->caps[prio] & caps) != 0 && (get_all_caps(heap) & caps) == caps) {
+                multi_heap_pool_handle_t pool = multi_heap_pool_create(heap->heap, object_size, initial_count);
+                if (pool != NULL) {
+                    return pool;
+                }
+            }
+        }
+    }
+    return NULL;
 }
 
 IRAM_ATTR void *heap_caps_realloc( void *ptr, size_t size, int caps)
@@ -312,20 +672,40 @@ IRAM_ATTR void *heap_caps_realloc( void *ptr, size_t size, int caps)
 
     // are the existing heap's capabilities compatible with the
     // requested ones?
-    bool compatible_caps = (caps & get_all_caps(heap)) == caps;
+    //Growing in place leaves the critical reserve, a moved buffer may use it
+    uint32_t heap_caps = caps & ~MALLOC_CAP_CRITICAL;
+    bool compatible_caps = (heap_caps & get_all_caps(heap)) == heap_caps;
+
+    //A tagged buffer keeps its tag, growing it counts against the limit of the tag
+    size_t old_block = 0;
+    uint32_t tag = heap_caps_tag_get(heap, ptr_in_diram_case ? dram_ptr : ptr, &old_block);
 
     if (compatible_caps && !ptr_in_diram_case) {
+        size_t grow = (tag != 0 && size > old_block) ? size - old_block : 0;
+        if (grow != 0 && !heap_caps_tag_reserve(tag, grow)) {
+            return NULL;
+        }
         // try to reallocate this memory within the same heap
         // (which will resize the block if it can)
         void *r = multi_heap_realloc(heap->heap, ptr, size);
+        if (tag != 0) {
+            size_t new_block = 0;
+            if (r != NULL) {
+                multi_heap_get_tag(heap->heap, r, &new_block);
+                heap_caps_tag_update(tag, new_block, old_block + grow);
+            } else {
+                heap_caps_tag_update(tag, 0, grow);
+            }
+        }
         if (r != NULL) {
+            heap_caps_watermark_dispatch(heap);
             return r;
         }
     }
 
     // if we couldn't do that, try to see if we can reallocate
     // in a different heap with requested capabilities.
-    void *new_p = heap_caps_malloc(size, caps);
+    void *new_p = heap_caps_malloc_tagged(size, caps, tag);
     if (new_p != NULL) {
         size_t old_size = 0;
 
@@ -422,6 +802,304 @@ void heap_caps_get_info( multi_heap_info_t *info, uint32_t caps )
             info->allocated_blocks += hinfo.allocated_blocks;
             info->free_blocks += hinfo.free_blocks;
             info->total_blocks += hinfo.total_blocks;
+            info->quick_bin_hits += hinfo.quick_bin_hits;
+            info->quick_bin_misses += hinfo.quick_bin_misses;
+        }
+    }
+}
+
+void heap_caps_get_info_nolock( multi_heap_info_t *info, uint32_t caps )
+{
+    bzero(info, sizeof(multi_heap_info_t));
+
+    heap_t *heap;
+    SLIST_FOREACH(heap, &registered_heaps, next) {
+        if (heap_caps_match(heap, caps)) {
+            multi_heap_info_t hinfo;
+            multi_heap_get_info_nolock(heap->heap, &hinfo);
+
+            info->total_free_bytes += hinfo.total_free_bytes;
+            info->total_allocated_bytes += hinfo.total_allocated_bytes;
+            info->largest_free_block = MAX(info->largest_free_block,
+                                           hinfo.largest_free_block);
+            info->minimum_free_bytes += hinfo.minimum_free_bytes;
+            info->allocated_blocks += hinfo.allocated_blocks;
+            info->free_blocks += hinfo.free_blocks;
+            info->total_blocks += hinfo.total_blocks;
+            info->quick_bin_hits += hinfo.quick_bin_hits;
+            info->quick_bin_misses += hinfo.quick_bin_misses;
+        }
+    }
+}
+
+void heap_caps_get_fragmentation( multi_heap_fragmentation_t *info, uint32_t caps )
+{
+    bzero(info, sizeof(multi_heap_fragmentation_t));
+
+    heap_t *heap;
+    SLIST_FOREACH(heap, &registered_heaps, next) {
+        if (heap_caps_match(heap, caps)) {
+            multi_heap_fragmentation_t hinfo;
+            multi_heap_get_fragmentation(heap->heap, &hinfo);
+
+            for (int slot = 0; slot < MULTI_HEAP_HISTOGRAM_SIZE; slot++) {
+                info->free_blocks[slot] += hinfo.free_blocks[slot];
+            }
+            info->total_free_bytes += hinfo.total_free_bytes;
+            info->largest_free_block = MAX(info->largest_free_block,
+                                           hinfo.largest_free_block);
+        }
+    }
+    //Free bytes in other heaps count as fragmented, they can't be allocated at once
+    if (info->largest_free_block < info->total_free_bytes) {
+        info->fragmentation = 100 - (uint32_t)((uint64_t)info->largest_free_block * 100 / info->total_free_bytes);
+    }
+}
+
+void heap_caps_set_reserve( uint32_t caps, size_t meta_reserve, size_t critical_reserve )
+{
+    heap_t *heap;
+    SLIST_FOREACH(heap, &registered_heaps, next) {
+        if (heap_caps_match(heap, caps)) {
+            multi_heap_set_reserve(heap->heap, meta_reserve, critical_reserve);
+        }
+    }
+}
+
+void heap_caps_set_watermark( uint32_t caps, size_t low_bytes, size_t high_bytes, heap_caps_watermark_cb_t cb )
+{
+    heap_t *heap;
+    SLIST_FOREACH(heap, &registered_heaps, next) {
+        if (heap_caps_match(heap, caps)) {
+            heap->watermark_cb = NULL;
+            heap->watermark_caps = caps;
+            multi_heap_set_watermark(heap->heap, cb != NULL ? low_bytes : 0, high_bytes);
+            heap->watermark_cb = cb;
+            //A heap which is already low is reported right away
+            heap_caps_watermark_dispatch(heap);
+        }
+    }
+}
+
+bool heap_caps_set_tag_limit( uint32_t tag, size_t limit )
+{
+    if (tag == 0 || tag >= HEAP_CAPS_TAG_COUNT) {
+        return false;
+    }
+    tag_counters[tag].limit = limit;
+    return true;
+}
+
+bool heap_caps_get_tag_info( uint32_t tag, heap_caps_tag_info_t *info )
+{
+    if (tag == 0 || tag >= HEAP_CAPS_TAG_COUNT || info == NULL) {
+        return false;
+    }
+    heap_caps_tag_t *counter = &tag_counters[tag];
+    info->current = __atomic_load_n(&counter->current, __ATOMIC_RELAXED);
+    info->peak = __atomic_load_n(&counter->peak, __ATOMIC_RELAXED);
+    info->limit = counter->limit;
+    info->allocations = __atomic_load_n(&counter->allocations, __ATOMIC_RELAXED);
+    info->failures = __atomic_load_n(&counter->failures, __ATOMIC_RELAXED);
+    return true;
+}
+
+void heap_caps_reset_tags( void )
+{
+    for (uint32_t tag = 1; tag < HEAP_CAPS_TAG_COUNT; tag++) {
+        heap_caps_tag_t *counter = &tag_counters[tag];
+        __atomic_store_n(&counter->peak, __atomic_load_n(&counter->current, __ATOMIC_RELAXED), __ATOMIC_RELAXED);
+        __atomic_store_n(&counter->allocations, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&counter->failures, 0, __ATOMIC_RELAXED);
+    }
+}
+
+void heap_caps_dump_tags( void )
+{
+    printf("Heap usage by tag:\n");
+    printf("  %4s %10s %10s %10s %10s %10s\n", "tag", "current", "peak", "limit", "allocs", "failed");
+    for (uint32_t tag = 1; tag < HEAP_CAPS_TAG_COUNT; tag++) {
+        heap_caps_tag_info_t info;
+        heap_caps_get_tag_info(tag, &info);
+        if (info.allocations == 0 && info.failures == 0 && info.limit == 0) {
+            continue;
+        }
+        printf("  %4u %10u %10u %10u %10u %10u\n", tag, (uint32_t)info.current, (uint32_t)info.peak,
+               (uint32_t)info.limit, (uint32_t)info.allocations, (uint32_t)info.failures);
+    }
+}
+
+void heap_caps_get_reserve_info( multi_heap_reserve_info_t *info, uint32_t caps )
+{
+    bzero(info, sizeof(multi_heap_reserve_info_t));
+
+    heap_t *heap;
+    SLIST_FOREACH(heap, &registered_heaps, next) {
+        if (heap_caps_match(heap, caps)) {
+            multi_heap_reserve_info_t hinfo;
+            multi_heap_get_reserve_info(heap->heap, &hinfo);
+
+            info->meta_reserve += hinfo.meta_reserve;
+            info->critical_reserve += hinfo.critical_reserve;
+            info->free_reserve += hinfo.free_reserve;
+            info->critical_allocations += hinfo.critical_allocations;
+            info->critical_failures += hinfo.critical_failures;
+            info->reserve_allocations += hinfo.reserve_allocations;
+            info->reserve_refusals += hinfo.reserve_refusals;
+        }
+    }
+}
+
+size_t heap_caps_maintain( uint32_t caps, size_t budget )
+{
+    size_t deferred = 0;
+    heap_t *heap;
+    SLIST_FOREACH(heap, &registered_heaps, next) {
+        if (heap_caps_match(heap, caps)) {
+            deferred += multi_heap_maintain(heap->heap, budget);
+            heap_caps_watermark_dispatch(heap);
+        }
+    }
+    return deferred;
+}
+
+void heap_caps_get_lock_stats( multi_heap_lock_stats_t *stats, uint32_t caps )
+{
+    bzero(stats, sizeof(multi_heap_lock_stats_t));
+
+    heap_t *heap;
+    SLIST_FOREACH(heap, &registered_heaps, next) {
+        if (heap_caps_match(heap, caps)) {
+            multi_heap_lock_stats_t hstats;
+            multi_heap_get_lock_stats(heap->heap, &hstats);
+
+            stats->acquisitions += hstats.acquisitions;
+            stats->contended += hstats.contended;
+            stats->total_hold_time += hstats.total_hold_time;
+            stats->total_wait_time += hstats.total_wait_time;
+            stats->max_hold_time = MAX(stats->max_hold_time, hstats.max_hold_time);
+            stats->max_wait_time = MAX(stats->max_wait_time, hstats.max_wait_time);
+            for (int slot = 0; slot < MULTI_HEAP_HISTOGRAM_SIZE; slot++) {
+                stats->hold_times[slot] += hstats.hold_times[slot];
+                stats->wait_times[slot] += hstats.wait_times[slot];
+            }
+        }
+    }
+}
+
+void heap_caps_reset_lock_stats( uint32_t caps )
+{
+    heap_t *heap;
+    SLIST_FOREACH(heap, &registered_heaps, next) {
+        if (heap_caps_match(heap, caps)) {
+            multi_heap_reset_lock_stats(heap->heap);
+        }
+    }
+}
+
+void heap_caps_dump_lock_stats( uint32_t caps )
+{
+    printf("Heap lock statistics for capabilities 0x%08X, times in %s:\n", caps, MULTI_HEAP_TIME_UNIT);
+    heap_t *heap;
+    SLIST_FOREACH(heap, &registered_heaps, next) {
+        if (heap_caps_match(heap, caps)) {
+            multi_heap_lock_stats_t stats;
+            multi_heap_get_lock_stats(heap->heap, &stats);
+
+            printf("  At 0x%08x len %d acquisitions %u contended %u\n",
+                   heap->start, heap->end - heap->start, stats.acquisitions, stats.contended);
+            if (stats.acquisitions == 0) {
+                continue;
+            }
+            printf("    hold mean %u max %u, wait mean %u max %u\n",
+                   (uint32_t)(stats.total_hold_time / stats.acquisitions), stats.max_hold_time,
+                   (uint32_t)(stats.total_wait_time / stats.acquisitions), stats.max_wait_time);
+            printf("    %10s %10s %10s\n", "from", "hold", "wait");
+            for (int slot = 0; slot < MULTI_HEAP_HISTOGRAM_SIZE; slot++) {
+                if (stats.hold_times[slot] || stats.wait_times[slot]) {
+                    printf("    %10u %10u %10u\n", slot ? 1U << slot : 0, stats.hold_times[slot], stats.wait_times[slot]);
+                }
+            }
+        }
+    }
+}
+
+void heap_caps_get_op_stats( multi_heap_op_stats_t *stats, multi_heap_op_t op, uint32_t caps )
+{
+    bzero(stats, sizeof(multi_heap_op_stats_t));
+
+    heap_t *heap;
+    SLIST_FOREACH(heap, &registered_heaps, next) {
+        if (heap_caps_match(heap, caps)) {
+            multi_heap_op_stats_t hstats;
+            multi_heap_get_op_stats(heap->heap, op, &hstats);
+
+            stats->count += hstats.count;
+            stats->total_time += hstats.total_time;
+            if (hstats.count && hstats.max_time >= stats->max_time) {
+                stats->max_time = hstats.max_time;
+                stats->max_size = hstats.max_size;
+                stats->max_caller = hstats.max_caller;
+            }
+            for (int slot = 0; slot < MULTI_HEAP_HISTOGRAM_SIZE; slot++) {
+                stats->times[slot] += hstats.times[slot];
+            }
+        }
+    }
+}
+
+void heap_caps_reset_op_stats( uint32_t caps )
+{
+    heap_t *heap;
+    SLIST_FOREACH(heap, &registered_heaps, next) {
+        if (heap_caps_match(heap, caps)) {
+            multi_heap_reset_op_stats(heap->heap);
+        }
+    }
+}
+
+void heap_caps_dump_op_stats( uint32_t caps )
+{
+    static const char *op_names[MULTI_HEAP_OP_COUNT] = { "malloc", "aligned", "realloc", "free", "m_batch", "f_batch" };
+    printf("Heap operation statistics for capabilities 0x%08X, times in %s:\n", caps, MULTI_HEAP_TIME_UNIT);
+    heap_t *heap;
+    SLIST_FOREACH(heap, &registered_heaps, next) {
+        if (heap_caps_match(heap, caps)) {
+            multi_heap_op_stats_t stats[MULTI_HEAP_OP_COUNT];
+            uint32_t slots = 0;
+            printf("  At 0x%08x len %d\n", heap->start, heap->end - heap->start);
+            for (int op = 0; op < MULTI_HEAP_OP_COUNT; op++) {
+                multi_heap_get_op_stats(heap->heap, op, &stats[op]);
+                if (stats[op].count == 0) {
+                    continue;
+                }
+                printf("    %-8s count %u mean %u max %u size %u caller %p\n", op_names[op], stats[op].count,
+                       (uint32_t)(stats[op].total_time / stats[op].count), stats[op].max_time,
+                       (uint32_t)stats[op].max_size, stats[op].max_caller);
+                for (int slot = 0; slot < MULTI_HEAP_HISTOGRAM_SIZE; slot++) {
+                    if (stats[op].times[slot]) {
+                        slots |= 1U << slot;
+                    }
+                }
+            }
+            if (slots == 0) {
+                continue;
+            }
+            printf("    %10s", "from");
+            for (int op = 0; op < MULTI_HEAP_OP_COUNT; op++) {
+                printf(" %9s", op_names[op]);
+            }
+            printf("\n");
+            for (int slot = 0; slot < MULTI_HEAP_HISTOGRAM_SIZE; slot++) {
+                if ((slots & (1U << slot)) == 0) {
+                    continue;
+                }
+                printf("    %10u", slot ? 1U << slot : 0);
+                for (int op = 0; op < MULTI_HEAP_OP_COUNT; op++) {
+                    printf(" %9u", stats[op].times[slot]);
+                }
+                printf("\n");
+            }
         }
     }
 }
@@ -502,7 +1180,7 @@ size_t heap_caps_get_allocated_size( void *ptr )
     return size;
 }
 
-IRAM_ATTR void *heap_caps_aligned_alloc(size_t alignment, size_t size, int caps)
+IRAM_ATTR static void *heap_caps_aligned_alloc_base(size_t alignment, size_t size, int caps)
 {
     void *ret = NULL;
 
@@ -544,6 +1222,7 @@ IRAM_ATTR void *heap_caps_aligned_alloc(size_t alignment, size_t size, int caps)
                     //Just try to alloc, nothing special.
                     ret = multi_heap_aligned_alloc(heap->heap, size, alignment); 
                     if (ret != NULL) {
+                        heap_caps_watermark_dispatch(heap);
                         return ret;
                     }
                 }
@@ -554,6 +1233,16 @@ IRAM_ATTR void *heap_caps_aligned_alloc(size_t alignment, size_t size, int caps)
     return NULL;
 }
 
+IRAM_ATTR void *heap_caps_aligned_alloc(size_t alignment, size_t size, int caps)
+{
+    void *ret = heap_caps_aligned_alloc_base(alignment, size, caps);
+    size_t next = 0;
+    while (ret == NULL && (next = heap_caps_reclaim(size, caps, next)) != 0) {
+        ret = heap_caps_aligned_alloc_base(alignment, size, caps);
+    }
+    return ret;
+}
+
 void *heap_caps_aligned_calloc(size_t alignment, size_t n, size_t size, uint32_t caps)
 {    
     size_t size_bytes;
@@ -578,4 +1267,5 @@ IRAM_ATTR void heap_caps_aligned_free(void *ptr)
     heap_t *heap = find_containing_heap(ptr);
     assert(heap != NULL && "free() target pointer is outside heap areas");
     multi_heap_aligned_free(heap->heap, ptr);
+    heap_caps_watermark_dispatch(heap);
 }
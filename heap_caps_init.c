@@ -106,6 +106,9 @@ void heap_caps_init(void)
         heap->start = region->start;
         heap->end = region->start + region->size;
         MULTI_HEAP_LOCK_INIT(&heap->heap_mux);
+        heap->watermark_cb = NULL;
+        heap->watermark_caps = 0;
+        heap->watermark_active = 0;
         if (type->startup_stack) {
             /* Will be registered when OS scheduler starts */
             heap->heap = NULL;
@@ -215,6 +218,9 @@ esp_err_t heap_caps_add_region_with_caps(const uint32_t caps[], intptr_t start,
     p_new->start = start;
     p_new->end = end;
     MULTI_HEAP_LOCK_INIT(&p_new->heap_mux);
+    p_new->watermark_cb = NULL;
+    p_new->watermark_caps = 0;
+    p_new->watermark_active = 0;
     p_new->heap = multi_heap_register((void *)start, end - start);
     SLIST_NEXT(p_new, next) = NULL;
     if (p_new->heap == NULL) {
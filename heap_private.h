@@ -17,6 +17,7 @@
 #include <stdint.h>
 #include <soc/soc_memory_layout.h>
 #include "multi_heap.h"
+#include "esp_heap_caps.h"
 #include "multi_heap_platform.h"
 #include "sys/queue.h"
 
@@ -37,6 +38,9 @@ typedef struct heap_t_ {
     intptr_t end;
     multi_heap_lock_t heap_mux;
     multi_heap_handle_t heap;
+    heap_caps_watermark_cb_t watermark_cb; ///< Called outside of the heap lock when the free memory crosses the watermark
+    uint32_t watermark_caps;
+    volatile uint32_t watermark_active;
     SLIST_ENTRY(heap_t_) next;
 } heap_t;
 
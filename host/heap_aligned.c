@@ -0,0 +1,222 @@
+//================
+// heap_aligned.c
+//================
+
+// Aligned allocations from 8 to 4096 bytes between blocks of odd sizes
+// Checks the pointers and the heap, reports the time and the padding of each alignment
+
+// Copyright 2021, Sven Bieg (svenbieg@web.de)
+// http://github.com/svenbieg/esp32-heap
+
+
+//=======
+// Using
+//=======
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "multi_heap.h"
+#include "multi_heap_host.h"
+
+
+//==========
+// Settings
+//==========
+
+typedef struct
+{
+uint32_t rounds;
+uint32_t live;
+size_t max_alignment;
+size_t heap_size;
+}heap_aligned_settings_t;
+
+heap_aligned_settings_t heap_aligned_settings={ 2000, 64, 4096, 512*1024 };
+
+
+//========
+// Result
+//========
+
+typedef struct
+{
+size_t alignment;
+uint32_t allocations;
+uint32_t failed;
+uint32_t errors;
+uint64_t alloc_ns;
+uint64_t free_ns;
+uint64_t padding;
+}heap_aligned_result_t;
+
+uint32_t heap_aligned_random(uint32_t* seed)
+{
+*seed=*seed*1103515245+12345;
+return *seed>>8;
+}
+
+// Small blocks of odd sizes leave free space at every offset
+void heap_aligned_fill(multi_heap_handle_t heap, void** blocks, uint32_t count, uint32_t* seed)
+{
+for(uint32_t u=0; u<count; u++)
+	{
+	blocks[u]=multi_heap_malloc(heap, 1+heap_aligned_random(seed)%61);
+	if(blocks[u]&&u%2)
+		{
+		multi_heap_free(heap, blocks[u]);
+		blocks[u]=NULL;
+		}
+	}
+}
+
+// The block must hold the size behind the aligned pointer, free and realloc must find it
+bool heap_aligned_check(multi_heap_handle_t heap, uint8_t* p, size_t size, size_t alignment, heap_aligned_result_t* result)
+{
+if((size_t)p%alignment)
+	{
+	printf("%p is not aligned to %zu\n", p, alignment);
+	return false;
+	}
+size_t allocated=multi_heap_get_allocated_size(heap, p);
+if(allocated<size)
+	{
+	printf("block of %zu bytes aligned to %zu has an allocated size of %zu\n", size, alignment, allocated);
+	return false;
+	}
+result->padding+=allocated-size;
+memset(p, 0xA5, size);
+return true;
+}
+
+bool heap_aligned_run(size_t alignment, heap_aligned_result_t* result)
+{
+memset(result, 0, sizeof(heap_aligned_result_t));
+result->alignment=alignment;
+void* region=aligned_alloc(16, heap_aligned_settings.heap_size);
+multi_heap_handle_t heap=multi_heap_register(region, heap_aligned_settings.heap_size);
+size_t initial_free=multi_heap_free_size(heap);
+uint32_t seed=(uint32_t)alignment;
+uint32_t live=heap_aligned_settings.live;
+void** small=(void**)calloc(4*live, sizeof(void*));
+uint8_t** blocks=(uint8_t**)calloc(live, sizeof(uint8_t*));
+size_t* sizes=(size_t*)calloc(live, sizeof(size_t));
+heap_aligned_fill(heap, small, 4*live, &seed);
+for(uint32_t round=0; round<heap_aligned_settings.rounds; round++)
+	{
+	uint32_t pos=heap_aligned_random(&seed)%live;
+	if(blocks[pos])
+		{
+		uint64_t start=multi_heap_host_time_ns();
+		multi_heap_aligned_free(heap, blocks[pos]);
+		result->free_ns+=multi_heap_host_time_ns()-start;
+		blocks[pos]=NULL;
+		continue;
+		}
+	size_t size=1+heap_aligned_random(&seed)%(2*alignment);
+	uint64_t start=multi_heap_host_time_ns();
+	uint8_t* p=(uint8_t*)multi_heap_aligned_alloc(heap, size, alignment);
+	result->alloc_ns+=multi_heap_host_time_ns()-start;
+	result->allocations++;
+	if(!p)
+		{
+		result->failed++;
+		continue;
+		}
+	if(!heap_aligned_check(heap, p, size, alignment, result))
+		result->errors++;
+	blocks[pos]=p;
+	sizes[pos]=size;
+	// Some blocks are resized, they keep their content but not their alignment
+	if(heap_aligned_random(&seed)%8==0)
+		{
+		size_t new_size=1+heap_aligned_random(&seed)%(2*alignment);
+		uint8_t* ptr=(uint8_t*)multi_heap_realloc(heap, p, new_size);
+		if(!ptr)
+			continue;
+		size_t keep=size<new_size? size: new_size;
+		for(size_t u=0; u<keep; u++)
+			{
+			if(ptr[u]!=0xA5)
+				{
+				result->errors++;
+				break;
+				}
+			}
+		blocks[pos]=ptr;
+		sizes[pos]=new_size;
+		}
+	if(round%64==0&&!multi_heap_check(heap, true))
+		result->errors++;
+	}
+for(uint32_t u=0; u<live; u++)
+	multi_heap_free(heap, blocks[u]);
+for(uint32_t u=0; u<4*live; u++)
+	multi_heap_free(heap, small[u]);
+free(small);
+free(blocks);
+free(sizes);
+multi_heap_maintain(heap, 0);
+bool success=!result->errors;
+if(!multi_heap_check(heap, true))
+	success=false;
+if(multi_heap_free_size(heap)>initial_free)
+	{
+	printf("free size %zu is larger than %zu\n", multi_heap_free_size(heap), initial_free);
+	success=false;
+	}
+free(region);
+return success;
+}
+
+void heap_aligned_print(heap_aligned_result_t* result)
+{
+uint32_t done=result->allocations-result->failed;
+printf("%9zu %8u %8.0f %8.0f %12.1f %7u %7u\n", result->alignment, result->allocations,
+	result->allocations? (double)result->alloc_ns/result->allocations: 0.0,
+	done? (double)result->free_ns/done: 0.0, done? (double)result->padding/done: 0.0,
+	result->failed, result->errors);
+}
+
+
+//======
+// Main
+//======
+
+void heap_aligned_usage(const char* name)
+{
+printf("usage: %s [-n rounds] [-l live blocks] [-a max alignment] [-s heap size in KiB]\n", name);
+}
+
+int main(int argc, char** argv)
+{
+int opt=0;
+while((opt=getopt(argc, argv, "n:l:a:s:h"))!=-1)
+	{
+	switch(opt)
+		{
+		case 'n': heap_aligned_settings.rounds=(uint32_t)atoi(optarg); break;
+		case 'l': heap_aligned_settings.live=(uint32_t)atoi(optarg); break;
+		case 'a': heap_aligned_settings.max_alignment=(size_t)atoi(optarg); break;
+		case 's': heap_aligned_settings.heap_size=(size_t)atoi(optarg)*1024; break;
+		default: heap_aligned_usage(argv[0]); return 2;
+		}
+	}
+if(!heap_aligned_settings.live||heap_aligned_settings.max_alignment<8)
+	{
+	heap_aligned_usage(argv[0]);
+	return 2;
+	}
+printf("heap: %zu KiB, %u rounds, %u live blocks between small blocks of odd sizes\n",
+	heap_aligned_settings.heap_size/1024, heap_aligned_settings.rounds, heap_aligned_settings.live);
+printf("alignment   allocs alloc ns  free ns  padding/blk  failed  errors\n");
+bool success=true;
+for(size_t alignment=8; alignment<=heap_aligned_settings.max_alignment; alignment*=2)
+	{
+	heap_aligned_result_t result;
+	success&=heap_aligned_run(alignment, &result);
+	heap_aligned_print(&result);
+	}
+return success? 0: 1;
+}
@@ -0,0 +1,171 @@
+//==============
+// heap_batch.c
+//==============
+
+// Bursts of 16 to 64 buffers allocated and freed with single calls and with one batch
+// Reports the time per buffer of both
+
+// Copyright 2021, Sven Bieg (svenbieg@web.de)
+// http://github.com/svenbieg/esp32-heap
+
+
+//=======
+// Using
+//=======
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "multi_heap.h"
+#include "multi_heap_host.h"
+
+
+//==========
+// Settings
+//==========
+
+typedef struct
+{
+uint32_t rounds;
+uint32_t live;
+size_t heap_size;
+}heap_batch_settings_t;
+
+heap_batch_settings_t heap_batch_settings={ 20000, 64, 256*1024 };
+
+
+//========
+// Result
+//========
+
+typedef struct
+{
+uint64_t buffers;
+uint64_t time_ns;
+uint32_t failed;
+}heap_batch_result_t;
+
+uint32_t heap_batch_random(uint32_t* seed)
+{
+*seed=*seed*1103515245+12345;
+return *seed>>8;
+}
+
+// Other blocks stay allocated between the bursts
+void heap_batch_fill(multi_heap_handle_t heap, void** others, uint32_t count, uint32_t* seed)
+{
+for(uint32_t u=0; u<count; u++)
+	others[u]=multi_heap_malloc(heap, 16+heap_batch_random(seed)%1024);
+}
+
+bool heap_batch_run(size_t size, uint32_t count, bool batch, heap_batch_result_t* result)
+{
+memset(result, 0, sizeof(heap_batch_result_t));
+void* region=aligned_alloc(16, heap_batch_settings.heap_size);
+multi_heap_handle_t heap=multi_heap_register(region, heap_batch_settings.heap_size);
+size_t initial_free=multi_heap_free_size(heap);
+uint32_t seed=(uint32_t)(size*count);
+uint32_t live=heap_batch_settings.live;
+void** others=(void**)calloc(live, sizeof(void*));
+void** ptrs=(void**)calloc(count, sizeof(void*));
+heap_batch_fill(heap, others, live, &seed);
+bool success=true;
+for(uint32_t round=0; round<heap_batch_settings.rounds; round++)
+	{
+	uint32_t done=0;
+	uint64_t start=multi_heap_host_time_ns();
+	if(batch)
+		{
+		done=(uint32_t)multi_heap_malloc_batch(heap, size, count, ptrs);
+		multi_heap_free_batch(heap, done, ptrs);
+		}
+	else
+		{
+		for(; done<count; done++)
+			{
+			ptrs[done]=multi_heap_malloc(heap, size);
+			if(!ptrs[done])
+				break;
+			}
+		for(uint32_t u=0; u<done; u++)
+			multi_heap_free(heap, ptrs[u]);
+		}
+	result->time_ns+=multi_heap_host_time_ns()-start;
+	result->buffers+=done;
+	result->failed+=count-done;
+	// One of the other blocks is replaced
+	uint32_t pos=heap_batch_random(&seed)%live;
+	multi_heap_free(heap, others[pos]);
+	others[pos]=multi_heap_malloc(heap, 16+heap_batch_random(&seed)%1024);
+	}
+for(uint32_t u=0; u<live; u++)
+	multi_heap_free(heap, others[u]);
+free(others);
+free(ptrs);
+multi_heap_maintain(heap, 0);
+if(!multi_heap_check(heap, true))
+	success=false;
+if(multi_heap_free_size(heap)>initial_free)
+	{
+	printf("free size %zu is larger than %zu\n", multi_heap_free_size(heap), initial_free);
+	success=false;
+	}
+free(region);
+return success;
+}
+
+
+//======
+// Main
+//======
+
+void heap_batch_usage(const char* name)
+{
+printf("usage: %s [-n rounds] [-l live blocks] [-s heap size in KiB]\n", name);
+}
+
+int main(int argc, char** argv)
+{
+int opt=0;
+while((opt=getopt(argc, argv, "n:l:s:h"))!=-1)
+	{
+	switch(opt)
+		{
+		case 'n': heap_batch_settings.rounds=(uint32_t)atoi(optarg); break;
+		case 'l': heap_batch_settings.live=(uint32_t)atoi(optarg); break;
+		case 's': heap_batch_settings.heap_size=(size_t)atoi(optarg)*1024; break;
+		default: heap_batch_usage(argv[0]); return 2;
+		}
+	}
+if(!heap_batch_settings.live)
+	{
+	heap_batch_usage(argv[0]);
+	return 2;
+	}
+#ifdef CONFIG_HEAP_SIZE_CLASSES
+const char* classes="on";
+#else
+const char* classes="off";
+#endif
+printf("heap: %zu KiB, %u rounds, %u live blocks between the bursts, size classes %s\n",
+	heap_batch_settings.heap_size/1024, heap_batch_settings.rounds, heap_batch_settings.live, classes);
+printf("size  count  single ns/buffer  batch ns/buffer  failed\n");
+size_t sizes[]={ 32, 256 };
+uint32_t counts[]={ 16, 64 };
+bool success=true;
+for(uint32_t s=0; s<2; s++)
+	{
+	for(uint32_t c=0; c<2; c++)
+		{
+		heap_batch_result_t single;
+		heap_batch_result_t batch;
+		success&=heap_batch_run(sizes[s], counts[c], false, &single);
+		success&=heap_batch_run(sizes[s], counts[c], true, &batch);
+		printf("%4zu %6u %17.1f %16.1f %7u\n", sizes[s], counts[c],
+			single.buffers? (double)single.time_ns/single.buffers: 0.0,
+			batch.buffers? (double)batch.time_ns/batch.buffers: 0.0, single.failed+batch.failed);
+		}
+	}
+return success? 0: 1;
+}
@@ -0,0 +1,229 @@
+//================
+// heap_bounded.c
+//================
+
+// Counts the work of each call with and without a work budget
+// Fails if a call with a budget does more work than the bound
+
+// Copyright 2021, Sven Bieg (svenbieg@web.de)
+// http://github.com/svenbieg/esp32-heap
+
+
+//=======
+// Using
+//=======
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "multi_heap.h"
+#include "multi_heap_internal.h"
+
+
+//==========
+// Settings
+//==========
+
+typedef struct
+{
+uint32_t ops;
+uint32_t live;
+size_t budget;
+uint32_t interval;
+size_t heap_size;
+}heap_bounded_settings_t;
+
+heap_bounded_settings_t heap_bounded_settings={ 200000, 1024, 4, 64, 128*1024 };
+
+
+//========
+// Result
+//========
+
+typedef struct
+{
+uint32_t calls;
+uint64_t total_cost;
+uint32_t max_cost;
+uint32_t max_deferred;
+uint32_t maintain_calls;
+uint32_t max_maintain_cost;
+uint32_t failed;
+}heap_bounded_result_t;
+
+uint32_t heap_bounded_random(uint32_t* seed)
+{
+*seed=*seed*1103515245+12345;
+return *seed>>8;
+}
+
+// Mostly small blocks, a few large ones and bursts of frees to have a lot to combine
+size_t heap_bounded_size(uint32_t* seed)
+{
+uint32_t r=heap_bounded_random(seed)%16;
+if(r<12)
+	return 8+heap_bounded_random(seed)%120;
+if(r<15)
+	return 128+heap_bounded_random(seed)%1024;
+return 1024+heap_bounded_random(seed)%4096;
+}
+
+void heap_bounded_count(heap_bounded_result_t* result, multi_heap_handle_t heap, uint32_t start)
+{
+uint32_t cost=multi_heap_cost-start;
+result->calls++;
+result->total_cost+=cost;
+if(cost>result->max_cost)
+	result->max_cost=cost;
+if(heap->free_offset_count>result->max_deferred)
+	result->max_deferred=heap->free_offset_count;
+}
+
+bool heap_bounded_run(size_t budget, heap_bounded_result_t* result)
+{
+memset(result, 0, sizeof(heap_bounded_result_t));
+void* region=malloc(heap_bounded_settings.heap_size);
+multi_heap_handle_t heap=multi_heap_register(region, heap_bounded_settings.heap_size);
+multi_heap_set_work_budget(heap, budget);
+size_t initial_free=multi_heap_free_size(heap);
+uint32_t live=heap_bounded_settings.live;
+void** blocks=(void**)calloc(live, sizeof(void*));
+uint32_t seed=12345;
+for(uint32_t op=0; op<heap_bounded_settings.ops; op++)
+	{
+	if(budget&&op%heap_bounded_settings.interval==0)
+		{
+		uint32_t start=multi_heap_cost;
+		multi_heap_maintain(heap, budget*heap_bounded_settings.interval);
+		uint32_t cost=multi_heap_cost-start;
+		result->maintain_calls++;
+		if(cost>result->max_maintain_cost)
+			result->max_maintain_cost=cost;
+		}
+	uint32_t slot=heap_bounded_random(&seed)%live;
+	if(heap_bounded_random(&seed)%1024==0)
+		{
+		// Free a burst of blocks
+		for(uint32_t u=0; u<live/4; u++)
+			{
+			uint32_t s=(slot+u)%live;
+			if(!blocks[s])
+				continue;
+			uint32_t start=multi_heap_cost;
+			multi_heap_free(heap, blocks[s]);
+			heap_bounded_count(result, heap, start);
+			blocks[s]=NULL;
+			}
+		continue;
+		}
+	uint32_t start=multi_heap_cost;
+	if(!blocks[slot])
+		{
+		blocks[slot]=multi_heap_malloc(heap, heap_bounded_size(&seed));
+		if(!blocks[slot])
+			result->failed++;
+		}
+	else if(heap_bounded_random(&seed)%8==0)
+		{
+		void* p=multi_heap_realloc(heap, blocks[slot], heap_bounded_size(&seed));
+		if(p)
+			{
+			blocks[slot]=p;
+			}
+		else
+			{
+			result->failed++;
+			}
+		}
+	else
+		{
+		multi_heap_free(heap, blocks[slot]);
+		blocks[slot]=NULL;
+		}
+	heap_bounded_count(result, heap, start);
+	}
+for(uint32_t slot=0; slot<live; slot++)
+	multi_heap_free(heap, blocks[slot]);
+free(blocks);
+bool success=true;
+if(multi_heap_maintain(heap, 0))
+	{
+	printf("deferred blocks are left after maintenance\n");
+	success=false;
+	}
+if(!multi_heap_check(heap, true))
+	success=false;
+// Blocks of the size classes are kept as allocated
+if(multi_heap_free_size(heap)>initial_free)
+	{
+	printf("free size %zu is larger than %zu\n", multi_heap_free_size(heap), initial_free);
+	success=false;
+	}
+free(region);
+return success;
+}
+
+void heap_bounded_print(const char* name, heap_bounded_result_t* result)
+{
+printf("%-10s %10u %10.2f %10u %10u %10u %10u\n", name, result->calls, (double)result->total_cost/result->calls,
+	result->max_cost, result->max_deferred, result->max_maintain_cost, result->failed);
+}
+
+
+//======
+// Main
+//======
+
+// A deferred block takes up to two map operations to combine and one to add it,
+// each of them can split or combine a group on every level and walk the deferred chain.
+// The call itself counts as one more block.
+uint32_t heap_bounded_get_bound(size_t budget, uint32_t deferred)
+{
+return (uint32_t)((budget+1)*3*(2+CONFIG_HEAP_MAP_MAX_LEVELS+deferred));
+}
+
+void heap_bounded_usage(const char* name)
+{
+printf("usage: %s [-n ops] [-l live blocks] [-b budget] [-i maintain interval] [-s heap size in KiB]\n", name);
+}
+
+int main(int argc, char** argv)
+{
+int opt=0;
+while((opt=getopt(argc, argv, "n:l:b:i:s:h"))!=-1)
+	{
+	switch(opt)
+		{
+		case 'n': heap_bounded_settings.ops=(uint32_t)atoi(optarg); break;
+		case 'l': heap_bounded_settings.live=(uint32_t)atoi(optarg); break;
+		case 'b': heap_bounded_settings.budget=(size_t)atoi(optarg); break;
+		case 'i': heap_bounded_settings.interval=(uint32_t)atoi(optarg); break;
+		case 's': heap_bounded_settings.heap_size=(size_t)atoi(optarg)*1024; break;
+		default: heap_bounded_usage(argv[0]); return 2;
+		}
+	}
+if(!heap_bounded_settings.live||!heap_bounded_settings.budget||!heap_bounded_settings.interval)
+	{
+	heap_bounded_usage(argv[0]);
+	return 2;
+	}
+printf("heap: %zu KiB, %u ops, %u live blocks, budget %zu, maintained every %u ops\n",
+	heap_bounded_settings.heap_size/1024, heap_bounded_settings.ops, heap_bounded_settings.live,
+	heap_bounded_settings.budget, heap_bounded_settings.interval);
+printf("budget          calls  mean cost   max cost   deferred   maintain     failed\n");
+heap_bounded_result_t unbounded;
+heap_bounded_result_t bounded;
+bool success=heap_bounded_run(0, &unbounded);
+heap_bounded_print("none", &unbounded);
+success&=heap_bounded_run(heap_bounded_settings.budget, &bounded);
+heap_bounded_print("bounded", &bounded);
+uint32_t bound=heap_bounded_get_bound(heap_bounded_settings.budget, bounded.max_deferred);
+printf("bound: %u, %u deferred blocks at most\n", bound, bounded.max_deferred);
+if(bounded.max_cost>bound)
+	{
+	printf("a call took %u, more than the bound\n", bounded.max_cost);
+	success=false;
+	}
+return success? 0: 1;
+}
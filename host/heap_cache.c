@@ -0,0 +1,199 @@
+//==============
+// heap_cache.c
+//==============
+
+// Small blocks allocated and freed from 1 to N threads, more threads than cache slots
+// Reports the heap lock acquisitions per operation and checks that an exhausted heap drains every cache
+
+// Copyright 2021, Sven Bieg (svenbieg@web.de)
+// http://github.com/svenbieg/esp32-heap
+
+
+//=======
+// Using
+//=======
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "esp_heap_caps.h"
+#include "heap_caps_host.h"
+#include "multi_heap_host.h"
+
+
+//==========
+// Settings
+//==========
+
+typedef struct
+{
+uint32_t threads;
+uint32_t ops;
+uint32_t live;
+size_t heap_size;
+}heap_cache_settings_t;
+
+heap_cache_settings_t heap_cache_settings={ 6, 200000, 16, 256*1024 };
+
+
+//========
+// Thread
+//========
+
+typedef struct
+{
+pthread_t thread;
+uint32_t seed;
+uint32_t failed;
+uint32_t corrupt;
+}heap_cache_thread_t;
+
+uint32_t heap_cache_random(uint32_t* seed)
+{
+*seed=*seed*1103515245+12345;
+return *seed>>8;
+}
+
+// Blocks of 8 to 128 bytes are filled with a pattern of the thread
+void* heap_cache_run(void* param)
+{
+heap_cache_thread_t* thread=(heap_cache_thread_t*)param;
+uint32_t live=heap_cache_settings.live;
+uint8_t** blocks=(uint8_t**)calloc(live, sizeof(uint8_t*));
+size_t* sizes=(size_t*)calloc(live, sizeof(size_t));
+uint8_t pattern=(uint8_t)thread->seed;
+for(uint32_t op=0; op<heap_cache_settings.ops; op++)
+	{
+	uint32_t pos=heap_cache_random(&thread->seed)%live;
+	uint8_t* p=blocks[pos];
+	if(p)
+		{
+		if(p[0]!=pattern||p[sizes[pos]-1]!=pattern)
+			thread->corrupt++;
+		heap_caps_free(p);
+		blocks[pos]=NULL;
+		continue;
+		}
+	size_t size=8+heap_cache_random(&thread->seed)%121;
+	p=(uint8_t*)heap_caps_malloc(size, MALLOC_CAP_8BIT);
+	if(!p)
+		{
+		thread->failed++;
+		continue;
+		}
+	memset(p, pattern, size);
+	blocks[pos]=p;
+	sizes[pos]=size;
+	}
+for(uint32_t pos=0; pos<live; pos++)
+	heap_caps_free(blocks[pos]);
+free(blocks);
+free(sizes);
+return NULL;
+}
+
+// The blocks left in the caches of the threads must be released for a large allocation
+bool heap_cache_exhaust(multi_heap_handle_t heap, size_t largest_free)
+{
+void* p=multi_heap_malloc(heap, largest_free-1024);
+if(!p)
+	{
+	printf("%zu bytes can't be allocated after the threads have finished\n", largest_free-1024);
+	return false;
+	}
+multi_heap_free(heap, p);
+return true;
+}
+
+
+//======
+// Main
+//======
+
+void heap_cache_usage(const char* name)
+{
+printf("usage: %s [-t threads] [-n ops per thread] [-l live blocks per thread] [-s heap size in KiB]\n", name);
+}
+
+int main(int argc, char** argv)
+{
+int opt=0;
+while((opt=getopt(argc, argv, "t:n:l:s:h"))!=-1)
+	{
+	switch(opt)
+		{
+		case 't': heap_cache_settings.threads=(uint32_t)atoi(optarg); break;
+		case 'n': heap_cache_settings.ops=(uint32_t)atoi(optarg); break;
+		case 'l': heap_cache_settings.live=(uint32_t)atoi(optarg); break;
+		case 's': heap_cache_settings.heap_size=(size_t)atoi(optarg)*1024; break;
+		default: heap_cache_usage(argv[0]); return 2;
+		}
+	}
+if(!heap_cache_settings.threads||!heap_cache_settings.live)
+	{
+	heap_cache_usage(argv[0]);
+	return 2;
+	}
+#ifdef CONFIG_HEAP_CORE_CACHES
+printf("core caches on, %u slots of %u blocks\n", MULTI_HEAP_HOST_CORE_COUNT, CONFIG_HEAP_CORE_CACHE_SIZE);
+#else
+printf("core caches off\n");
+#endif
+printf("lock: %s, heap: %zu KiB, %u ops per thread, %u live blocks per thread\n", multi_heap_host_lock_name(),
+	heap_cache_settings.heap_size/1024, heap_cache_settings.ops, heap_cache_settings.live);
+printf("threads    ns/op  acquisitions/op  contended  failed\n");
+bool success=true;
+heap_cache_thread_t* threads=(heap_cache_thread_t*)calloc(heap_cache_settings.threads, sizeof(heap_cache_thread_t));
+for(uint32_t count=1; count<=heap_cache_settings.threads; count++)
+	{
+	void* region=aligned_alloc(16, heap_cache_settings.heap_size);
+	multi_heap_handle_t heap=heap_caps_host_add_region(region, heap_cache_settings.heap_size, MALLOC_CAP_8BIT|MALLOC_CAP_32BIT|MALLOC_CAP_DEFAULT);
+	size_t initial_free=multi_heap_free_size(heap);
+	multi_heap_info_t info;
+	multi_heap_get_info(heap, &info);
+	size_t largest_free=info.largest_free_block;
+	uint64_t start=multi_heap_host_time_ns();
+	for(uint32_t u=0; u<count; u++)
+		{
+		memset(&threads[u], 0, sizeof(heap_cache_thread_t));
+		threads[u].seed=u*7919+1;
+		pthread_create(&threads[u].thread, NULL, heap_cache_run, &threads[u]);
+		}
+	uint32_t failed=0;
+	uint32_t corrupt=0;
+	for(uint32_t u=0; u<count; u++)
+		{
+		pthread_join(threads[u].thread, NULL);
+		failed+=threads[u].failed;
+		corrupt+=threads[u].corrupt;
+		}
+	uint64_t time=multi_heap_host_time_ns()-start;
+	uint64_t acquisitions=0;
+	uint64_t contended=0;
+	uint64_t wait_ns=0;
+	heap_caps_host_get_lock_counters(&acquisitions, &contended, &wait_ns);
+	uint64_t ops=(uint64_t)count*heap_cache_settings.ops;
+	printf("%7u %8.1f %16.3f %9.2f%% %7u\n", count, (double)time/ops, (double)acquisitions/ops,
+		acquisitions? 100.0*contended/acquisitions: 0.0, failed);
+	if(corrupt)
+		{
+		printf("%u blocks were overwritten\n", corrupt);
+		success=false;
+		}
+	success&=heap_cache_exhaust(heap, largest_free);
+	multi_heap_maintain(heap, 0);
+	if(!multi_heap_check(heap, true))
+		success=false;
+	if(multi_heap_free_size(heap)>initial_free)
+		{
+		printf("free size %zu is larger than %zu\n", multi_heap_free_size(heap), initial_free);
+		success=false;
+		}
+	heap_caps_host_remove_regions();
+	free(region);
+	}
+free(threads);
+return success? 0: 1;
+}
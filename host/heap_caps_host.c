@@ -0,0 +1,66 @@
+// Copyright 2021, Sven Bieg (svenbieg@web.de)
+// http://github.com/svenbieg/esp32-heap
+#include <stdlib.h>
+#include "heap_caps_host.h"
+#include "heap_private.h"
+#include "multi_heap_platform.h"
+
+/*
+Host replacement of heap_caps_init.c. There are no SoC memory regions on the host,
+heaps are registered from buffers of the test and released all at once.
+*/
+
+/* Linked-list of registered heaps */
+struct registered_heap_ll registered_heaps;
+
+multi_heap_handle_t heap_caps_host_add_region(void *start, size_t size, uint32_t caps)
+{
+    heap_t *heap = (heap_t *)calloc(1, sizeof(heap_t));
+    if (heap == NULL) {
+        return NULL;
+    }
+    heap->caps[0] = caps;
+    heap->start = (intptr_t)start;
+    heap->end = (intptr_t)start + size;
+    MULTI_HEAP_LOCK_INIT(&heap->heap_mux);
+    heap->heap = multi_heap_register(start, size);
+    if (heap->heap == NULL) {
+        free(heap);
+        return NULL;
+    }
+    multi_heap_set_lock(heap->heap, &heap->heap_mux);
+
+    /* Append, so heaps are tried in the order they were added */
+    if (SLIST_EMPTY(&registered_heaps)) {
+        SLIST_INSERT_HEAD(&registered_heaps, heap, next);
+    } else {
+        heap_t *last = SLIST_FIRST(&registered_heaps);
+        while (SLIST_NEXT(last, next) != NULL) {
+            last = SLIST_NEXT(last, next);
+        }
+        SLIST_INSERT_AFTER(last, heap, next);
+    }
+    return heap->heap;
+}
+
+void heap_caps_host_get_lock_counters(uint64_t *acquisitions, uint64_t *contended, uint64_t *wait_ns)
+{
+    *acquisitions = 0;
+    *contended = 0;
+    *wait_ns = 0;
+    heap_t *heap;
+    SLIST_FOREACH(heap, &registered_heaps, next) {
+        *acquisitions += heap->heap_mux.acquisitions;
+        *contended += heap->heap_mux.contended;
+        *wait_ns += heap->heap_mux.wait_ns;
+    }
+}
+
+void heap_caps_host_remove_regions(void)
+{
+    while (!SLIST_EMPTY(&registered_heaps)) {
+        heap_t *heap = SLIST_FIRST(&registered_heaps);
+        SLIST_REMOVE_HEAD(&registered_heaps, next);
+        free(heap);
+    }
+}
@@ -0,0 +1,45 @@
+// Copyright 2021, Sven Bieg (svenbieg@web.de)
+// http://github.com/svenbieg/esp32-heap
+#pragma once
+
+#include <stdint.h>
+#include <stdlib.h>
+#include "multi_heap.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @brief Register a region of host memory as a heap with the given capabilities
+ *
+ * Replaces heap_caps_init() on the host. The heap is locked with the backend
+ * selected in host/CMakeLists.txt.
+ *
+ * @param start Start of the region
+ * @param size Size of the region in bytes
+ * @param caps Bitwise OR of MALLOC_CAP_* flags the region provides
+ *
+ * @return Handle of the new heap, or NULL if the region is too small
+ */
+multi_heap_handle_t heap_caps_host_add_region(void *start, size_t size, uint32_t caps);
+
+/**
+ * @brief Add up the lock counters of all registered heaps
+ *
+ * @param acquisitions Number of times a heap was locked, not counting recursive locks
+ * @param contended Number of times a heap was held by another thread
+ * @param wait_ns Total time spent waiting for a heap held by another thread
+ */
+void heap_caps_host_get_lock_counters(uint64_t *acquisitions, uint64_t *contended, uint64_t *wait_ns);
+
+/**
+ * @brief Unregister all heaps added by heap_caps_host_add_region()
+ *
+ * The regions are not released, they belong to the caller.
+ */
+void heap_caps_host_remove_regions(void);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,166 @@
+//================
+// heap_classes.c
+//================
+
+// Mostly small allocations of 8 to 128 bytes with a few larger ones
+// Built as heap_classes with size classes and as heap_classes_plain without them
+
+// Copyright 2021, Sven Bieg (svenbieg@web.de)
+// http://github.com/svenbieg/esp32-heap
+
+
+//=======
+// Using
+//=======
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "multi_heap.h"
+#include "multi_heap_host.h"
+
+
+//==========
+// Settings
+//==========
+
+typedef struct
+{
+uint32_t ops;
+uint32_t live;
+uint32_t large_percent;
+size_t heap_size;
+}heap_classes_settings_t;
+
+heap_classes_settings_t heap_classes_settings={ 1000000, 1024, 10, 256*1024 };
+
+
+//========
+// Result
+//========
+
+typedef struct
+{
+uint32_t small_ops;
+uint32_t large_ops;
+uint64_t small_ns;
+uint64_t large_ns;
+uint32_t failed;
+size_t free_size;
+size_t largest_free;
+}heap_classes_result_t;
+
+uint32_t heap_classes_random(uint32_t* seed)
+{
+*seed=*seed*1103515245+12345;
+return *seed>>8;
+}
+
+bool heap_classes_run(heap_classes_result_t* result)
+{
+memset(result, 0, sizeof(heap_classes_result_t));
+void* region=aligned_alloc(16, heap_classes_settings.heap_size);
+multi_heap_handle_t heap=multi_heap_register(region, heap_classes_settings.heap_size);
+size_t initial_free=multi_heap_free_size(heap);
+uint32_t live=heap_classes_settings.live;
+void** blocks=(void**)calloc(live, sizeof(void*));
+size_t* sizes=(size_t*)calloc(live, sizeof(size_t));
+uint32_t seed=2021;
+for(uint32_t op=0; op<heap_classes_settings.ops; op++)
+	{
+	uint32_t pos=heap_classes_random(&seed)%live;
+	uint64_t start=multi_heap_host_time_ns();
+	size_t size=sizes[pos];
+	if(blocks[pos])
+		{
+		multi_heap_free(heap, blocks[pos]);
+		blocks[pos]=NULL;
+		}
+	else
+		{
+		size=8+heap_classes_random(&seed)%121;
+		if(heap_classes_random(&seed)%100<heap_classes_settings.large_percent)
+			size=129+heap_classes_random(&seed)%896;
+		blocks[pos]=multi_heap_malloc(heap, size);
+		sizes[pos]=size;
+		if(!blocks[pos])
+			result->failed++;
+		}
+	uint64_t time=multi_heap_host_time_ns()-start;
+	if(size<=128)
+		{
+		result->small_ops++;
+		result->small_ns+=time;
+		}
+	else
+		{
+		result->large_ops++;
+		result->large_ns+=time;
+		}
+	}
+multi_heap_info_t info;
+multi_heap_get_info(heap, &info);
+result->free_size=info.total_free_bytes;
+result->largest_free=info.largest_free_block;
+for(uint32_t u=0; u<live; u++)
+	multi_heap_free(heap, blocks[u]);
+free(blocks);
+free(sizes);
+multi_heap_maintain(heap, 0);
+bool success=true;
+if(!multi_heap_check(heap, true))
+	success=false;
+if(multi_heap_free_size(heap)>initial_free)
+	{
+	printf("free size %zu is larger than %zu\n", multi_heap_free_size(heap), initial_free);
+	success=false;
+	}
+free(region);
+return success;
+}
+
+
+//======
+// Main
+//======
+
+void heap_classes_usage(const char* name)
+{
+printf("usage: %s [-n ops] [-l live blocks] [-p percent of large blocks] [-s heap size in KiB]\n", name);
+}
+
+int main(int argc, char** argv)
+{
+int opt=0;
+while((opt=getopt(argc, argv, "n:l:p:s:h"))!=-1)
+	{
+	switch(opt)
+		{
+		case 'n': heap_classes_settings.ops=(uint32_t)atoi(optarg); break;
+		case 'l': heap_classes_settings.live=(uint32_t)atoi(optarg); break;
+		case 'p': heap_classes_settings.large_percent=(uint32_t)atoi(optarg); break;
+		case 's': heap_classes_settings.heap_size=(size_t)atoi(optarg)*1024; break;
+		default: heap_classes_usage(argv[0]); return 2;
+		}
+	}
+if(!heap_classes_settings.live||heap_classes_settings.large_percent>100)
+	{
+	heap_classes_usage(argv[0]);
+	return 2;
+	}
+#ifdef CONFIG_HEAP_SIZE_CLASSES
+const char* classes="on";
+#else
+const char* classes="off";
+#endif
+printf("heap: %zu KiB, %u ops, %u live blocks, %u%% larger than 128 bytes, size classes %s\n",
+	heap_classes_settings.heap_size/1024, heap_classes_settings.ops, heap_classes_settings.live,
+	heap_classes_settings.large_percent, classes);
+heap_classes_result_t result;
+bool success=heap_classes_run(&result);
+printf("small ns/op  large ns/op  free bytes  largest free  failed\n");
+printf("%11.1f %12.1f %11zu %13zu %7u\n", result.small_ops? (double)result.small_ns/result.small_ops: 0.0,
+	result.large_ops? (double)result.large_ns/result.large_ops: 0.0, result.free_size, result.largest_free, result.failed);
+return success? 0: 1;
+}
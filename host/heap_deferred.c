@@ -0,0 +1,199 @@
+//=================
+// heap_deferred.c
+//=================
+
+// Many small blocks are split from large ones, resized, aligned and freed in batches
+// Every free while the map is updated is deferred, reports the bytes missing after the final free
+
+// Copyright 2021, Sven Bieg (svenbieg@web.de)
+// http://github.com/svenbieg/esp32-heap
+
+
+//=======
+// Using
+//=======
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "multi_heap.h"
+#include "multi_heap_host.h"
+
+
+//==========
+// Settings
+//==========
+
+typedef struct
+{
+uint32_t slots;
+uint32_t rounds;
+uint32_t seeds;
+size_t heap_size;
+}heap_deferred_settings_t;
+
+heap_deferred_settings_t heap_deferred_settings={ 2000, 100, 3, 512*1024 };
+
+
+//========
+// Result
+//========
+
+typedef struct
+{
+uint64_t ops;
+uint32_t failed;
+uint32_t map_blocks;
+size_t leaked;
+uint64_t time_ns;
+}heap_deferred_result_t;
+
+uint32_t heap_deferred_random(uint32_t* seed)
+{
+*seed=*seed*1103515245+12345;
+return *seed>>8;
+}
+
+void heap_deferred_free_all(multi_heap_handle_t heap, void** blocks, uint32_t count)
+{
+multi_heap_free_batch(heap, count, blocks);
+memset(blocks, 0, count*sizeof(void*));
+}
+
+// Large blocks are freed and split into many small ones, so the map grows and shrinks
+void heap_deferred_split(multi_heap_handle_t heap, void** blocks, uint32_t* seed, heap_deferred_result_t* result)
+{
+uint32_t slots=heap_deferred_settings.slots;
+for(uint32_t u=0; u<slots; u+=4)
+	{
+	multi_heap_free(heap, blocks[u]);
+	blocks[u]=NULL;
+	}
+for(uint32_t u=0; u<slots; u++)
+	{
+	if(blocks[u])
+		continue;
+	size_t size=1+heap_deferred_random(seed)%96;
+	if(u%4==0)
+		size=256+heap_deferred_random(seed)%512;
+	blocks[u]=multi_heap_malloc(heap, size);
+	result->ops++;
+	if(!blocks[u])
+		result->failed++;
+	}
+}
+
+// Every second block is resized or replaced by an aligned one, its neighbours are combined
+void heap_deferred_shuffle(multi_heap_handle_t heap, void** blocks, uint32_t* seed, heap_deferred_result_t* result)
+{
+uint32_t slots=heap_deferred_settings.slots;
+for(uint32_t u=heap_deferred_random(seed)%2; u<slots; u+=2)
+	{
+	uint32_t op=heap_deferred_random(seed)%3;
+	result->ops++;
+	if(op==0&&blocks[u])
+		{
+		void* p=multi_heap_realloc(heap, blocks[u], 1+heap_deferred_random(seed)%192);
+		if(p)
+			blocks[u]=p;
+		continue;
+		}
+	multi_heap_free(heap, blocks[u]);
+	if(op==1)
+		{
+		blocks[u]=multi_heap_aligned_alloc(heap, 1+heap_deferred_random(seed)%128, 64);
+		}
+	else
+		{
+		blocks[u]=multi_heap_malloc(heap, 1+heap_deferred_random(seed)%64);
+		}
+	if(!blocks[u])
+		result->failed++;
+	}
+}
+
+bool heap_deferred_run(uint32_t seed, heap_deferred_result_t* result)
+{
+memset(result, 0, sizeof(heap_deferred_result_t));
+void* region=aligned_alloc(16, heap_deferred_settings.heap_size);
+multi_heap_handle_t heap=multi_heap_register(region, heap_deferred_settings.heap_size);
+size_t initial_free=multi_heap_free_size(heap);
+uint32_t slots=heap_deferred_settings.slots;
+void** blocks=(void**)calloc(slots, sizeof(void*));
+bool success=true;
+uint64_t start=multi_heap_host_time_ns();
+for(uint32_t round=0; round<heap_deferred_settings.rounds; round++)
+	{
+	heap_deferred_split(heap, blocks, &seed, result);
+	heap_deferred_shuffle(heap, blocks, &seed, result);
+	// Half of the blocks go at once
+	if(round%4==3)
+		heap_deferred_free_all(heap, blocks, slots/2);
+	if(round%16==0&&!multi_heap_check(heap, true))
+		success=false;
+	}
+result->time_ns=multi_heap_host_time_ns()-start;
+heap_deferred_free_all(heap, blocks, slots);
+free(blocks);
+result->map_blocks=(uint32_t)multi_heap_maintain(heap, 0);
+size_t free_size=multi_heap_free_size(heap);
+result->leaked=free_size<initial_free? initial_free-free_size: 0;
+if(!multi_heap_check(heap, true))
+	success=false;
+if(free_size>initial_free)
+	{
+	printf("free size %zu is larger than %zu\n", free_size, initial_free);
+	success=false;
+	}
+free(region);
+return success;
+}
+
+
+//======
+// Main
+//======
+
+void heap_deferred_usage(const char* name)
+{
+printf("usage: %s [-l slots] [-n rounds] [-r seeds] [-s heap size in KiB]\n", name);
+}
+
+int main(int argc, char** argv)
+{
+int opt=0;
+while((opt=getopt(argc, argv, "l:n:r:s:h"))!=-1)
+	{
+	switch(opt)
+		{
+		case 'l': heap_deferred_settings.slots=(uint32_t)atoi(optarg); break;
+		case 'n': heap_deferred_settings.rounds=(uint32_t)atoi(optarg); break;
+		case 'r': heap_deferred_settings.seeds=(uint32_t)atoi(optarg); break;
+		case 's': heap_deferred_settings.heap_size=(size_t)atoi(optarg)*1024; break;
+		default: heap_deferred_usage(argv[0]); return 2;
+		}
+	}
+if(heap_deferred_settings.slots<4)
+	{
+	heap_deferred_usage(argv[0]);
+	return 2;
+	}
+printf("heap: %zu KiB, %u slots, %u rounds of splits, resizes, aligned allocations and batch frees\n",
+	heap_deferred_settings.heap_size/1024, heap_deferred_settings.slots, heap_deferred_settings.rounds);
+printf("seed        ops    ns/op  failed  deferred left  leaked bytes\n");
+bool success=true;
+for(uint32_t seed=1; seed<=heap_deferred_settings.seeds; seed++)
+	{
+	heap_deferred_result_t result;
+	success&=heap_deferred_run(seed, &result);
+	printf("%4u %10llu %8.1f %7u %14u %13zu\n", seed, (unsigned long long)result.ops,
+		result.ops? (double)result.time_ns/result.ops: 0.0, result.failed, result.map_blocks, result.leaked);
+	if(result.map_blocks)
+		{
+		printf("deferred blocks are left after multi_heap_maintain()\n");
+		success=false;
+		}
+	}
+return success? 0: 1;
+}
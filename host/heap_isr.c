@@ -0,0 +1,306 @@
+//============
+// heap_isr.c
+//============
+
+// Frees blocks from a thread acting as interrupt while tasks allocate in the same heap
+// Compares the latency of heap_caps_free() waiting for the lock and using the free queue
+
+// Copyright 2021, Sven Bieg (svenbieg@web.de)
+// http://github.com/svenbieg/esp32-heap
+
+
+//=======
+// Using
+//=======
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "esp_heap_caps.h"
+#include "heap_caps_host.h"
+#include "multi_heap_host.h"
+
+
+//==========
+// Settings
+//==========
+
+typedef struct
+{
+uint32_t tasks;
+uint32_t ops;
+uint32_t live;
+uint32_t period_ns;
+size_t heap_size;
+}heap_isr_settings_t;
+
+heap_isr_settings_t heap_isr_settings={ 2, 200000, 64, 2000, 256*1024 };
+
+
+//======
+// Ring
+//======
+
+// Task 0 hands buffers to the interrupt, one producer and one consumer
+#define HEAP_ISR_RING_SIZE 256
+
+typedef struct
+{
+void* buffers[HEAP_ISR_RING_SIZE];
+volatile uint32_t head;
+volatile uint32_t tail;
+}heap_isr_ring_t;
+
+bool heap_isr_ring_push(heap_isr_ring_t* ring, void* p)
+{
+uint32_t head=__atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+if(head-__atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE)==HEAP_ISR_RING_SIZE)
+	return false;
+ring->buffers[head%HEAP_ISR_RING_SIZE]=p;
+__atomic_store_n(&ring->head, head+1, __ATOMIC_RELEASE);
+return true;
+}
+
+void* heap_isr_ring_pop(heap_isr_ring_t* ring)
+{
+uint32_t tail=__atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+if(tail==__atomic_load_n(&ring->head, __ATOMIC_ACQUIRE))
+	return NULL;
+void* p=ring->buffers[tail%HEAP_ISR_RING_SIZE];
+__atomic_store_n(&ring->tail, tail+1, __ATOMIC_RELEASE);
+return p;
+}
+
+
+//=======
+// Tasks
+//=======
+
+typedef struct
+{
+pthread_t thread;
+uint32_t id;
+uint32_t seed;
+uint32_t failed;
+}heap_isr_task_t;
+
+heap_isr_ring_t heap_isr_ring;
+volatile uint32_t heap_isr_running=0;
+
+uint32_t heap_isr_random(uint32_t* seed)
+{
+*seed=*seed*1103515245+12345;
+return *seed>>8;
+}
+
+// Small blocks with some large ones, the map has work to do on most calls
+size_t heap_isr_size(uint32_t* seed)
+{
+size_t size=8+heap_isr_random(seed)%256;
+if(heap_isr_random(seed)%8==0)
+	size+=2048;
+return size;
+}
+
+void* heap_isr_task_run(void* param)
+{
+heap_isr_task_t* task=(heap_isr_task_t*)param;
+uint32_t live=heap_isr_settings.live;
+void** blocks=(void**)calloc(live, sizeof(void*));
+for(uint32_t op=0; op<heap_isr_settings.ops; op++)
+	{
+	if(task->id==0&&op%16==0)
+		{
+		void* buffer=heap_caps_malloc(64+heap_isr_random(&task->seed)%448, MALLOC_CAP_8BIT);
+		if(buffer&&!heap_isr_ring_push(&heap_isr_ring, buffer))
+			heap_caps_free(buffer);
+		}
+	uint32_t slot=heap_isr_random(&task->seed)%live;
+	if(!blocks[slot])
+		{
+		blocks[slot]=heap_caps_malloc(heap_isr_size(&task->seed), MALLOC_CAP_8BIT);
+		if(!blocks[slot])
+			task->failed++;
+		continue;
+		}
+	if(heap_isr_random(&task->seed)%8==0)
+		{
+		void* p=heap_caps_realloc(blocks[slot], heap_isr_size(&task->seed), MALLOC_CAP_8BIT);
+		if(p)
+			{
+			blocks[slot]=p;
+			}
+		else
+			{
+			task->failed++;
+			}
+		continue;
+		}
+	heap_caps_free(blocks[slot]);
+	blocks[slot]=NULL;
+	}
+for(uint32_t slot=0; slot<live; slot++)
+	heap_caps_free(blocks[slot]);
+free(blocks);
+__atomic_fetch_sub(&heap_isr_running, 1, __ATOMIC_RELEASE);
+return NULL;
+}
+
+
+//===========
+// Interrupt
+//===========
+
+typedef struct
+{
+pthread_t thread;
+bool queue;
+uint32_t count;
+uint32_t capacity;
+uint32_t* latencies;
+}heap_isr_interrupt_t;
+
+void heap_isr_interrupt_free(heap_isr_interrupt_t* isr, void* p)
+{
+uint64_t start=multi_heap_host_time_ns();
+heap_caps_free(p);
+uint32_t latency=(uint32_t)(multi_heap_host_time_ns()-start);
+if(isr->count<isr->capacity)
+	isr->latencies[isr->count++]=latency;
+}
+
+void* heap_isr_interrupt_run(void* param)
+{
+heap_isr_interrupt_t* isr=(heap_isr_interrupt_t*)param;
+multi_heap_host_set_isr(isr->queue);
+while(__atomic_load_n(&heap_isr_running, __ATOMIC_ACQUIRE))
+	{
+	void* p=heap_isr_ring_pop(&heap_isr_ring);
+	if(p)
+		heap_isr_interrupt_free(isr, p);
+	// Wait for the next interrupt
+	uint64_t next=multi_heap_host_time_ns()+heap_isr_settings.period_ns;
+	while(multi_heap_host_time_ns()<next);
+	}
+void* p=NULL;
+while((p=heap_isr_ring_pop(&heap_isr_ring))!=NULL)
+	heap_isr_interrupt_free(isr, p);
+multi_heap_host_set_isr(false);
+return NULL;
+}
+
+
+//======
+// Main
+//======
+
+int heap_isr_compare(const void* a, const void* b)
+{
+uint32_t va=*(const uint32_t*)a;
+uint32_t vb=*(const uint32_t*)b;
+return va<vb? -1: va>vb? 1: 0;
+}
+
+uint32_t heap_isr_percentile(heap_isr_interrupt_t* isr, uint32_t permille)
+{
+if(!isr->count)
+	return 0;
+uint32_t index=(uint32_t)((uint64_t)(isr->count-1)*permille/1000);
+return isr->latencies[index];
+}
+
+bool heap_isr_run(bool queue)
+{
+void* region=aligned_alloc(16, heap_isr_settings.heap_size);
+multi_heap_handle_t heap=heap_caps_host_add_region(region, heap_isr_settings.heap_size, MALLOC_CAP_8BIT|MALLOC_CAP_32BIT|MALLOC_CAP_DEFAULT);
+size_t initial_free=multi_heap_free_size(heap);
+memset(&heap_isr_ring, 0, sizeof(heap_isr_ring_t));
+heap_isr_interrupt_t isr;
+memset(&isr, 0, sizeof(heap_isr_interrupt_t));
+isr.queue=queue;
+isr.capacity=heap_isr_settings.ops/16+HEAP_ISR_RING_SIZE;
+isr.latencies=(uint32_t*)calloc(isr.capacity, sizeof(uint32_t));
+heap_isr_task_t* tasks=(heap_isr_task_t*)calloc(heap_isr_settings.tasks, sizeof(heap_isr_task_t));
+heap_isr_running=heap_isr_settings.tasks;
+uint64_t start=multi_heap_host_time_ns();
+pthread_create(&isr.thread, NULL, heap_isr_interrupt_run, &isr);
+for(uint32_t u=0; u<heap_isr_settings.tasks; u++)
+	{
+	tasks[u].id=u;
+	tasks[u].seed=u*7919+1;
+	pthread_create(&tasks[u].thread, NULL, heap_isr_task_run, &tasks[u]);
+	}
+uint32_t failed=0;
+for(uint32_t u=0; u<heap_isr_settings.tasks; u++)
+	{
+	pthread_join(tasks[u].thread, NULL);
+	failed+=tasks[u].failed;
+	}
+pthread_join(isr.thread, NULL);
+uint64_t time=multi_heap_host_time_ns()-start;
+uint64_t total=0;
+for(uint32_t u=0; u<isr.count; u++)
+	total+=isr.latencies[u];
+qsort(isr.latencies, isr.count, sizeof(uint32_t), heap_isr_compare);
+uint64_t ops=(uint64_t)heap_isr_settings.tasks*heap_isr_settings.ops;
+printf("%-6s %8u %8.0f %8u %8u %8u %8u %12.0f %7u\n", queue? "queue": "lock", isr.count,
+	isr.count? (double)total/isr.count: 0.0, heap_isr_percentile(&isr, 500), heap_isr_percentile(&isr, 990),
+	heap_isr_percentile(&isr, 999), isr.count? isr.latencies[isr.count-1]: 0, ops*1e9/time, failed);
+bool success=true;
+// Blocks queued by the last interrupts are freed here
+if(heap_caps_maintain(MALLOC_CAP_8BIT, 0))
+	{
+	printf("deferred blocks are left after maintenance\n");
+	success=false;
+	}
+if(!multi_heap_check(heap, true))
+	success=false;
+if(multi_heap_free_size(heap)>initial_free)
+	{
+	printf("free size %zu is larger than %zu\n", multi_heap_free_size(heap), initial_free);
+	success=false;
+	}
+heap_caps_host_remove_regions();
+free(tasks);
+free(isr.latencies);
+free(region);
+return success;
+}
+
+void heap_isr_usage(const char* name)
+{
+printf("usage: %s [-t tasks] [-n ops per task] [-l live blocks per task] [-p interrupt period in ns] [-s heap size in KiB]\n", name);
+}
+
+int main(int argc, char** argv)
+{
+int opt=0;
+while((opt=getopt(argc, argv, "t:n:l:p:s:h"))!=-1)
+	{
+	switch(opt)
+		{
+		case 't': heap_isr_settings.tasks=(uint32_t)atoi(optarg); break;
+		case 'n': heap_isr_settings.ops=(uint32_t)atoi(optarg); break;
+		case 'l': heap_isr_settings.live=(uint32_t)atoi(optarg); break;
+		case 'p': heap_isr_settings.period_ns=(uint32_t)atoi(optarg); break;
+		case 's': heap_isr_settings.heap_size=(size_t)atoi(optarg)*1024; break;
+		default: heap_isr_usage(argv[0]); return 2;
+		}
+	}
+if(!heap_isr_settings.tasks||!heap_isr_settings.live)
+	{
+	heap_isr_usage(argv[0]);
+	return 2;
+	}
+printf("lock: %s, heap: %zu KiB, %u tasks, %u ops per task, interrupt every %u ns\n", multi_heap_host_lock_name(),
+	heap_isr_settings.heap_size/1024, heap_isr_settings.tasks, heap_isr_settings.ops, heap_isr_settings.period_ns);
+#ifndef CONFIG_HEAP_ISR_FREE_QUEUE
+printf("(the free queue is disabled, both runs wait for the lock)\n");
+#endif
+printf("free      count  mean ns   p50 ns   p99 ns p99.9 ns   max ns  task ops/s  failed\n");
+bool success=heap_isr_run(false);
+success&=heap_isr_run(true);
+return success? 0: 1;
+}
@@ -0,0 +1,218 @@
+//================
+// heap_realloc.c
+//================
+
+// Buffers grow a few hundred bytes at a time between other allocations
+// Compares multi_heap_realloc() with moving every block (malloc, copy and free)
+
+// Copyright 2021, Sven Bieg (svenbieg@web.de)
+// http://github.com/svenbieg/esp32-heap
+
+
+//=======
+// Using
+//=======
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "multi_heap.h"
+#include "multi_heap_host.h"
+
+
+//==========
+// Settings
+//==========
+
+typedef struct
+{
+uint32_t buffers;
+uint32_t rounds;
+size_t max_size;
+size_t heap_size;
+}heap_realloc_settings_t;
+
+heap_realloc_settings_t heap_realloc_settings={ 16, 200, 8192, 256*1024 };
+
+
+//========
+// Result
+//========
+
+typedef struct
+{
+uint32_t reallocs;
+uint32_t moved;
+uint32_t failed;
+uint64_t copied;
+uint64_t time_ns;
+uint32_t max_ns;
+size_t minimum_free;
+}heap_realloc_result_t;
+
+uint32_t heap_realloc_random(uint32_t* seed)
+{
+*seed=*seed*1103515245+12345;
+return *seed>>8;
+}
+
+// The old behaviour of heap_caps_realloc(), the block is always moved
+void* heap_realloc_move(multi_heap_handle_t heap, void* p, size_t old_size, size_t size)
+{
+void* ptr=multi_heap_malloc(heap, size);
+if(!ptr)
+	return NULL;
+memcpy(ptr, p, old_size<size? old_size: size);
+multi_heap_free(heap, p);
+return ptr;
+}
+
+bool heap_realloc_run(bool in_place, heap_realloc_result_t* result)
+{
+memset(result, 0, sizeof(heap_realloc_result_t));
+void* region=aligned_alloc(16, heap_realloc_settings.heap_size);
+multi_heap_handle_t heap=multi_heap_register(region, heap_realloc_settings.heap_size);
+size_t initial_free=multi_heap_free_size(heap);
+uint32_t count=heap_realloc_settings.buffers;
+uint8_t** buffers=(uint8_t**)calloc(count, sizeof(uint8_t*));
+size_t* sizes=(size_t*)calloc(count, sizeof(size_t));
+void** others=(void**)calloc(count, sizeof(void*));
+uint32_t seed=42;
+bool success=true;
+for(uint32_t round=0; round<heap_realloc_settings.rounds; round++)
+	{
+	uint32_t pos=heap_realloc_random(&seed)%count;
+	uint8_t* p=buffers[pos];
+	size_t old_size=sizes[pos];
+	// A message is complete, the buffer starts again
+	if(old_size+400>heap_realloc_settings.max_size)
+		{
+		multi_heap_free(heap, p);
+		buffers[pos]=NULL;
+		sizes[pos]=0;
+		p=NULL;
+		old_size=0;
+		}
+	size_t size=old_size+100+heap_realloc_random(&seed)%300;
+	uint64_t start=multi_heap_host_time_ns();
+	uint8_t* ptr=NULL;
+	if(!p)
+		{
+		ptr=(uint8_t*)multi_heap_malloc(heap, size);
+		}
+	else if(in_place)
+		{
+		ptr=(uint8_t*)multi_heap_realloc(heap, p, size);
+		}
+	else
+		{
+		ptr=(uint8_t*)heap_realloc_move(heap, p, old_size, size);
+		}
+	uint32_t time=(uint32_t)(multi_heap_host_time_ns()-start);
+	if(p)
+		{
+		result->reallocs++;
+		result->time_ns+=time;
+		if(time>result->max_ns)
+			result->max_ns=time;
+		}
+	if(!ptr)
+		{
+		result->failed++;
+		continue;
+		}
+	if(p&&ptr!=p)
+		{
+		result->moved++;
+		result->copied+=old_size;
+		}
+	for(size_t u=0; u<old_size; u+=64)
+		{
+		if(ptr[u]!=(uint8_t)(u/64+pos))
+			success=false;
+		}
+	for(size_t u=(old_size+63)/64*64; u<size; u+=64)
+		ptr[u]=(uint8_t)(u/64+pos);
+	buffers[pos]=ptr;
+	sizes[pos]=size;
+	// Other allocations come and go between the buffers
+	multi_heap_free(heap, others[pos]);
+	others[pos]=multi_heap_malloc(heap, 32+heap_realloc_random(&seed)%480);
+	}
+// Moving a block needs the old and the new one for a moment
+result->minimum_free=multi_heap_minimum_free_size(heap);
+if(!success)
+	printf("the content of a buffer was lost\n");
+for(uint32_t u=0; u<count; u++)
+	{
+	multi_heap_free(heap, buffers[u]);
+	multi_heap_free(heap, others[u]);
+	}
+free(buffers);
+free(sizes);
+free(others);
+multi_heap_maintain(heap, 0);
+if(!multi_heap_check(heap, true))
+	success=false;
+if(multi_heap_free_size(heap)>initial_free)
+	{
+	printf("free size %zu is larger than %zu\n", multi_heap_free_size(heap), initial_free);
+	success=false;
+	}
+free(region);
+return success;
+}
+
+void heap_realloc_print(const char* name, heap_realloc_result_t* result)
+{
+printf("%-8s %8u %7u %12llu %8.0f %8u %12zu %6u\n", name, result->reallocs, result->moved,
+	(unsigned long long)result->copied, result->reallocs? (double)result->time_ns/result->reallocs: 0.0,
+	result->max_ns, result->minimum_free, result->failed);
+}
+
+
+//======
+// Main
+//======
+
+void heap_realloc_usage(const char* name)
+{
+printf("usage: %s [-b buffers] [-n rounds] [-m max buffer size] [-s heap size in KiB]\n", name);
+}
+
+int main(int argc, char** argv)
+{
+int opt=0;
+while((opt=getopt(argc, argv, "b:n:m:s:h"))!=-1)
+	{
+	switch(opt)
+		{
+		case 'b': heap_realloc_settings.buffers=(uint32_t)atoi(optarg); break;
+		case 'n': heap_realloc_settings.rounds=(uint32_t)atoi(optarg); break;
+		case 'm': heap_realloc_settings.max_size=(size_t)atoi(optarg); break;
+		case 's': heap_realloc_settings.heap_size=(size_t)atoi(optarg)*1024; break;
+		default: heap_realloc_usage(argv[0]); return 2;
+		}
+	}
+if(!heap_realloc_settings.buffers||heap_realloc_settings.max_size<1024)
+	{
+	heap_realloc_usage(argv[0]);
+	return 2;
+	}
+printf("heap: %zu KiB, %u buffers growing up to %zu bytes, %u rounds\n", heap_realloc_settings.heap_size/1024,
+	heap_realloc_settings.buffers, heap_realloc_settings.max_size, heap_realloc_settings.rounds);
+printf("mode     reallocs   moved  bytes copied  mean ns   max ns  minimum free  failed\n");
+heap_realloc_result_t moved;
+heap_realloc_result_t in_place;
+bool success=heap_realloc_run(false, &moved);
+heap_realloc_print("move", &moved);
+success&=heap_realloc_run(true, &in_place);
+heap_realloc_print("realloc", &in_place);
+if(in_place.copied>moved.copied)
+	{
+	printf("multi_heap_realloc() copied more than moving every block\n");
+	success=false;
+	}
+return success? 0: 1;
+}
@@ -0,0 +1,358 @@
+//================
+// heap_reclaim.c
+//================
+
+// A cache of tiles shares a fixed heap with the buffers of the application
+// Compares a static limit of the cache with a cache evicting tiles from a reclaim callback
+
+// Copyright 2021, Sven Bieg (svenbieg@web.de)
+// http://github.com/svenbieg/esp32-heap
+
+
+//=======
+// Using
+//=======
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "esp_heap_caps.h"
+#include "heap_caps_host.h"
+#include "multi_heap_host.h"
+
+
+//==========
+// Settings
+//==========
+
+typedef struct
+{
+uint32_t keys;
+uint32_t ops;
+uint32_t period;
+uint32_t app_percent;
+uint32_t cache_percent;
+size_t heap_size;
+}heap_reclaim_settings_t;
+
+heap_reclaim_settings_t heap_reclaim_settings={ 1024, 200000, 20000, 50, 20, 128*1024 };
+
+typedef enum
+{
+HEAP_RECLAIM_STATIC,
+HEAP_RECLAIM_NONE,
+HEAP_RECLAIM_CALLBACK
+}heap_reclaim_mode_t;
+
+const char* heap_reclaim_mode_names[]={ "static", "none", "reclaim" };
+
+
+//=======
+// Cache
+//=======
+
+typedef struct
+{
+void* tile;
+size_t size;
+uint32_t stamp;
+}heap_reclaim_entry_t;
+
+typedef struct
+{
+heap_reclaim_entry_t* entries;
+size_t bytes;
+size_t limit;
+uint32_t stamp;
+uint32_t count;
+uint32_t evictions;
+uint32_t callbacks;
+uint32_t depth;
+uint32_t max_depth;
+}heap_reclaim_cache_t;
+
+heap_reclaim_cache_t heap_reclaim_cache;
+
+uint32_t heap_reclaim_random(uint32_t* seed)
+{
+*seed=*seed*1103515245+12345;
+return *seed>>8;
+}
+
+// Tiles of 256 bytes to 2 KiB, the size depends on the key
+size_t heap_reclaim_tile_size(uint32_t key)
+{
+return 256+(key*37)%1792;
+}
+
+// Frees the least recently used tile, returns its size or zero if the cache is empty
+size_t heap_reclaim_evict(heap_reclaim_cache_t* cache)
+{
+heap_reclaim_entry_t* lru=NULL;
+for(uint32_t key=0; key<heap_reclaim_settings.keys; key++)
+	{
+	heap_reclaim_entry_t* entry=&cache->entries[key];
+	if(!entry->tile)
+		continue;
+	if(!lru||entry->stamp<lru->stamp)
+		lru=entry;
+	}
+if(!lru)
+	return 0;
+heap_caps_free(lru->tile);
+lru->tile=NULL;
+cache->bytes-=lru->size;
+cache->count--;
+cache->evictions++;
+return lru->size;
+}
+
+// Evicts tiles until the failed allocation fits
+// The probe fails inside the callback without calling it again
+size_t heap_reclaim_callback(size_t size, uint32_t caps)
+{
+heap_reclaim_cache_t* cache=&heap_reclaim_cache;
+cache->callbacks++;
+if(++cache->depth>cache->max_depth)
+	cache->max_depth=cache->depth;
+size_t released=0;
+while(1)
+	{
+	void* probe=heap_caps_malloc(size, caps);
+	if(probe)
+		{
+		heap_caps_free(probe);
+		break;
+		}
+	size_t evicted=heap_reclaim_evict(cache);
+	if(!evicted)
+		break;
+	released+=evicted;
+	}
+cache->depth--;
+return released;
+}
+
+// Looks up a tile and loads it on a miss, returns true on a hit
+bool heap_reclaim_lookup(heap_reclaim_cache_t* cache, uint32_t key, bool limited)
+{
+heap_reclaim_entry_t* entry=&cache->entries[key];
+entry->stamp=++cache->stamp;
+if(entry->tile)
+	{
+	memset(entry->tile, (int)key, 16);
+	return true;
+	}
+size_t size=heap_reclaim_tile_size(key);
+if(limited)
+	{
+	while(cache->bytes+size>cache->limit)
+		{
+		if(!heap_reclaim_evict(cache))
+			break;
+		}
+	}
+entry->tile=heap_caps_malloc(size, MALLOC_CAP_8BIT);
+if(!entry->tile)
+	return false;
+memset(entry->tile, (int)key, size);
+entry->size=size;
+cache->bytes+=size;
+cache->count++;
+return false;
+}
+
+
+//=============
+// Application
+//=============
+
+typedef struct
+{
+void** buffers;
+size_t* sizes;
+uint32_t capacity;
+uint32_t head;
+uint32_t tail;
+size_t bytes;
+uint32_t allocations;
+uint32_t failed;
+}heap_reclaim_app_t;
+
+// The buffers of the application grow and shrink in a triangle wave
+size_t heap_reclaim_app_target(uint32_t op)
+{
+uint32_t period=heap_reclaim_settings.period;
+uint32_t phase=op%period;
+if(phase>period/2)
+	phase=period-phase;
+size_t peak=heap_reclaim_settings.heap_size*heap_reclaim_settings.app_percent/100;
+return (size_t)((uint64_t)peak*phase/(period/2));
+}
+
+void heap_reclaim_app_step(heap_reclaim_app_t* app, uint32_t op, uint32_t* seed)
+{
+size_t target=heap_reclaim_app_target(op);
+if(app->bytes<target&&app->head-app->tail<app->capacity)
+	{
+	size_t size=512+heap_reclaim_random(seed)%3584;
+	void* p=heap_caps_malloc(size, MALLOC_CAP_8BIT);
+	app->allocations++;
+	if(!p)
+		{
+		app->failed++;
+		return;
+		}
+	memset(p, 0xA5, size);
+	app->buffers[app->head%app->capacity]=p;
+	app->sizes[app->head%app->capacity]=size;
+	app->head++;
+	app->bytes+=size;
+	return;
+	}
+if(app->bytes>target&&app->head!=app->tail)
+	{
+	heap_caps_free(app->buffers[app->tail%app->capacity]);
+	app->bytes-=app->sizes[app->tail%app->capacity];
+	app->tail++;
+	}
+}
+
+
+//======
+// Main
+//======
+
+typedef struct
+{
+uint32_t hits;
+uint32_t lookups;
+uint32_t app_allocations;
+uint32_t app_failed;
+uint32_t evictions;
+uint32_t callbacks;
+uint32_t max_depth;
+size_t max_cache_bytes;
+}heap_reclaim_result_t;
+
+bool heap_reclaim_run(heap_reclaim_mode_t mode, heap_reclaim_result_t* result)
+{
+memset(result, 0, sizeof(heap_reclaim_result_t));
+void* region=aligned_alloc(16, heap_reclaim_settings.heap_size);
+multi_heap_handle_t heap=heap_caps_host_add_region(region, heap_reclaim_settings.heap_size, MALLOC_CAP_8BIT|MALLOC_CAP_32BIT|MALLOC_CAP_DEFAULT);
+size_t initial_free=multi_heap_free_size(heap);
+heap_reclaim_cache_t* cache=&heap_reclaim_cache;
+memset(cache, 0, sizeof(heap_reclaim_cache_t));
+cache->entries=(heap_reclaim_entry_t*)calloc(heap_reclaim_settings.keys, sizeof(heap_reclaim_entry_t));
+cache->limit=heap_reclaim_settings.heap_size*heap_reclaim_settings.cache_percent/100;
+heap_reclaim_app_t app;
+memset(&app, 0, sizeof(heap_reclaim_app_t));
+app.capacity=(uint32_t)(heap_reclaim_settings.heap_size/512);
+app.buffers=(void**)calloc(app.capacity, sizeof(void*));
+app.sizes=(size_t*)calloc(app.capacity, sizeof(size_t));
+if(mode==HEAP_RECLAIM_CALLBACK)
+	heap_caps_register_reclaim(heap_reclaim_callback, 0);
+uint32_t seed=4711;
+for(uint32_t op=0; op<heap_reclaim_settings.ops; op++)
+	{
+	// Skewed keys, low keys are used most often
+	uint32_t keys=heap_reclaim_settings.keys;
+	uint32_t key=(uint32_t)((uint64_t)(heap_reclaim_random(&seed)%keys)*(heap_reclaim_random(&seed)%keys)/keys);
+	result->lookups++;
+	if(heap_reclaim_lookup(cache, key, mode==HEAP_RECLAIM_STATIC))
+		result->hits++;
+	if(cache->bytes>result->max_cache_bytes)
+		result->max_cache_bytes=cache->bytes;
+	heap_reclaim_app_step(&app, op, &seed);
+	heap_reclaim_app_step(&app, op, &seed);
+	}
+if(mode==HEAP_RECLAIM_CALLBACK)
+	heap_caps_unregister_reclaim(heap_reclaim_callback);
+result->app_allocations=app.allocations;
+result->app_failed=app.failed;
+result->evictions=cache->evictions;
+result->callbacks=cache->callbacks;
+result->max_depth=cache->max_depth;
+while(heap_reclaim_evict(cache));
+for(; app.tail!=app.head; app.tail++)
+	heap_caps_free(app.buffers[app.tail%app.capacity]);
+free(app.buffers);
+free(app.sizes);
+free(cache->entries);
+bool success=true;
+heap_caps_maintain(MALLOC_CAP_8BIT, 0);
+if(!multi_heap_check(heap, true))
+	success=false;
+if(multi_heap_free_size(heap)>initial_free)
+	{
+	printf("free size %zu is larger than %zu\n", multi_heap_free_size(heap), initial_free);
+	success=false;
+	}
+heap_caps_host_remove_regions();
+free(region);
+return success;
+}
+
+void heap_reclaim_print(heap_reclaim_mode_t mode, heap_reclaim_result_t* result)
+{
+printf("%-8s %7.2f%% %9zu %8u/%-8u %9u %9u %7u\n", heap_reclaim_mode_names[mode],
+	result->lookups? 100.0*result->hits/result->lookups: 0.0, result->max_cache_bytes,
+	result->app_failed, result->app_allocations, result->evictions, result->callbacks, result->max_depth);
+}
+
+void heap_reclaim_usage(const char* name)
+{
+printf("usage: %s [-k keys] [-n ops] [-p period of the application] [-a peak of the application in percent] [-c static cache limit in percent] [-s heap size in KiB]\n", name);
+}
+
+int main(int argc, char** argv)
+{
+int opt=0;
+while((opt=getopt(argc, argv, "k:n:p:a:c:s:h"))!=-1)
+	{
+	switch(opt)
+		{
+		case 'k': heap_reclaim_settings.keys=(uint32_t)atoi(optarg); break;
+		case 'n': heap_reclaim_settings.ops=(uint32_t)atoi(optarg); break;
+		case 'p': heap_reclaim_settings.period=(uint32_t)atoi(optarg); break;
+		case 'a': heap_reclaim_settings.app_percent=(uint32_t)atoi(optarg); break;
+		case 'c': heap_reclaim_settings.cache_percent=(uint32_t)atoi(optarg); break;
+		case 's': heap_reclaim_settings.heap_size=(size_t)atoi(optarg)*1024; break;
+		default: heap_reclaim_usage(argv[0]); return 2;
+		}
+	}
+if(!heap_reclaim_settings.keys||heap_reclaim_settings.period<2)
+	{
+	heap_reclaim_usage(argv[0]);
+	return 2;
+	}
+printf("heap: %zu KiB, %u keys, %u ops, application up to %u%%, static cache limit %u%%\n",
+	heap_reclaim_settings.heap_size/1024, heap_reclaim_settings.keys, heap_reclaim_settings.ops,
+	heap_reclaim_settings.app_percent, heap_reclaim_settings.cache_percent);
+printf("cache    hit rate  max bytes  app failed/allocs  evicted  callbacks   depth\n");
+heap_reclaim_result_t results[3];
+bool success=true;
+for(uint32_t mode=HEAP_RECLAIM_STATIC; mode<=HEAP_RECLAIM_CALLBACK; mode++)
+	{
+	success&=heap_reclaim_run((heap_reclaim_mode_t)mode, &results[mode]);
+	heap_reclaim_print((heap_reclaim_mode_t)mode, &results[mode]);
+	}
+heap_reclaim_result_t* reclaim=&results[HEAP_RECLAIM_CALLBACK];
+if(reclaim->app_failed)
+	{
+	printf("%u allocations of the application failed with the reclaim callback\n", reclaim->app_failed);
+	success=false;
+	}
+if(reclaim->hits<results[HEAP_RECLAIM_STATIC].hits)
+	{
+	printf("the hit rate with the reclaim callback is lower than with a static limit\n");
+	success=false;
+	}
+if(reclaim->max_depth>1)
+	{
+	printf("the reclaim callback was called recursively\n");
+	success=false;
+	}
+return success? 0: 1;
+}
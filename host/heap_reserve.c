@@ -0,0 +1,208 @@
+//================
+// heap_reserve.c
+//================
+
+// Exhausts a heap with normal allocations, then allocates with MALLOC_CAP_CRITICAL
+// Fails if critical allocations within the critical reserve don't succeed
+
+// Copyright 2021, Sven Bieg (svenbieg@web.de)
+// http://github.com/svenbieg/esp32-heap
+
+
+//=======
+// Using
+//=======
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "esp_heap_caps.h"
+#include "heap_caps_host.h"
+#include "multi_heap_host.h"
+
+
+//==========
+// Settings
+//==========
+
+typedef struct
+{
+size_t reserve;
+uint32_t count;
+size_t size;
+uint32_t rounds;
+size_t heap_size;
+}heap_reserve_settings_t;
+
+heap_reserve_settings_t heap_reserve_settings={ 4096, 16, 96, 100, 64*1024 };
+
+
+//========
+// Result
+//========
+
+typedef struct
+{
+size_t normal_bytes;
+uint32_t attempts;
+uint32_t succeeded;
+uint64_t total_ns;
+uint32_t max_ns;
+multi_heap_reserve_info_t info;
+}heap_reserve_result_t;
+
+uint32_t heap_reserve_random(uint32_t* seed)
+{
+*seed=*seed*1103515245+12345;
+return *seed>>8;
+}
+
+// Allocate until a number of calls in a row fail, returns the bytes allocated
+size_t heap_reserve_fill(void** blocks, uint32_t* count, uint32_t max_count, uint32_t* seed, size_t max_size)
+{
+size_t bytes=0;
+uint32_t failed=0;
+while(failed<64&&*count<max_count)
+	{
+	size_t size=8+heap_reserve_random(seed)%max_size;
+	void* p=heap_caps_malloc(size, MALLOC_CAP_8BIT);
+	if(!p)
+		{
+		failed++;
+		continue;
+		}
+	failed=0;
+	blocks[(*count)++]=p;
+	bytes+=size;
+	}
+return bytes;
+}
+
+bool heap_reserve_run(size_t reserve, heap_reserve_result_t* result)
+{
+memset(result, 0, sizeof(heap_reserve_result_t));
+void* region=aligned_alloc(16, heap_reserve_settings.heap_size);
+multi_heap_handle_t heap=heap_caps_host_add_region(region, heap_reserve_settings.heap_size, MALLOC_CAP_8BIT|MALLOC_CAP_32BIT|MALLOC_CAP_DEFAULT);
+heap_caps_set_reserve(MALLOC_CAP_8BIT, 512, reserve);
+size_t initial_free=multi_heap_free_size(heap);
+uint32_t max_count=(uint32_t)(heap_reserve_settings.heap_size/8);
+void** blocks=(void**)calloc(max_count, sizeof(void*));
+uint32_t count=0;
+uint32_t seed=12345;
+// Exhaust the heap, free every third block and fill the holes with small blocks
+heap_reserve_fill(blocks, &count, max_count, &seed, 1024);
+for(uint32_t u=0; u<count; u+=3)
+	{
+	heap_caps_free(blocks[u]);
+	blocks[u]=NULL;
+	}
+heap_reserve_fill(blocks, &count, max_count, &seed, 256);
+heap_reserve_fill(blocks, &count, max_count, &seed, 16);
+for(uint32_t u=0; u<count; u++)
+	{
+	if(blocks[u])
+		result->normal_bytes+=heap_caps_get_allocated_size(blocks[u]);
+	}
+// Critical allocations like log messages, freed after each round
+void** critical=(void**)calloc(heap_reserve_settings.count, sizeof(void*));
+for(uint32_t round=0; round<heap_reserve_settings.rounds; round++)
+	{
+	for(uint32_t u=0; u<heap_reserve_settings.count; u++)
+		{
+		uint64_t start=multi_heap_host_time_ns();
+		critical[u]=heap_caps_malloc(heap_reserve_settings.size, MALLOC_CAP_8BIT|MALLOC_CAP_CRITICAL);
+		uint32_t time=(uint32_t)(multi_heap_host_time_ns()-start);
+		result->attempts++;
+		result->total_ns+=time;
+		if(time>result->max_ns)
+			result->max_ns=time;
+		if(!critical[u])
+			continue;
+		result->succeeded++;
+		memset(critical[u], 0x5A, heap_reserve_settings.size);
+		}
+	// Other allocations still fail
+	for(uint32_t u=0; u<heap_reserve_settings.count; u++)
+		{
+		void* p=heap_caps_malloc(heap_reserve_settings.size, MALLOC_CAP_8BIT);
+		if(p)
+			blocks[count++%max_count]=p;
+		}
+	for(uint32_t u=0; u<heap_reserve_settings.count; u++)
+		heap_caps_free(critical[u]);
+	}
+heap_caps_get_reserve_info(&result->info, MALLOC_CAP_8BIT);
+bool success=true;
+for(uint32_t u=0; u<count&&u<max_count; u++)
+	heap_caps_free(blocks[u]);
+free(critical);
+free(blocks);
+heap_caps_maintain(MALLOC_CAP_8BIT, 0);
+if(!multi_heap_check(heap, true))
+	success=false;
+if(multi_heap_free_size(heap)>initial_free)
+	{
+	printf("free size %zu is larger than %zu\n", multi_heap_free_size(heap), initial_free);
+	success=false;
+	}
+heap_caps_host_remove_regions();
+free(region);
+return success;
+}
+
+void heap_reserve_print(size_t reserve, heap_reserve_result_t* result)
+{
+printf("%7zu %12zu %7u/%-7u %8.0f %8u %9zu %9zu %9zu\n", reserve, result->normal_bytes, result->succeeded, result->attempts,
+	result->attempts? (double)result->total_ns/result->attempts: 0.0, result->max_ns,
+	result->info.reserve_allocations, result->info.reserve_refusals, result->info.free_reserve);
+}
+
+
+//======
+// Main
+//======
+
+void heap_reserve_usage(const char* name)
+{
+printf("usage: %s [-r critical reserve] [-c critical blocks per round] [-m critical block size] [-n rounds] [-s heap size in KiB]\n", name);
+}
+
+int main(int argc, char** argv)
+{
+int opt=0;
+while((opt=getopt(argc, argv, "r:c:m:n:s:h"))!=-1)
+	{
+	switch(opt)
+		{
+		case 'r': heap_reserve_settings.reserve=(size_t)atoi(optarg); break;
+		case 'c': heap_reserve_settings.count=(uint32_t)atoi(optarg); break;
+		case 'm': heap_reserve_settings.size=(size_t)atoi(optarg); break;
+		case 'n': heap_reserve_settings.rounds=(uint32_t)atoi(optarg); break;
+		case 's': heap_reserve_settings.heap_size=(size_t)atoi(optarg)*1024; break;
+		default: heap_reserve_usage(argv[0]); return 2;
+		}
+	}
+if(!heap_reserve_settings.count||!heap_reserve_settings.size)
+	{
+	heap_reserve_usage(argv[0]);
+	return 2;
+	}
+printf("heap: %zu KiB, %u rounds of %u critical blocks of %zu bytes in an exhausted heap\n",
+	heap_reserve_settings.heap_size/1024, heap_reserve_settings.rounds, heap_reserve_settings.count, heap_reserve_settings.size);
+printf("reserve  normal bytes  critical  mean ns   max ns  reserved   refused  reserve left\n");
+heap_reserve_result_t none;
+heap_reserve_result_t reserved;
+bool success=heap_reserve_run(0, &none);
+heap_reserve_print(0, &none);
+success&=heap_reserve_run(heap_reserve_settings.reserve, &reserved);
+heap_reserve_print(heap_reserve_settings.reserve, &reserved);
+// The critical blocks of a round fit into the reserve with their headers
+size_t needed=heap_reserve_settings.count*(heap_reserve_settings.size+4*sizeof(size_t));
+if(needed<=heap_reserve_settings.reserve&&reserved.succeeded<reserved.attempts)
+	{
+	printf("%u critical allocations failed\n", reserved.attempts-reserved.succeeded);
+	success=false;
+	}
+return success? 0: 1;
+}
@@ -0,0 +1,234 @@
+//===============
+// heap_stress.c
+//===============
+
+// Allocates, resizes and frees random blocks from 1 to N threads
+// Reports operations per second and the time spent waiting for the heap lock
+
+// Copyright 2021, Sven Bieg (svenbieg@web.de)
+// http://github.com/svenbieg/esp32-heap
+
+
+//=======
+// Using
+//=======
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "esp_heap_caps.h"
+#include "heap_caps_host.h"
+#include "multi_heap_host.h"
+
+
+//==========
+// Settings
+//==========
+
+typedef struct
+{
+uint32_t threads;
+uint32_t ops;
+uint32_t live;
+size_t max_size;
+size_t heap_size;
+bool dump;
+}heap_stress_settings_t;
+
+heap_stress_settings_t heap_stress_settings={ 4, 200000, 64, 256, 256*1024, false };
+
+
+//========
+// Thread
+//========
+
+typedef struct
+{
+pthread_t thread;
+uint32_t seed;
+uint32_t failed;
+uint32_t corrupt;
+}heap_stress_thread_t;
+
+// Random number, each thread has its own seed
+uint32_t heap_stress_random(uint32_t* seed)
+{
+*seed=*seed*1103515245+12345;
+return *seed>>8;
+}
+
+// Blocks hold at least their size, one in eight is large
+size_t heap_stress_size(uint32_t* seed)
+{
+size_t size=sizeof(size_t)+heap_stress_random(seed)%heap_stress_settings.max_size;
+if(heap_stress_random(seed)%8==0)
+	size+=8*heap_stress_settings.max_size;
+return size;
+}
+
+// Every block starts with its size and is filled with a pattern
+void heap_stress_fill(uint8_t* p, size_t size, uint8_t pattern)
+{
+memset(p, pattern, size);
+memcpy(p, &size, sizeof(size_t));
+}
+
+bool heap_stress_verify(uint8_t* p, uint8_t pattern)
+{
+size_t size=0;
+memcpy(&size, p, sizeof(size_t));
+if(size>9*heap_stress_settings.max_size+sizeof(size_t))
+	return false;
+// Sample the pattern, checking every byte would take longer than the heap
+for(size_t u=sizeof(size_t); u<size; u+=32)
+	{
+	if(p[u]!=pattern)
+		return false;
+	}
+return size==sizeof(size_t)||p[size-1]==pattern;
+}
+
+void* heap_stress_run(void* param)
+{
+heap_stress_thread_t* thread=(heap_stress_thread_t*)param;
+uint32_t live=heap_stress_settings.live;
+uint8_t** blocks=(uint8_t**)calloc(live, sizeof(uint8_t*));
+uint8_t pattern=(uint8_t)thread->seed;
+for(uint32_t op=0; op<heap_stress_settings.ops; op++)
+	{
+	uint32_t slot=heap_stress_random(&thread->seed)%live;
+	uint8_t* p=blocks[slot];
+	if(!p)
+		{
+		size_t size=heap_stress_size(&thread->seed);
+		p=(uint8_t*)heap_caps_malloc(size, MALLOC_CAP_8BIT);
+		if(!p)
+			{
+			thread->failed++;
+			continue;
+			}
+		heap_stress_fill(p, size, pattern);
+		blocks[slot]=p;
+		continue;
+		}
+	if(!heap_stress_verify(p, pattern))
+		thread->corrupt++;
+	if(heap_stress_random(&thread->seed)%8==0)
+		{
+		size_t size=heap_stress_size(&thread->seed);
+		uint8_t* ptr=(uint8_t*)heap_caps_realloc(p, size, MALLOC_CAP_8BIT);
+		if(!ptr)
+			{
+			thread->failed++;
+			continue;
+			}
+		heap_stress_fill(ptr, size, pattern);
+		blocks[slot]=ptr;
+		continue;
+		}
+	heap_caps_free(p);
+	blocks[slot]=NULL;
+	}
+for(uint32_t slot=0; slot<live; slot++)
+	{
+	if(!blocks[slot])
+		continue;
+	if(!heap_stress_verify(blocks[slot], pattern))
+		thread->corrupt++;
+	heap_caps_free(blocks[slot]);
+	}
+free(blocks);
+return NULL;
+}
+
+
+//======
+// Main
+//======
+
+void heap_stress_usage(const char* name)
+{
+printf("usage: %s [-t threads] [-n ops per thread] [-l live blocks per thread] [-m max size] [-s heap size in KiB] [-d dump statistics]\n", name);
+}
+
+int main(int argc, char** argv)
+{
+int opt=0;
+while((opt=getopt(argc, argv, "t:n:l:m:s:dh"))!=-1)
+	{
+	switch(opt)
+		{
+		case 't': heap_stress_settings.threads=(uint32_t)atoi(optarg); break;
+		case 'n': heap_stress_settings.ops=(uint32_t)atoi(optarg); break;
+		case 'l': heap_stress_settings.live=(uint32_t)atoi(optarg); break;
+		case 'm': heap_stress_settings.max_size=(size_t)atoi(optarg); break;
+		case 's': heap_stress_settings.heap_size=(size_t)atoi(optarg)*1024; break;
+		case 'd': heap_stress_settings.dump=true; break;
+		default: heap_stress_usage(argv[0]); return 2;
+		}
+	}
+if(!heap_stress_settings.threads||!heap_stress_settings.live||!heap_stress_settings.max_size)
+	{
+	heap_stress_usage(argv[0]);
+	return 2;
+	}
+printf("lock: %s, heap: %zu KiB, %u ops per thread, %u live blocks per thread\n", multi_heap_host_lock_name(),
+	heap_stress_settings.heap_size/1024, heap_stress_settings.ops, heap_stress_settings.live);
+printf("threads        ops/s    ns/op  acquisitions  contended  wait ns  failed\n");
+printf("(wait ns is the mean wait of a contended acquisition)\n");
+bool success=true;
+heap_stress_thread_t* threads=(heap_stress_thread_t*)calloc(heap_stress_settings.threads, sizeof(heap_stress_thread_t));
+for(uint32_t count=1; count<=heap_stress_settings.threads; count++)
+	{
+	void* region=aligned_alloc(16, heap_stress_settings.heap_size);
+	multi_heap_handle_t heap=heap_caps_host_add_region(region, heap_stress_settings.heap_size, MALLOC_CAP_8BIT|MALLOC_CAP_32BIT|MALLOC_CAP_DEFAULT);
+	size_t initial_free=multi_heap_free_size(heap);
+	uint64_t start=multi_heap_host_time_ns();
+	for(uint32_t u=0; u<count; u++)
+		{
+		memset(&threads[u], 0, sizeof(heap_stress_thread_t));
+		threads[u].seed=u*7919+1;
+		pthread_create(&threads[u].thread, NULL, heap_stress_run, &threads[u]);
+		}
+	uint32_t failed=0;
+	uint32_t corrupt=0;
+	for(uint32_t u=0; u<count; u++)
+		{
+		pthread_join(threads[u].thread, NULL);
+		failed+=threads[u].failed;
+		corrupt+=threads[u].corrupt;
+		}
+	uint64_t time=multi_heap_host_time_ns()-start;
+	uint64_t acquisitions=0;
+	uint64_t contended=0;
+	uint64_t wait_ns=0;
+	heap_caps_host_get_lock_counters(&acquisitions, &contended, &wait_ns);
+	uint64_t ops=(uint64_t)count*heap_stress_settings.ops;
+	printf("%7u %12.0f %8.1f %13llu %9.2f%% %8llu %7u\n", count, ops*1e9/time, (double)time/ops,
+		(unsigned long long)acquisitions, acquisitions? 100.0*contended/acquisitions: 0.0,
+		(unsigned long long)(contended? wait_ns/contended: 0), failed);
+	if(heap_stress_settings.dump)
+		{
+		heap_caps_dump_lock_stats(MALLOC_CAP_8BIT);
+		heap_caps_dump_op_stats(MALLOC_CAP_8BIT);
+		}
+	if(corrupt)
+		{
+		printf("%u blocks were overwritten\n", corrupt);
+		success=false;
+		}
+	if(!multi_heap_check(heap, true))
+		success=false;
+	if(multi_heap_free_size(heap)>initial_free)
+		{
+		printf("free size %zu is larger than %zu\n", multi_heap_free_size(heap), initial_free);
+		success=false;
+		}
+	heap_caps_host_remove_regions();
+	free(region);
+	}
+free(threads);
+return success? 0: 1;
+}
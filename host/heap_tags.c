@@ -0,0 +1,359 @@
+//=============
+// heap_tags.c
+//=============
+
+// Three subsystems share a heap, one of them allocates in large bursts
+// Compares the failures of the others with and without a limit for each tag
+
+// Copyright 2021, Sven Bieg (svenbieg@web.de)
+// http://github.com/svenbieg/esp32-heap
+
+
+//=======
+// Using
+//=======
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "esp_heap_caps.h"
+#include "heap_caps_host.h"
+#include "multi_heap_host.h"
+
+
+//==========
+// Settings
+//==========
+
+#define HEAP_TAGS_WIFI 1
+#define HEAP_TAGS_TLS 2
+#define HEAP_TAGS_APP 3
+#define HEAP_TAGS_COUNT 4
+
+const char* heap_tags_names[HEAP_TAGS_COUNT]={ "", "wifi", "tls", "app" };
+
+typedef struct
+{
+uint32_t ops;
+uint32_t period;
+size_t heap_size;
+size_t limits[HEAP_TAGS_COUNT];
+}heap_tags_settings_t;
+
+heap_tags_settings_t heap_tags_settings={ 200000, 2000, 128*1024, { 0, 24*1024, 32*1024, 48*1024 } };
+
+
+//============
+// Subsystems
+//============
+
+typedef struct
+{
+uint32_t tag;
+void** blocks;
+uint32_t capacity;
+uint32_t count;
+size_t bytes;
+size_t target;
+uint32_t allocations;
+uint32_t failed;
+uint32_t over_limit;
+}heap_tags_system_t;
+
+uint32_t heap_tags_random(uint32_t* seed)
+{
+*seed=*seed*1103515245+12345;
+return *seed>>8;
+}
+
+size_t heap_tags_size(heap_tags_system_t* system, uint32_t* seed)
+{
+switch(system->tag)
+	{
+	case HEAP_TAGS_WIFI: return 1600;
+	case HEAP_TAGS_TLS: return 4096+heap_tags_random(seed)%12288;
+	default: break;
+	}
+return 16+heap_tags_random(seed)%2032;
+}
+
+// Allocates, reallocates or frees one block to get closer to the target
+void heap_tags_step(heap_tags_system_t* system, uint32_t* seed)
+{
+if(system->bytes<system->target&&system->count<system->capacity)
+	{
+	size_t size=heap_tags_size(system, seed);
+	system->allocations++;
+	heap_caps_tag_info_t info;
+	heap_caps_get_tag_info(system->tag, &info);
+	void* p=heap_caps_malloc_tagged(size, MALLOC_CAP_8BIT, system->tag);
+	if(!p)
+		{
+		// Failures within the limit are caused by the other subsystems
+		if(info.limit&&info.current+size>info.limit)
+			{
+			system->over_limit++;
+			}
+		else
+			{
+			system->failed++;
+			}
+		return;
+		}
+	memset(p, (int)system->tag, size);
+	system->blocks[system->count++]=p;
+	system->bytes+=heap_caps_get_allocated_size(p);
+	return;
+	}
+if(!system->count)
+	return;
+uint32_t pos=heap_tags_random(seed)%system->count;
+if(system->tag==HEAP_TAGS_APP&&heap_tags_random(seed)%4==0)
+	{
+	size_t old_size=heap_caps_get_allocated_size(system->blocks[pos]);
+	void* p=heap_caps_realloc(system->blocks[pos], heap_tags_size(system, seed), MALLOC_CAP_8BIT);
+	if(p)
+		{
+		system->blocks[pos]=p;
+		system->bytes+=heap_caps_get_allocated_size(p)-old_size;
+		}
+	return;
+	}
+system->bytes-=heap_caps_get_allocated_size(system->blocks[pos]);
+heap_caps_free(system->blocks[pos]);
+system->blocks[pos]=system->blocks[--system->count];
+}
+
+// The usage of the tag is the size of its blocks
+bool heap_tags_check(heap_tags_system_t* system)
+{
+size_t bytes=0;
+for(uint32_t u=0; u<system->count; u++)
+	bytes+=heap_caps_get_allocated_size(system->blocks[u]);
+heap_caps_tag_info_t info;
+heap_caps_get_tag_info(system->tag, &info);
+if(info.current!=bytes)
+	{
+	printf("%s: tag counts %zu bytes, the blocks have %zu\n", heap_tags_names[system->tag], info.current, bytes);
+	return false;
+	}
+// The limit is checked with the requested size, the last block may exceed it by its header
+if(info.limit&&info.peak>info.limit+32)
+	{
+	printf("%s: peak %zu exceeds the limit %zu\n", heap_tags_names[system->tag], info.peak, info.limit);
+	return false;
+	}
+return true;
+}
+
+
+//=======
+// Tests
+//=======
+
+// Freed blocks of the size classes are reused untagged, batches and reallocations keep the counters
+bool heap_tags_test_blocks(void)
+{
+bool success=true;
+void* small=heap_caps_malloc_tagged(24, MALLOC_CAP_8BIT, HEAP_TAGS_APP);
+heap_caps_free(small);
+void* untagged=heap_caps_malloc(24, MALLOC_CAP_8BIT);
+void* ptrs[8];
+for(uint32_t u=0; u<8; u++)
+	ptrs[u]=heap_caps_malloc_tagged(32+u*200, MALLOC_CAP_8BIT, HEAP_TAGS_WIFI);
+ptrs[3]=heap_caps_realloc(ptrs[3], 4000, MALLOC_CAP_8BIT);
+ptrs[5]=heap_caps_realloc(ptrs[5], 40, MALLOC_CAP_8BIT);
+heap_caps_tag_info_t info;
+heap_caps_get_tag_info(HEAP_TAGS_WIFI, &info);
+size_t bytes=0;
+for(uint32_t u=0; u<8; u++)
+	bytes+=heap_caps_get_allocated_size(ptrs[u]);
+if(info.current!=bytes)
+	{
+	printf("tagged blocks have %zu bytes, the tag counts %zu\n", bytes, info.current);
+	success=false;
+	}
+heap_caps_free_batch(8, ptrs);
+heap_caps_free(untagged);
+for(uint32_t tag=1; tag<HEAP_TAGS_COUNT; tag++)
+	{
+	heap_caps_get_tag_info(tag, &info);
+	if(info.current)
+		{
+		printf("%s: %zu bytes left after freeing all blocks\n", heap_tags_names[tag], info.current);
+		success=false;
+		}
+	}
+return success;
+}
+
+// Time of an allocation over the limit and of an allocation in an exhausted heap
+void heap_tags_test_fail_fast(void)
+{
+heap_caps_set_tag_limit(HEAP_TAGS_TLS, 1024);
+uint32_t count=(uint32_t)(heap_tags_settings.heap_size/64);
+void** blocks=(void**)calloc(count, sizeof(void*));
+uint32_t filled=0;
+for(; filled<count; filled++)
+	{
+	blocks[filled]=heap_caps_malloc(48+filled%64, MALLOC_CAP_8BIT);
+	if(!blocks[filled])
+		break;
+	}
+for(uint32_t u=0; u<filled; u+=2)
+	{
+	heap_caps_free(blocks[u]);
+	blocks[u]=NULL;
+	}
+uint64_t limit_ns=0;
+uint64_t heap_ns=0;
+for(uint32_t u=0; u<1000; u++)
+	{
+	uint64_t start=multi_heap_host_time_ns();
+	void* p=heap_caps_malloc_tagged(8192, MALLOC_CAP_8BIT, HEAP_TAGS_TLS);
+	limit_ns+=multi_heap_host_time_ns()-start;
+	heap_caps_free(p);
+	start=multi_heap_host_time_ns();
+	p=heap_caps_malloc(64*1024, MALLOC_CAP_8BIT);
+	heap_ns+=multi_heap_host_time_ns()-start;
+	heap_caps_free(p);
+	}
+printf("failing allocation, over the limit: %.0f ns, exhausted heap: %.0f ns\n", limit_ns/1000.0, heap_ns/1000.0);
+for(uint32_t u=0; u<filled; u++)
+	heap_caps_free(blocks[u]);
+free(blocks);
+heap_caps_set_tag_limit(HEAP_TAGS_TLS, 0);
+}
+
+
+//======
+// Main
+//======
+
+typedef struct
+{
+uint32_t failed[HEAP_TAGS_COUNT];
+uint32_t over_limit[HEAP_TAGS_COUNT];
+uint32_t allocations[HEAP_TAGS_COUNT];
+}heap_tags_result_t;
+
+bool heap_tags_run(bool limited, heap_tags_result_t* result)
+{
+memset(result, 0, sizeof(heap_tags_result_t));
+void* region=aligned_alloc(16, heap_tags_settings.heap_size);
+multi_heap_handle_t heap=heap_caps_host_add_region(region, heap_tags_settings.heap_size, MALLOC_CAP_8BIT|MALLOC_CAP_32BIT|MALLOC_CAP_DEFAULT);
+size_t initial_free=multi_heap_free_size(heap);
+heap_caps_reset_tags();
+bool success=heap_tags_test_blocks();
+heap_tags_system_t systems[HEAP_TAGS_COUNT];
+memset(systems, 0, sizeof(systems));
+for(uint32_t tag=1; tag<HEAP_TAGS_COUNT; tag++)
+	{
+	heap_caps_set_tag_limit(tag, limited? heap_tags_settings.limits[tag]: 0);
+	systems[tag].tag=tag;
+	systems[tag].capacity=(uint32_t)(heap_tags_settings.heap_size/16);
+	systems[tag].blocks=(void**)calloc(systems[tag].capacity, sizeof(void*));
+	}
+systems[HEAP_TAGS_WIFI].target=16*1024;
+systems[HEAP_TAGS_APP].target=40*1024;
+uint32_t seed=1234;
+for(uint32_t op=0; op<heap_tags_settings.ops; op++)
+	{
+	// TLS handshakes take all of the memory they can get for a while
+	uint32_t phase=op%heap_tags_settings.period;
+	systems[HEAP_TAGS_TLS].target=phase<heap_tags_settings.period/4? heap_tags_settings.heap_size: 0;
+	for(uint32_t tag=1; tag<HEAP_TAGS_COUNT; tag++)
+		heap_tags_step(&systems[tag], &seed);
+	if(op%1000==0)
+		{
+		for(uint32_t tag=1; tag<HEAP_TAGS_COUNT; tag++)
+			success&=heap_tags_check(&systems[tag]);
+		}
+	}
+for(uint32_t tag=1; tag<HEAP_TAGS_COUNT; tag++)
+	{
+	success&=heap_tags_check(&systems[tag]);
+	result->failed[tag]=systems[tag].failed;
+	result->over_limit[tag]=systems[tag].over_limit;
+	result->allocations[tag]=systems[tag].allocations;
+	}
+if(limited)
+	heap_caps_dump_tags();
+for(uint32_t tag=1; tag<HEAP_TAGS_COUNT; tag++)
+	{
+	for(uint32_t u=0; u<systems[tag].count; u++)
+		heap_caps_free(systems[tag].blocks[u]);
+	free(systems[tag].blocks);
+	heap_caps_tag_info_t info;
+	heap_caps_get_tag_info(tag, &info);
+	if(info.current)
+		{
+		printf("%s: %zu bytes left after freeing all blocks\n", heap_tags_names[tag], info.current);
+		success=false;
+		}
+	heap_caps_set_tag_limit(tag, 0);
+	}
+if(limited)
+	heap_tags_test_fail_fast();
+heap_caps_maintain(MALLOC_CAP_8BIT, 0);
+if(!multi_heap_check(heap, true))
+	success=false;
+if(multi_heap_free_size(heap)>initial_free)
+	{
+	printf("free size %zu is larger than %zu\n", multi_heap_free_size(heap), initial_free);
+	success=false;
+	}
+heap_caps_host_remove_regions();
+free(region);
+return success;
+}
+
+void heap_tags_print(const char* name, heap_tags_result_t* result)
+{
+for(uint32_t tag=1; tag<HEAP_TAGS_COUNT; tag++)
+	printf("%-9s %-5s %8u %10u %8u\n", tag==1? name: "", heap_tags_names[tag], result->allocations[tag], result->over_limit[tag], result->failed[tag]);
+}
+
+void heap_tags_usage(const char* name)
+{
+printf("usage: %s [-n ops] [-p period of the tls bursts] [-w wifi limit] [-t tls limit] [-a app limit] (limits in KiB) [-s heap size in KiB]\n", name);
+}
+
+int main(int argc, char** argv)
+{
+int opt=0;
+while((opt=getopt(argc, argv, "n:p:w:t:a:s:h"))!=-1)
+	{
+	switch(opt)
+		{
+		case 'n': heap_tags_settings.ops=(uint32_t)atoi(optarg); break;
+		case 'p': heap_tags_settings.period=(uint32_t)atoi(optarg); break;
+		case 'w': heap_tags_settings.limits[HEAP_TAGS_WIFI]=(size_t)atoi(optarg)*1024; break;
+		case 't': heap_tags_settings.limits[HEAP_TAGS_TLS]=(size_t)atoi(optarg)*1024; break;
+		case 'a': heap_tags_settings.limits[HEAP_TAGS_APP]=(size_t)atoi(optarg)*1024; break;
+		case 's': heap_tags_settings.heap_size=(size_t)atoi(optarg)*1024; break;
+		default: heap_tags_usage(argv[0]); return 2;
+		}
+	}
+if(heap_tags_settings.period<4)
+	{
+	heap_tags_usage(argv[0]);
+	return 2;
+	}
+printf("heap: %zu KiB, %u ops, limits wifi %zu, tls %zu, app %zu KiB\n", heap_tags_settings.heap_size/1024, heap_tags_settings.ops,
+	heap_tags_settings.limits[HEAP_TAGS_WIFI]/1024, heap_tags_settings.limits[HEAP_TAGS_TLS]/1024, heap_tags_settings.limits[HEAP_TAGS_APP]/1024);
+heap_tags_result_t unlimited;
+heap_tags_result_t limited;
+bool success=heap_tags_run(false, &unlimited);
+success&=heap_tags_run(true, &limited);
+printf("limits    tag     allocs  over limit  failed\n");
+heap_tags_print("unlimited", &unlimited);
+heap_tags_print("limited", &limited);
+if(limited.failed[HEAP_TAGS_WIFI]||limited.failed[HEAP_TAGS_APP])
+	{
+	printf("wifi or app allocations failed within their limits\n");
+	success=false;
+	}
+return success? 0: 1;
+}
@@ -0,0 +1,283 @@
+//==================
+// heap_watermark.c
+//==================
+
+// The working set of a task swings around the watermark of a heap
+// Compares the watermark callback with a task polling heap_caps_get_free_size()
+
+// Copyright 2021, Sven Bieg (svenbieg@web.de)
+// http://github.com/svenbieg/esp32-heap
+
+
+//=======
+// Using
+//=======
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "esp_heap_caps.h"
+#include "heap_caps_host.h"
+#include "multi_heap_host.h"
+
+
+//==========
+// Settings
+//==========
+
+typedef struct
+{
+uint32_t ops;
+uint32_t period;
+uint32_t poll;
+size_t low;
+size_t high;
+size_t heap_size;
+}heap_watermark_settings_t;
+
+heap_watermark_settings_t heap_watermark_settings={ 400000, 4000, 1000, 32*1024, 48*1024, 128*1024 };
+
+
+//========
+// Events
+//========
+
+typedef struct
+{
+bool low;
+uint32_t events;
+uint32_t low_events;
+uint32_t errors;
+uint32_t depth;
+}heap_watermark_state_t;
+
+heap_watermark_state_t heap_watermark_callback_state;
+heap_watermark_state_t heap_watermark_exact_state;
+heap_watermark_state_t heap_watermark_poll_state;
+
+// Hysteresis of the reference and of the polling task, returns true if the state changed
+bool heap_watermark_update(heap_watermark_state_t* state, size_t free_size)
+{
+if(state->low)
+	{
+	if(free_size<heap_watermark_settings.high)
+		return false;
+	state->low=false;
+	}
+else
+	{
+	if(free_size>=heap_watermark_settings.low)
+		return false;
+	state->low=true;
+	state->low_events++;
+	}
+state->events++;
+return true;
+}
+
+// Checks the event and allocates while the heap is unlocked
+void heap_watermark_callback(uint32_t caps, size_t free_size, bool low)
+{
+heap_watermark_state_t* state=&heap_watermark_callback_state;
+if(state->depth++)
+	state->errors++;
+if(low==state->low)
+	state->errors++;
+if(low&&free_size>=heap_watermark_settings.low)
+	state->errors++;
+if(!low&&free_size<heap_watermark_settings.high)
+	state->errors++;
+state->low=low;
+state->events++;
+if(low)
+	state->low_events++;
+// The reference sees the free size of the crossing, allocating here may release the size classes
+heap_watermark_update(&heap_watermark_exact_state, free_size);
+void* p=heap_caps_malloc(256, caps);
+if(p)
+	heap_caps_free(p);
+state->depth--;
+}
+
+
+//======
+// Main
+//======
+
+uint32_t heap_watermark_random(uint32_t* seed)
+{
+*seed=*seed*1103515245+12345;
+return *seed>>8;
+}
+
+// The target of live bytes swings between a quarter and all of the heap, with short dips
+size_t heap_watermark_target(uint32_t op, uint32_t* seed)
+{
+uint32_t period=heap_watermark_settings.period;
+uint32_t phase=op%period;
+if(phase>period/2)
+	phase=period-phase;
+size_t size=heap_watermark_settings.heap_size;
+size_t target=size/4+(size_t)((uint64_t)size*5/8*phase/(period/2));
+if(heap_watermark_random(seed)%64==0)
+	target+=size/8;
+return target;
+}
+
+typedef struct
+{
+uint64_t time_ns;
+uint32_t callback_events;
+uint32_t exact_events;
+uint32_t poll_events;
+uint32_t missed;
+double poll_delay;
+uint32_t errors;
+}heap_watermark_result_t;
+
+bool heap_watermark_run(bool enabled, heap_watermark_result_t* result)
+{
+memset(result, 0, sizeof(heap_watermark_result_t));
+memset(&heap_watermark_callback_state, 0, sizeof(heap_watermark_state_t));
+memset(&heap_watermark_exact_state, 0, sizeof(heap_watermark_state_t));
+memset(&heap_watermark_poll_state, 0, sizeof(heap_watermark_state_t));
+void* region=aligned_alloc(16, heap_watermark_settings.heap_size);
+multi_heap_handle_t heap=heap_caps_host_add_region(region, heap_watermark_settings.heap_size, MALLOC_CAP_8BIT|MALLOC_CAP_32BIT|MALLOC_CAP_DEFAULT);
+size_t initial_free=multi_heap_free_size(heap);
+if(enabled)
+	heap_caps_set_watermark(MALLOC_CAP_8BIT, heap_watermark_settings.low, heap_watermark_settings.high, heap_watermark_callback);
+uint32_t capacity=(uint32_t)(heap_watermark_settings.heap_size/16);
+void** blocks=(void**)calloc(capacity, sizeof(void*));
+size_t* sizes=(size_t*)calloc(capacity, sizeof(size_t));
+uint32_t count=0;
+size_t live=0;
+uint32_t seed=815;
+uint64_t time=0;
+uint32_t poll_pending=0;
+uint64_t poll_delay=0;
+for(uint32_t op=0; op<heap_watermark_settings.ops; op++)
+	{
+	size_t target=heap_watermark_target(op, &seed);
+	uint32_t low_events=heap_watermark_exact_state.low_events;
+	uint64_t start=multi_heap_host_time_ns();
+	if(live<target&&count<capacity)
+		{
+		size_t size=16+heap_watermark_random(&seed)%2032;
+		void* p=heap_caps_malloc(size, MALLOC_CAP_8BIT);
+		if(p)
+			{
+			blocks[count]=p;
+			sizes[count]=size;
+			count++;
+			live+=size;
+			}
+		}
+	else if(count)
+		{
+		uint32_t pos=heap_watermark_random(&seed)%count;
+		heap_caps_free(blocks[pos]);
+		live-=sizes[pos];
+		count--;
+		blocks[pos]=blocks[count];
+		sizes[pos]=sizes[count];
+		}
+	time+=multi_heap_host_time_ns()-start;
+	if(!enabled)
+		continue;
+	// The callback has seen every crossing when the call returns
+	size_t free_size=heap_caps_get_free_size(MALLOC_CAP_8BIT);
+	heap_watermark_update(&heap_watermark_exact_state, free_size);
+	poll_pending+=heap_watermark_exact_state.low_events-low_events;
+	if(heap_watermark_exact_state.events!=heap_watermark_callback_state.events)
+		{
+		heap_watermark_callback_state.errors++;
+		heap_watermark_callback_state.events=heap_watermark_exact_state.events;
+		heap_watermark_callback_state.low=heap_watermark_exact_state.low;
+		}
+	// The polling task sees the free size every few operations
+	if(poll_pending)
+		poll_delay+=poll_pending;
+	if(op%heap_watermark_settings.poll==0)
+		{
+		heap_watermark_update(&heap_watermark_poll_state, free_size);
+		if(!heap_watermark_poll_state.low)
+			result->missed+=poll_pending;
+		poll_pending=0;
+		}
+	}
+if(enabled)
+	heap_caps_set_watermark(MALLOC_CAP_8BIT, 0, 0, NULL);
+result->time_ns=time;
+result->callback_events=heap_watermark_callback_state.events;
+result->exact_events=heap_watermark_exact_state.events;
+result->poll_events=heap_watermark_poll_state.events;
+uint32_t detected=heap_watermark_poll_state.low_events;
+result->poll_delay=detected? (double)poll_delay/detected: 0.0;
+result->errors=heap_watermark_callback_state.errors;
+for(uint32_t u=0; u<count; u++)
+	heap_caps_free(blocks[u]);
+free(blocks);
+free(sizes);
+bool success=true;
+heap_caps_maintain(MALLOC_CAP_8BIT, 0);
+if(!multi_heap_check(heap, true))
+	success=false;
+if(multi_heap_free_size(heap)>initial_free)
+	{
+	printf("free size %zu is larger than %zu\n", multi_heap_free_size(heap), initial_free);
+	success=false;
+	}
+heap_caps_host_remove_regions();
+free(region);
+return success;
+}
+
+void heap_watermark_usage(const char* name)
+{
+printf("usage: %s [-n ops] [-p period of the working set] [-i poll interval in ops] [-l low KiB] [-h high KiB] [-s heap size in KiB]\n", name);
+}
+
+int main(int argc, char** argv)
+{
+int opt=0;
+while((opt=getopt(argc, argv, "n:p:i:l:h:s:"))!=-1)
+	{
+	switch(opt)
+		{
+		case 'n': heap_watermark_settings.ops=(uint32_t)atoi(optarg); break;
+		case 'p': heap_watermark_settings.period=(uint32_t)atoi(optarg); break;
+		case 'i': heap_watermark_settings.poll=(uint32_t)atoi(optarg); break;
+		case 'l': heap_watermark_settings.low=(size_t)atoi(optarg)*1024; break;
+		case 'h': heap_watermark_settings.high=(size_t)atoi(optarg)*1024; break;
+		case 's': heap_watermark_settings.heap_size=(size_t)atoi(optarg)*1024; break;
+		default: heap_watermark_usage(argv[0]); return 2;
+		}
+	}
+if(heap_watermark_settings.period<2||!heap_watermark_settings.poll||heap_watermark_settings.low>heap_watermark_settings.high)
+	{
+	heap_watermark_usage(argv[0]);
+	return 2;
+	}
+printf("heap: %zu KiB, %u ops, watermark %zu/%zu KiB, polling every %u ops\n", heap_watermark_settings.heap_size/1024,
+	heap_watermark_settings.ops, heap_watermark_settings.low/1024, heap_watermark_settings.high/1024, heap_watermark_settings.poll);
+heap_watermark_result_t disabled;
+heap_watermark_result_t enabled;
+bool success=heap_watermark_run(false, &disabled);
+success&=heap_watermark_run(true, &enabled);
+printf("ns/op without watermark: %.1f, with watermark: %.1f\n", (double)disabled.time_ns/heap_watermark_settings.ops,
+	(double)enabled.time_ns/heap_watermark_settings.ops);
+printf("crossings: %u, callbacks: %u, polled: %u, missed by polling: %u low, polling delay: %.0f ops\n",
+	enabled.exact_events, enabled.callback_events, enabled.poll_events, enabled.missed, enabled.poll_delay);
+if(enabled.errors||enabled.callback_events!=enabled.exact_events)
+	{
+	printf("%u callbacks were wrong or missing\n", enabled.errors);
+	success=false;
+	}
+if(!enabled.exact_events)
+	{
+	printf("the watermark wasn't crossed\n");
+	success=false;
+	}
+return success? 0: 1;
+}
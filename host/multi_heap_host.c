@@ -0,0 +1,212 @@
+//===================
+// multi_heap_host.c
+//===================
+
+// Locks for running the heap on a Linux host
+
+// Copyright 2021, Sven Bieg (svenbieg@web.de)
+// http://github.com/svenbieg/esp32-heap
+
+
+//=======
+// Using
+//=======
+
+#include <linux/futex.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+#include "multi_heap_host.h"
+
+
+//=========
+// Private
+//=========
+
+// Identify the calling thread, zero is never a valid thread
+size_t multi_heap_host_thread_id(void)
+{
+return (size_t)pthread_self();
+}
+
+// Take the lock of the selected backend if it's free
+bool multi_heap_host_try_acquire(multi_heap_host_lock_t* lock)
+{
+#if defined(MULTI_HEAP_HOST_LOCK_TICKET)
+uint32_t ticket=__atomic_load_n(&lock->serving, __ATOMIC_RELAXED);
+return __atomic_compare_exchange_n(&lock->next_ticket, &ticket, ticket+1, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
+#elif defined(MULTI_HEAP_HOST_LOCK_FUTEX)
+// 0 is free, 1 is locked, 2 is locked with waiters
+uint32_t state=0;
+return __atomic_compare_exchange_n(&lock->state, &state, 1, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
+#else
+return pthread_mutex_trylock(&lock->mutex)==0;
+#endif
+}
+
+// Wait for the lock of the selected backend
+void multi_heap_host_acquire(multi_heap_host_lock_t* lock)
+{
+#if defined(MULTI_HEAP_HOST_LOCK_TICKET)
+uint32_t ticket=__atomic_fetch_add(&lock->next_ticket, 1, __ATOMIC_RELAXED);
+// Spin a while, then give the CPU to the holder
+uint32_t spins=0;
+while(__atomic_load_n(&lock->serving, __ATOMIC_ACQUIRE)!=ticket)
+	{
+	if(++spins>=100)
+		{
+		sched_yield();
+		spins=0;
+		}
+	}
+#elif defined(MULTI_HEAP_HOST_LOCK_FUTEX)
+uint32_t state=__atomic_exchange_n(&lock->state, 2, __ATOMIC_ACQUIRE);
+while(state!=0)
+	{
+	syscall(SYS_futex, &lock->state, FUTEX_WAIT_PRIVATE, 2, NULL, NULL, 0);
+	state=__atomic_exchange_n(&lock->state, 2, __ATOMIC_ACQUIRE);
+	}
+#else
+pthread_mutex_lock(&lock->mutex);
+#endif
+}
+
+// Give the lock of the selected backend back
+void multi_heap_host_release(multi_heap_host_lock_t* lock)
+{
+#if defined(MULTI_HEAP_HOST_LOCK_TICKET)
+__atomic_store_n(&lock->serving, lock->serving+1, __ATOMIC_RELEASE);
+#elif defined(MULTI_HEAP_HOST_LOCK_FUTEX)
+if(__atomic_exchange_n(&lock->state, 0, __ATOMIC_RELEASE)==2)
+	syscall(SYS_futex, &lock->state, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+#else
+pthread_mutex_unlock(&lock->mutex);
+#endif
+}
+
+
+//======
+// Lock
+//======
+
+// Con-/Destructors
+
+void multi_heap_host_lock_init(multi_heap_host_lock_t* lock)
+{
+#if defined(MULTI_HEAP_HOST_LOCK_TICKET)
+lock->next_ticket=0;
+lock->serving=0;
+#elif defined(MULTI_HEAP_HOST_LOCK_FUTEX)
+lock->state=0;
+#else
+pthread_mutex_init(&lock->mutex, NULL);
+#endif
+lock->owner=0;
+lock->depth=0;
+lock->acquisitions=0;
+lock->contended=0;
+lock->wait_ns=0;
+}
+
+
+// Access
+
+const char* multi_heap_host_lock_name(void)
+{
+#if defined(MULTI_HEAP_HOST_LOCK_TICKET)
+return "ticket";
+#elif defined(MULTI_HEAP_HOST_LOCK_FUTEX)
+return "futex";
+#else
+return "pthread";
+#endif
+}
+
+bool multi_heap_host_lock_busy(multi_heap_host_lock_t* lock)
+{
+return __atomic_load_n(&lock->owner, __ATOMIC_RELAXED)!=0;
+}
+
+
+// Modification
+
+void multi_heap_host_lock(multi_heap_host_lock_t* lock)
+{
+size_t self=multi_heap_host_thread_id();
+if(__atomic_load_n(&lock->owner, __ATOMIC_RELAXED)==self)
+	{
+	lock->depth++;
+	return;
+	}
+// The clock is only read if the lock is taken by another thread
+uint64_t wait_ns=0;
+bool waited=!multi_heap_host_try_acquire(lock);
+if(waited)
+	{
+	uint64_t start=multi_heap_host_time_ns();
+	multi_heap_host_acquire(lock);
+	wait_ns=multi_heap_host_time_ns()-start;
+	}
+__atomic_store_n(&lock->owner, self, __ATOMIC_RELAXED);
+lock->depth=1;
+lock->acquisitions++;
+if(waited)
+	{
+	lock->contended++;
+	lock->wait_ns+=wait_ns;
+	}
+}
+
+void multi_heap_host_unlock(multi_heap_host_lock_t* lock)
+{
+if(--lock->depth)
+	return;
+__atomic_store_n(&lock->owner, 0, __ATOMIC_RELAXED);
+multi_heap_host_release(lock);
+}
+
+
+//======
+// Time
+//======
+
+uint64_t multi_heap_host_time_ns(void)
+{
+struct timespec ts;
+clock_gettime(CLOCK_MONOTONIC, &ts);
+return (uint64_t)ts.tv_sec*1000000000+ts.tv_nsec;
+}
+
+
+//============
+// Interrupts
+//============
+
+__thread bool multi_heap_host_isr=false;
+
+bool multi_heap_host_in_isr(void)
+{
+return multi_heap_host_isr;
+}
+
+void multi_heap_host_set_isr(bool isr)
+{
+multi_heap_host_isr=isr;
+}
+
+
+//=======
+// Cores
+//=======
+
+// Threads get a slot in turns, threads sharing a slot take turns on its cache
+__thread uint32_t multi_heap_host_core=UINT32_MAX;
+uint32_t multi_heap_host_next_core=0;
+
+uint32_t multi_heap_host_core_id(void)
+{
+if(multi_heap_host_core==UINT32_MAX)
+	multi_heap_host_core=__atomic_fetch_add(&multi_heap_host_next_core, 1, __ATOMIC_RELAXED)%MULTI_HEAP_HOST_CORE_COUNT;
+return multi_heap_host_core;
+}
@@ -0,0 +1,99 @@
+//===================
+// multi_heap_host.h
+//===================
+
+// Locks for running the heap on a Linux host
+
+// Copyright 2021, Sven Bieg (svenbieg@web.de)
+// http://github.com/svenbieg/esp32-heap
+
+#pragma once
+
+
+//=======
+// Using
+//=======
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+
+//==========
+// Settings
+//==========
+
+// One backend is selected by the build, the pthread mutex is the default
+#if !defined(MULTI_HEAP_HOST_LOCK_TICKET)&&!defined(MULTI_HEAP_HOST_LOCK_FUTEX)
+#define MULTI_HEAP_HOST_LOCK_PTHREAD
+#endif
+
+
+//======
+// Lock
+//======
+
+// The lock is recursive like a portMUX, the owner can lock it again
+typedef struct
+{
+#if defined(MULTI_HEAP_HOST_LOCK_TICKET)
+volatile uint32_t next_ticket;
+volatile uint32_t serving;
+#elif defined(MULTI_HEAP_HOST_LOCK_FUTEX)
+volatile uint32_t state;
+#else
+pthread_mutex_t mutex;
+#endif
+volatile size_t owner;
+uint32_t depth;
+// Acquisitions of other threads are counted while the lock is held
+uint64_t acquisitions;
+uint64_t contended;
+uint64_t wait_ns;
+}multi_heap_host_lock_t;
+
+#if defined(MULTI_HEAP_HOST_LOCK_TICKET)
+#define MULTI_HEAP_HOST_LOCK_INITIALIZER { 0, 0, 0, 0, 0, 0, 0 }
+#elif defined(MULTI_HEAP_HOST_LOCK_FUTEX)
+#define MULTI_HEAP_HOST_LOCK_INITIALIZER { 0, 0, 0, 0, 0, 0 }
+#else
+#define MULTI_HEAP_HOST_LOCK_INITIALIZER { PTHREAD_MUTEX_INITIALIZER, 0, 0, 0, 0, 0 }
+#endif
+
+// Con-/Destructors
+void multi_heap_host_lock_init(multi_heap_host_lock_t* lock);
+
+// Access
+const char* multi_heap_host_lock_name(void);
+bool multi_heap_host_lock_busy(multi_heap_host_lock_t* lock);
+
+// Modification
+void multi_heap_host_lock(multi_heap_host_lock_t* lock);
+void multi_heap_host_unlock(multi_heap_host_lock_t* lock);
+
+
+//======
+// Time
+//======
+
+uint64_t multi_heap_host_time_ns(void);
+
+
+//============
+// Interrupts
+//============
+
+// A thread marked as interrupt is seen as one by heap_caps_free()
+bool multi_heap_host_in_isr(void);
+void multi_heap_host_set_isr(bool isr);
+
+
+//=======
+// Cores
+//=======
+
+// Per-core caches are selected by a slot of the calling thread
+#define MULTI_HEAP_HOST_CORE_COUNT 4
+
+uint32_t multi_heap_host_core_id(void);
@@ -0,0 +1,6 @@
+// Host stub of esp_attr.h, code placement attributes have no effect
+
+#pragma once
+
+#define IRAM_ATTR
+#define DRAM_ATTR
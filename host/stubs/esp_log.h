@@ -0,0 +1,10 @@
+// Host stub of esp_log.h, log messages are dropped
+
+#pragma once
+
+#define ESP_EARLY_LOGD(TAG, ...) (void)(TAG)
+#define ESP_EARLY_LOGI(TAG, ...) (void)(TAG)
+#define ESP_EARLY_LOGE(TAG, ...) (void)(TAG)
+#define ESP_LOGD(TAG, ...) (void)(TAG)
+#define ESP_LOGI(TAG, ...) (void)(TAG)
+#define ESP_LOGE(TAG, ...) (void)(TAG)
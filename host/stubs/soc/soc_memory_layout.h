@@ -0,0 +1,30 @@
+// Host stub of soc/soc_memory_layout.h
+// Host memory has no IRAM alias, every region is plain data memory
+
+#pragma once
+
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include "esp_attr.h"
+
+#define SOC_MEMORY_TYPE_NO_PRIOS 3
+#define SOC_MAX_CONTIGUOUS_RAM_SIZE (64*1024*1024)
+
+static inline bool esp_ptr_in_diram_dram(const void *p)
+{
+    (void)p;
+    return false;
+}
+
+static inline bool esp_ptr_in_diram_iram(const void *p)
+{
+    (void)p;
+    return false;
+}
+
+static inline void *esp_ptr_diram_dram_to_iram(const void *p)
+{
+    return (void *)p;
+}
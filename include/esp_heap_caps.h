@@ -37,6 +37,7 @@ extern "C" {
 #define MALLOC_CAP_SPIRAM           (1<<10) ///< Memory must be in SPI RAM
 #define MALLOC_CAP_INTERNAL         (1<<11) ///< Memory must be internal; specifically it should not disappear when flash/spiram cache is switched off
 #define MALLOC_CAP_DEFAULT          (1<<12) ///< Memory can be returned in a non-capability-specific memory allocation (e.g. malloc(), calloc()) call
+#define MALLOC_CAP_CRITICAL         (1<<30) ///< Allocation may use the critical reserve of a heap, see heap_caps_set_reserve()
 #define MALLOC_CAP_INVALID          (1<<31) ///< Memory can't be used / list end marker
 
 /**
@@ -46,6 +47,8 @@ extern "C" {
  *
  * In IDF, ``malloc(p)`` is equivalent to ``heap_caps_malloc(p, MALLOC_CAP_8BIT)``.
  *
+ * With MALLOC_CAP_CRITICAL the memory may be taken from the critical reserve of a heap.
+ *
  * @param size Size, in bytes, of the amount of memory to allocate
  * @param caps        Bitwise OR of MALLOC_CAP_* flags indicating the type
  *                    of memory to be returned
@@ -54,6 +57,42 @@ extern "C" {
  */
 void *heap_caps_malloc(size_t size, uint32_t caps);
 
+#define HEAP_CAPS_TAG_COUNT 16 ///< Number of allocation tags, tag 0 is untagged
+
+/**
+ * @brief Allocate a chunk of memory which has the given capabilities and count it against a tag
+ *
+ * Tags separate the memory used by subsystems, like Wi-Fi, TLS and the application.
+ * The tag is kept in the header of the block, heap_caps_free() and heap_caps_realloc() update its
+ * usage. If the tag would exceed its limit, the allocation fails before any heap is searched.
+ *
+ * MALLOC_CAP_CRITICAL is ignored for tagged allocations.
+ *
+ * @param size Size, in bytes, of the amount of memory to allocate
+ * @param caps        Bitwise OR of MALLOC_CAP_* flags indicating the type
+ *                    of memory to be returned
+ * @param tag  Tag from 1 to HEAP_CAPS_TAG_COUNT-1, zero allocates untagged memory
+ *
+ * @return A pointer to the memory allocated on success, NULL on failure or if the tag is over its limit
+ */
+void *heap_caps_malloc_tagged(size_t size, uint32_t caps, uint32_t tag);
+
+/**
+ * @brief Allocate several chunks of memory of the same size which have the given capabilities
+ *
+ * Each heap is locked only once for the whole batch. If a heap can't satisfy all
+ * allocations, the remaining ones are taken from the next matching heap.
+ *
+ * @param size Size, in bytes, of each chunk
+ * @param count Number of chunks to allocate
+ * @param ptrs Array of at least 'count' entries receiving the chunks, unused entries are set to NULL
+ * @param caps        Bitwise OR of MALLOC_CAP_* flags indicating the type
+ *                    of memory to be returned
+ *
+ * @return Number of chunks allocated
+ */
+size_t heap_caps_malloc_batch(size_t size, size_t count, void **ptrs, uint32_t caps);
+
 
 /**
  * @brief Free memory previously allocated via heap_caps_malloc() or heap_caps_realloc().
@@ -62,10 +101,54 @@ void *heap_caps_malloc(size_t size, uint32_t caps);
  *
  *  In IDF, ``free(p)`` is equivalent to ``heap_caps_free(p)``.
  *
+ *  With CONFIG_HEAP_ISR_FREE_QUEUE, an interrupt doesn't wait for the heap. The memory is
+ *  queued with multi_heap_free_from_isr() and freed by the next call to the heap.
+ *
  * @param ptr Pointer to memory previously returned from heap_caps_malloc() or heap_caps_realloc(). Can be NULL.
  */
 void heap_caps_free( void *ptr);
 
+/**
+ * @brief Free several chunks of memory previously allocated via heap_caps_malloc() or heap_caps_malloc_batch().
+ *
+ * Consecutive pointers into the same heap are freed with a single lock. The contents of
+ * the array are undefined afterwards.
+ *
+ * @param count Number of entries in 'ptrs'
+ * @param ptrs Array of pointers to free. Entries can be NULL.
+ */
+void heap_caps_free_batch(size_t count, void **ptrs);
+
+/**
+ * @brief Create a bump-arena in memory which has the given capabilities
+ *
+ * The arena reserves one chunk of 'size' bytes. Buffers are taken from it with
+ * multi_heap_arena_alloc() and released together with multi_heap_arena_reset()
+ * or multi_heap_arena_destroy(), they can't be passed to heap_caps_free().
+ *
+ * @param size Size, in bytes, of the chunk to reserve
+ * @param caps        Bitwise OR of MALLOC_CAP_* flags indicating the type
+ *                    of memory to be returned
+ *
+ * @return Handle of the arena, or NULL if no chunk could be allocated
+ */
+multi_heap_arena_handle_t heap_caps_arena_create(size_t size, uint32_t caps);
+
+/**
+ * @brief Create a pool of objects of the same size in memory which has the given capabilities
+ *
+ * Objects are taken with multi_heap_pool_alloc() and given back with multi_heap_pool_free(),
+ * neither of them locks the heap. They can't be passed to heap_caps_free().
+ *
+ * @param object_size Size, in bytes, of each object
+ * @param caps        Bitwise OR of MALLOC_CAP_* flags indicating the type
+ *                    of memory to be returned
+ * @param initial_count Number of objects in each page of the pool
+ *
+ * @return Handle of the pool, or NULL if the first page could not be allocated
+ */
+multi_heap_pool_handle_t heap_caps_pool_create(size_t object_size, uint32_t caps, size_t initial_count);
+
 /**
  * @brief Reallocate memory previously allocated via heap_caps_malloc() or heap_caps_realloc().
  *
@@ -222,6 +305,263 @@ size_t heap_caps_get_largest_free_block( uint32_t caps );
  */
 void heap_caps_get_info( multi_heap_info_t *info, uint32_t caps );
 
+/**
+ * @brief Get heap info for all regions with the given capabilities without locking the heaps.
+ *
+ * Same as heap_caps_get_info(), but calls multi_heap_get_info_nolock() on each heap. Each heap's values are
+ * consistent, but the heaps are read one after the other.
+ *
+ * @param info        Pointer to a structure which will be filled with relevant
+ *                    heap metadata.
+ * @param caps        Bitwise OR of MALLOC_CAP_* flags indicating the type
+ *                    of memory
+ *
+ */
+void heap_caps_get_info_nolock( multi_heap_info_t *info, uint32_t caps );
+
+/**
+ * @brief Get the fragmentation of all regions with the given capabilities.
+ *
+ * Calls multi_heap_get_fragmentation() on all heaps which share the given capabilities and adds up their histograms.
+ * The fragmentation is calculated from the largest free block of all heaps and their total free bytes.
+ *
+ * @param info        Pointer to a structure which will be filled with the histogram
+ *                    and the fragmentation.
+ * @param caps        Bitwise OR of MALLOC_CAP_* flags indicating the type
+ *                    of memory
+ *
+ */
+void heap_caps_get_fragmentation( multi_heap_fragmentation_t *info, uint32_t caps );
+
+/**
+ * @brief Set the reserves of all regions with the given capabilities.
+ *
+ * Calls multi_heap_set_reserve() on all heaps which share the given capabilities.
+ * Allocations with MALLOC_CAP_CRITICAL may use the critical reserve, others fail before they reach it.
+ *
+ * @param caps        Bitwise OR of MALLOC_CAP_* flags indicating the type
+ *                    of memory
+ * @param meta_reserve     Bytes kept in each heap for the index of free blocks
+ * @param critical_reserve Bytes kept in each heap for critical allocations
+ */
+void heap_caps_set_reserve( uint32_t caps, size_t meta_reserve, size_t critical_reserve );
+
+/**
+ * @brief Get the reserves of all regions with the given capabilities.
+ *
+ * Calls multi_heap_get_reserve_info() on all heaps which share the given capabilities
+ * and adds up the results.
+ *
+ * @param info        Pointer to a structure which will be filled with the reserves and counters
+ * @param caps        Bitwise OR of MALLOC_CAP_* flags indicating the type
+ *                    of memory
+ */
+void heap_caps_get_reserve_info( multi_heap_reserve_info_t *info, uint32_t caps );
+
+/**
+ * @brief Usage of an allocation tag
+ *
+ * Sizes are counted in blocks including their headers.
+ */
+typedef struct {
+    size_t current;      ///< Bytes currently allocated with this tag
+    size_t peak;         ///< Maximum of current
+    size_t limit;        ///< Limit of current, zero if unlimited
+    size_t allocations;  ///< Successful allocations with this tag
+    size_t failures;     ///< Allocations which failed, because of the limit or because the heaps were exhausted
+} heap_caps_tag_info_t;
+
+/**
+ * @brief Limit the memory allocated with a tag.
+ *
+ * The limit applies to all heaps together. Allocations exceeding it fail, memory already
+ * allocated isn't affected.
+ *
+ * @param tag   Tag from 1 to HEAP_CAPS_TAG_COUNT-1
+ * @param limit Maximum number of bytes, zero for no limit
+ *
+ * @return false if the tag is invalid
+ */
+bool heap_caps_set_tag_limit( uint32_t tag, size_t limit );
+
+/**
+ * @brief Get the usage of an allocation tag.
+ *
+ * @param tag   Tag from 1 to HEAP_CAPS_TAG_COUNT-1
+ * @param info  Pointer to a structure to fill with the counters of the tag
+ *
+ * @return false if the tag is invalid
+ */
+bool heap_caps_get_tag_info( uint32_t tag, heap_caps_tag_info_t *info );
+
+/**
+ * @brief Reset the peaks and the counters of all tags.
+ *
+ * The peaks are set to the memory currently allocated, limits are kept.
+ */
+void heap_caps_reset_tags( void );
+
+/**
+ * @brief Print the usage of all tags which were used or have a limit.
+ */
+void heap_caps_dump_tags( void );
+
+/**
+ * @brief Callback of the free memory watermark.
+ *
+ * Called without any heap lock held, by the task whose allocation or free crossed the watermark.
+ *
+ * @param caps      Capabilities passed to heap_caps_set_watermark()
+ * @param free_size Free bytes of the heap which crossed the watermark
+ * @param low       true if the heap dropped below the low watermark, false if it rose to the high watermark
+ */
+typedef void (*heap_caps_watermark_cb_t)(uint32_t caps, size_t free_size, bool low);
+
+/**
+ * @brief Set the free memory watermark of all regions with the given capabilities.
+ *
+ * Calls multi_heap_set_watermark() on all heaps which share the given capabilities. The callback
+ * is called when the free memory of one of these heaps drops below low_bytes, and again when it
+ * rises to high_bytes. The thresholds are evaluated in constant time by each call to the heap,
+ * the callback is called after the heap lock is released. Crossings caused by interrupts are
+ * reported by the next call to the heap from a task.
+ *
+ * Each heap has one watermark, setting another one replaces it.
+ *
+ * @param caps        Bitwise OR of MALLOC_CAP_* flags indicating the type
+ *                    of memory
+ * @param low_bytes   Free bytes of a heap below which it is low, or zero to disable the watermark
+ * @param high_bytes  Free bytes at which a low heap is high again
+ * @param cb          Callback, or NULL to disable the watermark
+ */
+void heap_caps_set_watermark( uint32_t caps, size_t low_bytes, size_t high_bytes, heap_caps_watermark_cb_t cb );
+
+/**
+ * @brief Do deferred work of all regions with the given capabilities.
+ *
+ * Calls multi_heap_maintain() on all heaps which share the given capabilities.
+ * This is only needed if CONFIG_HEAP_WORK_BUDGET limits the work of each call,
+ * or to free memory queued by interrupts while the heap is idle.
+ *
+ * @param caps        Bitwise OR of MALLOC_CAP_* flags indicating the type
+ *                    of memory
+ * @param budget      Maximum number of deferred blocks to handle per heap, or zero to handle all of them.
+ *
+ * @return Number of deferred blocks left in all of these heaps.
+ */
+size_t heap_caps_maintain( uint32_t caps, size_t budget );
+
+#define HEAP_CAPS_RECLAIM_MAX 8 ///< Maximum number of reclaim callbacks
+
+/**
+ * @brief Callback releasing memory when an allocation fails.
+ *
+ * Typically a cache evicting entries. The callback is called without any heap lock held,
+ * so it may free memory and allocate itself. Allocations failing inside the callback
+ * don't call the reclaim callbacks again.
+ *
+ * @param size Size of the allocation which failed
+ * @param caps Capabilities of the allocation which failed
+ *
+ * @return Number of bytes released, zero if nothing could be released
+ */
+typedef size_t (*heap_caps_reclaim_cb_t)(size_t size, uint32_t caps);
+
+/**
+ * @brief Register a callback to release memory when an allocation fails.
+ *
+ * If no heap can satisfy heap_caps_malloc() or heap_caps_aligned_alloc(), the callbacks are
+ * called in order of their priority, lower values first. The allocation is retried after each
+ * callback releasing memory, so the cheapest memory to give up should be registered with the
+ * lowest priority value. Each callback is called at most once per allocation.
+ *
+ * Allocations in interrupts and allocations failing while another task is reclaiming memory
+ * don't call the callbacks.
+ *
+ * @param cb       Callback to register
+ * @param priority Order of the callback, callbacks with the same priority are called in order of registration
+ *
+ * @return true on success, false if the callback is NULL or HEAP_CAPS_RECLAIM_MAX callbacks are registered
+ */
+bool heap_caps_register_reclaim( heap_caps_reclaim_cb_t cb, int priority );
+
+/**
+ * @brief Unregister a callback registered with heap_caps_register_reclaim().
+ *
+ * @param cb Callback to unregister
+ */
+void heap_caps_unregister_reclaim( heap_caps_reclaim_cb_t cb );
+
+/**
+ * @brief Get the lock statistics of all regions with the given capabilities.
+ *
+ * Calls multi_heap_get_lock_stats() on all heaps which share the given capabilities and adds up
+ * their counters and histograms. The statistics are only recorded if CONFIG_HEAP_LOCK_STATS is enabled.
+ *
+ * @param stats       Pointer to a structure which will be filled with the statistics.
+ * @param caps        Bitwise OR of MALLOC_CAP_* flags indicating the type
+ *                    of memory
+ *
+ */
+void heap_caps_get_lock_stats( multi_heap_lock_stats_t *stats, uint32_t caps );
+
+/**
+ * @brief Clear the lock statistics of all regions with the given capabilities.
+ *
+ * @param caps        Bitwise OR of MALLOC_CAP_* flags indicating the type
+ *                    of memory
+ *
+ */
+void heap_caps_reset_lock_stats( uint32_t caps );
+
+/**
+ * @brief Print the lock statistics of all regions with the given capabilities.
+ *
+ * Prints the acquisitions, contended acquisitions, mean and longest hold and wait times of each heap,
+ * followed by the rows of the histograms that are not empty.
+ *
+ * @param caps        Bitwise OR of MALLOC_CAP_* flags indicating the type
+ *                    of memory
+ *
+ */
+void heap_caps_dump_lock_stats( uint32_t caps );
+
+/**
+ * @brief Get the latency of an operation in all regions with the given capabilities.
+ *
+ * Calls multi_heap_get_op_stats() on all heaps which share the given capabilities and adds up
+ * their counters and histograms. The slowest call of all heaps is returned with its caller.
+ * The statistics are only recorded if CONFIG_HEAP_OP_STATS is enabled.
+ *
+ * @param stats       Pointer to a structure which will be filled with the statistics.
+ * @param op          Operation to return.
+ * @param caps        Bitwise OR of MALLOC_CAP_* flags indicating the type
+ *                    of memory
+ *
+ */
+void heap_caps_get_op_stats( multi_heap_op_stats_t *stats, multi_heap_op_t op, uint32_t caps );
+
+/**
+ * @brief Clear the operation statistics of all regions with the given capabilities.
+ *
+ * @param caps        Bitwise OR of MALLOC_CAP_* flags indicating the type
+ *                    of memory
+ *
+ */
+void heap_caps_reset_op_stats( uint32_t caps );
+
+/**
+ * @brief Print the operation statistics of all regions with the given capabilities.
+ *
+ * Prints the count, mean and longest time of each operation with the size and caller of the slowest call,
+ * followed by a histogram with one column per operation.
+ *
+ * @param caps        Bitwise OR of MALLOC_CAP_* flags indicating the type
+ *                    of memory
+ *
+ */
+void heap_caps_dump_op_stats( uint32_t caps );
+
 
 /**
  * @brief Print a summary of all memory with the given capabilities.
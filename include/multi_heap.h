@@ -51,6 +51,43 @@ void *multi_heap_aligned_alloc(multi_heap_handle_t heap, size_t size, size_t ali
  */
 void *multi_heap_malloc(multi_heap_handle_t heap, size_t size);
 
+/** @brief malloc() a buffer in a given heap, using the critical reserve if needed
+ *
+ * Other allocations leave the metadata reserve and the critical reserve at the end of the heap.
+ * This one only leaves the metadata reserve, so it still succeeds when the rest of the heap is exhausted.
+ *
+ * @param heap Handle to a registered heap.
+ * @param size Size of desired buffer.
+ *
+ * @return Pointer to new memory, or NULL if allocation fails.
+ */
+void *multi_heap_malloc_critical(multi_heap_handle_t heap, size_t size);
+
+/** @brief malloc() a buffer in a given heap and tag it
+ *
+ * The tag is kept in the header of the block until it is freed, realloc() keeps it.
+ *
+ * @param heap Handle to a registered heap.
+ * @param size Size of desired buffer.
+ * @param tag Tag from 1 to 255, zero allocates an untagged buffer.
+ *
+ * @return Pointer to new memory, or NULL if allocation fails.
+ */
+void *multi_heap_malloc_tagged(multi_heap_handle_t heap, size_t size, uint32_t tag);
+
+/** @brief Allocate several buffers of the same size in a given heap.
+ *
+ * The heap is locked only once, and the buffers are carved from contiguous free space when possible.
+ *
+ * @param heap Handle to a registered heap.
+ * @param size Size of each buffer.
+ * @param count Number of buffers.
+ * @param ptrs Array of at least 'count' entries. Receives the new buffers, unused entries are set to NULL.
+ *
+ * @return Number of buffers allocated, may be less than 'count' if the heap is exhausted.
+ */
+size_t multi_heap_malloc_batch(multi_heap_handle_t heap, size_t size, size_t count, void **ptrs);
+
 /** @brief free() a buffer aligned in a given heap.
  *
  * @param heap Handle to a registered heap.
@@ -68,6 +105,30 @@ void multi_heap_aligned_free(multi_heap_handle_t heap, void *p);
  */
 void multi_heap_free(multi_heap_handle_t heap, void *p);
 
+/** @brief free() several buffers in a given heap.
+ *
+ * The heap is locked only once, and adjacent buffers are combined before they are returned to the heap.
+ * The array is sorted and its contents are undefined afterwards.
+ *
+ * @param heap Handle to a registered heap.
+ * @param count Number of entries in 'ptrs'.
+ * @param ptrs Array of NULL, or pointers previously returned from multi_heap_malloc() or multi_heap_malloc_batch() for the same heap.
+ */
+void multi_heap_free_batch(multi_heap_handle_t heap, size_t count, void **ptrs);
+
+/** @brief free() a buffer in a given heap without taking the lock
+ *
+ * The buffer is pushed on a lock-free queue, linked through its first bytes. The next call to
+ * multi_heap_malloc(), multi_heap_free(), multi_heap_realloc() or multi_heap_maintain() for this heap frees it.
+ * Until then the buffer is counted as allocated.
+ *
+ * This can be called from interrupts and from several cores at once, it never waits for the heap.
+ *
+ * @param heap Handle to a registered heap.
+ * @param p NULL, or a pointer previously returned from multi_heap_malloc() or multi_heap_realloc() for the same heap.
+ */
+void multi_heap_free_from_isr(multi_heap_handle_t heap, void *p);
+
 /** @brief realloc() a buffer in a given heap.
  *
  * Semantics are the same as standard realloc(), only the argument 'p' must be NULL or have been allocated in the specified heap.
@@ -81,6 +142,18 @@ void multi_heap_free(multi_heap_handle_t heap, void *p);
 void *multi_heap_realloc(multi_heap_handle_t heap, void *p, size_t size);
 
 
+/** @brief Return the tag and the block size of a buffer
+ *
+ * Doesn't lock the heap, the buffer must not be freed or reallocated at the same time.
+ *
+ * @param heap Handle to a registered heap.
+ * @param p Pointer returned from a previous allocation in this heap.
+ * @param size Set to the size of the block including its header, may be NULL.
+ *
+ * @return Tag given to multi_heap_malloc_tagged(), zero for untagged and aligned buffers.
+ */
+uint32_t multi_heap_get_tag(multi_heap_handle_t heap, void *p, size_t *size);
+
 /** @brief Return the size that a particular pointer was allocated with.
  *
  * @param heap Handle to a registered heap.
@@ -119,6 +192,75 @@ multi_heap_handle_t multi_heap_register(void *start, size_t size);
  */
 void multi_heap_set_lock(multi_heap_handle_t heap, void* lock);
 
+/** @brief Limit the work done by each call to a given heap
+ *
+ * Free blocks are combined and added to the index of free blocks after each call. With a budget, each call
+ * handles at most this many deferred blocks and releases at most this many blocks of the size classes if an
+ * allocation fails. The remaining work is done by later calls or by multi_heap_maintain().
+ *
+ * The default is CONFIG_HEAP_WORK_BUDGET, zero does all of the work in the call that caused it.
+ *
+ * @param heap Handle to a registered heap.
+ * @param budget Number of deferred blocks handled per call, or zero.
+ */
+void multi_heap_set_work_budget(multi_heap_handle_t heap, size_t budget);
+
+/** @brief Set the reserves at the end of a given heap
+ *
+ * Allocations that can't be served from a free block are taken from the end of the heap.
+ * They leave the metadata reserve for the index of free blocks and the critical reserve
+ * for multi_heap_malloc_critical(). Growing a buffer in place at the end of the heap leaves them too.
+ *
+ * The defaults are CONFIG_HEAP_META_RESERVE and CONFIG_HEAP_CRITICAL_RESERVE.
+ *
+ * @param heap Handle to a registered heap.
+ * @param meta_reserve Bytes kept for the index of free blocks.
+ * @param critical_reserve Bytes kept for critical allocations.
+ */
+void multi_heap_set_reserve(multi_heap_handle_t heap, size_t meta_reserve, size_t critical_reserve);
+
+/** @brief Set the free memory watermark of a given heap
+ *
+ * The heap becomes low when its free bytes drop below low_bytes and high again when they rise to high_bytes.
+ * Both crossings are evaluated in constant time before the lock is released and stay pending until they are
+ * taken with multi_heap_get_watermark_event(), outside of the lock.
+ *
+ * @param heap Handle to a registered heap.
+ * @param low_bytes Free bytes below which the heap is low, or zero to disable the watermark.
+ * @param high_bytes Free bytes at which a low heap is high again, at least low_bytes.
+ */
+void multi_heap_set_watermark(multi_heap_handle_t heap, size_t low_bytes, size_t high_bytes);
+
+/** @brief Events of the free memory watermark */
+typedef enum {
+    MULTI_HEAP_WATERMARK_NONE = 0, ///< The watermark wasn't crossed since the last event.
+    MULTI_HEAP_WATERMARK_LOW,      ///< The free bytes dropped below the low watermark.
+    MULTI_HEAP_WATERMARK_HIGH,     ///< The free bytes rose to the high watermark.
+} multi_heap_watermark_t;
+
+/** @brief Take the pending watermark event of a given heap
+ *
+ * Doesn't lock the heap. If the watermark was crossed several times since the last event,
+ * only the current state is reported.
+ *
+ * @param heap Handle to a registered heap.
+ * @return The pending event, MULTI_HEAP_WATERMARK_NONE if there is none.
+ */
+multi_heap_watermark_t multi_heap_get_watermark_event(multi_heap_handle_t heap);
+
+/** @brief Do deferred work of a given heap
+ *
+ * Frees the buffers queued by multi_heap_free_from_isr(), combines deferred free blocks and adds them
+ * to the index of free blocks. Call this from a task with a low priority if a work budget is set.
+ *
+ * @param heap Handle to a registered heap.
+ * @param budget Maximum number of deferred blocks to handle, or zero to handle all of them. Without a budget
+ *               the blocks are handled again until none are left, or until the index can't take the rest.
+ *
+ * @return Number of deferred blocks left.
+ */
+size_t multi_heap_maintain(multi_heap_handle_t heap, size_t budget);
+
 /** @brief Dump heap information to stdout
  *
  * For debugging purposes, this function dumps information about every block in the heap to stdout.
@@ -148,6 +290,8 @@ bool multi_heap_check(multi_heap_handle_t heap, bool print_errors);
  * Note that the heap may be fragmented, so the actual maximum size for a single malloc() may be lower. To know this
  * size, see the largest_free_block member returned by multi_heap_get_heap_info().
  *
+ * The value is read without locking the heap, it's updated when an allocation or free has completed.
+ *
  * @param heap Handle to a registered heap.
  * @return Number of free bytes.
  */
@@ -160,6 +304,8 @@ size_t multi_heap_free_size(multi_heap_handle_t heap);
  * Returns the lifetime "low water mark" of possible values returned from multi_free_heap_size(), for the specified
  * heap.
  *
+ * The value is read without locking the heap.
+ *
  * @param heap Handle to a registered heap.
  * @return Number of free bytes.
  */
@@ -174,6 +320,8 @@ typedef struct {
     size_t allocated_blocks;      ///<  Number of (variable size) blocks allocated in the heap.
     size_t free_blocks;           ///<  Number of (variable size) free blocks in the heap.
     size_t total_blocks;          ///<  Total number of (variable size) blocks in the heap.
+    size_t quick_bin_hits;        ///<  Internal allocations served from a quick bin.
+    size_t quick_bin_misses;      ///<  Internal allocations not found in a quick bin.
 } multi_heap_info_t;
 
 /** @brief Return metadata about a given heap
@@ -185,6 +333,236 @@ typedef struct {
  */
 void multi_heap_get_info(multi_heap_handle_t heap, multi_heap_info_t *info);
 
+/** @brief Return metadata about a given heap without locking it
+ *
+ * Same as multi_heap_get_info(), but the values are copied from a snapshot that is taken whenever an allocation
+ * or free has completed. The snapshot is consistent, the reader retries if it's being written at the same time.
+ * Use this to poll heaps without delaying allocations on other cores.
+ *
+ * @param heap Handle to a registered heap.
+ * @param info Pointer to a structure to fill with heap metadata.
+ */
+void multi_heap_get_info_nolock(multi_heap_handle_t heap, multi_heap_info_t *info);
+
+/** @brief Number of size ranges in multi_heap_fragmentation_t */
+#define MULTI_HEAP_HISTOGRAM_SIZE 32
+
+/** @brief Structure to access the fragmentation of a heap via multi_heap_get_fragmentation */
+typedef struct {
+    size_t free_blocks[MULTI_HEAP_HISTOGRAM_SIZE]; ///<  Free blocks with a size from 2^n to 2^(n+1)-1 bytes.
+    size_t total_free_bytes;      ///<  Total free bytes in the heap.
+    size_t largest_free_block;    ///<  Size of largest free block in the heap.
+    uint32_t fragmentation;       ///<  Percentage of free bytes outside of the largest free block, from 0 to 100.
+} multi_heap_fragmentation_t;
+
+/** @brief Return the fragmentation of a given heap
+ *
+ * Free blocks are counted by size when they are added to or removed from the index of free blocks,
+ * so the histogram is copied without walking the heap. Free space at the end of the heap is counted
+ * as one block. Blocks kept in size classes are counted as allocated.
+ *
+ * @param heap Handle to a registered heap.
+ * @param info Pointer to a structure to fill with the histogram and the fragmentation.
+ */
+void multi_heap_get_fragmentation(multi_heap_handle_t heap, multi_heap_fragmentation_t *info);
+
+/** @brief Structure to access the reserves of a heap via multi_heap_get_reserve_info */
+typedef struct {
+    size_t meta_reserve;          ///<  Bytes at the end of the heap kept for the index of free blocks.
+    size_t critical_reserve;      ///<  Bytes at the end of the heap kept for critical allocations.
+    size_t free_reserve;          ///<  Bytes of both reserves that are still free.
+    size_t critical_allocations;  ///<  Critical allocations that succeeded.
+    size_t critical_failures;     ///<  Critical allocations that failed.
+    size_t reserve_allocations;   ///<  Critical allocations that needed the critical reserve.
+    size_t reserve_refusals;      ///<  Times the end of the heap was refused to other allocations because of the reserve.
+} multi_heap_reserve_info_t;
+
+/** @brief Return the reserves of a given heap and how they were used
+ *
+ * @param heap Handle to a registered heap.
+ * @param info Pointer to a structure to fill with the reserves and counters.
+ */
+void multi_heap_get_reserve_info(multi_heap_handle_t heap, multi_heap_reserve_info_t *info);
+
+/** @brief Structure to access the lock statistics of a heap via multi_heap_get_lock_stats
+ *
+ * Times are counted in CPU cycles on the target and in nanoseconds on the host.
+ * Nested acquisitions by the owner of the lock are not counted.
+ */
+typedef struct {
+    uint32_t acquisitions;        ///<  Number of times the lock was taken.
+    uint32_t contended;           ///<  Number of times the lock was held by another core or task.
+    uint64_t total_hold_time;     ///<  Sum of the times the lock was held.
+    uint64_t total_wait_time;     ///<  Sum of the times spent waiting for the lock.
+    uint32_t max_hold_time;       ///<  Longest time the lock was held.
+    uint32_t max_wait_time;       ///<  Longest time spent waiting for the lock.
+    uint32_t hold_times[MULTI_HEAP_HISTOGRAM_SIZE]; ///<  Acquisitions held from 2^n to 2^(n+1)-1 time units.
+    uint32_t wait_times[MULTI_HEAP_HISTOGRAM_SIZE]; ///<  Acquisitions that waited from 2^n to 2^(n+1)-1 time units.
+} multi_heap_lock_stats_t;
+
+/** @brief Return the lock statistics of a given heap
+ *
+ * The statistics are only recorded if CONFIG_HEAP_LOCK_STATS is enabled, otherwise they are zero.
+ * They are copied with the lock held, this acquisition is counted too.
+ *
+ * @param heap Handle to a registered heap.
+ * @param stats Pointer to a structure to fill with the statistics.
+ */
+void multi_heap_get_lock_stats(multi_heap_handle_t heap, multi_heap_lock_stats_t *stats);
+
+/** @brief Clear the lock statistics of a given heap
+ *
+ * @param heap Handle to a registered heap.
+ */
+void multi_heap_reset_lock_stats(multi_heap_handle_t heap);
+
+/** @brief Operations timed by the operation statistics */
+typedef enum {
+    MULTI_HEAP_OP_MALLOC,         ///<  multi_heap_malloc()
+    MULTI_HEAP_OP_ALIGNED_ALLOC,  ///<  multi_heap_aligned_alloc()
+    MULTI_HEAP_OP_REALLOC,        ///<  multi_heap_realloc()
+    MULTI_HEAP_OP_FREE,           ///<  multi_heap_free()
+    MULTI_HEAP_OP_MALLOC_BATCH,   ///<  multi_heap_malloc_batch()
+    MULTI_HEAP_OP_FREE_BATCH,     ///<  multi_heap_free_batch()
+    MULTI_HEAP_OP_COUNT
+} multi_heap_op_t;
+
+/** @brief Structure to access the latency of an operation via multi_heap_get_op_stats
+ *
+ * Times are counted in CPU cycles on the target and in nanoseconds on the host,
+ * from the start of the call including the wait for the lock.
+ */
+typedef struct {
+    uint32_t count;               ///<  Number of calls.
+    uint64_t total_time;          ///<  Sum of the times of all calls.
+    uint32_t max_time;            ///<  Time of the slowest call.
+    size_t max_size;              ///<  Size or count passed to the slowest call, zero for free.
+    void *max_caller;             ///<  Return address of the slowest call.
+    uint32_t times[MULTI_HEAP_HISTOGRAM_SIZE]; ///<  Calls that took from 2^n to 2^(n+1)-1 time units.
+} multi_heap_op_stats_t;
+
+/** @brief Return the latency of an operation in a given heap
+ *
+ * The statistics are only recorded if CONFIG_HEAP_OP_STATS is enabled, otherwise they are zero.
+ * Calls that are served by the per-core caches don't take the lock and are not timed.
+ * If the heap is used through heap_caps_malloc() and friends, the caller is in heap_caps.c.
+ *
+ * @param heap Handle to a registered heap.
+ * @param op Operation to return.
+ * @param stats Pointer to a structure to fill with the statistics.
+ */
+void multi_heap_get_op_stats(multi_heap_handle_t heap, multi_heap_op_t op, multi_heap_op_stats_t *stats);
+
+/** @brief Clear the operation statistics of a given heap
+ *
+ * @param heap Handle to a registered heap.
+ */
+void multi_heap_reset_op_stats(multi_heap_handle_t heap);
+
+/** @brief Opaque handle to a bump-arena */
+typedef struct multi_heap_arena *multi_heap_arena_handle_t;
+
+/** @brief Create a bump-arena in a given heap
+ *
+ * The arena reserves one block of the heap. Allocations from the arena have no header and can't be freed
+ * one by one, they are released all at once by multi_heap_arena_reset() or multi_heap_arena_destroy().
+ *
+ * An arena must not be used by several tasks at the same time.
+ *
+ * @param heap Handle to a registered heap.
+ * @param size Size of the block to reserve, additional blocks of this size are chained when the arena is full.
+ *
+ * @return Handle of the new arena, or NULL if the block could not be allocated.
+ */
+multi_heap_arena_handle_t multi_heap_arena_create(multi_heap_handle_t heap, size_t size);
+
+/** @brief Allocate a buffer from a bump-arena
+ *
+ * The buffer is 4-byte aligned and valid until the arena is reset or destroyed.
+ *
+ * @param arena Handle to an arena.
+ * @param size Size of desired buffer.
+ *
+ * @return Pointer to new memory, or NULL if the arena is full and no further block could be chained.
+ */
+void *multi_heap_arena_alloc(multi_heap_arena_handle_t arena, size_t size);
+
+/** @brief Release all buffers of a bump-arena
+ *
+ * Chained blocks are given back to the heap, the first block is kept for further allocations.
+ *
+ * @param arena Handle to an arena.
+ */
+void multi_heap_arena_reset(multi_heap_arena_handle_t arena);
+
+/** @brief Release all buffers of a bump-arena and the arena itself
+ *
+ * @param arena Handle to an arena, or NULL.
+ */
+void multi_heap_arena_destroy(multi_heap_arena_handle_t arena);
+
+/** @brief Opaque handle to an object pool */
+typedef struct multi_heap_pool *multi_heap_pool_handle_t;
+
+/** @brief Create a pool of objects of the same size in a given heap
+ *
+ * Objects are taken from pages allocated in the heap. Free objects are kept in a stack that is changed
+ * with compare-and-swap, so multi_heap_pool_alloc() and multi_heap_pool_free() don't lock the heap.
+ * The heap is only locked when a page is added. Pages are given back by multi_heap_pool_destroy().
+ *
+ * A pool holds up to 65535 objects in up to 16 pages.
+ *
+ * @param heap Handle to a registered heap.
+ * @param object_size Size of each object, rounded up to 4 bytes.
+ * @param initial_count Number of objects in the first page, rounded up to a power of two. Further pages have the same size.
+ *
+ * @return Handle of the new pool, or NULL if the first page could not be allocated.
+ */
+multi_heap_pool_handle_t multi_heap_pool_create(multi_heap_handle_t heap, size_t object_size, size_t initial_count);
+
+/** @brief Allocate an object from a pool
+ *
+ * @param pool Handle to a pool.
+ *
+ * @return Pointer to the object, or NULL if the pool is empty and no page could be added.
+ */
+void *multi_heap_pool_alloc(multi_heap_pool_handle_t pool);
+
+/** @brief Give an object back to its pool
+ *
+ * @param pool Handle to a pool.
+ * @param p NULL, or a pointer previously returned from multi_heap_pool_alloc() for the same pool.
+ */
+void multi_heap_pool_free(multi_heap_pool_handle_t pool, void *p);
+
+/** @brief Give all pages of a pool back to the heap
+ *
+ * The pool must not be used by other tasks at the same time.
+ *
+ * @param pool Handle to a pool, or NULL.
+ */
+void multi_heap_pool_destroy(multi_heap_pool_handle_t pool);
+
+/** @brief Structure to access pool statistics via multi_heap_pool_get_info */
+typedef struct {
+    size_t object_size;           ///<  Size of each object, rounded up to 4 bytes.
+    size_t total_objects;         ///<  Objects in all pages of the pool.
+    size_t used_objects;          ///<  Objects currently allocated.
+    size_t allocations;           ///<  Objects allocated since the pool was created.
+    size_t frees;                 ///<  Objects given back since the pool was created.
+    size_t failures;              ///<  Allocations that failed because no page could be added.
+    size_t pages;                 ///<  Pages allocated in the heap.
+} multi_heap_pool_info_t;
+
+/** @brief Return statistics of a pool
+ *
+ * The counters are read without a lock and can be changed by other tasks at the same time.
+ *
+ * @param pool Handle to a pool.
+ * @param info Pointer to a structure to fill with pool statistics.
+ */
+void multi_heap_pool_get_info(multi_heap_pool_handle_t pool, multi_heap_pool_info_t *info);
+
 #ifdef __cplusplus
 }
 #endif
@@ -22,7 +22,15 @@
 
 size_t mem_block_calc_size(size_t size)
 {
-return multi_heap_align_up(size, 4)+2*sizeof(size_t);
+size_t block_size=multi_heap_align_up(size, MEM_BLOCK_ALIGN)+sizeof(size_t);
+if(block_size<MEM_BLOCK_MIN_SIZE)
+	block_size=MEM_BLOCK_MIN_SIZE;
+return block_size;
+}
+
+size_t mem_block_calc_data_size(size_t size)
+{
+return size-sizeof(size_t);
 }
 
 void* mem_block_init(multi_heap_handle_t heap, size_t offset, size_t size, size_t flags)
@@ -34,23 +42,58 @@ if(offset<heap_start||offset>heap_end)
 if(offset+size>heap_end+size)
 	return NULL;
 size_t entry=size&MEM_BLOCK_SIZE_MASK;
-entry|=flags;
+entry|=flags&MEM_BLOCK_FLAG_FREE;
 size_t* head=(size_t*)offset;
+// The flag is kept up to date by the previous block
+if(offset>heap_start)
+	entry|=*head&MEM_BLOCK_FLAG_PREV_FREE;
 *head=entry;
 head++;
-size_t* foot=(size_t*)(offset+size);
-foot--;
-*foot=entry;
+if(flags&MEM_BLOCK_FLAG_FREE)
+	{
+	size_t* foot=(size_t*)(offset+size);
+	foot--;
+	*foot=entry&~MEM_BLOCK_FLAG_PREV_FREE;
+	}
+// Update the next header, or the word at the end of the heap
+size_t next=offset+size;
+if(next<heap_start+heap->total_size)
+	{
+	size_t* next_head=(size_t*)next;
+	if(flags&MEM_BLOCK_FLAG_FREE)
+		{
+		*next_head|=MEM_BLOCK_FLAG_PREV_FREE;
+		}
+	else
+		{
+		*next_head&=~MEM_BLOCK_FLAG_PREV_FREE;
+		}
+	}
 return head;
 }
 
+void* mem_block_init_aligned(multi_heap_handle_t heap, size_t offset, size_t size, size_t align)
+{
+void* p=mem_block_init(heap, offset, size, 0);
+if(!p)
+	return NULL;
+size_t ptr=multi_heap_align_up((size_t)p, align);
+if(ptr==(size_t)p)
+	return p;
+// Padding is marked in front of the pointer
+size_t* mark=(size_t*)ptr;
+mark--;
+*mark=(ptr-offset)|MEM_BLOCK_FLAG_ALIGNED;
+return (void*)ptr;
+}
+
 bool mem_block_get_neighbours(multi_heap_handle_t heap, size_t offset, mem_block_neighbours_t* info)
 {
 memset(info, 0, sizeof(mem_block_neighbours_t));
 if(!mem_block_get_info(heap, offset, &info->cur))
 	return false;
 size_t heap_start=(size_t)heap+sizeof(multi_heap_t);
-if(offset>heap_start)
+if(offset>heap_start&&(info->cur.flags&MEM_BLOCK_FLAG_PREV_FREE))
 	{
 	size_t* foot=(size_t*)offset;
 	foot--;
@@ -79,13 +122,16 @@ size_t* head=(size_t*)offset;
 size_t entry=*head;
 size_t flags=entry&MEM_BLOCK_FLAGS_MASK;
 size_t size=entry&MEM_BLOCK_SIZE_MASK;
-if(size<3*sizeof(size_t)||size>heap->size)
-	return false;
-size_t* foot=(size_t*)(offset+size);
-foot--;
-size_t foot_entry=*foot;
-if(entry!=foot_entry)
+if(size<MEM_BLOCK_MIN_SIZE||size>heap->size)
 	return false;
+if(flags&MEM_BLOCK_FLAG_FREE)
+	{
+	size_t* foot=(size_t*)(offset+size);
+	foot--;
+	size_t foot_entry=*foot;
+	if((entry&~MEM_BLOCK_FLAG_PREV_FREE)!=foot_entry)
+		return false;
+	}
 info->flags=flags;
 info->pos=offset;
 info->size=size;
@@ -99,5 +145,32 @@ return (void*)(offset+sizeof(size_t));
 
 size_t mem_block_get_offset(void* p)
 {
-return (size_t)p-sizeof(size_t);
+size_t* head=(size_t*)p;
+head--;
+size_t entry=*head;
+if((entry&MEM_BLOCK_FLAGS_MASK)==MEM_BLOCK_FLAG_ALIGNED)
+	return (size_t)p-(entry&MEM_BLOCK_SIZE_MASK);
+return (size_t)head;
+}
+
+// Only the owner of an allocated block calls this, the size and the tag don't change without the lock
+size_t mem_block_get_tag(void* p, size_t* size)
+{
+size_t* head=(size_t*)mem_block_get_offset(p);
+size_t entry=__atomic_load_n(head, __ATOMIC_RELAXED);
+if(size)
+	*size=entry&MEM_BLOCK_SIZE_MASK;
+if(head+1!=(size_t*)p)
+	return 0;
+return entry>>MEM_BLOCK_TAG_SHIFT;
+}
+
+// Aligned pointers are not tagged
+void mem_block_set_tag(void* p, size_t tag)
+{
+size_t* head=(size_t*)p;
+head--;
+if((*head&MEM_BLOCK_FLAGS_MASK)==MEM_BLOCK_FLAG_ALIGNED)
+	return;
+*head=(*head&~MEM_BLOCK_TAG_MASK)|((tag<<MEM_BLOCK_TAG_SHIFT)&MEM_BLOCK_TAG_MASK);
 }
@@ -19,10 +19,29 @@
 // Flags
 //=======
 
+// Only free blocks have a footer, the next block knows it by the prev-free flag.
+// Aligned pointers are marked with both flags, an allocated header never has them.
+
 #define MEM_BLOCK_FLAG_FREE (size_t)1
-#define MEM_BLOCK_FLAG_ALIGNED (size_t)2
+#define MEM_BLOCK_FLAG_PREV_FREE (size_t)2
+#define MEM_BLOCK_FLAG_ALIGNED (size_t)3
 #define MEM_BLOCK_FLAGS_MASK (size_t)3
-#define MEM_BLOCK_SIZE_MASK ((size_t)~3)
+
+// Allocated headers keep the tag of the allocation in the top byte, heaps are smaller than the size mask
+#define MEM_BLOCK_TAG_SHIFT (sizeof(size_t)*8-8)
+#define MEM_BLOCK_TAG_MASK ((size_t)0xFF<<MEM_BLOCK_TAG_SHIFT)
+#define MEM_BLOCK_SIZE_MASK (~(MEM_BLOCK_TAG_MASK|MEM_BLOCK_FLAGS_MASK))
+
+// Headers are read as words, so blocks are aligned to a word.
+// The padding of an aligned pointer is a multiple of a word and its mark never overlaps the header.
+#define MEM_BLOCK_ALIGN sizeof(size_t)
+
+// Free blocks need space for the header, the links and the footer
+#if defined(CONFIG_HEAP_INDEX_TLSF)||defined(CONFIG_HEAP_INDEX_TREE)
+#define MEM_BLOCK_MIN_SIZE (4*sizeof(size_t))
+#else
+#define MEM_BLOCK_MIN_SIZE (3*sizeof(size_t))
+#endif
 
 
 //======
@@ -49,8 +68,12 @@ mem_block_info_t prev;
 //========
 
 size_t mem_block_calc_size(size_t size);
+size_t mem_block_calc_data_size(size_t size);
 void* mem_block_init(multi_heap_handle_t heap, size_t offset, size_t size, size_t flags);
+void* mem_block_init_aligned(multi_heap_handle_t heap, size_t offset, size_t size, size_t align);
 bool mem_block_get_neighbours(multi_heap_handle_t heap, size_t offset, mem_block_neighbours_t* info);
 bool mem_block_get_info(multi_heap_handle_t heap, size_t offset, mem_block_info_t* info);
 void* mem_block_get_pointer(size_t offset);
 size_t mem_block_get_offset(void* p);
+size_t mem_block_get_tag(void* p, size_t* size);
+void mem_block_set_tag(void* p, size_t tag);
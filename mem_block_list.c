@@ -18,6 +18,63 @@
 #include "multi_heap_platform.h"
 
 
+//======
+// Item
+//======
+
+size_t mem_block_list_item_get(mem_block_list_item_t const* item)
+{
+#ifdef CONFIG_HEAP_COMPACT_MAP
+// 16bit operations are not allowed in IRAM
+size_t pos=(size_t)item;
+uint32_t const* word=(uint32_t const*)(pos&~(size_t)3);
+if(pos&2)
+	return *word>>16;
+return *word&0xFFFF;
+#else
+return *item;
+#endif
+}
+
+size_t mem_block_list_item_get_offset(multi_heap_handle_t heap, size_t value)
+{
+#ifdef CONFIG_HEAP_COMPACT_MAP
+size_t heap_start=(size_t)heap+sizeof(multi_heap_t);
+return heap_start+value*4;
+#else
+return value;
+#endif
+}
+
+size_t mem_block_list_item_get_value(multi_heap_handle_t heap, size_t offset)
+{
+#ifdef CONFIG_HEAP_COMPACT_MAP
+size_t heap_start=(size_t)heap+sizeof(multi_heap_t);
+return (offset-heap_start)/4;
+#else
+return offset;
+#endif
+}
+
+void mem_block_list_item_set(mem_block_list_item_t* item, size_t value)
+{
+#ifdef CONFIG_HEAP_COMPACT_MAP
+size_t pos=(size_t)item;
+uint32_t* word=(uint32_t*)(pos&~(size_t)3);
+if(pos&2)
+	{
+	*word=(*word&0xFFFF)|((uint32_t)value<<16);
+	}
+else
+	{
+	*word=(*word&0xFFFF0000)|(uint32_t)value;
+	}
+#else
+*item=value;
+#endif
+}
+
+
 //=======
 // Group
 //=======
@@ -28,7 +85,7 @@ void mem_block_list_group_destroy(multi_heap_handle_t heap, mem_block_list_group
 {
 if(mem_block_group_get_level(group)==0)
 	{
-	multi_heap_free_internal(heap, group);
+	multi_heap_free_group(heap, group);
 	return;
 	}
 mem_block_list_parent_group_destroy(heap, (mem_block_list_parent_group_t*)group);
@@ -44,17 +101,17 @@ if(mem_block_group_get_level(group)==0)
 return mem_block_list_parent_group_check(heap, (mem_block_list_parent_group_t*)group, print_errors);
 }
 
-void mem_block_list_group_dump(mem_block_list_group_t* group)
+void mem_block_list_group_dump(multi_heap_handle_t heap, mem_block_list_group_t* group)
 {
 if(mem_block_group_get_level(group)==0)
 	{
-	mem_block_list_item_group_dump((mem_block_list_item_group_t*)group);
+	mem_block_list_item_group_dump(heap, (mem_block_list_item_group_t*)group);
 	return;
 	}
-mem_block_list_parent_group_dump((mem_block_list_parent_group_t*)group);
+mem_block_list_parent_group_dump(heap, (mem_block_list_parent_group_t*)group);
 }
 
-size_t* mem_block_list_group_get_first_item(mem_block_list_group_t* group)
+mem_block_list_item_t* mem_block_list_group_get_first_item(mem_block_list_group_t* group)
 {
 if(mem_block_group_get_level(group)==0)
 	return mem_block_list_item_group_get_first_item((mem_block_list_item_group_t*)group);
@@ -62,14 +119,14 @@ mem_block_list_parent_group_t* pgroup=(mem_block_list_parent_group_t*)group;
 return pgroup->first;
 }
 
-size_t* mem_block_list_group_get_item(mem_block_list_group_t* group, size_t offset)
+mem_block_list_item_t* mem_block_list_group_get_item(mem_block_list_group_t* group, size_t offset)
 {
 if(mem_block_group_get_level(group)==0)
 	return mem_block_list_item_group_get_item((mem_block_list_item_group_t*)group, offset);
 return mem_block_list_parent_group_get_item((mem_block_list_parent_group_t*)group, offset);
 }
 
-size_t* mem_block_list_group_get_item_at(mem_block_list_group_t* group, size_t pos)
+mem_block_list_item_t* mem_block_list_group_get_item_at(mem_block_list_group_t* group, size_t pos)
 {
 if(mem_block_group_get_level(group)==0)
 	return mem_block_list_item_group_get_item_at((mem_block_list_item_group_t*)group, pos);
@@ -84,7 +141,7 @@ mem_block_list_parent_group_t* pgroup=(mem_block_list_parent_group_t*)group;
 return pgroup->item_count;
 }
 
-size_t* mem_block_list_group_get_last_item(mem_block_list_group_t* group)
+mem_block_list_item_t* mem_block_list_group_get_last_item(mem_block_list_group_t* group)
 {
 if(mem_block_group_get_level(group)==0)
 	return mem_block_list_item_group_get_last_item((mem_block_list_item_group_t*)group);
@@ -118,7 +175,7 @@ return mem_block_list_parent_group_remove_item(heap, (mem_block_list_parent_grou
 
 mem_block_list_item_group_t* mem_block_list_item_group_create(multi_heap_handle_t heap)
 {
-mem_block_list_item_group_t* group=(mem_block_list_item_group_t*)multi_heap_malloc_internal(heap, sizeof(mem_block_list_item_group_t));
+mem_block_list_item_group_t* group=(mem_block_list_item_group_t*)multi_heap_malloc_group(heap, sizeof(mem_block_list_item_group_t));
 if(group==NULL)
 	return NULL;
 mem_block_group_init((mem_block_group_t*)group, 0, 0);
@@ -145,7 +202,7 @@ size_t heap_end=heap_start+heap->size;
 size_t last_offset=0;
 for(uint16_t pos=0; pos<child_count; pos++)
 	{
-	size_t offset=group->items[pos];
+	size_t offset=mem_block_list_item_get_offset(heap, mem_block_list_item_get(&group->items[pos]));
 	if(offset<heap_start||offset>=heap_end)
 		{
 		if(print_errors)
@@ -169,16 +226,16 @@ for(uint16_t pos=0; pos<child_count; pos++)
 return success;
 }
 
-void mem_block_list_item_group_dump(mem_block_list_item_group_t* group)
+void mem_block_list_item_group_dump(multi_heap_handle_t heap, mem_block_list_item_group_t* group)
 {
 uint16_t child_count=mem_block_group_get_child_count((mem_block_group_t*)group);
 for(uint16_t pos=0; pos<child_count; pos++)
 	{
-	MULTI_HEAP_PRINTF(" 0x%x", group->items[pos]);
+	MULTI_HEAP_PRINTF(" 0x%x", mem_block_list_item_get_offset(heap, mem_block_list_item_get(&group->items[pos])));
 	}
 }
 
-size_t* mem_block_list_item_group_get_first_item(mem_block_list_item_group_t* group)
+mem_block_list_item_t* mem_block_list_item_group_get_first_item(mem_block_list_item_group_t* group)
 {
 if(mem_block_group_get_child_count((mem_block_group_t*)group)==0)
 	return NULL;
@@ -193,12 +250,12 @@ uint16_t end=child_count;
 while(start<end)
 	{
 	uint16_t pos=start+(end-start)/2;
-	if(group->items[pos]>offset)
+	if(mem_block_list_item_get(&group->items[pos])>offset)
 		{
 		end=pos;
 		continue;
 		}
-	if(group->items[pos]<offset)
+	if(mem_block_list_item_get(&group->items[pos])<offset)
 		{
 		start=pos+1;
 		continue;
@@ -209,7 +266,7 @@ while(start<end)
 return start;
 }
 
-size_t* mem_block_list_item_group_get_item(mem_block_list_item_group_t* group, size_t offset)
+mem_block_list_item_t* mem_block_list_item_group_get_item(mem_block_list_item_group_t* group, size_t offset)
 {
 int16_t pos=mem_block_list_item_group_get_item_pos(group, offset);
 if(pos<0)
@@ -217,7 +274,7 @@ if(pos<0)
 return &group->items[pos];
 }
 
-size_t* mem_block_list_item_group_get_item_at(mem_block_list_item_group_t* group, size_t pos)
+mem_block_list_item_t* mem_block_list_item_group_get_item_at(mem_block_list_item_group_t* group, size_t pos)
 {
 if(pos>=mem_block_group_get_child_count((mem_block_group_t*)group))
 	return NULL;
@@ -232,7 +289,7 @@ uint16_t pos=0;
 while(start<end)
 	{
 	pos=start+(end-start)/2;
-	size_t item=group->items[pos];
+	size_t item=mem_block_list_item_get(&group->items[pos]);
 	if(item>offset)
 		{
 		end=pos;
@@ -248,7 +305,7 @@ while(start<end)
 return -(int16_t)pos-1;
 }
 
-size_t* mem_block_list_item_group_get_last_item(mem_block_list_item_group_t* group)
+mem_block_list_item_t* mem_block_list_item_group_get_last_item(mem_block_list_item_group_t* group)
 {
 uint16_t count=mem_block_group_get_child_count((mem_block_group_t*)group);
 if(count==0)
@@ -273,27 +330,27 @@ uint16_t child_count=mem_block_group_get_child_count((mem_block_group_t*)group);
 if(child_count==CONFIG_HEAP_GROUP_SIZE)
 	return false;
 for(uint16_t u=child_count; u>pos; u--)
-	group->items[u]=group->items[u-1];
-group->items[pos]=offset;
+	mem_block_list_item_set(&group->items[u], mem_block_list_item_get(&group->items[u-1]));
+mem_block_list_item_set(&group->items[pos], offset);
 mem_block_group_set_child_count((mem_block_group_t*)group, child_count+1);
 return true;
 }
 
-void mem_block_list_item_group_append_items(mem_block_list_item_group_t* group, size_t const* items, uint16_t count)
+void mem_block_list_item_group_append_items(mem_block_list_item_group_t* group, mem_block_list_item_t const* items, uint16_t count)
 {
 uint16_t child_count=mem_block_group_get_child_count((mem_block_group_t*)group);
 for(uint16_t u=0; u<count; u++)
-	group->items[child_count+u]=items[u];
+	mem_block_list_item_set(&group->items[child_count+u], mem_block_list_item_get(&items[u]));
 mem_block_group_set_child_count((mem_block_group_t*)group, child_count+count);
 }
 
-void mem_block_list_item_group_insert_items(mem_block_list_item_group_t* group, uint16_t pos, size_t const* items, uint16_t count)
+void mem_block_list_item_group_insert_items(mem_block_list_item_group_t* group, uint16_t pos, mem_block_list_item_t const* items, uint16_t count)
 {
 uint16_t child_count=mem_block_group_get_child_count((mem_block_group_t*)group);
 for(uint16_t u=child_count+count-1; u>=pos+count; u--)
-	group->items[u]=group->items[u-count];
+	mem_block_list_item_set(&group->items[u], mem_block_list_item_get(&group->items[u-count]));
 for(uint16_t u=0; u<count; u++)
-	group->items[pos+u]=items[u];
+	mem_block_list_item_set(&group->items[pos+u], mem_block_list_item_get(&items[u]));
 mem_block_group_set_child_count((mem_block_group_t*)group, child_count+count);
 }
 
@@ -312,7 +369,7 @@ uint16_t child_count=mem_block_group_get_child_count((mem_block_group_t*)group);
 if(pos>=child_count)
 	return false;
 for(uint16_t u=pos; u+1<child_count; u++)
-	group->items[u]=group->items[u+1];
+	mem_block_list_item_set(&group->items[u], mem_block_list_item_get(&group->items[u+1]));
 mem_block_group_set_child_count((mem_block_group_t*)group, child_count-1);
 return true;
 }
@@ -321,7 +378,7 @@ void mem_block_list_item_group_remove_items(mem_block_list_item_group_t* group,
 {
 uint16_t child_count=mem_block_group_get_child_count((mem_block_group_t*)group);
 for(uint16_t u=pos; u+count<child_count; u++)
-	group->items[u]=group->items[u+count];
+	mem_block_list_item_set(&group->items[u], mem_block_list_item_get(&group->items[u+count]));
 mem_block_group_set_child_count((mem_block_group_t*)group, child_count-count);
 }
 
@@ -334,7 +391,7 @@ mem_block_group_set_child_count((mem_block_group_t*)group, child_count-count);
 
 mem_block_list_parent_group_t* mem_block_list_parent_group_create(multi_heap_handle_t heap, uint16_t level)
 {
-mem_block_list_parent_group_t* group=(mem_block_list_parent_group_t*)multi_heap_malloc_internal(heap, sizeof(mem_block_list_parent_group_t));
+mem_block_list_parent_group_t* group=(mem_block_list_parent_group_t*)multi_heap_malloc_group(heap, sizeof(mem_block_list_parent_group_t));
 if(group==NULL)
 	return NULL;
 mem_block_group_init((mem_block_group_t*)group, level, 0);
@@ -346,7 +403,7 @@ return group;
 
 mem_block_list_parent_group_t* mem_block_list_parent_group_create_with_child(multi_heap_handle_t heap, mem_block_list_group_t* child)
 {
-mem_block_list_parent_group_t* group=(mem_block_list_parent_group_t*)multi_heap_malloc_internal(heap, sizeof(mem_block_list_parent_group_t));
+mem_block_list_parent_group_t* group=(mem_block_list_parent_group_t*)multi_heap_malloc_group(heap, sizeof(mem_block_list_parent_group_t));
 if(group==NULL)
 	return NULL;
 uint16_t child_level=mem_block_group_get_level(child);
@@ -363,7 +420,7 @@ void mem_block_list_parent_group_destroy(multi_heap_handle_t heap, mem_block_lis
 uint16_t child_count=mem_block_group_get_child_count((mem_block_group_t*)group);
 for(uint16_t u=0; u<child_count; u++)
 	mem_block_list_group_destroy(heap, group->children[u]);
-multi_heap_free_internal(heap, group);
+multi_heap_free_group(heap, group);
 }
 
 
@@ -389,11 +446,11 @@ for(uint16_t pos=0; pos<child_count; pos++)
 return success;
 }
 
-void mem_block_list_parent_group_dump(mem_block_list_parent_group_t* group)
+void mem_block_list_parent_group_dump(multi_heap_handle_t heap, mem_block_list_parent_group_t* group)
 {
 uint16_t child_count=mem_block_group_get_child_count((mem_block_group_t*)group);
 for(uint16_t pos=0; pos<child_count; pos++)
-	mem_block_list_group_dump(group->children[pos]);
+	mem_block_list_group_dump(heap, group->children[pos]);
 }
 
 int16_t mem_block_list_parent_group_get_group(mem_block_list_parent_group_t* group, size_t* pos)
@@ -416,8 +473,8 @@ if(!child_count)
 	return 0;
 uint16_t start=0;
 uint16_t end=child_count;
-size_t* first=NULL;
-size_t* last=NULL;
+mem_block_list_item_t* first=NULL;
+mem_block_list_item_t* last=NULL;
 int16_t empty=0;
 while(start<end)
 	{
@@ -428,33 +485,33 @@ while(start<end)
 		if(empty<0)
 			{
 			empty--;
-			if((end-start)/2+empty<start)
+			if(start+(end-start)/2+empty<start)
 				break;
 			continue;
 			}
 		empty++;
-		if((end-start)/2+empty>=end)
+		if(start+(end-start)/2+empty>=end)
 			{
 			empty=-1;
-			if((end-start)/2+empty<start)
+			if(start+(end-start)/2+empty<start)
 				break;
 			}
 		continue;
 		}
 	empty=0;
 	last=mem_block_list_group_get_last_item(group->children[pos]);
-	if(*first==offset||*last==offset)
+	if(mem_block_list_item_get(first)==offset||mem_block_list_item_get(last)==offset)
 		{
 		*exists=true;
 		*insert_pos=pos;
 		return 1;
 		}
-	if(*first>offset)
+	if(mem_block_list_item_get(first)>offset)
 		{
 		end=pos;
 		continue;
 		}
-	if(*last<offset)
+	if(mem_block_list_item_get(last)<offset)
 		{
 		start=pos+1;
 		continue;
@@ -468,7 +525,7 @@ if(start>child_count-1)
 if(start>0)
 	{
 	first=mem_block_list_group_get_first_item(group->children[start]);
-	if(first==NULL||*first>=offset)
+	if(first==NULL||mem_block_list_item_get(first)>=offset)
 		{
 		*insert_pos=start-1;
 		return 2;
@@ -477,13 +534,13 @@ if(start>0)
 if(start+1<child_count)
 	{
 	last=mem_block_list_group_get_last_item(group->children[start]);
-	if(last==0||*last<=offset)
+	if(last==0||mem_block_list_item_get(last)<=offset)
 		return 2;
 	}
 return 1;
 }
 
-size_t* mem_block_list_parent_group_get_item(mem_block_list_parent_group_t* group, size_t offset)
+mem_block_list_item_t* mem_block_list_parent_group_get_item(mem_block_list_parent_group_t* group, size_t offset)
 {
 int16_t child=mem_block_list_parent_group_get_item_pos(group, offset);
 if(child<0)
@@ -491,7 +548,7 @@ if(child<0)
 return mem_block_list_group_get_item(group->children[child], offset);
 }
 
-size_t* mem_block_list_parent_group_get_item_at(mem_block_list_parent_group_t* group, size_t pos)
+mem_block_list_item_t* mem_block_list_parent_group_get_item_at(mem_block_list_parent_group_t* group, size_t pos)
 {
 int16_t child=mem_block_list_parent_group_get_group(group, &pos);
 if(child<0)
@@ -504,8 +561,8 @@ int16_t mem_block_list_parent_group_get_item_pos(mem_block_list_parent_group_t*
 uint16_t start=0;
 uint16_t end=mem_block_group_get_child_count((mem_block_group_t*)group);
 uint16_t pos=0;
-size_t* first=NULL;
-size_t* last=NULL;
+mem_block_list_item_t* first=NULL;
+mem_block_list_item_t* last=NULL;
 int16_t empty=0;
 while(start<end)
 	{
@@ -516,27 +573,27 @@ while(start<end)
 		if(empty<0)
 			{
 			empty--;
-			if((end-start)/2+empty<start)
+			if(start+(end-start)/2+empty<start)
 				break;
 			continue;
 			}
 		empty++;
-		if((end-start)/2+empty>=end)
+		if(start+(end-start)/2+empty>=end)
 			{
 			empty=-1;
-			if((end-start)/2+empty<start)
+			if(start+(end-start)/2+empty<start)
 				break;
 			}
 		continue;
 		}
 	empty=0;
-	if(*first>offset)
+	if(mem_block_list_item_get(first)>offset)
 		{
 		end=pos;
 		continue;
 		}
 	last=mem_block_list_group_get_last_item(group->children[pos]);
-	if(*last<offset)
+	if(mem_block_list_item_get(last)<offset)
 		{
 		start=pos+1;
 		continue;
@@ -580,7 +637,8 @@ mem_block_group_lock((mem_block_group_t*)group);
 bool added=mem_block_list_parent_group_add_item_internal(heap, group, offset, again, exists);
 if(added)
 	{
-	group->item_count++;
+	// Children may have changed while memory was allocated
+	mem_block_list_parent_group_update_item_count(group);
 	mem_block_list_parent_group_update_bounds(group);
 	}
 if(mem_block_group_is_dirty((mem_block_group_t*)group))
@@ -649,6 +707,7 @@ uint16_t count=mem_block_group_get_child_count(group->children[pos]);
 if(count==0)
 	{
 	mem_block_list_parent_group_remove_group(heap, group, pos);
+	mem_block_list_parent_group_update_bounds(group);
 	return true;
 	}
 if(pos>0)
@@ -658,6 +717,7 @@ if(pos>0)
 		{
 		mem_block_list_parent_group_move_children(group, pos, pos-1, count);
 		mem_block_list_parent_group_remove_group(heap, group, pos);
+		mem_block_list_parent_group_update_bounds(group);
 		return true;
 		}
 	}
@@ -669,6 +729,7 @@ if(pos+1<child_count)
 		{
 		mem_block_list_parent_group_move_children(group, pos+1, pos, after);
 		mem_block_list_parent_group_remove_group(heap, group, pos+1);
+		mem_block_list_parent_group_update_bounds(group);
 		return true;
 		}
 	}
@@ -766,7 +827,7 @@ mem_block_list_group_t* child=group->children[pos];
 for(uint16_t u=pos; u+1<child_count; u++)
 	group->children[u]=group->children[u+1];
 mem_block_group_set_child_count((mem_block_group_t*)group, child_count-1);
-multi_heap_free_internal(heap, child);
+multi_heap_free_group(heap, child);
 }
 
 void mem_block_list_parent_group_remove_groups(mem_block_list_parent_group_t* group, uint16_t pos, uint16_t count)
@@ -807,6 +868,9 @@ if(space<0)
 	return false;
 if(count>1&&space>pos)
 	pos++;
+// Only a full child makes room, after a failed allocation it can have a single entry
+if(mem_block_group_get_child_count(group->children[pos])<CONFIG_HEAP_GROUP_SIZE)
+	return false;
 mem_block_list_parent_group_move_space(group, space, pos);
 return true;
 }
@@ -816,6 +880,9 @@ bool mem_block_list_parent_group_split_child(multi_heap_handle_t heap, mem_block
 uint16_t child_count=mem_block_group_get_child_count((mem_block_group_t*)group);
 if(child_count==CONFIG_HEAP_GROUP_SIZE)
 	return false;
+// A child with one entry would be left empty, after a failed allocation it doesn't have to be full
+if(pos>=child_count||mem_block_group_get_child_count(group->children[pos])<2)
+	return false;
 mem_block_list_group_t* child=NULL;
 uint16_t level=mem_block_group_get_level((mem_block_group_t*)group);
 if(level>1)
@@ -836,6 +903,14 @@ mem_block_list_parent_group_move_children(group, pos, pos+1, 1);
 return true;
 }
 
+void mem_block_list_parent_group_update_item_count(mem_block_list_parent_group_t* group)
+{
+uint16_t child_count=mem_block_group_get_child_count((mem_block_group_t*)group);
+group->item_count=0;
+for(uint16_t pos=0; pos<child_count; pos++)
+	group->item_count+=mem_block_list_group_get_item_count(group->children[pos]);
+}
+
 void mem_block_list_parent_group_update_bounds(mem_block_list_parent_group_t* group)
 {
 uint16_t child_count=mem_block_group_get_child_count((mem_block_group_t*)group);
@@ -901,28 +976,29 @@ if(!list->root)
 return mem_block_list_group_check(heap, list->root, print_errors);
 }
 
-void mem_block_list_dump(mem_block_list_t* list)
+void mem_block_list_dump(multi_heap_handle_t heap, mem_block_list_t* list)
 {
 if(list->root)
-	mem_block_list_group_dump(list->root);
+	mem_block_list_group_dump(heap, list->root);
 }
 
-size_t mem_block_list_get_item(mem_block_list_t* list, size_t offset)
+size_t mem_block_list_get_item(multi_heap_handle_t heap, mem_block_list_t* list, size_t offset)
 {
 if(!list->root)
 	return 0;
-size_t* item=mem_block_list_group_get_item(list->root, offset);
+size_t value=mem_block_list_item_get_value(heap, offset);
+mem_block_list_item_t* item=mem_block_list_group_get_item(list->root, value);
 if(!item)
 	return 0;
-return *item;
+return mem_block_list_item_get_offset(heap, mem_block_list_item_get(item));
 }
 
-size_t mem_block_list_get_item_at(mem_block_list_t* list, size_t pos)
+size_t mem_block_list_get_item_at(multi_heap_handle_t heap, mem_block_list_t* list, size_t pos)
 {
-size_t* item=mem_block_list_group_get_item_at(list->root, pos);
+mem_block_list_item_t* item=mem_block_list_group_get_item_at(list->root, pos);
 if(!item)
 	return 0;
-return *item;
+return mem_block_list_item_get_offset(heap, mem_block_list_item_get(item));
 }
 
 size_t mem_block_list_get_item_count(mem_block_list_t* list)
@@ -937,6 +1013,7 @@ return mem_block_list_group_get_item_count(list->root);
 
 bool mem_block_list_add_offset(multi_heap_handle_t heap, mem_block_list_t* list, size_t offset)
 {
+size_t value=mem_block_list_item_get_value(heap, offset);
 if(!list->root)
 	{
 	list->root=(mem_block_list_group_t*)mem_block_list_item_group_create(heap);
@@ -944,12 +1021,15 @@ if(!list->root)
 		return false;
 	}
 bool exists=false;
-bool added=mem_block_list_group_add_item(heap, list->root, offset, false, &exists);
+bool added=mem_block_list_group_add_item(heap, list->root, value, false, &exists);
 mem_block_list_update_root(heap, list);
 if(added)
 	return true;
 if(exists)
 	return false;
+// A root with space failed to allocate a group, another level wouldn't help
+if(mem_block_group_get_child_count(list->root)<CONFIG_HEAP_GROUP_SIZE)
+	return false;
 mem_block_group_lock(list->root);
 mem_block_list_parent_group_t* root=mem_block_list_parent_group_create_with_child(heap, list->root);
 mem_block_group_unlock(list->root);
@@ -959,7 +1039,7 @@ if(!root)
 	return false;
 	}
 list->root=(mem_block_list_group_t*)root;
-added=mem_block_list_parent_group_add_item(heap, root, offset, true, &exists);
+added=mem_block_list_parent_group_add_item(heap, root, value, true, &exists);
 mem_block_list_update_root(heap, list);
 return added;
 }
@@ -968,7 +1048,8 @@ bool mem_block_list_remove_offset(multi_heap_handle_t heap, mem_block_list_t* li
 {
 if(!list->root)
 	return false;
-if(!mem_block_list_group_remove_item(heap, list->root, offset))
+size_t value=mem_block_list_item_get_value(heap, offset);
+if(!mem_block_list_group_remove_item(heap, list->root, value))
 	return false;
 mem_block_list_update_root(heap, list);
 return true;
@@ -986,7 +1067,7 @@ if(level==0)
 	if(child_count==0)
 		{
 		list->root=NULL;
-		multi_heap_free_internal(heap, root);
+		multi_heap_free_group(heap, root);
 		}
 	return;
 	}
@@ -994,5 +1075,5 @@ if(child_count>1)
 	return;
 mem_block_list_parent_group_t* proot=(mem_block_list_parent_group_t*)root;
 list->root=proot->children[0];
-multi_heap_free_internal(heap, root);
+multi_heap_free_group(heap, root);
 }
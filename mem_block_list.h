@@ -19,6 +19,23 @@
 #include "multi_heap_platform.h"
 
 
+//======
+// Item
+//======
+
+#ifdef CONFIG_HEAP_COMPACT_MAP
+// Heap-relative offset in units of 4 bytes
+typedef uint16_t mem_block_list_item_t;
+#else
+typedef size_t mem_block_list_item_t;
+#endif
+
+size_t mem_block_list_item_get(mem_block_list_item_t const* item);
+size_t mem_block_list_item_get_offset(multi_heap_handle_t heap, size_t value);
+size_t mem_block_list_item_get_value(multi_heap_handle_t heap, size_t offset);
+void mem_block_list_item_set(mem_block_list_item_t* item, size_t value);
+
+
 //=======
 // Group
 //=======
@@ -30,12 +47,12 @@ void mem_block_list_group_destroy(multi_heap_handle_t heap, mem_block_list_group
 
 // Access
 bool mem_block_list_group_check(multi_heap_handle_t heap, mem_block_list_group_t* group, bool print_errors);
-void mem_block_list_group_dump(mem_block_list_group_t* group);
-size_t* mem_block_list_group_get_first_item(mem_block_list_group_t* group);
-size_t* mem_block_list_group_get_item(mem_block_list_group_t* group, size_t offset);
-size_t* mem_block_list_group_get_item_at(mem_block_list_group_t* group, size_t pos);
+void mem_block_list_group_dump(multi_heap_handle_t heap, mem_block_list_group_t* group);
+mem_block_list_item_t* mem_block_list_group_get_first_item(mem_block_list_group_t* group);
+mem_block_list_item_t* mem_block_list_group_get_item(mem_block_list_group_t* group, size_t offset);
+mem_block_list_item_t* mem_block_list_group_get_item_at(mem_block_list_group_t* group, size_t pos);
 size_t mem_block_list_group_get_item_count(mem_block_list_group_t* group);
-size_t* mem_block_list_group_get_last_item(mem_block_list_group_t* group);
+mem_block_list_item_t* mem_block_list_group_get_last_item(mem_block_list_group_t* group);
 
 // Modification
 bool mem_block_list_group_add_item(multi_heap_handle_t heap, mem_block_list_group_t* group, size_t value, bool again, bool* exists);
@@ -50,7 +67,7 @@ typedef struct mem_block_list_item_group_t
 {
 uint16_t level;
 uint16_t child_count;
-size_t items[CONFIG_HEAP_GROUP_SIZE];
+mem_block_list_item_t items[CONFIG_HEAP_GROUP_SIZE];
 }mem_block_list_item_group_t;
 
 // Con-/Destructors
@@ -58,19 +75,19 @@ mem_block_list_item_group_t* mem_block_list_item_group_create(multi_heap_handle_
 
 // Access
 bool mem_block_list_item_group_check(multi_heap_handle_t heap, mem_block_list_item_group_t* group, bool print_errors);
-void mem_block_list_item_group_dump(mem_block_list_item_group_t* group);
-size_t* mem_block_list_item_group_get_first_item(mem_block_list_item_group_t* group);
+void mem_block_list_item_group_dump(multi_heap_handle_t heap, mem_block_list_item_group_t* group);
+mem_block_list_item_t* mem_block_list_item_group_get_first_item(mem_block_list_item_group_t* group);
 uint16_t mem_block_list_item_group_get_insert_pos(mem_block_list_item_group_t* group, size_t offset, bool* exists);
-size_t* mem_block_list_item_group_get_item(mem_block_list_item_group_t* group, size_t offset);
-size_t* mem_block_list_item_group_get_item_at(mem_block_list_item_group_t* group, size_t pos);
+mem_block_list_item_t* mem_block_list_item_group_get_item(mem_block_list_item_group_t* group, size_t offset);
+mem_block_list_item_t* mem_block_list_item_group_get_item_at(mem_block_list_item_group_t* group, size_t pos);
 int16_t mem_block_list_item_group_get_item_pos(mem_block_list_item_group_t* group, size_t offset);
-size_t* mem_block_list_item_group_get_last_item(mem_block_list_item_group_t* group);
+mem_block_list_item_t* mem_block_list_item_group_get_last_item(mem_block_list_item_group_t* group);
 
 // Modification
 bool mem_block_list_item_group_add_item(mem_block_list_item_group_t* group, size_t value, bool* exists);
 bool mem_block_list_item_group_add_item_internal(mem_block_list_item_group_t* group, size_t value, uint16_t pos);
-void mem_block_list_item_group_append_items(mem_block_list_item_group_t* group, size_t const* items, uint16_t count);
-void mem_block_list_item_group_insert_items(mem_block_list_item_group_t* group, uint16_t pos, size_t const* items, uint16_t count);
+void mem_block_list_item_group_append_items(mem_block_list_item_group_t* group, mem_block_list_item_t const* items, uint16_t count);
+void mem_block_list_item_group_insert_items(mem_block_list_item_group_t* group, uint16_t pos, mem_block_list_item_t const* items, uint16_t count);
 bool mem_block_list_item_group_remove_item(mem_block_list_item_group_t* group, size_t value);
 bool mem_block_list_item_group_remove_item_at(mem_block_list_item_group_t* group, size_t pos);
 void mem_block_list_item_group_remove_items(mem_block_list_item_group_t* group, uint16_t pos, uint16_t count);
@@ -84,8 +101,8 @@ typedef struct
 {
 uint16_t level;
 uint16_t child_count;
-size_t* first;
-size_t* last;
+mem_block_list_item_t* first;
+mem_block_list_item_t* last;
 size_t item_count;
 mem_block_list_group_t* children[CONFIG_HEAP_GROUP_SIZE];
 }mem_block_list_parent_group_t;
@@ -98,11 +115,11 @@ void mem_block_list_parent_group_destroy(multi_heap_handle_t heap, mem_block_lis
 
 // Access
 bool mem_block_list_parent_group_check(multi_heap_handle_t heap, mem_block_list_parent_group_t* group, bool print_errors);
-void mem_block_list_parent_group_dump(mem_block_list_parent_group_t* group);
+void mem_block_list_parent_group_dump(multi_heap_handle_t heap, mem_block_list_parent_group_t* group);
 int16_t mem_block_list_parent_group_get_group(mem_block_list_parent_group_t* group, size_t* pos);
 uint16_t mem_block_list_parent_group_get_insert_pos(mem_block_list_parent_group_t* group, size_t value, uint16_t* insert_pos, bool* exists);
-size_t* mem_block_list_parent_group_get_item(mem_block_list_parent_group_t* group, size_t value);
-size_t* mem_block_list_parent_group_get_item_at(mem_block_list_parent_group_t* group, size_t pos);
+mem_block_list_item_t* mem_block_list_parent_group_get_item(mem_block_list_parent_group_t* group, size_t value);
+mem_block_list_item_t* mem_block_list_parent_group_get_item_at(mem_block_list_parent_group_t* group, size_t pos);
 int16_t mem_block_list_parent_group_get_item_pos(mem_block_list_parent_group_t* group, size_t value);
 int16_t mem_block_list_parent_group_get_nearest_space(mem_block_list_parent_group_t* group, int16_t pos);
 
@@ -121,6 +138,7 @@ bool mem_block_list_parent_group_remove_item(multi_heap_handle_t heap, mem_block
 bool mem_block_list_parent_group_shift_children(mem_block_list_parent_group_t* group, uint16_t pos, uint16_t count);
 bool mem_block_list_parent_group_split_child(multi_heap_handle_t heap, mem_block_list_parent_group_t* group, uint16_t pos);
 void mem_block_list_parent_group_update_bounds(mem_block_list_parent_group_t* group);
+void mem_block_list_parent_group_update_item_count(mem_block_list_parent_group_t* group);
 
 
 //======
@@ -139,12 +157,12 @@ void mem_block_list_open(mem_block_list_t* list, size_t offset);
 
 // Access
 bool mem_block_list_check(multi_heap_handle_t heap, mem_block_list_t* list, bool print_errors);
-void mem_block_list_dump(mem_block_list_t* list);
-size_t mem_block_list_get_item(mem_block_list_t* list, size_t value);
-size_t mem_block_list_get_item_at(mem_block_list_t* list, size_t pos);
+void mem_block_list_dump(multi_heap_handle_t heap, mem_block_list_t* list);
+size_t mem_block_list_get_item(multi_heap_handle_t heap, mem_block_list_t* list, size_t offset);
+size_t mem_block_list_get_item_at(multi_heap_handle_t heap, mem_block_list_t* list, size_t pos);
 size_t mem_block_list_get_item_count(mem_block_list_t* list);
 
 // Modification
-bool mem_block_list_add_offset(multi_heap_handle_t heap, mem_block_list_t* list, size_t value);
-bool mem_block_list_remove_offset(multi_heap_handle_t heap, mem_block_list_t* list, size_t value);
+bool mem_block_list_add_offset(multi_heap_handle_t heap, mem_block_list_t* list, size_t offset);
+bool mem_block_list_remove_offset(multi_heap_handle_t heap, mem_block_list_t* list, size_t offset);
 void mem_block_list_update_root(multi_heap_handle_t heap, mem_block_list_t* list);
@@ -23,17 +23,67 @@
 // Item
 //======
 
-size_t mem_block_map_item_get_offset(mem_block_map_item_t* item)
+size_t mem_block_map_item_get_entry(multi_heap_handle_t heap, mem_block_map_item_t* item)
+{
+#ifdef CONFIG_HEAP_COMPACT_MAP
+size_t heap_start=(size_t)heap+sizeof(multi_heap_t);
+size_t offset=heap_start+(item->value>>16)*4;
+if(offset>=heap_start+heap->total_size)
+	return offset|MEM_BLOCK_MAP_FLAG_LIST;
+// Lists out of the arena are stored by the offset of their block
+size_t* head=(size_t*)offset;
+if(*head&MEM_BLOCK_FLAG_FREE)
+	return offset;
+return (size_t)mem_block_get_pointer(offset)|MEM_BLOCK_MAP_FLAG_LIST;
+#else
+return item->offset;
+#endif
+}
+
+size_t mem_block_map_item_get_offset(multi_heap_handle_t heap, mem_block_map_item_t* item)
 {
 if(!item)
 	return 0;
-size_t flags=item->offset&MEM_BLOCK_MAP_FLAGS_MASK;
-size_t offset=item->offset&MEM_BLOCK_MAP_OFFSET_MASK;
-if(!flags&MEM_BLOCK_MAP_FLAG_LIST)
+size_t entry=mem_block_map_item_get_entry(heap, item);
+size_t flags=entry&MEM_BLOCK_MAP_FLAGS_MASK;
+size_t offset=entry&MEM_BLOCK_MAP_OFFSET_MASK;
+if(!(flags&MEM_BLOCK_MAP_FLAG_LIST))
 	return offset;
 mem_block_list_t list;
 mem_block_list_open(&list, offset);
-return mem_block_list_get_item_at(&list, 0);
+return mem_block_list_get_item_at(heap, &list, 0);
+}
+
+size_t mem_block_map_item_get_size(mem_block_map_item_t* item)
+{
+#ifdef CONFIG_HEAP_COMPACT_MAP
+return (size_t)(item->value&0xFFFF)*4;
+#else
+return item->size;
+#endif
+}
+
+void mem_block_map_item_set_entry(multi_heap_handle_t heap, mem_block_map_item_t* item, size_t entry)
+{
+#ifdef CONFIG_HEAP_COMPACT_MAP
+size_t heap_start=(size_t)heap+sizeof(multi_heap_t);
+size_t offset=entry&MEM_BLOCK_MAP_OFFSET_MASK;
+if((entry&MEM_BLOCK_MAP_FLAG_LIST)&&offset<heap_start+heap->total_size)
+	offset=mem_block_get_offset((void*)offset);
+size_t value=(offset-heap_start)/4;
+item->value=(item->value&0xFFFF)|((uint32_t)value<<16);
+#else
+item->offset=entry;
+#endif
+}
+
+void mem_block_map_item_set_size(mem_block_map_item_t* item, size_t size)
+{
+#ifdef CONFIG_HEAP_COMPACT_MAP
+item->value=(item->value&0xFFFF0000)|(uint32_t)(size/4);
+#else
+item->size=size;
+#endif
 }
 
 
@@ -46,7 +96,7 @@ void mem_block_map_group_destroy(multi_heap_handle_t heap, mem_block_map_group_t
 {
 if(mem_block_group_get_level(group)==0)
 	{
-	multi_heap_free_internal(heap, group);
+	multi_heap_free_group(heap, group);
 	return;
 	}
 mem_block_map_parent_group_destroy(heap, (mem_block_map_parent_group_t*)group);
@@ -62,14 +112,14 @@ if(mem_block_group_get_level(group)==0)
 return mem_block_map_parent_group_check(heap, (mem_block_map_parent_group_t*)group, print_errors);
 }
 
-void mem_block_map_group_dump(mem_block_map_group_t* group)
+void mem_block_map_group_dump(multi_heap_handle_t heap, mem_block_map_group_t* group)
 {
 if(mem_block_group_get_level(group)==0)
 	{
-	mem_block_map_item_group_dump((mem_block_map_item_group_t*)group);
+	mem_block_map_item_group_dump(heap, (mem_block_map_item_group_t*)group);
 	return;
 	}
-mem_block_map_parent_group_dump((mem_block_map_parent_group_t*)group);
+mem_block_map_parent_group_dump(heap, (mem_block_map_parent_group_t*)group);
 }
 
 mem_block_map_item_t* mem_block_map_group_get_first_item(mem_block_map_group_t* group)
@@ -136,7 +186,7 @@ return mem_block_map_parent_group_remove_offset(heap, (mem_block_map_parent_grou
 
 mem_block_map_item_group_t* mem_block_map_item_group_create(multi_heap_handle_t heap)
 {
-mem_block_map_item_group_t* group=(mem_block_map_item_group_t*)multi_heap_malloc_internal(heap, sizeof(mem_block_map_item_group_t));
+mem_block_map_item_group_t* group=(mem_block_map_item_group_t*)multi_heap_malloc_group(heap, sizeof(mem_block_map_item_group_t));
 if(group==NULL)
 	return NULL;
 mem_block_group_init((mem_block_group_t*)group, 0, 0);
@@ -163,7 +213,7 @@ size_t heap_end=heap_start+heap->size;
 size_t last_size=0;
 for(uint16_t pos=0; pos<child_count; pos++)
 	{
-	size_t size=group->items[pos].size;
+	size_t size=mem_block_map_item_get_size(&group->items[pos]);
 	if(size<=last_size)
 		{
 		if(print_errors)
@@ -174,10 +224,10 @@ for(uint16_t pos=0; pos<child_count; pos++)
 		continue;
 		}
 	last_size=size;
-	size_t entry=group->items[pos].offset;
+	size_t entry=mem_block_map_item_get_entry(heap, &group->items[pos]);
 	size_t flags=entry&MEM_BLOCK_MAP_FLAGS_MASK;
 	size_t offset=entry&MEM_BLOCK_MAP_OFFSET_MASK;
-	if(offset<heap_start||offset>=heap_end)
+	if(!(flags&MEM_BLOCK_MAP_FLAG_LIST)&&(offset<heap_start||offset>=heap_end))
 		{
 		if(print_errors)
 			{
@@ -197,20 +247,20 @@ for(uint16_t pos=0; pos<child_count; pos++)
 return success;
 }
 
-void mem_block_map_item_group_dump(mem_block_map_item_group_t* group)
+void mem_block_map_item_group_dump(multi_heap_handle_t heap, mem_block_map_item_group_t* group)
 {
 uint16_t child_count=mem_block_group_get_child_count((mem_block_group_t*)group);
 for(uint16_t pos=0; pos<child_count; pos++)
 	{
-	size_t entry=group->items[pos].offset;
-	size_t size=group->items[pos].size;
+	size_t entry=mem_block_map_item_get_entry(heap, &group->items[pos]);
+	size_t size=mem_block_map_item_get_size(&group->items[pos]);
 	size_t offset=entry&MEM_BLOCK_MAP_OFFSET_MASK;
 	MULTI_HEAP_PRINTF("\t[%u]", size);
 	if(entry&MEM_BLOCK_MAP_FLAG_LIST)
 		{
 		mem_block_list_t list;
 		mem_block_list_open(&list, offset);
-		mem_block_list_dump(&list);
+		mem_block_list_dump(heap, &list);
 		}
 	else
 		{
@@ -235,12 +285,12 @@ uint16_t end=child_count;
 while(start<end)
 	{
 	uint16_t pos=start+(end-start)/2;
-	if(group->items[pos].size>size)
+	if(mem_block_map_item_get_size(&group->items[pos])>size)
 		{
 		end=pos;
 		continue;
 		}
-	if(group->items[pos].size<size)
+	if(mem_block_map_item_get_size(&group->items[pos])<size)
 		{
 		start=pos+1;
 		continue;
@@ -276,12 +326,12 @@ while(start<end)
 	{
 	pos=start+(end-start)/2;
 	item=&group->items[pos];
-	if(item->size>size)
+	if(mem_block_map_item_get_size(item)>size)
 		{
 		end=pos;
 		continue;
 		}
-	if(item->size<size)
+	if(mem_block_map_item_get_size(item)<size)
 		{
 		start=pos+1;
 		continue;
@@ -309,14 +359,19 @@ if(*exists)
 	{
 	mem_block_group_lock((mem_block_group_t*)group);
 	mem_block_map_item_t* item=mem_block_map_item_group_get_item_at(group, pos);
-	size_t flags=item->offset&MEM_BLOCK_MAP_FLAGS_MASK;
-	size_t entry=item->offset&MEM_BLOCK_MAP_OFFSET_MASK;
+	size_t entry=mem_block_map_item_get_entry(heap, item);
+	size_t flags=entry&MEM_BLOCK_MAP_FLAGS_MASK;
+	entry&=MEM_BLOCK_MAP_OFFSET_MASK;
 	mem_block_list_t list;
 	if(flags&MEM_BLOCK_MAP_FLAG_LIST)
 		{
 		mem_block_list_open(&list, entry);
 		if(!mem_block_list_add_offset(heap, &list, offset))
 			{
+			// The root may have been replaced before the list failed to grow
+			entry=(size_t)list.root;
+			entry|=MEM_BLOCK_MAP_FLAG_LIST;
+			mem_block_map_item_set_entry(heap, item, entry);
 			mem_block_group_unlock((mem_block_group_t*)group);
 			return false;
 			}
@@ -347,34 +402,34 @@ if(*exists)
 			{
 			entry=(size_t)list.root;
 			entry|=MEM_BLOCK_MAP_FLAG_LIST;
-			item->offset=entry;
+			mem_block_map_item_set_entry(heap, item, entry);
 			}
 		else
 			{
-			item->offset=offset;
+			mem_block_map_item_set_entry(heap, item, offset);
 			mem_block_list_destroy(heap, &list);
 			}
 		}
 	else
 		{
-		mem_block_map_item_group_add_offset_internal(group, size, offset, pos);
+		mem_block_map_item_group_add_offset_internal(heap, group, size, offset, pos);
 		mem_block_list_destroy(heap, &list);
 		}
 	mem_block_group_unlock((mem_block_group_t*)group);
 	return true;
 	}
-return mem_block_map_item_group_add_offset_internal(group, size, offset, pos);
+return mem_block_map_item_group_add_offset_internal(heap, group, size, offset, pos);
 }
 
-bool mem_block_map_item_group_add_offset_internal(mem_block_map_item_group_t* group, size_t size, size_t offset, uint16_t pos)
+bool mem_block_map_item_group_add_offset_internal(multi_heap_handle_t heap, mem_block_map_item_group_t* group, size_t size, size_t offset, uint16_t pos)
 {
 uint16_t child_count=mem_block_group_get_child_count((mem_block_group_t*)group);
 if(child_count==CONFIG_HEAP_GROUP_SIZE)
 	return false;
 for(uint16_t u=child_count; u>pos; u--)
 	group->items[u]=group->items[u-1];
-group->items[pos].size=size;
-group->items[pos].offset=offset;
+mem_block_map_item_set_size(&group->items[pos], size);
+mem_block_map_item_set_entry(heap, &group->items[pos], offset);
 mem_block_group_set_child_count((mem_block_group_t*)group, child_count+1);
 return true;
 }
@@ -403,8 +458,9 @@ int16_t pos=mem_block_map_item_group_get_item_pos(group, size);
 if(pos<0)
 	return false;
 mem_block_map_item_t* item=mem_block_map_item_group_get_item_at(group, pos);
-size_t flags=item->offset&MEM_BLOCK_MAP_FLAGS_MASK;
-size_t entry=item->offset&MEM_BLOCK_MAP_OFFSET_MASK;
+size_t entry=mem_block_map_item_get_entry(heap, item);
+size_t flags=entry&MEM_BLOCK_MAP_FLAGS_MASK;
+entry&=MEM_BLOCK_MAP_OFFSET_MASK;
 if(flags&MEM_BLOCK_MAP_FLAG_LIST)
 	{
 	mem_block_list_t list;
@@ -416,12 +472,12 @@ if(flags&MEM_BLOCK_MAP_FLAG_LIST)
 		{
 		entry=(size_t)list.root;
 		entry|=MEM_BLOCK_MAP_FLAG_LIST;
-		item->offset=entry;
+		mem_block_map_item_set_entry(heap, item, entry);
 		}
 	else if(item_count==1)
 		{
-		entry=mem_block_list_get_item_at(&list, 0);
-		item->offset=entry;
+		entry=mem_block_list_get_item_at(heap, &list, 0);
+		mem_block_map_item_set_entry(heap, item, entry);
 		mem_block_list_destroy(heap, &list);
 		}
 	else
@@ -467,7 +523,7 @@ mem_block_group_set_child_count((mem_block_group_t*)group, child_count-count);
 
 mem_block_map_parent_group_t* mem_block_map_parent_group_create(multi_heap_handle_t heap, uint16_t level)
 {
-mem_block_map_parent_group_t* group=(mem_block_map_parent_group_t*)multi_heap_malloc_internal(heap, sizeof(mem_block_map_parent_group_t));
+mem_block_map_parent_group_t* group=(mem_block_map_parent_group_t*)multi_heap_malloc_group(heap, sizeof(mem_block_map_parent_group_t));
 if(group==NULL)
 	return NULL;
 mem_block_group_init((mem_block_group_t*)group, level, 0);
@@ -479,7 +535,7 @@ return group;
 
 mem_block_map_parent_group_t* mem_block_map_parent_group_create_with_child(multi_heap_handle_t heap, mem_block_map_group_t* child)
 {
-mem_block_map_parent_group_t* group=(mem_block_map_parent_group_t*)multi_heap_malloc_internal(heap, sizeof(mem_block_map_parent_group_t));
+mem_block_map_parent_group_t* group=(mem_block_map_parent_group_t*)multi_heap_malloc_group(heap, sizeof(mem_block_map_parent_group_t));
 if(group==NULL)
 	return NULL;
 uint16_t child_level=mem_block_group_get_level(child);
@@ -496,7 +552,7 @@ void mem_block_map_parent_group_destroy(multi_heap_handle_t heap, mem_block_map_
 uint16_t child_count=mem_block_group_get_child_count((mem_block_group_t*)group);
 for(uint16_t u=0; u<child_count; u++)
 	mem_block_map_group_destroy(heap, group->children[u]);
-multi_heap_free_internal(heap, group);
+multi_heap_free_group(heap, group);
 }
 
 
@@ -522,11 +578,11 @@ for(uint16_t pos=0; pos<child_count; pos++)
 return success;
 }
 
-void mem_block_map_parent_group_dump(mem_block_map_parent_group_t* group)
+void mem_block_map_parent_group_dump(multi_heap_handle_t heap, mem_block_map_parent_group_t* group)
 {
 uint16_t child_count=mem_block_group_get_child_count((mem_block_group_t*)group);
 for(uint16_t pos=0; pos<child_count; pos++)
-	mem_block_map_group_dump(group->children[pos]);
+	mem_block_map_group_dump(heap, group->children[pos]);
 }
 
 int16_t mem_block_map_parent_group_get_group(mem_block_map_parent_group_t* group, size_t* pos)
@@ -561,33 +617,33 @@ while(start<end)
 		if(empty<0)
 			{
 			empty--;
-			if((end-start)/2+empty<start)
+			if(start+(end-start)/2+empty<start)
 				break;
 			continue;
 			}
 		empty++;
-		if((end-start)/2+empty>=end)
+		if(start+(end-start)/2+empty>=end)
 			{
 			empty=-1;
-			if((end-start)/2+empty<start)
+			if(start+(end-start)/2+empty<start)
 				break;
 			}
 		continue;
 		}
 	empty=0;
 	last=mem_block_map_group_get_last_item(group->children[pos]);
-	if(first->size==size||last->size==size)
+	if(mem_block_map_item_get_size(first)==size||mem_block_map_item_get_size(last)==size)
 		{
 		*exists=true;
 		*insert_pos=pos;
 		return 1;
 		}
-	if(first->size>size)
+	if(mem_block_map_item_get_size(first)>size)
 		{
 		end=pos;
 		continue;
 		}
-	if(last->size<size)
+	if(mem_block_map_item_get_size(last)<size)
 		{
 		start=pos+1;
 		continue;
@@ -601,7 +657,7 @@ if(start>child_count-1)
 if(start>0)
 	{
 	first=mem_block_map_group_get_first_item(group->children[start]);
-	if(first==NULL||first->size>=size)
+	if(first==NULL||mem_block_map_item_get_size(first)>=size)
 		{
 		*insert_pos=start-1;
 		return 2;
@@ -610,7 +666,7 @@ if(start>0)
 if(start+1<child_count)
 	{
 	last=mem_block_map_group_get_last_item(group->children[start]);
-	if(last==NULL||last->size<=size)
+	if(last==NULL||mem_block_map_item_get_size(last)<=size)
 		return 2;
 	}
 return 1;
@@ -649,27 +705,27 @@ while(start<end)
 		if(empty<0)
 			{
 			empty--;
-			if((end-start)/2+empty<start)
+			if(start+(end-start)/2+empty<start)
 				break;
 			continue;
 			}
 		empty++;
-		if((end-start)/2+empty>=end)
+		if(start+(end-start)/2+empty>=end)
 			{
 			empty=-1;
-			if((end-start)/2+empty<start)
+			if(start+(end-start)/2+empty<start)
 				break;
 			}
 		continue;
 		}
 	empty=0;
-	if(first->size>size)
+	if(mem_block_map_item_get_size(first)>size)
 		{
 		end=pos;
 		continue;
 		}
 	last=mem_block_map_group_get_last_item(group->children[pos]);
-	if(last->size<size)
+	if(mem_block_map_item_get_size(last)<size)
 		{
 		start=pos+1;
 		continue;
@@ -713,7 +769,8 @@ mem_block_group_lock((mem_block_group_t*)group);
 bool added=mem_block_map_parent_group_add_offset_internal(heap, group, size, offset, again, exists);
 if(added)
 	{
-	group->item_count++;
+	// Offsets of an existing size are added to its list
+	mem_block_map_parent_group_update_item_count(group);
 	mem_block_map_parent_group_update_bounds(group);
 	}
 if(mem_block_group_is_dirty((mem_block_group_t*)group))
@@ -777,6 +834,7 @@ uint16_t count=mem_block_group_get_child_count(group->children[pos]);
 if(count==0)
 	{
 	mem_block_map_parent_group_remove_group(heap, group, pos);
+	mem_block_map_parent_group_update_bounds(group);
 	return true;
 	}
 if(pos>0)
@@ -786,6 +844,7 @@ if(pos>0)
 		{
 		mem_block_map_parent_group_move_children(group, pos, pos-1, count);
 		mem_block_map_parent_group_remove_group(heap, group, pos);
+		mem_block_map_parent_group_update_bounds(group);
 		return true;
 		}
 	}
@@ -797,6 +856,7 @@ if(pos+1<child_count)
 		{
 		mem_block_map_parent_group_move_children(group, pos+1, pos, after);
 		mem_block_map_parent_group_remove_group(heap, group, pos+1);
+		mem_block_map_parent_group_update_bounds(group);
 		return true;
 		}
 	}
@@ -894,7 +954,7 @@ mem_block_map_group_t* child=group->children[pos];
 for(uint16_t u=pos; u+1<child_count; u++)
 	group->children[u]=group->children[u+1];
 mem_block_group_set_child_count((mem_block_group_t*)group, child_count-1);
-multi_heap_free_internal(heap, child);
+multi_heap_free_group(heap, child);
 }
 
 void mem_block_map_parent_group_remove_groups(mem_block_map_parent_group_t* group, uint16_t pos, uint16_t count)
@@ -938,6 +998,9 @@ if(space<0)
 	return false;
 if(count>1&&space>pos)
 	pos++;
+// Only a full child makes room, after a failed allocation it can have a single entry
+if(mem_block_group_get_child_count(group->children[pos])<CONFIG_HEAP_GROUP_SIZE)
+	return false;
 mem_block_map_parent_group_move_space(group, space, pos);
 return true;
 }
@@ -947,6 +1010,9 @@ bool mem_block_map_parent_group_split_child(multi_heap_handle_t heap, mem_block_
 uint16_t child_count=mem_block_group_get_child_count((mem_block_group_t*)group);
 if(child_count==CONFIG_HEAP_GROUP_SIZE)
 	return false;
+// A child with one entry would be left empty, after a failed allocation it doesn't have to be full
+if(pos>=child_count||mem_block_group_get_child_count(group->children[pos])<2)
+	return false;
 mem_block_map_group_t* child=NULL;
 uint16_t level=mem_block_group_get_level((mem_block_group_t*)group);
 if(level>1)
@@ -967,6 +1033,14 @@ mem_block_map_parent_group_move_children(group, pos, pos+1, 1);
 return true;
 }
 
+void mem_block_map_parent_group_update_item_count(mem_block_map_parent_group_t* group)
+{
+uint16_t child_count=mem_block_group_get_child_count((mem_block_group_t*)group);
+group->item_count=0;
+for(uint16_t pos=0; pos<child_count; pos++)
+	group->item_count+=mem_block_map_group_get_item_count(group->children[pos]);
+}
+
 void mem_block_map_parent_group_update_bounds(mem_block_map_parent_group_t* group)
 {
 uint16_t child_count=mem_block_group_get_child_count((mem_block_group_t*)group);
@@ -1025,7 +1099,7 @@ void mem_block_map_dump(multi_heap_handle_t heap, mem_block_map_t* map)
 {
 if(!map->root)
 	return;
-mem_block_map_group_dump(map->root);
+mem_block_map_group_dump(heap, map->root);
 }
 
 mem_block_map_item_t* mem_block_map_get_item_at(mem_block_map_t* map, size_t pos)
@@ -1042,23 +1116,12 @@ if(!map->root)
 return mem_block_map_group_get_item_count(map->root);
 }
 
-size_t mem_block_map_get_offset(mem_block_map_t* map, size_t size)
+size_t mem_block_map_get_offset(multi_heap_handle_t heap, mem_block_map_t* map, size_t size)
 {
 if(!map->root)
 	return 0;
 mem_block_map_item_t* item=mem_block_map_group_get_item(map->root, size);
-if(!item)
-	return 0;
-size_t entry=item->offset;
-size_t flags=entry&MEM_BLOCK_MAP_FLAGS_MASK;
-size_t offset=entry&MEM_BLOCK_MAP_OFFSET_MASK;
-if(flags&MEM_BLOCK_MAP_FLAG_LIST)
-	{
-	mem_block_list_t list;
-	mem_block_list_open(&list, offset);
-	offset=mem_block_list_get_item_at(&list, 0);
-	}
-return offset;
+return mem_block_map_item_get_offset(heap, item);
 }
 
 
@@ -1085,6 +1148,9 @@ if(added)
 	return true;
 if(exists)
 	return false;
+// A root with space failed to allocate a group, another level wouldn't help
+if(mem_block_group_get_child_count(map->root)<CONFIG_HEAP_GROUP_SIZE)
+	return false;
 mem_block_group_lock(map->root);
 mem_block_map_parent_group_t* root=mem_block_map_parent_group_create_with_child(heap, map->root);
 mem_block_group_unlock(map->root);
@@ -1123,7 +1189,7 @@ if(level==0)
 	if(child_count==0)
 		{
 		map->root=NULL;
-		multi_heap_free_internal(heap, root);
+		multi_heap_free_group(heap, root);
 		}
 	return;
 	}
@@ -1131,7 +1197,7 @@ if(child_count>1)
 	return;
 mem_block_map_parent_group_t* proot=(mem_block_map_parent_group_t*)root;
 map->root=proot->children[0];
-multi_heap_free_internal(heap, root);
+multi_heap_free_group(heap, root);
 }
 
 
@@ -32,13 +32,30 @@
 // Item
 //======
 
+#ifdef CONFIG_HEAP_COMPACT_MAP
+
+// Size and heap-relative offset in units of 4 bytes
+// Both are kept in one word, 16bit operations are not allowed in IRAM
+typedef struct
+{
+uint32_t value;
+}mem_block_map_item_t;
+
+#else
+
 typedef struct
 {
 size_t size;
 size_t offset;
 }mem_block_map_item_t;
 
-size_t mem_block_map_item_get_offset(mem_block_map_item_t* item);
+#endif
+
+size_t mem_block_map_item_get_entry(multi_heap_handle_t heap, mem_block_map_item_t* item);
+size_t mem_block_map_item_get_offset(multi_heap_handle_t heap, mem_block_map_item_t* item);
+size_t mem_block_map_item_get_size(mem_block_map_item_t* item);
+void mem_block_map_item_set_entry(multi_heap_handle_t heap, mem_block_map_item_t* item, size_t entry);
+void mem_block_map_item_set_size(mem_block_map_item_t* item, size_t size);
 
 
 //=======
@@ -52,7 +69,7 @@ void mem_block_map_group_destroy(multi_heap_handle_t heap, mem_block_map_group_t
 
 // Access
 bool mem_block_map_group_check(multi_heap_handle_t heap, mem_block_map_group_t* group, bool print_errors);
-void mem_block_map_group_dump(mem_block_map_group_t* group);
+void mem_block_map_group_dump(multi_heap_handle_t heap, mem_block_map_group_t* group);
 mem_block_map_item_t* mem_block_map_group_get_first_item(mem_block_map_group_t* group);
 mem_block_map_item_t* mem_block_map_group_get_item(mem_block_map_group_t* group, size_t size);
 mem_block_map_item_t* mem_block_map_group_get_item_at(mem_block_map_group_t* group, size_t pos);
@@ -80,7 +97,7 @@ mem_block_map_item_group_t* mem_block_map_item_group_create(multi_heap_handle_t
 
 // Access
 bool mem_block_map_item_group_check(multi_heap_handle_t heap, mem_block_map_item_group_t* group, bool print_errors);
-void mem_block_map_item_group_dump(mem_block_map_item_group_t* group);
+void mem_block_map_item_group_dump(multi_heap_handle_t heap, mem_block_map_item_group_t* group);
 mem_block_map_item_t* mem_block_map_item_group_get_first_item(mem_block_map_item_group_t* group);
 uint16_t mem_block_map_item_group_get_insert_pos(mem_block_map_item_group_t* group, size_t size, bool* exists);
 mem_block_map_item_t* mem_block_map_item_group_get_item(mem_block_map_item_group_t* group, size_t size);
@@ -90,7 +107,7 @@ mem_block_map_item_t* mem_block_map_item_group_get_last_item(mem_block_map_item_
 
 // Modification
 bool mem_block_map_item_group_add_offset(multi_heap_handle_t heap, mem_block_map_item_group_t* group, size_t size, size_t offset, bool* exists);
-bool mem_block_map_item_group_add_offset_internal(mem_block_map_item_group_t* group, size_t size, size_t offset, uint16_t pos);
+bool mem_block_map_item_group_add_offset_internal(multi_heap_handle_t heap, mem_block_map_item_group_t* group, size_t size, size_t offset, uint16_t pos);
 void mem_block_map_item_group_append_items(mem_block_map_item_group_t* group, mem_block_map_item_t const* items, uint16_t count);
 void mem_block_map_item_group_insert_items(mem_block_map_item_group_t* group, uint16_t pos, mem_block_map_item_t const* items, uint16_t count);
 bool mem_block_map_item_group_remove_offset(multi_heap_handle_t heap, mem_block_map_item_group_t* group, size_t size, size_t offset, bool* removed);
@@ -120,7 +137,7 @@ void mem_block_map_parent_group_destroy(multi_heap_handle_t heap, mem_block_map_
 
 // Access
 bool mem_block_map_parent_group_check(multi_heap_handle_t heap, mem_block_map_parent_group_t* group, bool print_errors);
-void mem_block_map_parent_group_dump(mem_block_map_parent_group_t* group);
+void mem_block_map_parent_group_dump(multi_heap_handle_t heap, mem_block_map_parent_group_t* group);
 int16_t mem_block_map_parent_group_get_group(mem_block_map_parent_group_t* group, size_t* pos);
 uint16_t mem_block_map_parent_group_get_insert_pos(mem_block_map_parent_group_t* group, size_t size, uint16_t* insert_pos, bool* exists);
 mem_block_map_item_t* mem_block_map_parent_group_get_item(mem_block_map_parent_group_t* group, size_t size);
@@ -143,6 +160,7 @@ bool mem_block_map_parent_group_remove_offset(multi_heap_handle_t heap, mem_bloc
 bool mem_block_map_parent_group_shift_children(mem_block_map_parent_group_t* group, uint16_t pos, uint16_t count);
 bool mem_block_map_parent_group_split_child(multi_heap_handle_t heap, mem_block_map_parent_group_t* group, uint16_t pos);
 void mem_block_map_parent_group_update_bounds(mem_block_map_parent_group_t* group);
+void mem_block_map_parent_group_update_item_count(mem_block_map_parent_group_t* group);
 
 
 //=====
@@ -163,7 +181,7 @@ bool mem_block_map_check(multi_heap_handle_t heap, mem_block_map_t* map, bool pr
 void mem_block_map_dump(multi_heap_handle_t heap, mem_block_map_t* map);
 mem_block_map_item_t* mem_block_map_get_item_at(mem_block_map_t* map, size_t pos);
 size_t mem_block_map_get_item_count(mem_block_map_t* map);
-size_t mem_block_map_get_offset(mem_block_map_t* map, size_t size);
+size_t mem_block_map_get_offset(multi_heap_handle_t heap, mem_block_map_t* map, size_t size);
 
 // Modification
 bool mem_block_map_add_offset(multi_heap_handle_t heap, mem_block_map_t* map, size_t size, size_t offset);
@@ -0,0 +1,260 @@
+//==================
+// mem_block_tlsf.c
+//==================
+
+// Free memory-blocks in segregated lists, found with a two-level bitmap
+
+// Copyright 2021, Sven Bieg (svenbieg@web.de)
+// http://github.com/svenbieg/esp32-heap
+
+
+//=======
+// Using
+//=======
+
+#include "mem_block.h"
+#include "mem_block_tlsf.h"
+#include "multi_heap_internal.h"
+#include "multi_heap_platform.h"
+
+
+//=======
+// Index
+//=======
+
+// Con-/Destructors
+
+void mem_block_tlsf_init(mem_block_tlsf_t* tlsf)
+{
+tlsf->fl_map=0;
+for(uint32_t fl=0; fl<MEM_BLOCK_TLSF_FL_COUNT; fl++)
+	{
+	tlsf->sl_maps[fl]=0;
+	for(uint32_t sl=0; sl<MEM_BLOCK_TLSF_SL_COUNT; sl++)
+		tlsf->lists[fl][sl]=0;
+	}
+}
+
+
+// Access
+
+bool mem_block_tlsf_check(multi_heap_handle_t heap, mem_block_tlsf_t* tlsf, bool print_errors)
+{
+bool success=true;
+for(uint32_t fl=0; fl<MEM_BLOCK_TLSF_FL_COUNT; fl++)
+	{
+	bool fl_set=(tlsf->fl_map&(1U<<fl))!=0;
+	if(fl_set!=(tlsf->sl_maps[fl]!=0))
+		{
+		if(print_errors)
+			{
+			MULTI_HEAP_PRINTF("multi_heap_check(0x%x): tlsf first level %u mismatch\n", heap, fl);
+			}
+		success=false;
+		}
+	for(uint32_t sl=0; sl<MEM_BLOCK_TLSF_SL_COUNT; sl++)
+		{
+		bool sl_set=(tlsf->sl_maps[fl]&(1U<<sl))!=0;
+		size_t offset=tlsf->lists[fl][sl];
+		if(sl_set!=(offset!=0))
+			{
+			if(print_errors)
+				{
+				MULTI_HEAP_PRINTF("multi_heap_check(0x%x): tlsf list %u/%u mismatch\n", heap, fl, sl);
+				}
+			success=false;
+			continue;
+			}
+		size_t prev=0;
+		while(offset)
+			{
+			mem_block_info_t info;
+			if(!mem_block_get_info(heap, offset, &info)||!(info.flags&MEM_BLOCK_FLAG_FREE))
+				{
+				if(print_errors)
+					{
+					MULTI_HEAP_PRINTF("multi_heap_check(0x%x, 0x%x): tlsf offset invalid\n", heap, offset);
+					}
+				success=false;
+				break;
+				}
+			uint32_t block_fl=0;
+			uint32_t block_sl=0;
+			mem_block_tlsf_map_size(info.size, &block_fl, &block_sl);
+			size_t* links=(size_t*)mem_block_get_pointer(offset);
+			if(block_fl!=fl||block_sl!=sl||links[1]!=prev)
+				{
+				if(print_errors)
+					{
+					MULTI_HEAP_PRINTF("multi_heap_check(0x%x, 0x%x): tlsf offset in wrong list\n", heap, offset);
+					}
+				success=false;
+				break;
+				}
+			prev=offset;
+			offset=links[0];
+			}
+		}
+	}
+return success;
+}
+
+void mem_block_tlsf_dump(multi_heap_handle_t heap, mem_block_tlsf_t* tlsf)
+{
+for(uint32_t fl=0; fl<MEM_BLOCK_TLSF_FL_COUNT; fl++)
+	{
+	for(uint32_t sl=0; sl<MEM_BLOCK_TLSF_SL_COUNT; sl++)
+		{
+		size_t offset=tlsf->lists[fl][sl];
+		if(!offset)
+			continue;
+		MULTI_HEAP_PRINTF("\t[%u/%u]", fl, sl);
+		while(offset)
+			{
+			mem_block_info_t info;
+			mem_block_get_info(heap, offset, &info);
+			MULTI_HEAP_PRINTF(" 0x%x(%u)", offset, info.size);
+			size_t* links=(size_t*)mem_block_get_pointer(offset);
+			offset=links[0];
+			}
+		MULTI_HEAP_PRINTF("\n");
+		}
+	}
+}
+
+size_t mem_block_tlsf_get_largest(multi_heap_handle_t heap, mem_block_tlsf_t* tlsf)
+{
+if(!tlsf->fl_map)
+	return 0;
+uint32_t fl=31-__builtin_clz(tlsf->fl_map);
+uint32_t sl=31-__builtin_clz(tlsf->sl_maps[fl]);
+// Sizes in the list differ, the largest is looked up
+size_t largest=0;
+for(size_t offset=tlsf->lists[fl][sl]; offset; offset=*(size_t*)mem_block_get_pointer(offset))
+	{
+	size_t size=*(size_t*)offset&MEM_BLOCK_SIZE_MASK;
+	if(size>largest)
+		largest=size;
+	}
+return largest;
+}
+
+size_t mem_block_tlsf_get_offset(multi_heap_handle_t heap, mem_block_tlsf_t* tlsf, size_t size)
+{
+// Round up to the next list, every block there is big enough
+size_t search=size;
+if(search>=MEM_BLOCK_TLSF_SMALL_SIZE)
+	{
+	uint32_t high=31-__builtin_clz((uint32_t)(search>>MEM_BLOCK_TLSF_SL_LOG2))+MEM_BLOCK_TLSF_SL_LOG2;
+	search+=((size_t)1<<(high-MEM_BLOCK_TLSF_SL_LOG2))-1;
+	}
+uint32_t fl=0;
+uint32_t sl=0;
+mem_block_tlsf_map_size(search, &fl, &sl);
+uint32_t sl_map=tlsf->sl_maps[fl]&(~0U<<sl);
+if(!sl_map)
+	{
+	uint32_t fl_map=0;
+	if(fl+1<MEM_BLOCK_TLSF_FL_COUNT)
+		fl_map=tlsf->fl_map&(~0U<<(fl+1));
+	if(!fl_map)
+		return 0;
+	fl=__builtin_ctz(fl_map);
+	sl_map=tlsf->sl_maps[fl];
+	}
+sl=__builtin_ctz(sl_map);
+size_t offset=tlsf->lists[fl][sl];
+if(fl<MEM_BLOCK_TLSF_FL_COUNT-1||sl<MEM_BLOCK_TLSF_SL_COUNT-1)
+	return offset;
+// Blocks in the last list can be too small
+for(; offset; offset=*(size_t*)mem_block_get_pointer(offset))
+	{
+	if((*(size_t*)offset&MEM_BLOCK_SIZE_MASK)>=size)
+		return offset;
+	}
+return 0;
+}
+
+
+// Modification
+
+bool mem_block_tlsf_add_offset(multi_heap_handle_t heap, mem_block_tlsf_t* tlsf, size_t size, size_t offset)
+{
+uint32_t fl=0;
+uint32_t sl=0;
+mem_block_tlsf_map_size(size, &fl, &sl);
+// Free blocks hold the next and the previous offset
+size_t* links=(size_t*)mem_block_get_pointer(offset);
+size_t next=tlsf->lists[fl][sl];
+links[0]=next;
+links[1]=0;
+if(next)
+	{
+	size_t* next_links=(size_t*)mem_block_get_pointer(next);
+	next_links[1]=offset;
+	}
+tlsf->lists[fl][sl]=offset;
+tlsf->sl_maps[fl]|=1U<<sl;
+tlsf->fl_map|=1U<<fl;
+return true;
+}
+
+bool mem_block_tlsf_remove_offset(multi_heap_handle_t heap, mem_block_tlsf_t* tlsf, size_t size, size_t offset)
+{
+uint32_t fl=0;
+uint32_t sl=0;
+mem_block_tlsf_map_size(size, &fl, &sl);
+size_t* links=(size_t*)mem_block_get_pointer(offset);
+size_t next=links[0];
+size_t prev=links[1];
+if(prev)
+	{
+	size_t* prev_links=(size_t*)mem_block_get_pointer(prev);
+	if(prev_links[0]!=offset)
+		return false;
+	prev_links[0]=next;
+	}
+else
+	{
+	if(tlsf->lists[fl][sl]!=offset)
+		return false;
+	tlsf->lists[fl][sl]=next;
+	if(!next)
+		{
+		tlsf->sl_maps[fl]&=~(1U<<sl);
+		if(!tlsf->sl_maps[fl])
+			tlsf->fl_map&=~(1U<<fl);
+		}
+	}
+if(next)
+	{
+	size_t* next_links=(size_t*)mem_block_get_pointer(next);
+	next_links[1]=prev;
+	}
+return true;
+}
+
+
+//=========
+// Mapping
+//=========
+
+void mem_block_tlsf_map_size(size_t size, uint32_t* fl, uint32_t* sl)
+{
+if(size<MEM_BLOCK_TLSF_SMALL_SIZE)
+	{
+	*fl=0;
+	*sl=size/4;
+	return;
+	}
+uint32_t high=31-__builtin_clz((uint32_t)(size>>MEM_BLOCK_TLSF_SL_LOG2))+MEM_BLOCK_TLSF_SL_LOG2;
+uint32_t first=high-MEM_BLOCK_TLSF_FL_SHIFT+1;
+if(first>=MEM_BLOCK_TLSF_FL_COUNT)
+	{
+	*fl=MEM_BLOCK_TLSF_FL_COUNT-1;
+	*sl=MEM_BLOCK_TLSF_SL_COUNT-1;
+	return;
+	}
+*fl=first;
+*sl=(uint32_t)(size>>(high-MEM_BLOCK_TLSF_SL_LOG2))-MEM_BLOCK_TLSF_SL_COUNT;
+}
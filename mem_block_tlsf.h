@@ -0,0 +1,71 @@
+//==================
+// mem_block_tlsf.h
+//==================
+
+// Free memory-blocks in segregated lists, found with a two-level bitmap
+
+// Copyright 2021, Sven Bieg (svenbieg@web.de)
+// http://github.com/svenbieg/esp32-heap
+
+#pragma once
+
+
+//=======
+// Using
+//=======
+
+#include <multi_heap.h>
+#include "multi_heap_platform.h"
+
+
+//==========
+// Settings
+//==========
+
+#ifdef CONFIG_HEAP_TLSF_SL_LOG2
+#define MEM_BLOCK_TLSF_SL_LOG2 CONFIG_HEAP_TLSF_SL_LOG2
+#else
+#define MEM_BLOCK_TLSF_SL_LOG2 3
+#endif
+
+#define MEM_BLOCK_TLSF_SL_COUNT (1<<MEM_BLOCK_TLSF_SL_LOG2)
+
+// Smaller blocks are listed in steps of 4 bytes
+#define MEM_BLOCK_TLSF_FL_SHIFT (MEM_BLOCK_TLSF_SL_LOG2+2)
+#define MEM_BLOCK_TLSF_SMALL_SIZE ((size_t)1<<MEM_BLOCK_TLSF_FL_SHIFT)
+
+// Larger blocks share the last list
+#define MEM_BLOCK_TLSF_FL_MAX 24
+#define MEM_BLOCK_TLSF_FL_COUNT (MEM_BLOCK_TLSF_FL_MAX-MEM_BLOCK_TLSF_FL_SHIFT+1)
+
+
+//=======
+// Index
+//=======
+
+typedef struct
+{
+uint32_t fl_map;
+uint32_t sl_maps[MEM_BLOCK_TLSF_FL_COUNT];
+size_t lists[MEM_BLOCK_TLSF_FL_COUNT][MEM_BLOCK_TLSF_SL_COUNT];
+}mem_block_tlsf_t;
+
+// Con-/Destructors
+void mem_block_tlsf_init(mem_block_tlsf_t* tlsf);
+
+// Access
+bool mem_block_tlsf_check(multi_heap_handle_t heap, mem_block_tlsf_t* tlsf, bool print_errors);
+void mem_block_tlsf_dump(multi_heap_handle_t heap, mem_block_tlsf_t* tlsf);
+size_t mem_block_tlsf_get_largest(multi_heap_handle_t heap, mem_block_tlsf_t* tlsf);
+size_t mem_block_tlsf_get_offset(multi_heap_handle_t heap, mem_block_tlsf_t* tlsf, size_t size);
+
+// Modification
+bool mem_block_tlsf_add_offset(multi_heap_handle_t heap, mem_block_tlsf_t* tlsf, size_t size, size_t offset);
+bool mem_block_tlsf_remove_offset(multi_heap_handle_t heap, mem_block_tlsf_t* tlsf, size_t size, size_t offset);
+
+
+//=========
+// Mapping
+//=========
+
+void mem_block_tlsf_map_size(size_t size, uint32_t* fl, uint32_t* sl);
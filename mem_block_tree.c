@@ -0,0 +1,463 @@
+//==================
+// mem_block_tree.c
+//==================
+
+// Free memory-blocks in bins and size-trees, linked inside the free blocks
+
+// Copyright 2021, Sven Bieg (svenbieg@web.de)
+// http://github.com/svenbieg/esp32-heap
+
+
+//=======
+// Using
+//=======
+
+#include "mem_block.h"
+#include "mem_block_tree.h"
+#include "multi_heap_internal.h"
+#include "multi_heap_platform.h"
+
+
+//======
+// Node
+//======
+
+// Access
+
+bool mem_block_tree_node_check(multi_heap_handle_t heap, size_t offset, size_t parent, uint32_t index, uint32_t level, bool print_errors)
+{
+mem_block_info_t info;
+if(!mem_block_get_info(heap, offset, &info)||!(info.flags&MEM_BLOCK_FLAG_FREE))
+	{
+	if(print_errors)
+		{
+		MULTI_HEAP_PRINTF("multi_heap_check(0x%x, 0x%x): tree offset invalid\n", heap, offset);
+		}
+	return false;
+	}
+mem_block_tree_node_t* node=mem_block_tree_node_get(offset);
+if(mem_block_tree_get_index(info.size)!=index||node->parent!=parent||node->prev!=0)
+	{
+	if(print_errors)
+		{
+		MULTI_HEAP_PRINTF("multi_heap_check(0x%x, 0x%x): tree node invalid\n", heap, offset);
+		}
+	return false;
+	}
+size_t prev=offset;
+for(size_t next=node->next; next; next=mem_block_tree_node_get(next)->next)
+	{
+	mem_block_info_t next_info;
+	if(!mem_block_get_info(heap, next, &next_info)||!(next_info.flags&MEM_BLOCK_FLAG_FREE)||next_info.size!=info.size||next<prev||mem_block_tree_node_get(next)->prev!=prev)
+		{
+		if(print_errors)
+			{
+			MULTI_HEAP_PRINTF("multi_heap_check(0x%x, 0x%x): tree chain invalid\n", heap, next);
+			}
+		return false;
+		}
+	prev=next;
+	}
+uint32_t bit=index+MEM_BLOCK_TREE_SMALL_SHIFT-1-level;
+for(uint32_t u=0; u<2; u++)
+	{
+	size_t child=node->children[u];
+	if(!child)
+		continue;
+	if(((mem_block_tree_node_get_size(child)>>bit)&1)!=u)
+		{
+		if(print_errors)
+			{
+			MULTI_HEAP_PRINTF("multi_heap_check(0x%x, 0x%x): tree child on wrong side\n", heap, child);
+			}
+		return false;
+		}
+	if(!mem_block_tree_node_check(heap, child, offset, index, level+1, print_errors))
+		return false;
+	}
+return true;
+}
+
+void mem_block_tree_node_dump(multi_heap_handle_t heap, size_t offset)
+{
+mem_block_tree_node_t* node=mem_block_tree_node_get(offset);
+MULTI_HEAP_PRINTF("\t%u:", mem_block_tree_node_get_size(offset));
+for(size_t next=offset; next; next=mem_block_tree_node_get(next)->next)
+	MULTI_HEAP_PRINTF(" 0x%x", next);
+MULTI_HEAP_PRINTF("\n");
+for(uint32_t u=0; u<2; u++)
+	{
+	if(node->children[u])
+		mem_block_tree_node_dump(heap, node->children[u]);
+	}
+}
+
+mem_block_tree_node_t* mem_block_tree_node_get(size_t offset)
+{
+return (mem_block_tree_node_t*)mem_block_get_pointer(offset);
+}
+
+size_t mem_block_tree_node_get_size(size_t offset)
+{
+return *(size_t*)offset&MEM_BLOCK_SIZE_MASK;
+}
+
+
+//======
+// Tree
+//======
+
+// Con-/Destructors
+
+void mem_block_tree_init(mem_block_tree_t* tree)
+{
+for(uint32_t u=0; u<MEM_BLOCK_TREE_SMALL_COUNT/32; u++)
+	tree->small_maps[u]=0;
+tree->tree_map=0;
+for(uint32_t u=0; u<MEM_BLOCK_TREE_SMALL_COUNT; u++)
+	tree->small_bins[u]=0;
+for(uint32_t u=0; u<MEM_BLOCK_TREE_COUNT; u++)
+	tree->trees[u]=0;
+}
+
+
+// Access
+
+bool mem_block_tree_check(multi_heap_handle_t heap, mem_block_tree_t* tree, bool print_errors)
+{
+bool success=true;
+for(uint32_t bin=0; bin<MEM_BLOCK_TREE_SMALL_COUNT; bin++)
+	{
+	bool set=(tree->small_maps[bin/32]&(1U<<(bin%32)))!=0;
+	if(set!=(tree->small_bins[bin]!=0))
+		{
+		if(print_errors)
+			{
+			MULTI_HEAP_PRINTF("multi_heap_check(0x%x): tree bin %u mismatch\n", heap, bin);
+			}
+		success=false;
+		continue;
+		}
+	size_t prev=0;
+	for(size_t offset=tree->small_bins[bin]; offset; offset=mem_block_tree_node_get(offset)->next)
+		{
+		mem_block_info_t info;
+		if(!mem_block_get_info(heap, offset, &info)||!(info.flags&MEM_BLOCK_FLAG_FREE)||info.size!=bin*4||mem_block_tree_node_get(offset)->prev!=prev)
+			{
+			if(print_errors)
+				{
+				MULTI_HEAP_PRINTF("multi_heap_check(0x%x, 0x%x): tree bin offset invalid\n", heap, offset);
+				}
+			success=false;
+			break;
+			}
+		prev=offset;
+		}
+	}
+for(uint32_t index=0; index<MEM_BLOCK_TREE_COUNT; index++)
+	{
+	bool set=(tree->tree_map&(1U<<index))!=0;
+	if(set!=(tree->trees[index]!=0))
+		{
+		if(print_errors)
+			{
+			MULTI_HEAP_PRINTF("multi_heap_check(0x%x): tree %u mismatch\n", heap, index);
+			}
+		success=false;
+		continue;
+		}
+	if(!tree->trees[index])
+		continue;
+	if(!mem_block_tree_node_check(heap, tree->trees[index], 0, index, 0, print_errors))
+		success=false;
+	}
+return success;
+}
+
+void mem_block_tree_dump(multi_heap_handle_t heap, mem_block_tree_t* tree)
+{
+for(uint32_t bin=0; bin<MEM_BLOCK_TREE_SMALL_COUNT; bin++)
+	{
+	size_t offset=tree->small_bins[bin];
+	if(!offset)
+		continue;
+	MULTI_HEAP_PRINTF("\t%u:", bin*4);
+	for(; offset; offset=mem_block_tree_node_get(offset)->next)
+		MULTI_HEAP_PRINTF(" 0x%x", offset);
+	MULTI_HEAP_PRINTF("\n");
+	}
+for(uint32_t index=0; index<MEM_BLOCK_TREE_COUNT; index++)
+	{
+	if(tree->trees[index])
+		mem_block_tree_node_dump(heap, tree->trees[index]);
+	}
+}
+
+size_t mem_block_tree_get_index(size_t size)
+{
+return 31-__builtin_clz((uint32_t)size)-MEM_BLOCK_TREE_SMALL_SHIFT;
+}
+
+size_t mem_block_tree_get_largest(multi_heap_handle_t heap, mem_block_tree_t* tree)
+{
+if(tree->tree_map)
+	{
+	// The largest size is on the path of the upper children
+	size_t largest=0;
+	size_t offset=tree->trees[31-__builtin_clz(tree->tree_map)];
+	while(offset)
+		{
+		size_t size=mem_block_tree_node_get_size(offset);
+		if(size>largest)
+			largest=size;
+		mem_block_tree_node_t* node=mem_block_tree_node_get(offset);
+		offset=node->children[1]?node->children[1]:node->children[0];
+		}
+	return largest;
+	}
+for(uint32_t u=MEM_BLOCK_TREE_SMALL_COUNT/32; u>0; u--)
+	{
+	uint32_t map=tree->small_maps[u-1];
+	if(map)
+		return ((u-1)*32+31-__builtin_clz(map))*4;
+	}
+return 0;
+}
+
+size_t mem_block_tree_get_offset(multi_heap_handle_t heap, mem_block_tree_t* tree, size_t size)
+{
+uint32_t index=0;
+if(size<MEM_BLOCK_TREE_SMALL_SIZE)
+	{
+	// Bins hold the exact size, the next one set is the best fit
+	uint32_t bin=size/4;
+	for(uint32_t u=bin/32; u<MEM_BLOCK_TREE_SMALL_COUNT/32; u++)
+		{
+		uint32_t map=tree->small_maps[u];
+		if(u==bin/32)
+			map&=~0U<<(bin%32);
+		if(map)
+			return tree->small_bins[u*32+__builtin_ctz(map)];
+		}
+	}
+else
+	{
+	index=mem_block_tree_get_index(size);
+	}
+size_t best=0;
+size_t best_rest=SIZE_MAX;
+size_t offset=0;
+if(size>=MEM_BLOCK_TREE_SMALL_SIZE&&index<MEM_BLOCK_TREE_COUNT&&(tree->tree_map&(1U<<index)))
+	{
+	// Follow the size, upper subtrees passed on the way are larger
+	uint32_t bits=(uint32_t)size<<(32-index-MEM_BLOCK_TREE_SMALL_SHIFT);
+	size_t upper=0;
+	offset=tree->trees[index];
+	while(offset)
+		{
+		size_t node_size=mem_block_tree_node_get_size(offset);
+		if(node_size>=size&&node_size-size<best_rest)
+			{
+			best=offset;
+			best_rest=node_size-size;
+			if(!best_rest)
+				return best;
+			}
+		mem_block_tree_node_t* node=mem_block_tree_node_get(offset);
+		size_t child=node->children[bits>>31];
+		if(node->children[1]&&node->children[1]!=child)
+			upper=node->children[1];
+		bits<<=1;
+		offset=child;
+		}
+	offset=upper;
+	index++;
+	}
+if(!best&&!offset)
+	{
+	if(index>=MEM_BLOCK_TREE_COUNT)
+		return 0;
+	uint32_t map=tree->tree_map&(~0U<<index);
+	if(!map)
+		return 0;
+	offset=tree->trees[__builtin_ctz(map)];
+	}
+// The smallest size is on the path of the lower children
+while(offset)
+	{
+	size_t node_size=mem_block_tree_node_get_size(offset);
+	if(node_size>=size&&node_size-size<best_rest)
+		{
+		best=offset;
+		best_rest=node_size-size;
+		}
+	mem_block_tree_node_t* node=mem_block_tree_node_get(offset);
+	offset=node->children[0]?node->children[0]:node->children[1];
+	}
+return best;
+}
+
+
+// Modification
+
+bool mem_block_tree_add_offset(multi_heap_handle_t heap, mem_block_tree_t* tree, size_t size, size_t offset)
+{
+mem_block_tree_node_t* node=mem_block_tree_node_get(offset);
+node->next=0;
+node->prev=0;
+if(size<MEM_BLOCK_TREE_SMALL_SIZE)
+	{
+	uint32_t bin=size/4;
+	size_t next=tree->small_bins[bin];
+	node->next=next;
+	if(next)
+		mem_block_tree_node_get(next)->prev=offset;
+	tree->small_bins[bin]=offset;
+	tree->small_maps[bin/32]|=1U<<(bin%32);
+	return true;
+	}
+node->children[0]=0;
+node->children[1]=0;
+uint32_t index=mem_block_tree_get_index(size);
+if(!(tree->tree_map&(1U<<index)))
+	{
+	node->parent=0;
+	tree->trees[index]=offset;
+	tree->tree_map|=1U<<index;
+	return true;
+	}
+uint32_t bits=(uint32_t)size<<(32-index-MEM_BLOCK_TREE_SMALL_SHIFT);
+size_t current=tree->trees[index];
+while(1)
+	{
+	mem_block_tree_node_t* cur=mem_block_tree_node_get(current);
+	if(mem_block_tree_node_get_size(current)==size)
+		{
+		if(offset<current)
+			{
+			// Lowest address goes into the tree
+			mem_block_tree_replace_node(tree, current, offset);
+			node->next=current;
+			cur->prev=offset;
+			return true;
+			}
+		size_t prev=current;
+		while(mem_block_tree_node_get(prev)->next&&mem_block_tree_node_get(prev)->next<offset)
+			prev=mem_block_tree_node_get(prev)->next;
+		mem_block_tree_node_t* prev_node=mem_block_tree_node_get(prev);
+		node->next=prev_node->next;
+		node->prev=prev;
+		if(prev_node->next)
+			mem_block_tree_node_get(prev_node->next)->prev=offset;
+		prev_node->next=offset;
+		return true;
+		}
+	uint32_t side=bits>>31;
+	bits<<=1;
+	if(!cur->children[side])
+		{
+		cur->children[side]=offset;
+		node->parent=current;
+		return true;
+		}
+	current=cur->children[side];
+	}
+return false;
+}
+
+bool mem_block_tree_remove_offset(multi_heap_handle_t heap, mem_block_tree_t* tree, size_t size, size_t offset)
+{
+mem_block_tree_node_t* node=mem_block_tree_node_get(offset);
+size_t next=node->next;
+size_t prev=node->prev;
+if(prev)
+	{
+	mem_block_tree_node_t* prev_node=mem_block_tree_node_get(prev);
+	if(prev_node->next!=offset)
+		return false;
+	prev_node->next=next;
+	if(next)
+		mem_block_tree_node_get(next)->prev=prev;
+	return true;
+	}
+if(size<MEM_BLOCK_TREE_SMALL_SIZE)
+	{
+	uint32_t bin=size/4;
+	if(tree->small_bins[bin]!=offset)
+		return false;
+	tree->small_bins[bin]=next;
+	if(next)
+		{
+		mem_block_tree_node_get(next)->prev=0;
+		}
+	else
+		{
+		tree->small_maps[bin/32]&=~(1U<<(bin%32));
+		}
+	return true;
+	}
+uint32_t index=mem_block_tree_get_index(size);
+if(node->parent)
+	{
+	mem_block_tree_node_t* parent=mem_block_tree_node_get(node->parent);
+	if(parent->children[0]!=offset&&parent->children[1]!=offset)
+		return false;
+	}
+else if(tree->trees[index]!=offset)
+	{
+	return false;
+	}
+size_t replace=next;
+if(replace)
+	{
+	mem_block_tree_node_get(replace)->prev=0;
+	}
+else
+	{
+	// Move a leaf of the subtree up
+	replace=node->children[1]?node->children[1]:node->children[0];
+	if(replace)
+		{
+		while(1)
+			{
+			mem_block_tree_node_t* leaf=mem_block_tree_node_get(replace);
+			size_t child=leaf->children[1]?leaf->children[1]:leaf->children[0];
+			if(!child)
+				break;
+			replace=child;
+			}
+		mem_block_tree_node_t* parent=mem_block_tree_node_get(mem_block_tree_node_get(replace)->parent);
+		parent->children[parent->children[0]==replace?0:1]=0;
+		}
+	}
+mem_block_tree_replace_node(tree, offset, replace);
+if(!tree->trees[index])
+	tree->tree_map&=~(1U<<index);
+return true;
+}
+
+void mem_block_tree_replace_node(mem_block_tree_t* tree, size_t offset, size_t replace)
+{
+mem_block_tree_node_t* node=mem_block_tree_node_get(offset);
+if(replace)
+	{
+	mem_block_tree_node_t* replace_node=mem_block_tree_node_get(replace);
+	replace_node->parent=node->parent;
+	for(uint32_t u=0; u<2; u++)
+		{
+		size_t child=node->children[u];
+		replace_node->children[u]=child;
+		if(child)
+			mem_block_tree_node_get(child)->parent=replace;
+		}
+	}
+if(node->parent)
+	{
+	mem_block_tree_node_t* parent=mem_block_tree_node_get(node->parent);
+	parent->children[parent->children[0]==offset?0:1]=replace;
+	}
+else
+	{
+	tree->trees[mem_block_tree_get_index(mem_block_tree_node_get_size(offset))]=replace;
+	}
+}
@@ -0,0 +1,81 @@
+//==================
+// mem_block_tree.h
+//==================
+
+// Free memory-blocks in bins and size-trees, linked inside the free blocks
+
+// Copyright 2021, Sven Bieg (svenbieg@web.de)
+// http://github.com/svenbieg/esp32-heap
+
+#pragma once
+
+
+//=======
+// Using
+//=======
+
+#include <multi_heap.h>
+#include "multi_heap_platform.h"
+
+
+//==========
+// Settings
+//==========
+
+// Smaller blocks are kept in bins of the exact size
+#define MEM_BLOCK_TREE_SMALL_SHIFT 8
+#define MEM_BLOCK_TREE_SMALL_SIZE ((size_t)1<<MEM_BLOCK_TREE_SMALL_SHIFT)
+#define MEM_BLOCK_TREE_SMALL_COUNT (MEM_BLOCK_TREE_SMALL_SIZE/4)
+
+// Larger blocks are kept in one tree per power of two
+#define MEM_BLOCK_TREE_COUNT (32-MEM_BLOCK_TREE_SMALL_SHIFT)
+
+
+//======
+// Node
+//======
+
+// Blocks of the same size are chained by address, the first one is in the tree.
+// Chained blocks have a previous offset, blocks in bins only use the chain.
+
+typedef struct
+{
+size_t next;
+size_t prev;
+size_t children[2];
+size_t parent;
+}mem_block_tree_node_t;
+
+// Access
+bool mem_block_tree_node_check(multi_heap_handle_t heap, size_t offset, size_t parent, uint32_t index, uint32_t level, bool print_errors);
+void mem_block_tree_node_dump(multi_heap_handle_t heap, size_t offset);
+mem_block_tree_node_t* mem_block_tree_node_get(size_t offset);
+size_t mem_block_tree_node_get_size(size_t offset);
+
+
+//======
+// Tree
+//======
+
+typedef struct
+{
+uint32_t small_maps[MEM_BLOCK_TREE_SMALL_COUNT/32];
+uint32_t tree_map;
+size_t small_bins[MEM_BLOCK_TREE_SMALL_COUNT];
+size_t trees[MEM_BLOCK_TREE_COUNT];
+}mem_block_tree_t;
+
+// Con-/Destructors
+void mem_block_tree_init(mem_block_tree_t* tree);
+
+// Access
+bool mem_block_tree_check(multi_heap_handle_t heap, mem_block_tree_t* tree, bool print_errors);
+void mem_block_tree_dump(multi_heap_handle_t heap, mem_block_tree_t* tree);
+size_t mem_block_tree_get_index(size_t size);
+size_t mem_block_tree_get_largest(multi_heap_handle_t heap, mem_block_tree_t* tree);
+size_t mem_block_tree_get_offset(multi_heap_handle_t heap, mem_block_tree_t* tree, size_t size);
+
+// Modification
+bool mem_block_tree_add_offset(multi_heap_handle_t heap, mem_block_tree_t* tree, size_t size, size_t offset);
+bool mem_block_tree_remove_offset(multi_heap_handle_t heap, mem_block_tree_t* tree, size_t size, size_t offset);
+void mem_block_tree_replace_node(mem_block_tree_t* tree, size_t offset, size_t replace);
@@ -32,50 +32,533 @@
 // Private
 //=========
 
-// Remove offset from buffer or map
-void multi_heap_remove_offset(multi_heap_handle_t heap, mem_block_info_t* info)
+#ifdef MULTI_HEAP_COST_COUNTER
+uint32_t multi_heap_cost=0;
+#endif
+
+// Link to the next offset in buffer, stored in the free block
+size_t* multi_heap_get_next_offset(size_t offset)
+{
+return (size_t*)mem_block_get_pointer(offset);
+}
+
+// Get quick-bin of a block size
+int32_t multi_heap_get_quick_bin(size_t size)
 {
-size_t* offsets=heap->free_offsets;
-uint32_t count=heap->free_offset_count;
-for(uint32_t pos=0; pos<count; pos++)
+#ifdef CONFIG_HEAP_QUICK_BINS
+if(size<MULTI_HEAP_QUICK_BIN_MIN)
+	return -1;
+size_t bin=(size-MULTI_HEAP_QUICK_BIN_MIN)/MULTI_HEAP_QUICK_BIN_STEP;
+if(bin>=CONFIG_HEAP_QUICK_BIN_COUNT)
+	return -1;
+return (int32_t)bin;
+#else
+return -1;
+#endif
+}
+
+// Add free block to its quick-bin
+bool multi_heap_add_quick_bin(multi_heap_handle_t heap, size_t offset, size_t size)
+{
+#ifdef CONFIG_HEAP_QUICK_BINS
+int32_t bin=multi_heap_get_quick_bin(size);
+if(bin<0)
+	return false;
+// Free blocks hold the next offset and the link pointing to them
+size_t* links=(size_t*)mem_block_get_pointer(offset);
+size_t next=heap->quick_bins[bin];
+links[0]=next;
+links[1]=(size_t)&heap->quick_bins[bin];
+if(next)
 	{
-	if(offsets[pos]!=info->pos)
-		continue;
-	for(uint32_t u=pos; u+1<count; u++)
-		offsets[u]=offsets[u+1];
-	heap->free_offset_count--;
-	return;
+	size_t* next_links=(size_t*)mem_block_get_pointer(next);
+	next_links[1]=(size_t)&links[0];
 	}
-mem_block_map_remove_offset(heap, &heap->map_free, info->size, info->pos);
+heap->quick_bins[bin]=offset;
+return true;
+#else
+return false;
+#endif
 }
 
-// Add free offset to buffer
-void multi_heap_free_private(multi_heap_handle_t heap, size_t offset)
+// Mark free block as not binned before adding it to the map
+void multi_heap_clear_quick_bin(size_t offset, size_t size)
+{
+if(multi_heap_get_quick_bin(size)<0)
+	return;
+size_t* links=(size_t*)mem_block_get_pointer(offset);
+links[1]=0;
+}
+
+// Remove free block from its quick-bin
+bool multi_heap_remove_quick_bin(size_t offset, size_t size)
 {
-uint32_t count=heap->free_offset_count;
-if(count==CONFIG_HEAP_MAX_OFFSETS)
+if(multi_heap_get_quick_bin(size)<0)
+	return false;
+size_t* links=(size_t*)mem_block_get_pointer(offset);
+size_t* link=(size_t*)links[1];
+if(!link)
+	return false;
+*link=links[0];
+if(links[0])
 	{
-	MULTI_HEAP_PRINTF("CONFIG_HEAP_MAX_OFFSETS\n");
-	heap->flags|=MULTI_HEAP_FLAG_DIRTY;
+	size_t* next_links=(size_t*)mem_block_get_pointer(links[0]);
+	next_links[1]=(size_t)link;
+	}
+links[1]=0;
+return true;
+}
+
+// Get range of a free block size in the histogram
+uint32_t multi_heap_get_histogram_slot(size_t size)
+{
+if(size>UINT32_MAX)
+	return MULTI_HEAP_HISTOGRAM_SIZE-1;
+return 31-__builtin_clz((uint32_t)size);
+}
+
+#if defined(CONFIG_HEAP_LOCK_STATS)||defined(CONFIG_HEAP_OP_STATS)
+
+// Get range of a time in the histogram, zero is counted with one
+uint32_t multi_heap_get_time_slot(uint32_t time)
+{
+return time? 31-__builtin_clz(time): 0;
+}
+
+#endif
+
+#ifdef CONFIG_HEAP_LOCK_STATS
+
+// Count a time of the lock
+void multi_heap_lock_stats_add(uint32_t* histogram, uint64_t* total, uint32_t* max, uint32_t time)
+{
+histogram[multi_heap_get_time_slot(time)]++;
+*total+=time;
+if(time>*max)
+	*max=time;
+}
+
+// Lock the heap, only the outermost acquisition is counted
+void multi_heap_lock_acquire(multi_heap_handle_t heap)
+{
+// The owner is read before spinning, it's only used for the statistics
+bool busy=heap->lock&&MULTI_HEAP_LOCK_BUSY(heap->lock);
+uint32_t start=MULTI_HEAP_TIME();
+MULTI_HEAP_LOCK(heap->lock);
+uint32_t time=MULTI_HEAP_TIME();
+if(heap->lock_depth++>0)
 	return;
+multi_heap_lock_stats_t* stats=&heap->lock_stats;
+stats->acquisitions++;
+if(busy)
+	stats->contended++;
+multi_heap_lock_stats_add(stats->wait_times, &stats->total_wait_time, &stats->max_wait_time, time-start);
+heap->lock_time=time;
+}
+
+// Unlock the heap, the hold time is counted when the outermost lock is released
+void multi_heap_lock_release(multi_heap_handle_t heap)
+{
+if(--heap->lock_depth==0)
+	{
+	multi_heap_lock_stats_t* stats=&heap->lock_stats;
+	uint32_t time=MULTI_HEAP_TIME();
+	multi_heap_lock_stats_add(stats->hold_times, &stats->total_hold_time, &stats->max_hold_time, time-heap->lock_time);
 	}
-size_t* offsets=heap->free_offsets;
-uint32_t pos=0;
-for(; pos<count; pos++)
+MULTI_HEAP_UNLOCK(heap->lock);
+}
+
+#endif
+
+#ifdef CONFIG_HEAP_OP_STATS
+
+// Count the time of a public operation, the slowest call is kept with its caller
+void multi_heap_op_stats_add(multi_heap_handle_t heap, multi_heap_op_t op, uint32_t start, size_t size, void* caller)
+{
+uint32_t time=MULTI_HEAP_TIME()-start;
+multi_heap_op_stats_t* stats=&heap->op_stats[op];
+stats->count++;
+stats->total_time+=time;
+stats->times[multi_heap_get_time_slot(time)]++;
+if(time<stats->max_time)
+	return;
+stats->max_time=time;
+stats->max_size=size;
+stats->max_caller=caller;
+}
+
+#endif
+
+#if !defined(CONFIG_HEAP_INDEX_TLSF)&&!defined(CONFIG_HEAP_INDEX_TREE)
+// Keep group for the map, the first word links the spare groups
+void multi_heap_push_spare(multi_heap_handle_t heap, void* group)
+{
+*(void**)group=heap->spare_groups;
+heap->spare_groups=group;
+heap->spare_count++;
+}
+#endif
+
+// Add free block to the index
+bool multi_heap_add_free_offset(multi_heap_handle_t heap, size_t size, size_t offset)
+{
+MULTI_HEAP_COST(1);
+if(size>heap->largest_free)
+	heap->largest_free=size;
+heap->free_histogram[multi_heap_get_histogram_slot(size)]++;
+#if defined(CONFIG_HEAP_INDEX_TLSF)
+return mem_block_tlsf_add_offset(heap, &heap->tlsf_free, size, offset);
+#elif defined(CONFIG_HEAP_INDEX_TREE)
+return mem_block_tree_add_offset(heap, &heap->tree_free, size, offset);
+#else
+// The map is locked, its groups are not taken from it
+heap->flags|=MULTI_HEAP_FLAG_INDEX;
+bool added=mem_block_map_add_offset(heap, &heap->map_free, size, offset);
+heap->flags&=~MULTI_HEAP_FLAG_INDEX;
+if(added)
+	return true;
+// The map couldn't grow, groups are taken from it while it's unlocked and the block is added again
+// Groups freed by a failed try are kept for the next one, that gets one more
+heap->flags|=MULTI_HEAP_FLAG_SPARE;
+for(uint32_t count=1; !added&&count<=CONFIG_HEAP_MAP_MAX_LEVELS; count++)
 	{
-	if(offset>offsets[pos])
+	while(heap->spare_count<count)
 		{
-		for(uint32_t u=count; u>pos; u--)
-			offsets[u]=offsets[u-1];
-		offsets[pos]=offset;
+		void* group=multi_heap_malloc_internal(heap, MULTI_HEAP_GROUP_MAX_SIZE);
+		if(!group)
+			break;
+		multi_heap_push_spare(heap, group);
+		}
+	if(heap->spare_count<count)
 		break;
+	heap->flags&=~MULTI_HEAP_FLAG_SPARE_EMPTY;
+	heap->flags|=MULTI_HEAP_FLAG_INDEX;
+	added=mem_block_map_add_offset(heap, &heap->map_free, size, offset);
+	heap->flags&=~MULTI_HEAP_FLAG_INDEX;
+	// It failed for another reason if there were groups left
+	if(!(heap->flags&MULTI_HEAP_FLAG_SPARE_EMPTY))
+		break;
+	}
+heap->flags&=~(MULTI_HEAP_FLAG_SPARE|MULTI_HEAP_FLAG_SPARE_EMPTY);
+// Groups left are kept for the next growth of the map, freed they would be taken from it again
+while(heap->spare_count>CONFIG_HEAP_MAP_MAX_LEVELS)
+	{
+	void* group=heap->spare_groups;
+	heap->spare_groups=*(void**)group;
+	heap->spare_count--;
+	multi_heap_free_internal(heap, group);
+	}
+if(!added)
+	heap->free_histogram[multi_heap_get_histogram_slot(size)]--;
+return added;
+#endif
+}
+
+// Remove free block from the index, the largest size is looked up again if it's removed
+bool multi_heap_remove_free_offset(multi_heap_handle_t heap, size_t size, size_t offset)
+{
+MULTI_HEAP_COST(1);
+if(size==heap->largest_free)
+	heap->flags|=MULTI_HEAP_FLAG_LARGEST;
+heap->free_histogram[multi_heap_get_histogram_slot(size)]--;
+#if defined(CONFIG_HEAP_INDEX_TLSF)
+return mem_block_tlsf_remove_offset(heap, &heap->tlsf_free, size, offset);
+#elif defined(CONFIG_HEAP_INDEX_TREE)
+return mem_block_tree_remove_offset(heap, &heap->tree_free, size, offset);
+#else
+return mem_block_map_remove_offset(heap, &heap->map_free, size, offset);
+#endif
+}
+
+// Find free block of the exact size or at least the over-size
+bool multi_heap_find_free_offset(multi_heap_handle_t heap, size_t size, size_t over_size, mem_block_info_t* info)
+{
+MULTI_HEAP_COST(1);
+#if defined(CONFIG_HEAP_INDEX_TLSF)
+// Good fit from the bitmaps, the rest can be smaller than the over-size
+size_t offset=mem_block_tlsf_get_offset(heap, &heap->tlsf_free, size);
+if(!offset)
+	return false;
+return mem_block_get_info(heap, offset, info);
+#elif defined(CONFIG_HEAP_INDEX_TREE)
+// Best fit, the rest can be smaller than the over-size
+size_t offset=mem_block_tree_get_offset(heap, &heap->tree_free, size);
+if(!offset)
+	return false;
+return mem_block_get_info(heap, offset, info);
+#else
+mem_block_map_it_t it;
+mem_block_map_it_init(&it, &heap->map_free);
+if(size==over_size||!mem_block_map_it_find(&it, size))
+	{
+	mem_block_map_it_find(&it, over_size);
+	if(!it.current)
+		return false;
+	if(mem_block_map_item_get_size(it.current)<over_size)
+		mem_block_map_it_move_next(&it);
+	if(!it.current)
+		return false;
+	}
+info->flags=MEM_BLOCK_FLAG_FREE;
+info->pos=mem_block_map_item_get_offset(heap, it.current);
+info->size=mem_block_map_item_get_size(it.current);
+return true;
+#endif
+}
+
+// Get size of the largest free block in the index
+size_t multi_heap_get_largest_free(multi_heap_handle_t heap)
+{
+#if defined(CONFIG_HEAP_INDEX_TLSF)
+return mem_block_tlsf_get_largest(heap, &heap->tlsf_free);
+#elif defined(CONFIG_HEAP_INDEX_TREE)
+return mem_block_tree_get_largest(heap, &heap->tree_free);
+#else
+size_t item_count=mem_block_map_get_item_count(&heap->map_free);
+mem_block_map_item_t* last=mem_block_map_get_item_at(&heap->map_free, item_count-1);
+if(!last)
+	return 0;
+return mem_block_map_item_get_size(last);
+#endif
+}
+
+// Get the bytes at the end of the heap an allocation has to leave, critical allocations may use their own
+size_t multi_heap_get_reserve(multi_heap_handle_t heap)
+{
+if(heap->flags&MULTI_HEAP_FLAG_CRITICAL)
+	return heap->meta_reserve;
+return heap->meta_reserve+heap->critical_reserve;
+}
+
+// Check if a block can be taken from the end of the heap without using the reserve
+bool multi_heap_check_reserve(multi_heap_handle_t heap, size_t size)
+{
+size_t top=heap->total_size-heap->size;
+if(top<size+multi_heap_get_reserve(heap))
+	{
+	if(top>=size)
+		heap->reserve_refusals++;
+	return false;
+	}
+if(top<size+heap->meta_reserve+heap->critical_reserve)
+	heap->reserve_allocations++;
+return true;
+}
+
+// Get size of the largest free block including the end of the heap, look it up if it was removed
+size_t multi_heap_get_largest_block(multi_heap_handle_t heap)
+{
+if(heap->flags&MULTI_HEAP_FLAG_LARGEST)
+	{
+	heap->largest_free=multi_heap_get_largest_free(heap);
+	heap->flags&=~MULTI_HEAP_FLAG_LARGEST;
+	}
+size_t largest=heap->total_size-heap->size;
+if(heap->largest_free>largest)
+	largest=heap->largest_free;
+return largest;
+}
+
+// Add free offset to the list in buffer, sorted from top to bottom
+void multi_heap_chain_offset(multi_heap_handle_t heap, size_t offset)
+{
+size_t* link=&heap->free_offset;
+while(*link>offset)
+	{
+	MULTI_HEAP_COST(1);
+	link=multi_heap_get_next_offset(*link);
+	}
+*multi_heap_get_next_offset(offset)=*link;
+*link=offset;
+}
+
+// Remove offset from buffer or map, returns true if it was in the buffer
+bool multi_heap_remove_offset(multi_heap_handle_t heap, mem_block_info_t* info)
+{
+if(multi_heap_remove_quick_bin(info->pos, info->size))
+	{
+	heap->free_offset_count--;
+	return true;
+	}
+size_t* link=&heap->free_offset;
+while(*link)
+	{
+	MULTI_HEAP_COST(1);
+	if(*link!=info->pos)
+		{
+		link=multi_heap_get_next_offset(*link);
+		continue;
 		}
+	*link=*multi_heap_get_next_offset(info->pos);
+	heap->free_offset_count--;
+	return true;
 	}
-if(pos==count)
-	offsets[count]=offset;
+multi_heap_remove_free_offset(heap, info->size, info->pos);
+return false;
+}
+
+// Add free offset to buffer
+void multi_heap_free_private(multi_heap_handle_t heap, size_t offset)
+{
+mem_block_info_t info;
+if(!mem_block_get_info(heap, offset, &info)||!multi_heap_add_quick_bin(heap, offset, info.size))
+	multi_heap_chain_offset(heap, offset);
 heap->free_offset_count++;
 }
 
+// Get size class of an allocated block
+bool multi_heap_get_class(multi_heap_handle_t heap, void* p, mem_block_info_t* info, size_t* cls)
+{
+#ifdef CONFIG_HEAP_SIZE_CLASSES
+size_t offset=mem_block_get_offset(p);
+if(mem_block_get_pointer(offset)!=p)
+	return false;
+if(!mem_block_get_info(heap, offset, info))
+	return false;
+if(info->flags&MEM_BLOCK_FLAG_FREE)
+	return false;
+size_t size=mem_block_calc_data_size(info->size);
+if(size<CONFIG_HEAP_SIZE_CLASS_STEP||size>CONFIG_HEAP_SIZE_CLASS_MAX)
+	return false;
+*cls=size/CONFIG_HEAP_SIZE_CLASS_STEP-1;
+return true;
+#else
+return false;
+#endif
+}
+
+// Add small block to its size class
+bool multi_heap_free_class(multi_heap_handle_t heap, void* p)
+{
+#ifdef CONFIG_HEAP_SIZE_CLASSES
+mem_block_info_t info;
+size_t cls=0;
+if(!multi_heap_get_class(heap, p, &info, &cls))
+	return false;
+if(heap->class_counts[cls]==CONFIG_HEAP_SIZE_CLASS_BLOCKS)
+	return false;
+// The header is kept, the next allocation may be untagged
+mem_block_set_tag(p, 0);
+*(void**)p=heap->class_blocks[cls];
+heap->class_blocks[cls]=p;
+heap->class_counts[cls]++;
+heap->free_bytes+=info.size;
+heap->allocated_blocks--;
+heap->free_blocks++;
+return true;
+#else
+return false;
+#endif
+}
+
+// Initialize aligned block in free space
+void* multi_heap_aligned_alloc_block(multi_heap_handle_t heap, size_t free_pos, size_t free_size, size_t block_size, size_t alignment)
+{
+size_t min_size=mem_block_calc_size(1);
+size_t ptr=(size_t)mem_block_get_pointer(free_pos);
+size_t lead=multi_heap_align_up(ptr, alignment)-ptr;
+if(lead>=min_size)
+	{
+	mem_block_init(heap, free_pos, lead, MEM_BLOCK_FLAG_FREE);
+	multi_heap_free_private(heap, free_pos);
+	heap->free_blocks++;
+	heap->total_blocks++;
+	free_pos+=lead;
+	free_size-=lead;
+	lead=0;
+	}
+block_size+=lead;
+size_t rest_size=free_size-block_size;
+if(rest_size<min_size)
+	{
+	block_size=free_size;
+	rest_size=0;
+	}
+void* p=mem_block_init_aligned(heap, free_pos, block_size, alignment);
+if(rest_size)
+	{
+	size_t rest_pos=free_pos+block_size;
+	mem_block_init(heap, rest_pos, rest_size, MEM_BLOCK_FLAG_FREE);
+	multi_heap_free_private(heap, rest_pos);
+	heap->free_blocks++;
+	heap->total_blocks++;
+	}
+heap->free_bytes-=block_size;
+if(heap->free_bytes<heap->minimum_free_bytes)
+	heap->minimum_free_bytes=heap->free_bytes;
+heap->allocated_blocks++;
+heap->total_blocks++;
+return p;
+}
+
+// Allocate aligned block at the end of the heap
+void* multi_heap_aligned_alloc_direct(multi_heap_handle_t heap, size_t block_size, size_t alignment)
+{
+size_t heap_start=(size_t)heap+sizeof(multi_heap_t);
+size_t heap_end=heap_start+heap->size;
+size_t ptr=(size_t)mem_block_get_pointer(heap_end);
+size_t lead=multi_heap_align_up(ptr, alignment)-ptr;
+if(heap->total_size-heap->size<lead+block_size)
+	return NULL;
+heap->size+=lead+block_size;
+if(lead>=mem_block_calc_size(1))
+	{
+	mem_block_init(heap, heap_end, lead, MEM_BLOCK_FLAG_FREE);
+	multi_heap_free_private(heap, heap_end);
+	heap->free_blocks++;
+	heap->total_blocks++;
+	heap_end+=lead;
+	lead=0;
+	}
+block_size+=lead;
+void* p=mem_block_init_aligned(heap, heap_end, block_size, alignment);
+heap->free_bytes-=block_size;
+if(heap->free_bytes<heap->minimum_free_bytes)
+	heap->minimum_free_bytes=heap->free_bytes;
+heap->allocated_blocks++;
+heap->total_blocks++;
+return p;
+}
+
+// Allocate aligned block from map
+void* multi_heap_aligned_alloc_fit(multi_heap_handle_t heap, size_t block_size, size_t alignment)
+{
+// Big enough for any padding, blocks are aligned to a word
+size_t over_size=block_size+alignment-MEM_BLOCK_ALIGN;
+mem_block_info_t info;
+if(!multi_heap_find_free_offset(heap, over_size, over_size, &info))
+	return NULL;
+multi_heap_remove_free_offset(heap, info.size, info.pos);
+heap->free_blocks--;
+heap->total_blocks--;
+return multi_heap_aligned_alloc_block(heap, info.pos, info.size, block_size, alignment);
+}
+
+// Allocate block from size class
+void* multi_heap_malloc_class(multi_heap_handle_t heap, size_t size)
+{
+#ifdef CONFIG_HEAP_SIZE_CLASSES
+if(size>CONFIG_HEAP_SIZE_CLASS_MAX)
+	return NULL;
+size_t cls=(size-1)/CONFIG_HEAP_SIZE_CLASS_STEP;
+void* p=heap->class_blocks[cls];
+if(!p)
+	return NULL;
+heap->class_blocks[cls]=*(void**)p;
+heap->class_counts[cls]--;
+mem_block_info_t info;
+mem_block_get_info(heap, mem_block_get_offset(p), &info);
+heap->free_bytes-=info.size;
+if(heap->free_bytes<heap->minimum_free_bytes)
+	heap->minimum_free_bytes=heap->free_bytes;
+heap->allocated_blocks++;
+heap->free_blocks--;
+return p;
+#else
+return NULL;
+#endif
+}
+
 // Allocate block at the end of the heap
 void* multi_heap_malloc_direct(multi_heap_handle_t heap, size_t block_size)
 {
@@ -93,56 +576,117 @@ heap->total_blocks++;
 return p;
 }
 
-// Allocate free block from map
+// Allocate free block from the index
 void* multi_heap_malloc_fit(multi_heap_handle_t heap, size_t block_size)
 {
-mem_block_map_it_t it;
-mem_block_map_it_init(&it, &heap->map_free);
-if(mem_block_map_it_find(&it, block_size))
+size_t min_size=mem_block_calc_size(1);
+mem_block_info_t info;
+if(!multi_heap_find_free_offset(heap, block_size, block_size+min_size, &info))
+	return NULL;
+multi_heap_remove_free_offset(heap, info.size, info.pos);
+size_t rest_size=info.size-block_size;
+if(rest_size<min_size)
+	{
+	block_size=info.size;
+	rest_size=0;
+	}
+void* p=mem_block_init(heap, info.pos, block_size, 0);
+if(rest_size)
+	{
+	size_t rest_pos=info.pos+block_size;
+	mem_block_init(heap, rest_pos, rest_size, MEM_BLOCK_FLAG_FREE);
+	multi_heap_free_private(heap, rest_pos);
+	heap->total_blocks++;
+	}
+else
 	{
-	size_t free_pos=mem_block_map_item_get_offset(it.current);
-	mem_block_map_remove_offset(heap, &heap->map_free, block_size, free_pos);
-	void* p=mem_block_init(heap, free_pos, block_size, 0);
-	heap->free_bytes-=block_size;
-	if(heap->free_bytes<heap->minimum_free_bytes)
-		heap->minimum_free_bytes=heap->free_bytes;
-	heap->allocated_blocks++;
 	heap->free_blocks--;
-	return p;
 	}
-size_t over_size=block_size+mem_block_calc_size(1);
-mem_block_map_it_find(&it, over_size);
-if(!it.current)
-	return NULL;
-if(it.current->size<over_size)
-	mem_block_map_it_move_next(&it);
-if(!it.current)
-	return NULL;
-size_t free_pos=mem_block_map_item_get_offset(it.current);
-size_t free_size=it.current->size;
-mem_block_map_remove_offset(heap, &heap->map_free, free_size, free_pos);
-void* p=mem_block_init(heap, free_pos, block_size, 0);
-size_t rest_pos=free_pos+block_size;
-size_t rest_size=free_size-block_size;
-mem_block_init(heap, rest_pos, rest_size, MEM_BLOCK_FLAG_FREE);
-multi_heap_free_private(heap, rest_pos);
 heap->free_bytes-=block_size;
 if(heap->free_bytes<heap->minimum_free_bytes)
 	heap->minimum_free_bytes=heap->free_bytes;
 heap->allocated_blocks++;
-heap->total_blocks++;
 return p;
 }
 
+// Split free block from buffer, the index is not used while it's modified
+void* multi_heap_malloc_split(multi_heap_handle_t heap, size_t block_size)
+{
+size_t min_size=mem_block_calc_size(1);
+size_t count=0;
+for(size_t offset=heap->free_offset; offset; offset=*multi_heap_get_next_offset(offset))
+	{
+	MULTI_HEAP_COST(1);
+	if(heap->work_budget&&count++==heap->work_budget)
+		break;
+	mem_block_info_t info;
+	if(!mem_block_get_info(heap, offset, &info))
+		continue;
+	if(info.size<block_size)
+		continue;
+	multi_heap_remove_offset(heap, &info);
+	size_t rest_size=info.size-block_size;
+	if(rest_size<min_size)
+		{
+		block_size=info.size;
+		rest_size=0;
+		}
+	void* p=mem_block_init(heap, info.pos, block_size, 0);
+	if(rest_size)
+		{
+		size_t rest_pos=info.pos+block_size;
+		mem_block_init(heap, rest_pos, rest_size, MEM_BLOCK_FLAG_FREE);
+		multi_heap_free_private(heap, rest_pos);
+		heap->total_blocks++;
+		}
+	else
+		{
+		heap->free_blocks--;
+		}
+	heap->free_bytes-=block_size;
+	if(heap->free_bytes<heap->minimum_free_bytes)
+		heap->minimum_free_bytes=heap->free_bytes;
+	heap->allocated_blocks++;
+	return p;
+	}
+return NULL;
+}
+
 // Allocate free block from buffer
 void* multi_heap_malloc_private(multi_heap_handle_t heap, size_t block_size)
 {
-uint32_t count=heap->free_offset_count;
-size_t* offsets=heap->free_offsets;
-for(uint32_t pos=count; pos>0; pos--)
+#ifdef CONFIG_HEAP_QUICK_BINS
+int32_t bin=multi_heap_get_quick_bin(block_size);
+if(bin>=0)
+	{
+	size_t offset=heap->quick_bins[bin];
+	if(!offset)
+		{
+		heap->quick_bin_misses++;
+		return NULL;
+		}
+	heap->quick_bin_hits++;
+	multi_heap_remove_quick_bin(offset, block_size);
+	heap->free_offset_count--;
+	void* p=mem_block_init(heap, offset, block_size, 0);
+	heap->free_bytes-=block_size;
+	if(heap->free_bytes<heap->minimum_free_bytes)
+		heap->minimum_free_bytes=heap->free_bytes;
+	heap->allocated_blocks++;
+	heap->free_blocks--;
+	return p;
+	}
+heap->quick_bin_misses++;
+#endif
+// With a work budget only the first blocks are searched
+size_t count=0;
+for(size_t offset=heap->free_offset; offset; offset=*multi_heap_get_next_offset(offset))
 	{
+	MULTI_HEAP_COST(1);
+	if(heap->work_budget&&count++==heap->work_budget)
+		break;
 	mem_block_info_t info;
-	if(!mem_block_get_info(heap, offsets[pos-1], &info))
+	if(!mem_block_get_info(heap, offset, &info))
 		continue;
 	if(info.size!=block_size)
 		continue;
@@ -158,81 +702,762 @@ for(uint32_t pos=count; pos>0; pos--)
 return NULL;
 }
 
-// Add free offsets from buffer to map
-void multi_heap_update_map(multi_heap_handle_t heap)
+// Resize block in place using the next free block or the end of the heap
+bool multi_heap_realloc_private(multi_heap_handle_t heap, mem_block_neighbours_t* info, size_t block_size)
 {
-// Copy free offsets from buffer
-size_t offsets[CONFIG_HEAP_MAX_OFFSETS];
-size_t count=heap->free_offset_count;
-for(uint32_t pos=0; pos<count; pos++)
-	offsets[pos]=heap->free_offsets[pos];
-heap->free_offset_count=0;
+size_t cur_pos=info->cur.pos;
+size_t cur_size=info->cur.size;
+size_t min_size=mem_block_calc_size(1);
+if(block_size<=cur_size&&cur_size-block_size<min_size)
+	return true;
 size_t heap_start=(size_t)heap+sizeof(multi_heap_t);
-for(uint32_t pos=0; pos<count; pos++)
+size_t heap_end=heap_start+heap->size;
+size_t free_size=0;
+if(info->next.flags&MEM_BLOCK_FLAG_FREE)
+	free_size=info->next.size;
+bool top=(cur_pos+cur_size+free_size==heap_end);
+size_t available=cur_size+free_size;
+if(top)
+	{
+	// The reserve is kept at the end of the heap
+	size_t reserve=multi_heap_get_reserve(heap);
+	if(heap->total_size-heap->size>reserve)
+		available+=heap->total_size-heap->size-reserve;
+	}
+if(block_size>available)
+	return false;
+if(free_size)
+	{
+	multi_heap_remove_offset(heap, &info->next);
+	heap->free_blocks--;
+	heap->total_blocks--;
+	}
+if(top)
+	{
+	heap->size=cur_pos+block_size-heap_start;
+	mem_block_init(heap, cur_pos, block_size, 0);
+	}
+else
 	{
-	if(offsets[pos]==0)
+	size_t rest_size=available-block_size;
+	if(rest_size<min_size)
+		{
+		block_size=available;
+		rest_size=0;
+		}
+	mem_block_init(heap, cur_pos, block_size, 0);
+	if(rest_size)
+		{
+		size_t rest_pos=cur_pos+block_size;
+		mem_block_init(heap, rest_pos, rest_size, MEM_BLOCK_FLAG_FREE);
+		multi_heap_free_private(heap, rest_pos);
+		heap->free_blocks++;
+		heap->total_blocks++;
+		}
+	}
+heap->free_bytes=heap->free_bytes+cur_size-block_size;
+if(heap->free_bytes<heap->minimum_free_bytes)
+	heap->minimum_free_bytes=heap->free_bytes;
+return true;
+}
+
+// Get free mask of an arena chunk, chunks are counted from the top
+size_t* multi_heap_get_arena_chunk(multi_heap_handle_t heap, size_t chunk)
+{
+#ifdef CONFIG_HEAP_NODE_ARENA
+size_t heap_start=(size_t)heap+sizeof(multi_heap_t);
+size_t arena_end=heap_start+heap->total_size+heap->arena_chunks*MULTI_HEAP_ARENA_CHUNK_SIZE;
+return (size_t*)(arena_end-(chunk+1)*MULTI_HEAP_ARENA_CHUNK_SIZE);
+#else
+return NULL;
+#endif
+}
+
+// Take slot from the arena, grow it into the end of the heap
+void* multi_heap_malloc_slot(multi_heap_handle_t heap)
+{
+#ifdef CONFIG_HEAP_NODE_ARENA
+for(size_t chunk=0; chunk<heap->arena_chunks; chunk++)
+	{
+	size_t* mask=multi_heap_get_arena_chunk(heap, chunk);
+	if(!*mask)
 		continue;
+	size_t slot=0;
+	while(!(*mask&((size_t)1<<slot)))
+		slot++;
+	*mask&=~((size_t)1<<slot);
+	return (void*)((size_t)&mask[1]+slot*MULTI_HEAP_ARENA_SLOT_SIZE);
+	}
+if(heap->total_size-heap->size<MULTI_HEAP_ARENA_CHUNK_SIZE)
+	return NULL;
+heap->total_size-=MULTI_HEAP_ARENA_CHUNK_SIZE;
+heap->free_bytes-=MULTI_HEAP_ARENA_CHUNK_SIZE;
+if(heap->free_bytes<heap->minimum_free_bytes)
+	heap->minimum_free_bytes=heap->free_bytes;
+heap->arena_chunks++;
+size_t* mask=multi_heap_get_arena_chunk(heap, heap->arena_chunks-1);
+*mask=MULTI_HEAP_ARENA_FREE&~(size_t)1;
+return &mask[1];
+#else
+return NULL;
+#endif
+}
+
+// Give slot back to the arena, release free chunks at the bottom
+bool multi_heap_free_slot(multi_heap_handle_t heap, void* p)
+{
+#ifdef CONFIG_HEAP_NODE_ARENA
+size_t heap_start=(size_t)heap+sizeof(multi_heap_t);
+size_t arena_start=heap_start+heap->total_size;
+size_t arena_end=arena_start+heap->arena_chunks*MULTI_HEAP_ARENA_CHUNK_SIZE;
+size_t ptr=(size_t)p;
+if(ptr<arena_start||ptr>=arena_end)
+	return false;
+size_t chunk=(arena_end-ptr-1)/MULTI_HEAP_ARENA_CHUNK_SIZE;
+size_t* mask=multi_heap_get_arena_chunk(heap, chunk);
+size_t slot=(ptr-(size_t)&mask[1])/MULTI_HEAP_ARENA_SLOT_SIZE;
+*mask|=(size_t)1<<slot;
+while(heap->arena_chunks)
+	{
+	mask=multi_heap_get_arena_chunk(heap, heap->arena_chunks-1);
+	if(*mask!=MULTI_HEAP_ARENA_FREE)
+		break;
+	// The word at the end of the heap holds the prev-free flag
+	if(heap->size==heap->total_size)
+		break;
+	heap->arena_chunks--;
+	heap->total_size+=MULTI_HEAP_ARENA_CHUNK_SIZE;
+	heap->free_bytes+=MULTI_HEAP_ARENA_CHUNK_SIZE;
+	}
+return true;
+#else
+return false;
+#endif
+}
+
+// Round size up to its size class
+size_t multi_heap_class_size(size_t size)
+{
+#ifdef CONFIG_HEAP_SIZE_CLASSES
+if(size<=CONFIG_HEAP_SIZE_CLASS_MAX)
+	return multi_heap_align_up(size, CONFIG_HEAP_SIZE_CLASS_STEP);
+#endif
+return size;
+}
+
+// Remove free blocks from the end of the heap, groups released by the index can leave them there
+// Without the node arena the last group of the map can stay above the only block it holds
+void multi_heap_release_top(multi_heap_handle_t heap)
+{
+size_t heap_start=(size_t)heap+sizeof(multi_heap_t);
+while(heap->size&&heap->size<heap->total_size)
+	{
+	size_t heap_end=heap_start+heap->size;
+	// The word at the end of the heap holds the prev-free flag
+	if(*(size_t*)heap_end&MEM_BLOCK_FLAG_PREV_FREE)
+		{
+		size_t* foot=(size_t*)heap_end;
+		foot--;
+		mem_block_info_t info;
+		if(!mem_block_get_info(heap, heap_end-(*foot&MEM_BLOCK_SIZE_MASK), &info))
+			return;
+		multi_heap_remove_offset(heap, &info);
+		heap->size-=info.size;
+		heap->free_blocks--;
+		heap->total_blocks--;
+		continue;
+		}
+#if defined(CONFIG_HEAP_INDEX_MAP)&&!defined(CONFIG_HEAP_NODE_ARENA)
+	if(!heap->map_free.root||mem_block_map_get_item_count(&heap->map_free)!=1)
+		return;
+	mem_block_neighbours_t info;
+	if(!mem_block_get_neighbours(heap, mem_block_get_offset(heap->map_free.root), &info))
+		return;
+	if(info.cur.pos+info.cur.size!=heap_end)
+		return;
+	if(!(info.prev.flags&MEM_BLOCK_FLAG_FREE))
+		return;
+	mem_block_map_item_t* item=mem_block_map_get_item_at(&heap->map_free, 0);
+	if(mem_block_map_item_get_offset(heap, item)!=info.prev.pos)
+		return;
+	// The group is released with its last block
+	multi_heap_remove_offset(heap, &info.prev);
+	multi_heap_free_private(heap, info.prev.pos);
+	if(heap->size==info.cur.pos-heap_start)
+		continue;
+#endif
+	return;
+	}
+}
+
+// Add free block to the index, it stays in the buffer if the index can't grow
+void multi_heap_index_block(multi_heap_handle_t heap, size_t pos, size_t size)
+{
+multi_heap_clear_quick_bin(pos, size);
+if(!multi_heap_add_free_offset(heap, size, pos))
+	{
+	multi_heap_free_private(heap, pos);
+	return;
+	}
+// Groups released by the index can leave the block at the end of the heap
+size_t heap_start=(size_t)heap+sizeof(multi_heap_t);
+if(pos+size!=heap_start+heap->size)
+	return;
+multi_heap_remove_free_offset(heap, size, pos);
+heap->size-=size;
+heap->free_blocks--;
+heap->total_blocks--;
+}
+
+// Add free offsets from buffer to map, at most budget blocks if it's not zero
+void multi_heap_update_map_pass(multi_heap_handle_t heap, size_t budget)
+{
+size_t work=0;
+#ifdef CONFIG_HEAP_QUICK_BINS
+// Sort blocks from quick-bins into the list to combine them
+for(uint32_t bin=0; bin<CONFIG_HEAP_QUICK_BIN_COUNT; bin++)
+	{
+	while(heap->quick_bins[bin])
+		{
+		if(budget&&work==budget)
+			break;
+		size_t bin_offset=heap->quick_bins[bin];
+		multi_heap_remove_quick_bin(bin_offset, MULTI_HEAP_QUICK_BIN_MIN+bin*MULTI_HEAP_QUICK_BIN_STEP);
+		multi_heap_chain_offset(heap, bin_offset);
+		work++;
+		}
+	}
+#endif
+// Take the chain from buffer, blocks freed meanwhile are chained again
+size_t offset=heap->free_offset;
+if(budget)
+	{
+	// Take the blocks at the top and leave the rest for the next call
+	size_t* link=&heap->free_offset;
+	size_t count=0;
+	for(; *link&&work<budget; work++, count++)
+		link=multi_heap_get_next_offset(*link);
+	if(!count)
+		return;
+	heap->free_offset=*link;
+	*link=0;
+	heap->free_offset_count-=count;
+	}
+else
+	{
+	heap->free_offset=0;
+	heap->free_offset_count=0;
+	}
+size_t heap_start=(size_t)heap+sizeof(multi_heap_t);
+while(offset)
+	{
+	MULTI_HEAP_COST(1);
 	mem_block_info_t cur;
-	if(!mem_block_get_info(heap, offsets[pos], &cur))
+	bool valid=mem_block_get_info(heap, offset, &cur);
+	offset=*multi_heap_get_next_offset(offset);
+	if(!valid)
 		{
 		heap->flags|=MULTI_HEAP_FLAG_DIRTY;
 		continue;
 		}
 	// Combine with free blocks in buffer
-	for(uint32_t u=pos+1; u<count; u++)
+	while(offset)
 		{
 		mem_block_info_t prev;
-		if(!mem_block_get_info(heap, offsets[u], &prev))
-			{
-			offsets[u]=0;
+		if(!mem_block_get_info(heap, offset, &prev))
 			break;
-			}
 		if(prev.pos+prev.size<cur.pos)
 			break;
-		offsets[u]=0;
+		offset=*multi_heap_get_next_offset(offset);
 		cur.pos=prev.pos;
 		cur.size+=prev.size;
 		heap->free_blocks--;
 		heap->total_blocks--;
 		}
 	mem_block_init(heap, cur.pos, cur.size, MEM_BLOCK_FLAG_FREE);
-	// Combine free block with neighbours
-	mem_block_neighbours_t info;
-	if(!mem_block_get_neighbours(heap, cur.pos, &info))
+	// Combine free block with neighbours, a neighbour from the buffer can have a free neighbour too
+	bool deferred=true;
+	while(deferred)
 		{
-		heap->flags|=MULTI_HEAP_FLAG_DIRTY;
-		continue;
+		deferred=false;
+		mem_block_neighbours_t info;
+		if(!mem_block_get_neighbours(heap, cur.pos, &info))
+			{
+			heap->flags|=MULTI_HEAP_FLAG_DIRTY;
+			valid=false;
+			break;
+			}
+		if(info.prev.flags&MEM_BLOCK_FLAG_FREE)
+			{
+			// The chain is sorted, a free block below can only be the next one we took
+			if(info.prev.pos==offset)
+				{
+				offset=*multi_heap_get_next_offset(offset);
+				deferred=true;
+				}
+			else
+				{
+				deferred|=multi_heap_remove_offset(heap, &info.prev);
+				}
+			cur.pos=info.prev.pos;
+			cur.size+=info.prev.size;
+			heap->free_blocks--;
+			heap->total_blocks--;
+			}
+		if(info.next.flags&MEM_BLOCK_FLAG_FREE)
+			{
+			deferred|=multi_heap_remove_offset(heap, &info.next);
+			cur.size+=info.next.size;
+			heap->free_blocks--;
+			heap->total_blocks--;
+			}
+		if(deferred)
+			mem_block_init(heap, cur.pos, cur.size, MEM_BLOCK_FLAG_FREE);
 		}
-	if(info.prev.flags&MEM_BLOCK_FLAG_FREE)
+	if(!valid)
+		continue;
+	// Remove free block from end of heap
+	if(cur.pos+cur.size==heap_start+heap->size)
 		{
-		multi_heap_remove_offset(heap, &info.prev);
-		cur.pos=info.prev.pos;
-		cur.size+=info.prev.size;
+		heap->size-=cur.size;
 		heap->free_blocks--;
 		heap->total_blocks--;
+		continue;
 		}
-	if(info.next.flags&MEM_BLOCK_FLAG_FREE)
+	// Add free block to the index
+	mem_block_init(heap, cur.pos, cur.size, MEM_BLOCK_FLAG_FREE);
+	multi_heap_index_block(heap, cur.pos, cur.size);
+	}
+multi_heap_release_top(heap);
+}
+
+// Add free offsets from buffer to map, without a budget until the buffer is empty
+void multi_heap_update_map_budget(multi_heap_handle_t heap, size_t budget)
+{
+if(budget)
+	{
+	multi_heap_update_map_pass(heap, budget);
+	return;
+	}
+// Groups freed by a pass are buffered again, blocks the index can't take stay in the buffer
+size_t count=heap->free_offset_count+1;
+while(heap->free_offset_count&&heap->free_offset_count<count)
+	{
+	count=heap->free_offset_count;
+	multi_heap_update_map_pass(heap, 0);
+	}
+}
+
+// Add free offsets from buffer to map, within the work budget of the heap
+void multi_heap_update_map(multi_heap_handle_t heap)
+{
+multi_heap_update_map_budget(heap, heap->work_budget);
+}
+
+// Free the blocks queued by interrupts, called after the lock is taken
+void multi_heap_drain_free_queue(multi_heap_handle_t heap)
+{
+if(!__atomic_load_n(&heap->free_queue, __ATOMIC_RELAXED))
+	return;
+// Producers only push, taking the whole queue at once has no ABA-problem
+size_t p=__atomic_exchange_n(&heap->free_queue, 0, __ATOMIC_ACQUIRE);
+while(p)
+	{
+	size_t next=*(size_t*)p;
+	if(!multi_heap_free_class(heap, (void*)p))
+		multi_heap_free_protected(heap, (void*)p);
+	p=next;
+	}
+}
+
+// Compare the free bytes with the watermark, the state only changes when the other threshold is crossed
+void multi_heap_update_watermark(multi_heap_handle_t heap)
+{
+if(!heap->watermark_low)
+	return;
+uint32_t state=heap->watermark_state;
+if(state&MULTI_HEAP_WATERMARK_BELOW)
+	{
+	if(heap->free_bytes<heap->watermark_high)
+		return;
+	state=MULTI_HEAP_WATERMARK_PENDING;
+	}
+else
+	{
+	if(heap->free_bytes>=heap->watermark_low)
+		return;
+	state=MULTI_HEAP_WATERMARK_BELOW|MULTI_HEAP_WATERMARK_PENDING;
+	}
+__atomic_store_n(&heap->watermark_state, state, __ATOMIC_RELEASE);
+}
+
+// Copy the counters for readers without the lock, called before the lock is released
+void multi_heap_publish_stats(multi_heap_handle_t heap)
+{
+multi_heap_update_watermark(heap);
+multi_heap_stats_t* stats=&heap->stats;
+uint32_t seq=stats->seq;
+__atomic_store_n(&stats->seq, seq+1, __ATOMIC_RELAXED);
+__atomic_thread_fence(__ATOMIC_RELEASE);
+size_t largest=multi_heap_get_largest_block(heap);
+__atomic_store_n(&stats->free_bytes, heap->free_bytes, __ATOMIC_RELAXED);
+__atomic_store_n(&stats->minimum_free_bytes, heap->minimum_free_bytes, __ATOMIC_RELAXED);
+__atomic_store_n(&stats->allocated_bytes, heap->size, __ATOMIC_RELAXED);
+__atomic_store_n(&stats->largest_free_block, largest, __ATOMIC_RELAXED);
+__atomic_store_n(&stats->allocated_blocks, heap->allocated_blocks, __ATOMIC_RELAXED);
+__atomic_store_n(&stats->free_blocks, heap->free_blocks, __ATOMIC_RELAXED);
+__atomic_store_n(&stats->total_blocks, heap->total_blocks, __ATOMIC_RELAXED);
+#ifdef CONFIG_HEAP_QUICK_BINS
+__atomic_store_n(&stats->quick_bin_hits, heap->quick_bin_hits, __ATOMIC_RELAXED);
+__atomic_store_n(&stats->quick_bin_misses, heap->quick_bin_misses, __ATOMIC_RELAXED);
+#endif
+__atomic_store_n(&stats->seq, seq+2, __ATOMIC_RELEASE);
+}
+
+
+#ifdef CONFIG_HEAP_CORE_CACHES
+
+// Move blocks from a core cache to the heap
+void multi_heap_drain_cache(multi_heap_handle_t heap, multi_heap_cache_t* cache, uint32_t count)
+{
+while(cache->count>count)
+	{
+	void* p=cache->blocks[--cache->count];
+	if(multi_heap_free_class(heap, p))
+		continue;
+	multi_heap_free_protected(heap, p);
+	multi_heap_update_map(heap);
+	}
+}
+
+// Move blocks from the heap to a core cache
+void multi_heap_fill_cache(multi_heap_handle_t heap, multi_heap_cache_t* cache, size_t size)
+{
+while(cache->count<CONFIG_HEAP_CORE_CACHE_SIZE/2)
+	{
+	void* p=multi_heap_malloc_class(heap, size);
+	if(!p)
 		{
-		multi_heap_remove_offset(heap, &info.next);
-		cur.size+=info.next.size;
-		heap->free_blocks--;
-		heap->total_blocks--;
+		p=multi_heap_malloc_protected(heap, size);
+		multi_heap_update_map(heap);
 		}
-	// Remove free block from end of heap
-	if(cur.pos+cur.size==heap_start+heap->size)
+	if(!p)
+		break;
+	cache->blocks[cache->count++]=p;
+	}
+}
+
+// Lock the cache of the current core, other cores only try to take it
+uint32_t multi_heap_lock_cache(multi_heap_handle_t heap, uint32_t* state)
+{
+MULTI_HEAP_LOCAL_LOCK(state);
+uint32_t core=MULTI_HEAP_CORE_ID();
+while(__atomic_exchange_n(&heap->cache_locks[core], 1, __ATOMIC_ACQUIRE))
+	MULTI_HEAP_CACHE_WAIT();
+return core;
+}
+
+void multi_heap_unlock_cache(multi_heap_handle_t heap, uint32_t core, uint32_t* state)
+{
+__atomic_store_n(&heap->cache_locks[core], 0, __ATOMIC_RELEASE);
+MULTI_HEAP_LOCAL_UNLOCK(state);
+}
+
+#endif
+
+// Add small block to the cache of the current core
+bool multi_heap_free_cache(multi_heap_handle_t heap, void* p)
+{
+#ifdef CONFIG_HEAP_CORE_CACHES
+// The tag can only be cleared with the lock
+if(mem_block_get_tag(p, NULL))
+	return false;
+mem_block_info_t info;
+size_t cls=0;
+if(!multi_heap_get_class(heap, p, &info, &cls))
+	return false;
+uint32_t state;
+uint32_t core=multi_heap_lock_cache(heap, &state);
+multi_heap_cache_t* cache=&heap->caches[core][cls];
+if(cache->count==CONFIG_HEAP_CORE_CACHE_SIZE)
+	{
+	multi_heap_internal_lock(heap);
+	multi_heap_drain_cache(heap, cache, CONFIG_HEAP_CORE_CACHE_SIZE/2);
+	multi_heap_publish_stats(heap);
+	multi_heap_internal_unlock(heap);
+	}
+cache->blocks[cache->count++]=p;
+multi_heap_unlock_cache(heap, core, &state);
+return true;
+#else
+return false;
+#endif
+}
+
+// Allocate block from the cache of the current core
+void* multi_heap_malloc_cache(multi_heap_handle_t heap, size_t size)
+{
+#ifdef CONFIG_HEAP_CORE_CACHES
+if(size>CONFIG_HEAP_SIZE_CLASS_MAX)
+	return NULL;
+size_t cls=(size-1)/CONFIG_HEAP_SIZE_CLASS_STEP;
+uint32_t state;
+uint32_t core=multi_heap_lock_cache(heap, &state);
+multi_heap_cache_t* cache=&heap->caches[core][cls];
+if(!cache->count)
+	{
+	multi_heap_internal_lock(heap);
+	multi_heap_fill_cache(heap, cache, size);
+	multi_heap_publish_stats(heap);
+	multi_heap_internal_unlock(heap);
+	}
+void* p=NULL;
+if(cache->count)
+	p=cache->blocks[--cache->count];
+multi_heap_unlock_cache(heap, core, &state);
+return p;
+#else
+return NULL;
+#endif
+}
+
+// Release blocks of all size classes
+bool multi_heap_release_classes(multi_heap_handle_t heap)
+{
+bool released=false;
+#ifdef CONFIG_HEAP_SIZE_CLASSES
+// With a work budget only some blocks are released, the next failure releases more
+size_t count=0;
+#endif
+#ifdef CONFIG_HEAP_CORE_CACHES
+// The caches of all cores are drained, with the heap lock held they can only be tried.
+// A core holding its cache is waiting for the heap lock to fill or drain it.
+for(uint32_t core=0; core<MULTI_HEAP_CORE_COUNT; core++)
+	{
+	uint32_t locked=0;
+	if(!__atomic_compare_exchange_n(&heap->cache_locks[core], &locked, 1, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+		continue;
+	multi_heap_cache_t* caches=heap->caches[core];
+	for(uint32_t cls=0; cls<MULTI_HEAP_CLASS_COUNT; cls++)
 		{
-		heap->size-=cur.size;
-		heap->free_blocks--;
+		if(!caches[cls].count)
+			continue;
+		uint32_t keep=0;
+		if(heap->work_budget&&caches[cls].count>heap->work_budget-count)
+			keep=caches[cls].count-(uint32_t)(heap->work_budget-count);
+		count+=caches[cls].count-keep;
+		multi_heap_drain_cache(heap, &caches[cls], keep);
+		released=true;
+		if(keep)
+			break;
+		}
+	__atomic_store_n(&heap->cache_locks[core], 0, __ATOMIC_RELEASE);
+	if(heap->work_budget&&count==heap->work_budget)
+		return released;
+	}
+#endif
+#ifdef CONFIG_HEAP_SIZE_CLASSES
+for(uint32_t cls=0; cls<MULTI_HEAP_CLASS_COUNT; cls++)
+	{
+	while(heap->class_blocks[cls])
+		{
+		if(heap->work_budget&&count++==heap->work_budget)
+			return released;
+		MULTI_HEAP_COST(1);
+		void* p=multi_heap_malloc_class(heap, (cls+1)*CONFIG_HEAP_SIZE_CLASS_STEP);
+		multi_heap_free_protected(heap, p);
+		released=true;
+		}
+	}
+#endif
+return released;
+}
+
+// Allocate contiguous run of equal blocks
+size_t multi_heap_malloc_run(multi_heap_handle_t heap, size_t size, size_t count, void** ptrs)
+{
+size_t block_size=mem_block_calc_size(size);
+if(count>heap->free_bytes/block_size)
+	count=heap->free_bytes/block_size;
+void* p=NULL;
+for(; count>0; count/=2)
+	{
+	p=multi_heap_malloc_protected(heap, mem_block_calc_data_size(count*block_size));
+	if(p)
+		break;
+	}
+if(!p)
+	return 0;
+size_t offset=mem_block_get_offset(p);
+mem_block_info_t info;
+mem_block_get_info(heap, offset, &info);
+for(size_t u=0; u+1<count; u++)
+	ptrs[u]=mem_block_init(heap, offset+u*block_size, block_size, 0);
+// The last block keeps the rest of a larger free block
+size_t last_pos=offset+(count-1)*block_size;
+ptrs[count-1]=mem_block_init(heap, last_pos, info.pos+info.size-last_pos, 0);
+heap->allocated_blocks+=count-1;
+heap->total_blocks+=count-1;
+return count;
+}
+
+// Sort pointers by address
+void multi_heap_sort_pointers(void** ptrs, size_t count)
+{
+for(size_t u=1; u<count; u++)
+	{
+	void* p=ptrs[u];
+	size_t pos=u;
+	for(; pos>0; pos--)
+		{
+		if(ptrs[pos-1]<=p)
+			break;
+		ptrs[pos]=ptrs[pos-1];
+		}
+	ptrs[pos]=p;
+	}
+}
+
+// Combine adjacent blocks and free them at once
+void multi_heap_free_run(multi_heap_handle_t heap, void** ptrs, size_t count)
+{
+mem_block_info_t run;
+bool open=false;
+for(size_t u=0; u<count; u++)
+	{
+	if(ptrs[u]==NULL)
+		continue;
+	mem_block_info_t info;
+	size_t offset=mem_block_get_offset(ptrs[u]);
+	if(!mem_block_get_info(heap, offset, &info))
+		continue;
+	if(info.flags&MEM_BLOCK_FLAG_FREE)
+		continue;
+	if(open&&run.pos+run.size==info.pos)
+		{
+		run.size+=info.size;
+		heap->allocated_blocks--;
 		heap->total_blocks--;
 		continue;
 		}
-	// Add free block to map
-	mem_block_init(heap, cur.pos, cur.size, MEM_BLOCK_FLAG_FREE);
-	if(!mem_block_map_add_offset(heap, &heap->map_free, cur.size, cur.pos))
-		heap->flags|=MULTI_HEAP_FLAG_DIRTY;
+	if(open)
+		{
+		mem_block_init(heap, run.pos, run.size, 0);
+		multi_heap_free_protected(heap, mem_block_get_pointer(run.pos));
+		}
+	run=info;
+	open=true;
+	}
+if(open)
+	{
+	mem_block_init(heap, run.pos, run.size, 0);
+	multi_heap_free_protected(heap, mem_block_get_pointer(run.pos));
 	}
 }
 
+// Get object of a pool by its index
+void* multi_heap_pool_get_object(multi_heap_pool_t* pool, uint32_t index)
+{
+uint32_t page=index>>pool->page_shift;
+uint32_t slot=index&((1U<<pool->page_shift)-1);
+return (void*)((size_t)pool->pages[page]+slot*pool->object_size);
+}
+
+// Get index of a pool object, or -1 if it's not in the pool
+int32_t multi_heap_pool_get_index(multi_heap_pool_t* pool, void* p)
+{
+size_t ptr=(size_t)p;
+size_t page_size=pool->object_size<<pool->page_shift;
+uint32_t page_count=__atomic_load_n(&pool->page_count, __ATOMIC_ACQUIRE);
+for(uint32_t page=0; page<page_count; page++)
+	{
+	size_t start=(size_t)pool->pages[page];
+	if(ptr<start||ptr>=start+page_size)
+		continue;
+	if((ptr-start)%pool->object_size)
+		return -1;
+	return (int32_t)((page<<pool->page_shift)+(ptr-start)/pool->object_size);
+	}
+return -1;
+}
+
+// Push object on the free stack, the object holds the index below
+void multi_heap_pool_push(multi_heap_pool_t* pool, uint32_t index)
+{
+volatile uint32_t* link=(volatile uint32_t*)multi_heap_pool_get_object(pool, index);
+uint32_t top=__atomic_load_n(&pool->free_top, __ATOMIC_ACQUIRE);
+uint32_t next=0;
+do
+	{
+	*link=top&MULTI_HEAP_POOL_INDEX_MASK;
+	next=((top&~MULTI_HEAP_POOL_INDEX_MASK)+MULTI_HEAP_POOL_TAG_STEP)|(index+1);
+	}
+while(!multi_heap_compare_exchange(&pool->free_top, &top, next));
+}
+
+// Pop object from the free stack, a changed tag detects a concurrent pop and push
+void* multi_heap_pool_pop(multi_heap_pool_t* pool)
+{
+uint32_t top=__atomic_load_n(&pool->free_top, __ATOMIC_ACQUIRE);
+while(1)
+	{
+	uint32_t index=top&MULTI_HEAP_POOL_INDEX_MASK;
+	if(!index)
+		return NULL;
+	// Pages are never released, the link can be read even if the object was taken meanwhile
+	void* p=multi_heap_pool_get_object(pool, index-1);
+	uint32_t below=*(volatile uint32_t*)p&MULTI_HEAP_POOL_INDEX_MASK;
+	uint32_t next=((top&~MULTI_HEAP_POOL_INDEX_MASK)+MULTI_HEAP_POOL_TAG_STEP)|below;
+	if(multi_heap_compare_exchange(&pool->free_top, &top, next))
+		return p;
+	}
+}
+
+// Add a page to an empty pool, pages are added under the heap lock
+bool multi_heap_pool_grow(multi_heap_pool_t* pool)
+{
+multi_heap_handle_t heap=pool->heap;
+bool success=false;
+multi_heap_internal_lock(heap);
+uint32_t page=pool->page_count;
+uint32_t count=1U<<pool->page_shift;
+if(__atomic_load_n(&pool->free_top, __ATOMIC_ACQUIRE)&MULTI_HEAP_POOL_INDEX_MASK)
+	{
+	// Objects were freed meanwhile
+	success=true;
+	}
+else if(page<MULTI_HEAP_POOL_MAX_PAGES&&(page+1)*count<=MULTI_HEAP_POOL_INDEX_MASK)
+	{
+	void* p=multi_heap_malloc(heap, count*pool->object_size);
+	if(p)
+		{
+		pool->pages[page]=p;
+		__atomic_store_n(&pool->page_count, page+1, __ATOMIC_RELEASE);
+		for(uint32_t slot=count; slot>0; slot--)
+			multi_heap_pool_push(pool, (page<<pool->page_shift)+slot-1);
+		success=true;
+		}
+	}
+multi_heap_internal_unlock(heap);
+return success;
+}
+
+// Chain another chunk to a full arena, at least as large as the first one
+bool multi_heap_arena_grow(multi_heap_arena_t* arena, size_t size)
+{
+size_t chunk_size=arena->size;
+if(size>chunk_size)
+	chunk_size=size;
+void** chunk=(void**)multi_heap_malloc(arena->heap, sizeof(void*)+chunk_size);
+if(!chunk)
+	return false;
+*chunk=arena->chunks;
+arena->chunks=chunk;
+arena->pos=(size_t)&chunk[1];
+arena->end=arena->pos+chunk_size;
+return true;
+}
+
 
 //==========
 // Internal
@@ -251,20 +1476,40 @@ while(pos<heap_end)
 	size_t* head=(size_t*)pos;
 	size_t entry=*head;
 	size_t size=entry&MEM_BLOCK_SIZE_MASK;
-	size_t* foot=(size_t*)(pos+size);
-	foot--;
-	size_t foot_entry=*foot;
-	if(foot_entry!=entry)
+	if(entry&MEM_BLOCK_FLAG_FREE)
+		{
+		size_t* foot=(size_t*)(pos+size);
+		foot--;
+		size_t foot_entry=*foot;
+		if(foot_entry!=(entry&~MEM_BLOCK_FLAG_PREV_FREE))
+			{
+			if(print_errors)
+				{
+				MULTI_HEAP_PRINTF("multi_heap_check_internal(0x%x): entry 0x%x mismatch %u - %u\n", heap, pos, entry, foot_entry);
+				}
+			success=false;
+			break;
+			}
+		}
+	if(((entry&MEM_BLOCK_FLAG_PREV_FREE)!=0)!=prev_free)
 		{
 		if(print_errors)
 			{
-			MULTI_HEAP_PRINTF("multi_heap_check_internal(0x%x): entry 0x%x mismatch %u - %u\n", heap, pos, entry, foot_entry);
+			MULTI_HEAP_PRINTF("multi_heap_check_internal(0x%x): entry 0x%x prev-free flag mismatch\n", heap, pos);
 			}
 		success=false;
 		break;
 		}
 	mem_block_info_t info;
-	mem_block_get_info(heap, pos, &info);
+	if(!mem_block_get_info(heap, pos, &info))
+		{
+		if(print_errors)
+			{
+			MULTI_HEAP_PRINTF("multi_heap_check_internal(0x%x): entry 0x%x invalid\n", heap, pos);
+			}
+		success=false;
+		break;
+		}
 	if(info.flags&MEM_BLOCK_FLAG_FREE)
 		{
 		if(prev_free)
@@ -281,8 +1526,16 @@ if(print_errors&&free_collide)
 	{
 	MULTI_HEAP_PRINTF("multi_heap_check_internal(0x%x): free entries collide\n", heap);
 	}
+#if defined(CONFIG_HEAP_INDEX_TLSF)
+if(!mem_block_tlsf_check(heap, &heap->tlsf_free, print_errors))
+	success=false;
+#elif defined(CONFIG_HEAP_INDEX_TREE)
+if(!mem_block_tree_check(heap, &heap->tree_free, print_errors))
+	success=false;
+#else
 if(!mem_block_map_check(heap, &heap->map_free, print_errors))
 	success=false;
+#endif
 return success;
 }
 
@@ -300,11 +1553,37 @@ MULTI_HEAP_PRINTF("\n\tblocks allocated: %u\tfree blocks: %u\ttotal blocks: %u\n
 if(heap->free_blocks)
 	{
 	MULTI_HEAP_PRINTF("\nfree blocks:\n");
+#if defined(CONFIG_HEAP_INDEX_TLSF)
+	mem_block_tlsf_dump(heap, &heap->tlsf_free);
+#elif defined(CONFIG_HEAP_INDEX_TREE)
+	mem_block_tree_dump(heap, &heap->tree_free);
+#else
 	mem_block_map_dump(heap, &heap->map_free);
+#endif
 	}
 MULTI_HEAP_PRINTF("\n");
 }
 
+void multi_heap_free_group(multi_heap_handle_t heap, void* group)
+{
+MULTI_HEAP_COST(1);
+if(multi_heap_free_slot(heap, group))
+	return;
+#if !defined(CONFIG_HEAP_INDEX_TLSF)&&!defined(CONFIG_HEAP_INDEX_TREE)
+// Spare groups have to fit any group
+mem_block_info_t info;
+if(heap->flags&MULTI_HEAP_FLAG_SPARE)
+	{
+	if(mem_block_get_info(heap, mem_block_get_offset(group), &info)&&info.size>=mem_block_calc_size(MULTI_HEAP_GROUP_MAX_SIZE))
+		{
+		multi_heap_push_spare(heap, group);
+		return;
+		}
+	}
+#endif
+multi_heap_free_internal(heap, group);
+}
+
 void multi_heap_free_internal(multi_heap_handle_t heap, void* p)
 {
 size_t offset=mem_block_get_offset(p);
@@ -329,13 +1608,41 @@ heap->free_blocks++;
 multi_heap_free_private(heap, info.pos);
 }
 
+void* multi_heap_malloc_group(multi_heap_handle_t heap, size_t size)
+{
+MULTI_HEAP_COST(1);
+void* p=multi_heap_malloc_slot(heap);
+if(p)
+	return p;
+#if !defined(CONFIG_HEAP_INDEX_TLSF)&&!defined(CONFIG_HEAP_INDEX_TREE)
+if(heap->spare_groups)
+	{
+	p=heap->spare_groups;
+	heap->spare_groups=*(void**)p;
+	heap->spare_count--;
+	return p;
+	}
+if(heap->flags&MULTI_HEAP_FLAG_SPARE)
+	heap->flags|=MULTI_HEAP_FLAG_SPARE_EMPTY;
+#endif
+return multi_heap_malloc_internal(heap, size);
+}
+
 void* multi_heap_malloc_internal(multi_heap_handle_t heap, size_t size)
 {
 size_t block_size=mem_block_calc_size(size);
 void* p=multi_heap_malloc_private(heap, block_size);
 if(p)
 	return p;
-p=multi_heap_malloc_fit(heap, block_size);
+// A block taken from the map while it's modified corrupts it, groups are split from the buffer instead
+if(heap->flags&MULTI_HEAP_FLAG_INDEX)
+	{
+	p=multi_heap_malloc_split(heap, block_size);
+	}
+else
+	{
+	p=multi_heap_malloc_fit(heap, block_size);
+	}
 if(p)
 	return p;
 return multi_heap_malloc_direct(heap, block_size);
@@ -356,9 +1663,10 @@ if(info.cur.flags&MEM_BLOCK_FLAG_FREE)
 	return;
 size_t free_pos=info.cur.pos;
 size_t free_size=info.cur.size;
+bool deferred=false;
 if(info.prev.flags&MEM_BLOCK_FLAG_FREE)
 	{
-	multi_heap_remove_offset(heap, &info.prev);
+	deferred|=multi_heap_remove_offset(heap, &info.prev);
 	free_pos=info.prev.pos;
 	free_size+=info.prev.size;
 	heap->free_blocks--;
@@ -366,7 +1674,7 @@ if(info.prev.flags&MEM_BLOCK_FLAG_FREE)
 	}
 if(info.next.flags&MEM_BLOCK_FLAG_FREE)
 	{
-	multi_heap_remove_offset(heap, &info.next);
+	deferred|=multi_heap_remove_offset(heap, &info.next);
 	free_size+=info.next.size;
 	heap->free_blocks--;
 	heap->total_blocks--;
@@ -378,14 +1686,21 @@ if(free_pos+free_size==heap_start+heap->size)
 	heap->free_bytes+=info.cur.size;
 	heap->allocated_blocks--;
 	heap->total_blocks--;
+	multi_heap_release_top(heap);
 	return;
 	}
 mem_block_init(heap, free_pos, free_size, MEM_BLOCK_FLAG_FREE);
 heap->free_bytes+=info.cur.size;
 heap->allocated_blocks--;
 heap->free_blocks++;
-if(!mem_block_map_add_offset(heap, &heap->map_free, free_size, free_pos))
-	heap->flags|=MULTI_HEAP_FLAG_DIRTY;
+// A neighbour from the buffer can have a free neighbour too, the block is combined with the buffer
+if(deferred)
+	{
+	multi_heap_free_private(heap, free_pos);
+	return;
+	}
+multi_heap_index_block(heap, free_pos, free_size);
+multi_heap_release_top(heap);
 }
 
 void* multi_heap_malloc_protected(multi_heap_handle_t heap, size_t size)
@@ -396,11 +1711,45 @@ if(heap->free_bytes<block_size)
 void* p=multi_heap_malloc_fit(heap, block_size);
 if(p)
 	return p;
-if(heap->total_size-heap->size<block_size+512)
+if(!multi_heap_check_reserve(heap, block_size))
 	return NULL;
 return multi_heap_malloc_direct(heap, block_size);
 }
 
+void* multi_heap_aligned_alloc_protected(multi_heap_handle_t heap, size_t size, size_t alignment)
+{
+size_t block_size=mem_block_calc_size(size);
+if(heap->free_bytes<block_size)
+	return NULL;
+void* p=multi_heap_aligned_alloc_fit(heap, block_size, alignment);
+if(p)
+	return p;
+if(!multi_heap_check_reserve(heap, block_size+alignment))
+	return NULL;
+return multi_heap_aligned_alloc_direct(heap, block_size, alignment);
+}
+
+void* multi_heap_realloc_protected(multi_heap_handle_t heap, void* p, size_t size)
+{
+mem_block_neighbours_t info;
+size_t offset=mem_block_get_offset(p);
+if(!mem_block_get_neighbours(heap, offset, &info))
+	return NULL;
+if(info.cur.flags&MEM_BLOCK_FLAG_FREE)
+	return NULL;
+size_t lead=(size_t)p-(size_t)mem_block_get_pointer(offset);
+size_t block_size=mem_block_calc_size(size)+lead;
+if(multi_heap_realloc_private(heap, &info, block_size))
+	return p;
+// Move block as last resort
+void* ptr=multi_heap_malloc_protected(heap, size);
+if(!ptr)
+	return NULL;
+memcpy(ptr, p, mem_block_calc_data_size(info.cur.size)-lead);
+multi_heap_free_protected(heap, p);
+return ptr;
+}
+
 
 //========
 // Public
@@ -408,22 +1757,155 @@ return multi_heap_malloc_direct(heap, block_size);
 
 void *multi_heap_aligned_alloc(multi_heap_handle_t heap, size_t size, size_t alignment)
 {
-if(alignment!=sizeof(size_t))
-	return NULL; // TODO
-return multi_heap_malloc(heap, size);
+if(heap==NULL||size==0)
+	return NULL;
+if(alignment&(alignment-1))
+	return NULL;
+if(alignment<=sizeof(size_t))
+	return multi_heap_malloc(heap, size);
+MULTI_HEAP_OP_START(start);
+multi_heap_internal_lock(heap);
+multi_heap_drain_free_queue(heap);
+void* p=multi_heap_aligned_alloc_protected(heap, size, alignment);
+if(!p&&multi_heap_release_classes(heap))
+	{
+	multi_heap_update_map(heap);
+	p=multi_heap_aligned_alloc_protected(heap, size, alignment);
+	}
+multi_heap_update_map(heap);
+multi_heap_publish_stats(heap);
+MULTI_HEAP_OP_END(heap, MULTI_HEAP_OP_ALIGNED_ALLOC, start, size);
+multi_heap_internal_unlock(heap);
+return p;
 }
 
 void* multi_heap_malloc(multi_heap_handle_t heap, size_t size)
 {
 if(heap==NULL||size==0)
 	return NULL;
-MULTI_HEAP_LOCK(heap->lock);
-void* p=multi_heap_malloc_protected(heap, size);
+size=multi_heap_class_size(size);
+void* p=multi_heap_malloc_cache(heap, size);
+if(p)
+	return p;
+MULTI_HEAP_OP_START(start);
+multi_heap_internal_lock(heap);
+multi_heap_drain_free_queue(heap);
+p=multi_heap_malloc_class(heap, size);
+if(!p)
+	p=multi_heap_malloc_protected(heap, size);
+if(!p&&multi_heap_release_classes(heap))
+	{
+	multi_heap_update_map(heap);
+	p=multi_heap_malloc_protected(heap, size);
+	}
 multi_heap_update_map(heap);
-MULTI_HEAP_UNLOCK(heap->lock);
+multi_heap_publish_stats(heap);
+MULTI_HEAP_OP_END(heap, MULTI_HEAP_OP_MALLOC, start, size);
+multi_heap_internal_unlock(heap);
+return p;
+}
+
+void* multi_heap_malloc_critical(multi_heap_handle_t heap, size_t size)
+{
+if(heap==NULL||size==0)
+	return NULL;
+size=multi_heap_class_size(size);
+void* p=multi_heap_malloc_cache(heap, size);
+if(p)
+	return p;
+MULTI_HEAP_OP_START(start);
+multi_heap_internal_lock(heap);
+multi_heap_drain_free_queue(heap);
+heap->flags|=MULTI_HEAP_FLAG_CRITICAL;
+p=multi_heap_malloc_class(heap, size);
+if(!p)
+	p=multi_heap_malloc_protected(heap, size);
+if(!p&&multi_heap_release_classes(heap))
+	{
+	multi_heap_update_map(heap);
+	p=multi_heap_malloc_protected(heap, size);
+	}
+heap->flags&=~MULTI_HEAP_FLAG_CRITICAL;
+if(p)
+	{
+	heap->critical_allocations++;
+	}
+else
+	{
+	heap->critical_failures++;
+	}
+multi_heap_update_map(heap);
+multi_heap_publish_stats(heap);
+MULTI_HEAP_OP_END(heap, MULTI_HEAP_OP_MALLOC, start, size);
+multi_heap_internal_unlock(heap);
+return p;
+}
+
+void* multi_heap_malloc_tagged(multi_heap_handle_t heap, size_t size, uint32_t tag)
+{
+if(heap==NULL||size==0)
+	return NULL;
+if(!tag)
+	return multi_heap_malloc(heap, size);
+size=multi_heap_class_size(size);
+MULTI_HEAP_OP_START(start);
+multi_heap_internal_lock(heap);
+multi_heap_drain_free_queue(heap);
+void* p=multi_heap_malloc_class(heap, size);
+if(!p)
+	p=multi_heap_malloc_protected(heap, size);
+if(!p&&multi_heap_release_classes(heap))
+	{
+	multi_heap_update_map(heap);
+	p=multi_heap_malloc_protected(heap, size);
+	}
+if(p)
+	mem_block_set_tag(p, tag);
+multi_heap_update_map(heap);
+multi_heap_publish_stats(heap);
+MULTI_HEAP_OP_END(heap, MULTI_HEAP_OP_MALLOC, start, size);
+multi_heap_internal_unlock(heap);
 return p;
 }
 
+size_t multi_heap_malloc_batch(multi_heap_handle_t heap, size_t size, size_t count, void** ptrs)
+{
+if(heap==NULL||size==0||ptrs==NULL)
+	return 0;
+size=multi_heap_class_size(size);
+size_t done=0;
+MULTI_HEAP_OP_START(start);
+multi_heap_internal_lock(heap);
+multi_heap_drain_free_queue(heap);
+for(; done<count; done++)
+	{
+	ptrs[done]=multi_heap_malloc_class(heap, size);
+	if(!ptrs[done])
+		break;
+	}
+bool released=false;
+while(done<count)
+	{
+	size_t run=multi_heap_malloc_run(heap, size, count-done, &ptrs[done]);
+	multi_heap_update_map(heap);
+	if(run)
+		{
+		done+=run;
+		continue;
+		}
+	if(released||!multi_heap_release_classes(heap))
+		break;
+	multi_heap_update_map(heap);
+	released=true;
+	}
+multi_heap_publish_stats(heap);
+MULTI_HEAP_OP_END(heap, MULTI_HEAP_OP_MALLOC_BATCH, start, count);
+multi_heap_internal_unlock(heap);
+for(size_t u=done; u<count; u++)
+	ptrs[u]=NULL;
+return done;
+}
+
 void multi_heap_aligned_free(multi_heap_handle_t heap, void* p)
 {
 multi_heap_free(heap, p);
@@ -431,22 +1913,100 @@ multi_heap_free(heap, p);
 
 void multi_heap_free(multi_heap_handle_t heap, void* p)
 {
-MULTI_HEAP_LOCK(heap->lock);
-multi_heap_free_protected(heap, p);
+if(p==NULL)
+	return;
+if(multi_heap_free_cache(heap, p))
+	return;
+MULTI_HEAP_OP_START(start);
+multi_heap_internal_lock(heap);
+multi_heap_drain_free_queue(heap);
+if(!multi_heap_free_class(heap, p))
+	{
+	multi_heap_free_protected(heap, p);
+	multi_heap_update_map(heap);
+	}
+multi_heap_publish_stats(heap);
+MULTI_HEAP_OP_END(heap, MULTI_HEAP_OP_FREE, start, 0);
+multi_heap_internal_unlock(heap);
+}
+
+void multi_heap_free_batch(multi_heap_handle_t heap, size_t count, void** ptrs)
+{
+if(heap==NULL||ptrs==NULL)
+	return;
+MULTI_HEAP_OP_START(start);
+multi_heap_sort_pointers(ptrs, count);
+multi_heap_internal_lock(heap);
+multi_heap_drain_free_queue(heap);
+for(size_t u=0; u<count; u++)
+	{
+	if(ptrs[u]&&multi_heap_free_class(heap, ptrs[u]))
+		ptrs[u]=NULL;
+	}
+multi_heap_free_run(heap, ptrs, count);
 multi_heap_update_map(heap);
-MULTI_HEAP_UNLOCK(heap->lock);
+multi_heap_publish_stats(heap);
+MULTI_HEAP_OP_END(heap, MULTI_HEAP_OP_FREE_BATCH, start, count);
+multi_heap_internal_unlock(heap);
+}
+
+void multi_heap_free_from_isr(multi_heap_handle_t heap, void* p)
+{
+if(heap==NULL||p==NULL)
+	return;
+// The block is linked in its payload, the next call with the lock frees it
+size_t* link=(size_t*)p;
+size_t next=__atomic_load_n(&heap->free_queue, __ATOMIC_RELAXED);
+do
+	{
+	*link=next;
+	}
+while(!__atomic_compare_exchange_n(&heap->free_queue, &next, (size_t)p, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
 }
 
 void* multi_heap_realloc(multi_heap_handle_t heap, void* p, size_t size)
 {
 if(p==NULL)
 	return multi_heap_malloc(heap, size);
-return NULL; // TODO
+if(size==0)
+	{
+	multi_heap_free(heap, p);
+	return NULL;
+	}
+MULTI_HEAP_OP_START(start);
+multi_heap_internal_lock(heap);
+multi_heap_drain_free_queue(heap);
+size_t tag=mem_block_get_tag(p, NULL);
+void* ptr=multi_heap_realloc_protected(heap, p, size);
+if(!ptr&&multi_heap_release_classes(heap))
+	{
+	multi_heap_update_map(heap);
+	ptr=multi_heap_realloc_protected(heap, p, size);
+	}
+// The header of the block is written again, or the buffer was moved
+if(ptr&&tag)
+	mem_block_set_tag(ptr, tag);
+multi_heap_update_map(heap);
+multi_heap_publish_stats(heap);
+MULTI_HEAP_OP_END(heap, MULTI_HEAP_OP_REALLOC, start, size);
+multi_heap_internal_unlock(heap);
+return ptr;
+}
+
+uint32_t multi_heap_get_tag(multi_heap_handle_t heap, void* p, size_t* size)
+{
+if(heap==NULL||p==NULL)
+	{
+	if(size)
+		*size=0;
+	return 0;
+	}
+return (uint32_t)mem_block_get_tag(p, size);
 }
 
 size_t multi_heap_get_allocated_size(multi_heap_handle_t heap, void* p)
 {
-MULTI_HEAP_LOCK(heap->lock);
+multi_heap_internal_lock(heap);
 size_t offset=mem_block_get_offset(p);
 mem_block_info_t info;
 if(mem_block_get_info(heap, offset, &info))
@@ -454,7 +2014,7 @@ if(mem_block_get_info(heap, offset, &info))
 	if(info.flags&MEM_BLOCK_FLAG_FREE)
 		info.size=0;
 	}
-MULTI_HEAP_UNLOCK(heap->lock);
+multi_heap_internal_unlock(heap);
 return info.size;
 }
 
@@ -464,6 +2024,13 @@ size_t offset=multi_heap_align_up((size_t)head, 8);
 multi_heap_t* heap=(multi_heap_t*)offset;
 size_t start=offset+sizeof(multi_heap_t);
 size_t end=multi_heap_align_down(offset+size, 16);
+#ifdef CONFIG_HEAP_COMPACT_MAP
+if(end-start>MULTI_HEAP_MAX_SIZE)
+	end=multi_heap_align_down(start+MULTI_HEAP_MAX_SIZE, 16);
+#endif
+// The top byte of the headers holds the tags
+if(end-start>MEM_BLOCK_SIZE_MASK)
+	end=multi_heap_align_down(start+MEM_BLOCK_SIZE_MASK, 16);
 heap->lock=NULL;
 heap->total_size=end-start;
 heap->size=0;
@@ -473,8 +2040,67 @@ heap->allocated_blocks=0;
 heap->free_blocks=0;
 heap->total_blocks=0;
 heap->flags=0;
+heap->largest_free=0;
+for(uint32_t slot=0; slot<MULTI_HEAP_HISTOGRAM_SIZE; slot++)
+	heap->free_histogram[slot]=0;
+heap->free_offset=0;
 heap->free_offset_count=0;
+heap->work_budget=CONFIG_HEAP_WORK_BUDGET;
+heap->free_queue=0;
+heap->meta_reserve=CONFIG_HEAP_META_RESERVE;
+heap->critical_reserve=CONFIG_HEAP_CRITICAL_RESERVE;
+heap->critical_allocations=0;
+heap->critical_failures=0;
+heap->reserve_allocations=0;
+heap->reserve_refusals=0;
+heap->watermark_low=0;
+heap->watermark_high=0;
+heap->watermark_state=0;
+#ifdef CONFIG_HEAP_QUICK_BINS
+for(uint32_t bin=0; bin<CONFIG_HEAP_QUICK_BIN_COUNT; bin++)
+	heap->quick_bins[bin]=0;
+heap->quick_bin_hits=0;
+heap->quick_bin_misses=0;
+#endif
+#if defined(CONFIG_HEAP_INDEX_TLSF)
+mem_block_tlsf_init(&heap->tlsf_free);
+#elif defined(CONFIG_HEAP_INDEX_TREE)
+mem_block_tree_init(&heap->tree_free);
+#else
 mem_block_map_init(&heap->map_free);
+heap->spare_groups=NULL;
+heap->spare_count=0;
+#endif
+#ifdef CONFIG_HEAP_NODE_ARENA
+heap->arena_chunks=0;
+#endif
+#ifdef CONFIG_HEAP_SIZE_CLASSES
+for(uint32_t cls=0; cls<MULTI_HEAP_CLASS_COUNT; cls++)
+	{
+	heap->class_blocks[cls]=NULL;
+	heap->class_counts[cls]=0;
+	}
+#endif
+#ifdef CONFIG_HEAP_CORE_CACHES
+for(uint32_t core=0; core<MULTI_HEAP_CORE_COUNT; core++)
+	{
+	for(uint32_t cls=0; cls<MULTI_HEAP_CLASS_COUNT; cls++)
+		heap->caches[core][cls].count=0;
+	heap->cache_locks[core]=0;
+	}
+#endif
+#ifdef CONFIG_HEAP_LOCK_STATS
+heap->lock_depth=0;
+heap->lock_time=0;
+memset(&heap->lock_stats, 0, sizeof(multi_heap_lock_stats_t));
+#endif
+#ifdef CONFIG_HEAP_OP_STATS
+memset(heap->op_stats, 0, sizeof(heap->op_stats));
+#endif
+heap->stats.seq=0;
+heap->stats.quick_bin_hits=0;
+heap->stats.quick_bin_misses=0;
+multi_heap_publish_stats(heap);
 return heap;
 }
 
@@ -483,18 +2109,75 @@ void multi_heap_set_lock(multi_heap_handle_t heap, void* lock)
 heap->lock=lock;
 }
 
+void multi_heap_set_work_budget(multi_heap_handle_t heap, size_t budget)
+{
+if(heap==NULL)
+	return;
+multi_heap_internal_lock(heap);
+heap->work_budget=budget;
+multi_heap_internal_unlock(heap);
+}
+
+void multi_heap_set_reserve(multi_heap_handle_t heap, size_t meta_reserve, size_t critical_reserve)
+{
+if(heap==NULL)
+	return;
+multi_heap_internal_lock(heap);
+heap->meta_reserve=meta_reserve;
+heap->critical_reserve=critical_reserve;
+multi_heap_internal_unlock(heap);
+}
+
+void multi_heap_set_watermark(multi_heap_handle_t heap, size_t low_bytes, size_t high_bytes)
+{
+if(heap==NULL)
+	return;
+multi_heap_internal_lock(heap);
+heap->watermark_low=low_bytes;
+heap->watermark_high=high_bytes>low_bytes? high_bytes: low_bytes;
+heap->watermark_state=0;
+multi_heap_update_watermark(heap);
+multi_heap_internal_unlock(heap);
+}
+
+multi_heap_watermark_t multi_heap_get_watermark_event(multi_heap_handle_t heap)
+{
+if(heap==NULL)
+	return MULTI_HEAP_WATERMARK_NONE;
+uint32_t state=__atomic_load_n(&heap->watermark_state, __ATOMIC_ACQUIRE);
+while(state&MULTI_HEAP_WATERMARK_PENDING)
+	{
+	if(__atomic_compare_exchange_n(&heap->watermark_state, &state, state&~MULTI_HEAP_WATERMARK_PENDING, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+		return (state&MULTI_HEAP_WATERMARK_BELOW)? MULTI_HEAP_WATERMARK_LOW: MULTI_HEAP_WATERMARK_HIGH;
+	}
+return MULTI_HEAP_WATERMARK_NONE;
+}
+
+size_t multi_heap_maintain(multi_heap_handle_t heap, size_t budget)
+{
+if(heap==NULL)
+	return 0;
+multi_heap_internal_lock(heap);
+multi_heap_drain_free_queue(heap);
+multi_heap_update_map_budget(heap, budget);
+multi_heap_publish_stats(heap);
+size_t deferred=heap->free_offset_count;
+multi_heap_internal_unlock(heap);
+return deferred;
+}
+
 void multi_heap_dump(multi_heap_handle_t heap)
 {
-MULTI_HEAP_LOCK(heap->lock);
+multi_heap_internal_lock(heap);
 multi_heap_dump_internal(heap);
-MULTI_HEAP_UNLOCK(heap->lock);
+multi_heap_internal_unlock(heap);
 }
 
 bool multi_heap_check(multi_heap_handle_t heap, bool print_errors)
 {
-MULTI_HEAP_LOCK(heap->lock);
+multi_heap_internal_lock(heap);
 bool b=multi_heap_check_internal(heap, print_errors);
-MULTI_HEAP_UNLOCK(heap->lock);
+multi_heap_internal_unlock(heap);
 return b;
 }
 
@@ -502,20 +2185,14 @@ size_t multi_heap_free_size(multi_heap_handle_t heap)
 {
 if(heap==NULL)
 	return 0;
-MULTI_HEAP_LOCK(heap->lock);
-size_t size=heap->free_bytes;
-MULTI_HEAP_UNLOCK(heap->lock);
-return size;
+return __atomic_load_n(&heap->stats.free_bytes, __ATOMIC_RELAXED);
 }
 
 size_t multi_heap_minimum_free_size(multi_heap_handle_t heap)
 {
 if(heap==NULL)
 	return 0;
-MULTI_HEAP_LOCK(heap->lock);
-size_t size=heap->minimum_free_bytes;
-MULTI_HEAP_UNLOCK(heap->lock);
-return size;
+return __atomic_load_n(&heap->stats.minimum_free_bytes, __ATOMIC_RELAXED);
 }
 
 void multi_heap_get_info(multi_heap_handle_t heap, multi_heap_info_t *info)
@@ -523,18 +2200,258 @@ void multi_heap_get_info(multi_heap_handle_t heap, multi_heap_info_t *info)
 memset(info, 0, sizeof(multi_heap_info_t));
 if(heap==NULL)
 	return;
-MULTI_HEAP_LOCK(heap->lock);
+multi_heap_internal_lock(heap);
 info->total_free_bytes=heap->free_bytes;
 info->total_allocated_bytes=heap->size;
-size_t largest=heap->total_size-heap->size;
-size_t item_count=mem_block_map_get_item_count(&heap->map_free);
-mem_block_map_item_t* last=mem_block_map_get_item_at(&heap->map_free, item_count-1);
-if(last&&last->size>largest)
-	largest=last->size;
-info->largest_free_block=largest;
+info->largest_free_block=multi_heap_get_largest_block(heap);
 info->minimum_free_bytes=heap->minimum_free_bytes;
 info->allocated_blocks=heap->allocated_blocks;
 info->free_blocks=heap->free_blocks;
 info->total_blocks=heap->total_blocks;
-MULTI_HEAP_UNLOCK(heap->lock);
+#ifdef CONFIG_HEAP_QUICK_BINS
+info->quick_bin_hits=heap->quick_bin_hits;
+info->quick_bin_misses=heap->quick_bin_misses;
+#endif
+multi_heap_internal_unlock(heap);
+}
+
+void multi_heap_get_info_nolock(multi_heap_handle_t heap, multi_heap_info_t *info)
+{
+memset(info, 0, sizeof(multi_heap_info_t));
+if(heap==NULL)
+	return;
+multi_heap_stats_t* stats=&heap->stats;
+uint32_t seq=0;
+do
+	{
+	seq=__atomic_load_n(&stats->seq, __ATOMIC_ACQUIRE);
+	if(seq&1)
+		continue;
+	info->total_free_bytes=__atomic_load_n(&stats->free_bytes, __ATOMIC_RELAXED);
+	info->total_allocated_bytes=__atomic_load_n(&stats->allocated_bytes, __ATOMIC_RELAXED);
+	info->largest_free_block=__atomic_load_n(&stats->largest_free_block, __ATOMIC_RELAXED);
+	info->minimum_free_bytes=__atomic_load_n(&stats->minimum_free_bytes, __ATOMIC_RELAXED);
+	info->allocated_blocks=__atomic_load_n(&stats->allocated_blocks, __ATOMIC_RELAXED);
+	info->free_blocks=__atomic_load_n(&stats->free_blocks, __ATOMIC_RELAXED);
+	info->total_blocks=__atomic_load_n(&stats->total_blocks, __ATOMIC_RELAXED);
+	info->quick_bin_hits=__atomic_load_n(&stats->quick_bin_hits, __ATOMIC_RELAXED);
+	info->quick_bin_misses=__atomic_load_n(&stats->quick_bin_misses, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	}
+while((seq&1)||__atomic_load_n(&stats->seq, __ATOMIC_RELAXED)!=seq);
+}
+
+void multi_heap_get_fragmentation(multi_heap_handle_t heap, multi_heap_fragmentation_t *info)
+{
+memset(info, 0, sizeof(multi_heap_fragmentation_t));
+if(heap==NULL)
+	return;
+multi_heap_internal_lock(heap);
+for(uint32_t slot=0; slot<MULTI_HEAP_HISTOGRAM_SIZE; slot++)
+	info->free_blocks[slot]=heap->free_histogram[slot];
+size_t top=heap->total_size-heap->size;
+if(top)
+	info->free_blocks[multi_heap_get_histogram_slot(top)]++;
+info->total_free_bytes=heap->free_bytes;
+info->largest_free_block=multi_heap_get_largest_block(heap);
+multi_heap_internal_unlock(heap);
+if(info->largest_free_block<info->total_free_bytes)
+	info->fragmentation=100-(uint32_t)((uint64_t)info->largest_free_block*100/info->total_free_bytes);
+}
+
+void multi_heap_get_reserve_info(multi_heap_handle_t heap, multi_heap_reserve_info_t *info)
+{
+memset(info, 0, sizeof(multi_heap_reserve_info_t));
+if(heap==NULL)
+	return;
+multi_heap_internal_lock(heap);
+info->meta_reserve=heap->meta_reserve;
+info->critical_reserve=heap->critical_reserve;
+size_t top=heap->total_size-heap->size;
+size_t reserve=heap->meta_reserve+heap->critical_reserve;
+info->free_reserve=top<reserve? top: reserve;
+info->critical_allocations=heap->critical_allocations;
+info->critical_failures=heap->critical_failures;
+info->reserve_allocations=heap->reserve_allocations;
+info->reserve_refusals=heap->reserve_refusals;
+multi_heap_internal_unlock(heap);
+}
+
+void multi_heap_get_lock_stats(multi_heap_handle_t heap, multi_heap_lock_stats_t *stats)
+{
+memset(stats, 0, sizeof(multi_heap_lock_stats_t));
+if(heap==NULL)
+	return;
+#ifdef CONFIG_HEAP_LOCK_STATS
+multi_heap_internal_lock(heap);
+memcpy(stats, &heap->lock_stats, sizeof(multi_heap_lock_stats_t));
+multi_heap_internal_unlock(heap);
+#endif
+}
+
+void multi_heap_reset_lock_stats(multi_heap_handle_t heap)
+{
+if(heap==NULL)
+	return;
+#ifdef CONFIG_HEAP_LOCK_STATS
+multi_heap_internal_lock(heap);
+memset(&heap->lock_stats, 0, sizeof(multi_heap_lock_stats_t));
+multi_heap_internal_unlock(heap);
+#endif
+}
+
+void multi_heap_get_op_stats(multi_heap_handle_t heap, multi_heap_op_t op, multi_heap_op_stats_t *stats)
+{
+memset(stats, 0, sizeof(multi_heap_op_stats_t));
+if(heap==NULL||op>=MULTI_HEAP_OP_COUNT)
+	return;
+#ifdef CONFIG_HEAP_OP_STATS
+multi_heap_internal_lock(heap);
+memcpy(stats, &heap->op_stats[op], sizeof(multi_heap_op_stats_t));
+multi_heap_internal_unlock(heap);
+#endif
+}
+
+void multi_heap_reset_op_stats(multi_heap_handle_t heap)
+{
+if(heap==NULL)
+	return;
+#ifdef CONFIG_HEAP_OP_STATS
+multi_heap_internal_lock(heap);
+memset(heap->op_stats, 0, sizeof(heap->op_stats));
+multi_heap_internal_unlock(heap);
+#endif
+}
+
+multi_heap_arena_handle_t multi_heap_arena_create(multi_heap_handle_t heap, size_t size)
+{
+if(heap==NULL||size==0)
+	return NULL;
+size=multi_heap_align_up(size, 4);
+multi_heap_arena_t* arena=(multi_heap_arena_t*)multi_heap_malloc(heap, sizeof(multi_heap_arena_t)+size);
+if(!arena)
+	return NULL;
+arena->heap=heap;
+arena->size=size;
+arena->chunks=NULL;
+arena->pos=(size_t)arena+sizeof(multi_heap_arena_t);
+arena->end=arena->pos+size;
+return arena;
+}
+
+void* multi_heap_arena_alloc(multi_heap_arena_handle_t arena, size_t size)
+{
+if(arena==NULL||size==0)
+	return NULL;
+size=multi_heap_align_up(size, 4);
+if(arena->end-arena->pos<size)
+	{
+	if(!multi_heap_arena_grow(arena, size))
+		return NULL;
+	}
+void* p=(void*)arena->pos;
+arena->pos+=size;
+return p;
+}
+
+void multi_heap_arena_reset(multi_heap_arena_handle_t arena)
+{
+if(arena==NULL)
+	return;
+while(arena->chunks)
+	{
+	void** chunk=(void**)arena->chunks;
+	arena->chunks=*chunk;
+	multi_heap_free(arena->heap, chunk);
+	}
+arena->pos=(size_t)arena+sizeof(multi_heap_arena_t);
+arena->end=arena->pos+arena->size;
+}
+
+void multi_heap_arena_destroy(multi_heap_arena_handle_t arena)
+{
+if(arena==NULL)
+	return;
+multi_heap_arena_reset(arena);
+multi_heap_free(arena->heap, arena);
+}
+
+multi_heap_pool_handle_t multi_heap_pool_create(multi_heap_handle_t heap, size_t object_size, size_t initial_count)
+{
+if(heap==NULL||object_size==0||initial_count>MULTI_HEAP_POOL_INDEX_MASK)
+	return NULL;
+multi_heap_pool_t* pool=(multi_heap_pool_t*)multi_heap_malloc(heap, sizeof(multi_heap_pool_t));
+if(!pool)
+	return NULL;
+pool->heap=heap;
+pool->object_size=multi_heap_align_up(object_size, 4);
+pool->page_shift=0;
+while((1U<<pool->page_shift)<initial_count)
+	pool->page_shift++;
+pool->page_count=0;
+pool->free_top=0;
+pool->allocations=0;
+pool->frees=0;
+pool->failures=0;
+if(!multi_heap_pool_grow(pool))
+	{
+	multi_heap_free(heap, pool);
+	return NULL;
+	}
+return pool;
+}
+
+void* multi_heap_pool_alloc(multi_heap_pool_handle_t pool)
+{
+if(pool==NULL)
+	return NULL;
+void* p=multi_heap_pool_pop(pool);
+while(!p)
+	{
+	if(!multi_heap_pool_grow(pool))
+		{
+		__atomic_fetch_add(&pool->failures, 1, __ATOMIC_RELAXED);
+		return NULL;
+		}
+	p=multi_heap_pool_pop(pool);
+	}
+__atomic_fetch_add(&pool->allocations, 1, __ATOMIC_RELAXED);
+return p;
+}
+
+void multi_heap_pool_free(multi_heap_pool_handle_t pool, void* p)
+{
+if(pool==NULL||p==NULL)
+	return;
+int32_t index=multi_heap_pool_get_index(pool, p);
+if(index<0)
+	return;
+multi_heap_pool_push(pool, (uint32_t)index);
+__atomic_fetch_add(&pool->frees, 1, __ATOMIC_RELAXED);
+}
+
+void multi_heap_pool_destroy(multi_heap_pool_handle_t pool)
+{
+if(pool==NULL)
+	return;
+for(uint32_t page=0; page<pool->page_count; page++)
+	multi_heap_free(pool->heap, pool->pages[page]);
+multi_heap_free(pool->heap, pool);
+}
+
+void multi_heap_pool_get_info(multi_heap_pool_handle_t pool, multi_heap_pool_info_t* info)
+{
+memset(info, 0, sizeof(multi_heap_pool_info_t));
+if(pool==NULL)
+	return;
+uint32_t page_count=__atomic_load_n(&pool->page_count, __ATOMIC_ACQUIRE);
+size_t allocations=__atomic_load_n(&pool->allocations, __ATOMIC_RELAXED);
+size_t frees=__atomic_load_n(&pool->frees, __ATOMIC_RELAXED);
+info->object_size=pool->object_size;
+info->total_objects=page_count<<pool->page_shift;
+info->used_objects=allocations-frees;
+info->allocations=allocations;
+info->frees=frees;
+info->failures=__atomic_load_n(&pool->failures, __ATOMIC_RELAXED);
+info->pages=page_count;
 }
@@ -25,7 +25,10 @@
 
 #include <stdbool.h>
 #include <stdint.h>
+#include "mem_block_list.h"
 #include "mem_block_map.h"
+#include "mem_block_tlsf.h"
+#include "mem_block_tree.h"
 #include "multi_heap_platform.h"
 
 
@@ -34,6 +37,169 @@
 //=======
 
 #define MULTI_HEAP_FLAG_DIRTY ((uint32_t)1)
+#define MULTI_HEAP_FLAG_LARGEST ((uint32_t)2)
+#define MULTI_HEAP_FLAG_CRITICAL ((uint32_t)4)
+#define MULTI_HEAP_FLAG_INDEX ((uint32_t)8)
+#define MULTI_HEAP_FLAG_SPARE ((uint32_t)16)
+#define MULTI_HEAP_FLAG_SPARE_EMPTY ((uint32_t)32)
+
+// State of the watermark, pending until it is taken by the caller outside of the lock
+#define MULTI_HEAP_WATERMARK_BELOW ((uint32_t)1)
+#define MULTI_HEAP_WATERMARK_PENDING ((uint32_t)2)
+
+
+//======
+// Size
+//======
+
+#ifdef CONFIG_HEAP_COMPACT_MAP
+// Map items hold 16 bits in units of 4 bytes
+#define MULTI_HEAP_MAX_SIZE ((size_t)UINT16_MAX*4)
+#endif
+
+
+//=======
+// Arena
+//=======
+
+#define MULTI_HEAP_MAX(a, b) ((a)>(b)?(a):(b))
+#define MULTI_HEAP_GROUP_MAX_SIZE MULTI_HEAP_MAX(MULTI_HEAP_MAX(sizeof(mem_block_map_item_group_t), sizeof(mem_block_map_parent_group_t)), MULTI_HEAP_MAX(sizeof(mem_block_list_item_group_t), sizeof(mem_block_list_parent_group_t)))
+
+#ifdef CONFIG_HEAP_NODE_ARENA
+#define MULTI_HEAP_ARENA_SLOT_SIZE MULTI_HEAP_GROUP_MAX_SIZE
+#define MULTI_HEAP_ARENA_CHUNK_SIZE (sizeof(size_t)+CONFIG_HEAP_NODE_ARENA_SLOTS*MULTI_HEAP_ARENA_SLOT_SIZE)
+#define MULTI_HEAP_ARENA_FREE ((size_t)~0>>(sizeof(size_t)*8-CONFIG_HEAP_NODE_ARENA_SLOTS))
+#endif
+
+
+//============
+// Quick-bins
+//============
+
+#ifdef CONFIG_HEAP_QUICK_BINS
+#define MULTI_HEAP_QUICK_BIN_MIN (4*sizeof(size_t))
+// Block sizes are multiples of a word, each bin holds exactly one size
+#define MULTI_HEAP_QUICK_BIN_STEP MEM_BLOCK_ALIGN
+#endif
+
+
+//=========
+// Reserve
+//=========
+
+#ifndef CONFIG_HEAP_META_RESERVE
+#define CONFIG_HEAP_META_RESERVE 512
+#endif
+
+#ifndef CONFIG_HEAP_CRITICAL_RESERVE
+#define CONFIG_HEAP_CRITICAL_RESERVE 0
+#endif
+
+
+//=============
+// Work budget
+//=============
+
+#ifndef CONFIG_HEAP_WORK_BUDGET
+#define CONFIG_HEAP_WORK_BUDGET 0
+#endif
+
+// The host harness counts units of work to test the bound of each call
+#ifdef MULTI_HEAP_COST_COUNTER
+extern uint32_t multi_heap_cost;
+#define MULTI_HEAP_COST(N) (multi_heap_cost+=(N))
+#else
+#define MULTI_HEAP_COST(N)
+#endif
+
+
+//=========
+// Classes
+//=========
+
+#ifdef CONFIG_HEAP_SIZE_CLASSES
+#define MULTI_HEAP_CLASS_COUNT (CONFIG_HEAP_SIZE_CLASS_MAX/CONFIG_HEAP_SIZE_CLASS_STEP)
+#endif
+
+
+//========
+// Caches
+//========
+
+#ifdef CONFIG_HEAP_CORE_CACHES
+typedef struct
+{
+uint32_t count;
+void* blocks[CONFIG_HEAP_CORE_CACHE_SIZE];
+}multi_heap_cache_t;
+#endif
+
+
+//=============
+// Bump-arenas
+//=============
+
+typedef struct multi_heap_arena
+{
+multi_heap_handle_t heap;
+size_t size;
+void* chunks;
+size_t pos;
+size_t end;
+}multi_heap_arena_t;
+
+
+//=======
+// Pools
+//=======
+
+#define MULTI_HEAP_POOL_MAX_PAGES 16
+
+// The free stack holds the index of the top object plus one and a tag against ABA
+#define MULTI_HEAP_POOL_INDEX_MASK ((uint32_t)0xFFFF)
+#define MULTI_HEAP_POOL_TAG_STEP ((uint32_t)0x10000)
+
+typedef struct multi_heap_pool
+{
+multi_heap_handle_t heap;
+size_t object_size;
+uint32_t page_shift;
+volatile uint32_t page_count;
+volatile uint32_t free_top;
+volatile uint32_t allocations;
+volatile uint32_t frees;
+volatile uint32_t failures;
+void* pages[MULTI_HEAP_POOL_MAX_PAGES];
+}multi_heap_pool_t;
+
+
+//============
+// Statistics
+//============
+
+// Copy of the counters for readers without the lock, an odd sequence means it's being written
+typedef struct
+{
+volatile uint32_t seq;
+volatile size_t free_bytes;
+volatile size_t minimum_free_bytes;
+volatile size_t allocated_bytes;
+volatile size_t largest_free_block;
+volatile size_t allocated_blocks;
+volatile size_t free_blocks;
+volatile size_t total_blocks;
+volatile size_t quick_bin_hits;
+volatile size_t quick_bin_misses;
+}multi_heap_stats_t;
+
+// Public operations are timed from the start of the call until the lock is released
+#ifdef CONFIG_HEAP_OP_STATS
+#define MULTI_HEAP_OP_START(START) uint32_t START=MULTI_HEAP_TIME()
+#define MULTI_HEAP_OP_END(HEAP, OP, START, SIZE) multi_heap_op_stats_add((HEAP), (OP), (START), (SIZE), __builtin_return_address(0))
+#else
+#define MULTI_HEAP_OP_START(START)
+#define MULTI_HEAP_OP_END(HEAP, OP, START, SIZE)
+#endif
 
 
 //======
@@ -51,9 +217,55 @@ size_t allocated_blocks;
 size_t free_blocks;
 size_t total_blocks;
 uint32_t flags;
+size_t largest_free;
+size_t free_histogram[MULTI_HEAP_HISTOGRAM_SIZE];
 uint32_t free_offset_count;
-size_t free_offsets[CONFIG_HEAP_MAX_OFFSETS];
+size_t free_offset;
+size_t work_budget;
+volatile size_t free_queue;
+size_t meta_reserve;
+size_t critical_reserve;
+size_t critical_allocations;
+size_t critical_failures;
+size_t reserve_allocations;
+size_t reserve_refusals;
+size_t watermark_low;
+size_t watermark_high;
+volatile uint32_t watermark_state;
+#ifdef CONFIG_HEAP_QUICK_BINS
+size_t quick_bins[CONFIG_HEAP_QUICK_BIN_COUNT];
+size_t quick_bin_hits;
+size_t quick_bin_misses;
+#endif
+#if defined(CONFIG_HEAP_INDEX_TLSF)
+mem_block_tlsf_t tlsf_free;
+#elif defined(CONFIG_HEAP_INDEX_TREE)
+mem_block_tree_t tree_free;
+#else
 mem_block_map_t map_free;
+void* spare_groups;
+uint32_t spare_count;
+#endif
+#ifdef CONFIG_HEAP_NODE_ARENA
+size_t arena_chunks;
+#endif
+#ifdef CONFIG_HEAP_SIZE_CLASSES
+void* class_blocks[MULTI_HEAP_CLASS_COUNT];
+uint32_t class_counts[MULTI_HEAP_CLASS_COUNT];
+#endif
+#ifdef CONFIG_HEAP_CORE_CACHES
+multi_heap_cache_t caches[MULTI_HEAP_CORE_COUNT][MULTI_HEAP_CLASS_COUNT];
+uint32_t cache_locks[MULTI_HEAP_CORE_COUNT];
+#endif
+#ifdef CONFIG_HEAP_LOCK_STATS
+uint32_t lock_depth;
+uint32_t lock_time;
+multi_heap_lock_stats_t lock_stats;
+#endif
+#ifdef CONFIG_HEAP_OP_STATS
+multi_heap_op_stats_t op_stats[MULTI_HEAP_OP_COUNT];
+#endif
+multi_heap_stats_t stats;
 }multi_heap_t;
 
 
@@ -80,14 +292,35 @@ return offset;
 // Tasks
 //=======
 
+#ifdef CONFIG_HEAP_LOCK_STATS
+void multi_heap_lock_acquire(multi_heap_handle_t heap);
+void multi_heap_lock_release(multi_heap_handle_t heap);
+#endif
+#ifdef CONFIG_HEAP_OP_STATS
+void multi_heap_op_stats_add(multi_heap_handle_t heap, multi_heap_op_t op, uint32_t start, size_t size, void* caller);
+#endif
+
 static inline void multi_heap_internal_lock(multi_heap_handle_t heap)
 {
+#ifdef CONFIG_HEAP_LOCK_STATS
+multi_heap_lock_acquire(heap);
+#else
 MULTI_HEAP_LOCK(heap->lock);
+#endif
 }
 
 static inline void multi_heap_internal_unlock(multi_heap_handle_t heap)
 {
+#ifdef CONFIG_HEAP_LOCK_STATS
+multi_heap_lock_release(heap);
+#else
 MULTI_HEAP_UNLOCK(heap->lock);
+#endif
+}
+
+static inline bool multi_heap_compare_exchange(volatile uint32_t* value, uint32_t* expected, uint32_t desired)
+{
+return __atomic_compare_exchange_n(value, expected, desired, true, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
 }
 
 
@@ -97,5 +330,15 @@ MULTI_HEAP_UNLOCK(heap->lock);
 
 bool multi_heap_check_internal(multi_heap_handle_t heap, bool print_errors);
 void multi_heap_dump_internal(multi_heap_handle_t heap);
+void multi_heap_free_group(multi_heap_handle_t heap, void* group);
 void multi_heap_free_internal(multi_heap_handle_t heap, void* ptr);
+void* multi_heap_malloc_group(multi_heap_handle_t heap, size_t size);
 void* multi_heap_malloc_internal(multi_heap_handle_t heap, size_t size);
+
+
+//===========
+// Protected
+//===========
+
+void multi_heap_free_protected(multi_heap_handle_t heap, void* p);
+void* multi_heap_malloc_protected(multi_heap_handle_t heap, size_t size);
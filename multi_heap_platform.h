@@ -52,6 +52,33 @@ typedef portMUX_TYPE multi_heap_lock_t;
 
 #define MULTI_HEAP_LOCK_STATIC_INITIALIZER     portMUX_INITIALIZER_UNLOCKED
 
+/* Lock and operation statistics count CPU cycles of the current core.
+   The owner of the portmux is read before spinning to detect contention. */
+#define MULTI_HEAP_TIME_UNIT "cycles"
+#if defined(CONFIG_HEAP_LOCK_STATS) || defined(CONFIG_HEAP_OP_STATS)
+#include <xtensa/hal.h>
+#define MULTI_HEAP_TIME() ((uint32_t)xthal_get_ccount())
+#define MULTI_HEAP_LOCK_BUSY(PLOCK) (((portMUX_TYPE*)(PLOCK))->owner != portMUX_FREE_VAL)
+#endif
+
+/* Per-core data is only accessed by its own core,
+   masking interrupts is enough to protect it */
+#define MULTI_HEAP_CORE_COUNT portNUM_PROCESSORS
+#define MULTI_HEAP_CORE_ID() xPortGetCoreID()
+#define MULTI_HEAP_IN_ISR() xPortInIsrContext()
+
+#define MULTI_HEAP_LOCAL_LOCK(PSTATE) do {                  \
+        *(PSTATE) = portSET_INTERRUPT_MASK_FROM_ISR();      \
+    } while(0)
+
+#define MULTI_HEAP_LOCAL_UNLOCK(PSTATE) do {                \
+        portCLEAR_INTERRUPT_MASK_FROM_ISR(*(PSTATE));       \
+    } while(0)
+
+/* The other core only tries to take a cache when the heap is exhausted,
+   waiting for it with interrupts masked is short */
+#define MULTI_HEAP_CACHE_WAIT()  do {} while(0)
+
 /* Not safe to use std i/o while in a portmux critical section,
    can deadlock, so we use the ROM equivalent functions. */
 
@@ -91,6 +118,57 @@ inline static void multi_heap_assert(bool condition, const char *format, int lin
 #define MULTI_HEAP_GET_BLOCK_OWNER(HEAD) (NULL)
 #endif
 
+#elif defined(MULTI_HEAP_HOST)
+
+#include <assert.h>
+#include <sched.h>
+#include <stdio.h>
+#include "multi_heap_host.h"
+
+typedef multi_heap_host_lock_t multi_heap_lock_t;
+
+/* Host builds lock with the backend selected in host/CMakeLists.txt */
+#define MULTI_HEAP_LOCK(PLOCK) do {                         \
+        if((PLOCK) != NULL) {                               \
+            multi_heap_host_lock((multi_heap_host_lock_t*)(PLOCK)); \
+        }                                                   \
+    } while(0)
+
+#define MULTI_HEAP_UNLOCK(PLOCK) do {                       \
+        if ((PLOCK) != NULL) {                              \
+            multi_heap_host_unlock((multi_heap_host_lock_t*)(PLOCK)); \
+        }                                                   \
+    } while(0)
+
+#define MULTI_HEAP_LOCK_INIT(PLOCK) do {                    \
+        multi_heap_host_lock_init((PLOCK));                 \
+    } while(0)
+
+#define MULTI_HEAP_LOCK_STATIC_INITIALIZER MULTI_HEAP_HOST_LOCK_INITIALIZER
+
+#define MULTI_HEAP_TIME() ((uint32_t)multi_heap_host_time_ns())
+#define MULTI_HEAP_TIME_UNIT "ns"
+#define MULTI_HEAP_LOCK_BUSY(PLOCK) multi_heap_host_lock_busy((multi_heap_host_lock_t*)(PLOCK))
+
+/* Threads aren't bound to cores, each thread gets a slot instead.
+   Threads sharing a slot wait for each other on the lock of its cache. */
+#define MULTI_HEAP_CORE_COUNT MULTI_HEAP_HOST_CORE_COUNT
+#define MULTI_HEAP_CORE_ID() multi_heap_host_core_id()
+/* Threads are marked as interrupts by the test */
+#define MULTI_HEAP_IN_ISR() multi_heap_host_in_isr()
+#define MULTI_HEAP_LOCAL_LOCK(PSTATE)  (void) (PSTATE)
+#define MULTI_HEAP_LOCAL_UNLOCK(PSTATE)  (void) (PSTATE)
+#define MULTI_HEAP_CACHE_WAIT()  sched_yield()
+
+#define MULTI_HEAP_PRINTF printf
+#define MULTI_HEAP_STDERR_PRINTF(MSG, ...) fprintf(stderr, MSG, __VA_ARGS__)
+
+#define MULTI_HEAP_ASSERT(CONDITION, ADDRESS) assert((CONDITION) && "Heap corrupt")
+
+#define MULTI_HEAP_BLOCK_OWNER
+#define MULTI_HEAP_SET_BLOCK_OWNER(HEAD)
+#define MULTI_HEAP_GET_BLOCK_OWNER(HEAD) (NULL)
+
 #else // MULTI_HEAP_FREERTOS
 
 #include <assert.h>
@@ -103,6 +181,16 @@ typedef int multi_heap_lock_t;
 #define MULTI_HEAP_UNLOCK(PLOCK)  (void) (PLOCK)
 #define MULTI_HEAP_LOCK_INIT(PLOCK)  (void) (PLOCK)
 #define MULTI_HEAP_LOCK_STATIC_INITIALIZER  0
+#define MULTI_HEAP_TIME()  0
+#define MULTI_HEAP_TIME_UNIT ""
+#define MULTI_HEAP_LOCK_BUSY(PLOCK)  false
+
+#define MULTI_HEAP_CORE_COUNT 1
+#define MULTI_HEAP_CORE_ID() 0
+#define MULTI_HEAP_IN_ISR()  false
+#define MULTI_HEAP_LOCAL_LOCK(PSTATE)  (void) (PSTATE)
+#define MULTI_HEAP_LOCAL_UNLOCK(PSTATE)  (void) (PSTATE)
+#define MULTI_HEAP_CACHE_WAIT()  (void) 0
 
 #define MULTI_HEAP_ASSERT(CONDITION, ADDRESS) assert((CONDITION) && "Heap corrupt")
 